@@ -1,86 +1,196 @@
-#!/usr/bin/env python
-
-from subprocess import *
-import os
+#!/usr/bin/env python3
+
+"""
+Benchmark suite runner
+
+Each benchmark is run a number of times after some warmup runs, with the
+--stats option of zeta, which reports the time spent loading and parsing
+packages apart from the run time, along with memory usage. The medians
+and standard deviations are printed, and can be saved as JSON and later
+compared against, to detect regressions:
+
+    ./benchmark.py --json before.json
+    (change things, rebuild)
+    ./benchmark.py --baseline before.json
+"""
+
+import argparse
+import datetime
+import glob
+import json
+import math
+import statistics
+import subprocess
 import sys
 import time
-import csv
 
-def bench(benchPath):
+# Metrics reported by zeta --stats, in addition to the wall clock time
+TIME_METRICS = ['wall_ms', 'load_ms', 'run_ms']
+MEM_METRICS = ['peak_rss_kb', 'heap_peak_bytes', 'alloc_bytes', 'gc_count']
 
-    startTime = time.time()
+STATS_TAG = 'zeta-stats '
 
-    benchCmd = './zeta %s' % benchPath
-    pipe = Popen(benchCmd, shell=True, stdout=PIPE, stderr=PIPE)
+def runOnce(zetaPath, benchPath):
+    """Run a benchmark once, returns a dictionary of metrics"""
 
-    # Wait until the benchmark terminates
-    pipe.wait()
+    startTime = time.perf_counter()
 
-    endTime = time.time()
+    proc = subprocess.run(
+        [zetaPath, '--stats', benchPath],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True
+    )
 
-    # Verify the return code
-    ret = pipe.returncode
-    if ret != 0:
-        output = pipe.stdout.read()
-        sys.stdout.write('\n')
-        sys.stdout.write(output)
-        raise Exception('invalid return code: ' + str(ret))
+    endTime = time.perf_counter()
 
-    # Compute the time in milliseconds
-    deltaTime = 1000 * (endTime - startTime)
+    if proc.returncode != 0:
+        output = (proc.stdout + proc.stderr).strip().splitlines()
+        raise Exception(
+            'invalid return code %d\n%s' % (proc.returncode, '\n'.join(output[-5:]))
+        )
 
-    return deltaTime
+    statLines = [l for l in proc.stderr.splitlines() if l.startswith(STATS_TAG)]
+    if len(statLines) != 1:
+        raise Exception('no statistics in the output of %s' % zetaPath)
 
-# Computes the geometric mean of a list of values
-def geoMean(numList):
-    if len(numList) == 1:
-        return numList[0]
+    stats = json.loads(statLines[0][len(STATS_TAG):])
+    stats['wall_ms'] = 1000 * (endTime - startTime)
 
-    prod = 1
-    for val in numList:
-        if val != 0:
-            prod *= val
+    return stats
 
-    return prod ** (1.0/len(numList))
+def summarize(samples):
+    """Compute the median and standard deviation of a list of samples"""
 
-def runBenchs():
+    return {
+        'median': statistics.median(samples),
+        'stddev': statistics.stdev(samples) if len(samples) > 1 else 0.0,
+        'min': min(samples),
+        'samples': samples
+    }
 
-    benchList = [
-        'benchmarks/loop_cnt_100m.zim',
-        'benchmarks/incr_field_1m.pls',
-        'benchmarks/get_field_1m.pls',
-        'benchmarks/set_field_1m.pls',
-        'benchmarks/fcalls_10m.zim',
-        'benchmarks/fib29.pls',
-        'benchmarks/fib36.zim',
-        'benchmarks/plush_parser.zim',
-        'benchmarks/img_fill.pls',
-        'benchmarks/saw_wave.pls',
-        'benchmarks/sine_wave.pls',
-        'benchmarks/func_audio.pls',
-        'benchmarks/rand_floats_1m.pls',
-        'benchmarks/zsdf.pls',
-    ]
+def bench(zetaPath, benchPath, numWarmup, numRuns):
 
-    timeVals = []
+    for i in range(numWarmup):
+        runOnce(zetaPath, benchPath)
 
-    for benchPath in benchList:
+    runs = [runOnce(zetaPath, benchPath) for i in range(numRuns)]
 
-        sys.stdout.write(benchPath.ljust(35))
-        sys.stdout.flush()
+    result = {}
+    for metric in TIME_METRICS + MEM_METRICS:
+        result[metric] = summarize([run[metric] for run in runs])
+
+    return result
+
+def isSignificant(cur, base, numRuns):
+    """
+    Test if two medians differ by more than twice the standard error
+    of their difference, which needs several runs to be meaningful
+    """
+
+    error = math.sqrt((cur['stddev'] ** 2 + base['stddev'] ** 2) / numRuns)
+    return abs(cur['median'] - base['median']) > 2 * error
+
+def gitRevision():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', '--short', 'HEAD'],
+            stderr=subprocess.DEVNULL,
+            universal_newlines=True
+        ).strip()
+    except Exception:
+        return None
+
+def printHeader(baseline):
+    sys.stdout.write('benchmark'.ljust(32))
+    sys.stdout.write('%12s %12s %12s %10s' % ('run ms', 'load ms', 'wall ms', 'rss kb'))
+    if baseline:
+        sys.stdout.write('  vs baseline')
+    sys.stdout.write('\n')
+
+def printResult(benchPath, result, baseline, numRuns):
 
-        timeMs = bench(benchPath)
-        timeVals += [timeMs]
+    def fmtTime(metric):
+        stats = result[metric]
+        return '%7.1f±%-4.1f' % (stats['median'], stats['stddev'])
 
-        sys.stdout.write('%6d ms\n' % timeMs)
+    sys.stdout.write(fmtTime('run_ms') + ' ')
+    sys.stdout.write(fmtTime('load_ms') + ' ')
+    sys.stdout.write(fmtTime('wall_ms') + ' ')
+    sys.stdout.write('%10d' % result['peak_rss_kb']['median'])
 
-    meanTime = geoMean(timeVals)
-    sys.stdout.write(44 * '-' + '\n')
-    sys.stdout.write('geometric mean'.ljust(35))
-    sys.stdout.write('%6d ms\n' % meanTime)
+    base = baseline.get(benchPath) if baseline else None
+    if base:
+        cur = result['run_ms']
+        prev = base['run_ms']
+        change = 100.0 * (cur['median'] - prev['median']) / prev['median']
+        sig = isSignificant(cur, prev, numRuns)
+        sys.stdout.write('  %+6.1f%%%s' % (change, ' *' if sig else ''))
 
-# TODO: trigger make clean, make -j4 to make sure we have a fresh build
-# Note: could ./configure with NDEBUG to disable assertions
+    sys.stdout.write('\n')
+
+def main():
+
+    parser = argparse.ArgumentParser(description='Run the ZetaVM benchmarks')
+    parser.add_argument('benchmarks', nargs='*', help='benchmark files (default: benchmarks/*.pls and *.zim)')
+    parser.add_argument('--runs', type=int, default=5, help='number of measured runs')
+    parser.add_argument('--warmup', type=int, default=1, help='number of warmup runs')
+    parser.add_argument('--zeta', default='./zeta', help='path to the zeta binary')
+    parser.add_argument('--json', help='write the results to a JSON file')
+    parser.add_argument('--baseline', help='compare against results saved with --json')
+    args = parser.parse_args()
+
+    benchList = args.benchmarks or sorted(
+        glob.glob('benchmarks/*.pls') + glob.glob('benchmarks/*.zim')
+    )
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)['benchmarks']
+
+    printHeader(baseline)
+
+    results = {}
+    failures = []
+
+    for benchPath in benchList:
+
+        sys.stdout.write(benchPath.ljust(32))
+        sys.stdout.flush()
 
-# Run the benchmarks
-runBenchs()
+        try:
+            result = bench(args.zeta, benchPath, args.warmup, args.runs)
+        except Exception as e:
+            sys.stdout.write('FAILED\n')
+            failures.append((benchPath, str(e)))
+            continue
+
+        results[benchPath] = result
+        printResult(benchPath, result, baseline, args.runs)
+
+    if baseline:
+        sys.stdout.write('(* marks run time changes larger than twice the standard error)\n')
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(
+                {
+                    'revision': gitRevision(),
+                    'date': datetime.datetime.now().isoformat(),
+                    'zeta': args.zeta,
+                    'runs': args.runs,
+                    'warmup': args.warmup,
+                    'benchmarks': results
+                },
+                f,
+                indent=2
+            )
+
+    for benchPath, error in failures:
+        sys.stderr.write('%s failed: %s\n' % (benchPath, error))
+
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
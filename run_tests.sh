@@ -16,6 +16,11 @@ set -x
 ./zeta tests/vm/throw_exc2.zim
 ./zeta tests/vm/throw_exc3.zim
 ./zeta tests/vm/closure.zim
+./zeta --no-jit tests/vm/jit_exits.zim || test $? -eq 47
+
+# Check that programs run the same from binary images
+./zeta --bin-image=/tmp/zeta_closure.bin tests/vm/closure.zim
+./zeta /tmp/zeta_closure.bin
 
 # Check that loading a non-existent file produces a sensible error
 ./zeta non_existent_file | grep -q "non_existent_file"
@@ -54,6 +59,7 @@ set -x
 ./plush.sh tests/plush/fun_locals.pls
 ./plush.sh tests/plush/method_calls.pls
 ./plush.sh tests/plush/obj_ext.pls
+./plush.sh tests/plush/poly_fields.pls
 ./plush.sh tests/plush/throw_exc.pls
 ./plush.sh tests/plush/throw_exc2.pls
 
@@ -76,28 +82,76 @@ set -x
 ./zeta tests/plush/for_loop_break.pls
 ./zeta tests/plush/line_count.pls
 ./zeta tests/plush/array_push.pls
+./zeta tests/plush/typed_array.pls
+./zeta tests/plush/array_copy.pls
+./zeta tests/plush/simd.pls
+./zeta tests/plush/parallel.pls
 ./zeta tests/plush/method_calls.pls
 ./zeta tests/plush/obj_field_names.pls
+./zeta tests/plush/obj_dict.pls
 ./zeta tests/plush/obj_ext.pls
+./zeta tests/plush/poly_fields.pls
 ./zeta tests/plush/import.pls
 ./zeta tests/plush/circular3.pls
 ./zeta tests/plush/peval.pls
+./zeta tests/plush/specialize.pls
 ./zeta tests/plush/random.pls
+./zeta tests/plush/strings.pls
 ./zeta tests/plush/throw_exc.pls
 ./zeta tests/plush/throw_exc2.pls
 ./zeta tests/plush/catch_import_missing.pls
 ./zeta tests/plush/cmdline_args.pls -- foo bar
+./zeta tests/plush/time_ms.pls
+./zeta tests/plush/file_io.pls
 
 # Regression tests
 ./zeta tests/plush/regress_exc_var.pls
 ./zeta tests/plush/regress_exc_idx.pls
 ./zeta tests/plush/regress_throw_str.pls | grep -q "foobar"
 
+# Check that packages run the same when loaded from the parse cache
+rm -rf /tmp/zeta_test_cache
+XDG_CACHE_HOME=/tmp/zeta_test_cache ./zeta tests/plush/fib.pls
+XDG_CACHE_HOME=/tmp/zeta_test_cache ./zeta tests/plush/fib.pls
+XDG_CACHE_HOME=/tmp/zeta_test_cache ./zeta tests/plush/call_site_pos.pls | grep -q "call_site_pos.pls@8:"
+XDG_CACHE_HOME=/tmp/zeta_test_cache ./zeta tests/plush/call_site_pos.pls | grep -q "call_site_pos.pls@8:"
+./zeta --no-parse-cache tests/plush/fib.pls
+
+# Check that packages load the same when prefetched
+./zeta --prefetch tests/plush/import.pls
+./zeta --prefetch --no-parse-cache tests/plush/fib.pls
+./zeta --prefetch examples/csv_parsing.pls -- examples/GOOG.csv | grep -q "rows: 23"
+
+# Check that programs run the same in several isolates at once
+./zeta --isolates=4 --no-parse-cache tests/plush/fib.pls
+./zeta --isolates=4 examples/csv_parsing.pls -- examples/GOOG.csv | grep -c "rows: 23" | grep -q 4
+./zeta --isolates=2 tests/gc/bigloop.pls
+
+# Check that statistics are reported for the benchmark runner
+./zeta --stats tests/plush/fib.pls 2>&1 | grep -q '^zeta-stats {"total_ms"'
+./zeta --stats tests/plush/fib.pls 2>&1 | grep -q '"jit_skipped": 0}'
+
+# Check that the profiler reports counts and writes sampled call stacks
+./zeta --profile tests/plush/fib.pls 2>&1 | grep -q "print_int32"
+./zeta --no-parse-cache --profile-stacks=/tmp/zeta_self_parse.stacks tests/plush/self_parse.pls
+grep -q "std/parsing/0.Input" /tmp/zeta_self_parse.stacks
+
+# Check that no function or block version is reported with more
+# field cache misses than field accesses
+./zeta --profile tests/plush/self_parse.pls 2>&1 >/dev/null | awk '
+    /^functions:/ { sec = 1 } /^block versions:/ { sec = 2 }
+    /%/ && ((sec == 1 && $8 > $7) || (sec == 2 && $6 > $5)) { bad = 1; print }
+    END { exit bad }
+'
+
 # Check that source position is reported on errors
 ./zeta tests/plush/assert.pls | grep -q "3:1"
 ./zeta tests/plush/call_site_pos.pls | grep -q "call_site_pos.pls@8:"
 ./zeta tests/plush/parse_error.pls | grep -q "parse_error.pls@5:6"
 
+# Check that overflowing the stack is reported, also from native code
+./zeta tests/plush/stack_overflow.pls | grep -q "stack overflow"
+
 # Check that the Plush language package is
 # able to parse its own source code
 ./zeta tests/plush/self_parse.pls
@@ -105,6 +159,23 @@ set -x
 # Image parsing and serialization tests
 ./zeta tests/plush/serialize.pls
 
+##############################################################################
+# Garbage collector tests
+##############################################################################
+
+./zeta tests/gc/collect.pls
+./zeta tests/gc/objext.pls
+./zeta tests/gc/deepstack.pls
+./zeta tests/gc/graph.pls
+./zeta tests/gc/code.pls
+./zeta tests/gc/jitcode.pls
+./zeta tests/gc/frames.pls
+./zeta --no-jit tests/gc/frames.pls
+./zeta tests/gc/pkg_roots.pls
+
+# Check that garbage allocated in a loop is reclaimed
+(ulimit -v 400000; ./zeta tests/gc/bigloop.pls)
+
 ##############################################################################
 # cscheme tests
 ##############################################################################
@@ -125,5 +196,5 @@ python espresso/main.py test
 # Example programs
 ##############################################################################
 
-./zeta examples/line_count.pls -- examples/line_count.pls | grep -q "54"
+./zeta examples/line_count.pls -- examples/line_count.pls | grep -q "71"
 ./zeta examples/csv_parsing.pls -- examples/GOOG.csv | grep -q "rows: 23"
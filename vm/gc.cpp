@@ -0,0 +1,165 @@
+#include <cassert>
+#include <vector>
+#include "gc.h"
+
+/// Minimum heap size before a collection is triggered
+const size_t GC_MIN_HEAP = 16 << 20;
+
+/// Heap growth factor, relative to the size of the live set
+const size_t GC_GROWTH = 2;
+
+/// Objects marked but not yet traced
+thread_local std::vector<refptr> markStack;
+
+/// Values rooted by C++ code
+thread_local std::vector<Value*> extraRoots;
+
+/// Number of collections performed so far
+thread_local size_t numCollections = 0;
+
+/// Initialize the collector, enables automatic collections
+void initGC()
+{
+    vm.setGCThreshold(GC_MIN_HEAP);
+}
+
+GCRoot::GCRoot(Value val)
+: val(val)
+{
+    extraRoots.push_back(&this->val);
+}
+
+GCRoot::~GCRoot()
+{
+    assert (extraRoots.back() == &this->val);
+    extraRoots.pop_back();
+}
+
+void gcMarkPtr(refptr ptr)
+{
+    if (ptr == nullptr)
+        return;
+
+    auto& header = *(uint64_t*)ptr;
+
+    if (header & HEADER_MSK_MARK)
+        return;
+
+    header |= HEADER_MSK_MARK;
+    markStack.push_back(ptr);
+}
+
+void gcMark(Value val)
+{
+    if (!val.isPointer())
+        return;
+
+    gcMarkPtr(val.getWord().ptr);
+}
+
+bool gcMarked(refptr ptr)
+{
+    return *(uint64_t*)ptr & HEADER_MSK_MARK;
+}
+
+/// Mark the values referenced by a heap object
+void traceObj(refptr ptr)
+{
+    auto header = *(uint64_t*)ptr;
+
+    // If the object was extended, its contents now live in the
+    // next object, and the fields of this one are stale
+    if (header & HEADER_MSK_NEXT)
+    {
+        gcMarkPtr(*(refptr*)(ptr + OBJ_OF_NEXT));
+        return;
+    }
+
+    switch ((Tag)header)
+    {
+        case TAG_STRING:
+        if (header & HEADER_MSK_ROPE)
+        {
+            gcMarkPtr(*(refptr*)(ptr + String::OF_LEFT));
+            gcMarkPtr(*(refptr*)(ptr + String::OF_RIGHT));
+        }
+        break;
+
+        case TAG_ARRAY:
+        {
+            // Typed arrays hold no references
+            if (header & HEADER_MSK_ELEMS)
+                break;
+
+            auto cap = *(uint32_t*)(ptr + Array::OF_CAP);
+            auto len = *(uint32_t*)(ptr + Array::OF_LEN);
+            auto words = (Word*)(ptr + Array::OF_DATA);
+            auto tags = (Tag*)(ptr + Array::OF_DATA + cap * sizeof(Word));
+
+            for (size_t i = 0; i < len; ++i)
+                gcMark(Value(words[i], tags[i]));
+        }
+        break;
+
+        case TAG_OBJECT:
+        {
+            // Field names are interned, only the values need marking
+            auto cap = *(uint32_t*)(ptr + Object::OF_CAP);
+            auto shape = *(Shape**)(ptr + Object::OF_SHAPE);
+            auto words = (Word*)(ptr + Object::OF_FIELDS);
+            auto tags = (Tag*)(ptr + Object::OF_FIELDS + cap * sizeof(Word));
+
+            for (size_t i = 0; i < shape->getNumSlots(); ++i)
+                gcMark(Value(words[i], tags[i]));
+        }
+        break;
+
+        case TAG_IMGREF:
+        gcMarkPtr(*(refptr*)(ptr + ImgRef::OF_SYM));
+        break;
+
+        default:
+        assert (false && "unknown object type in GC trace");
+    }
+}
+
+/// Perform a full collection
+void gcCollect()
+{
+    assert (markStack.empty());
+
+    markRuntimeRoots();
+    markInterpRoots();
+    markPkgRoots();
+
+    for (auto root : extraRoots)
+        gcMark(*root);
+
+    // Compiled code is only traced once its function is found
+    // reachable, which may in turn make more functions reachable
+    do
+    {
+        while (!markStack.empty())
+        {
+            auto ptr = markStack.back();
+            markStack.pop_back();
+            traceObj(ptr);
+        }
+    } while (markInterpCode());
+
+    sweepInterpCode();
+    vm.sweep();
+
+    // Let the heap grow proportionally to the live set
+    auto liveBytes = vm.allocated();
+    auto threshold = GC_GROWTH * liveBytes;
+    vm.setGCThreshold((threshold > GC_MIN_HEAP)? threshold:GC_MIN_HEAP);
+
+    numCollections++;
+}
+
+/// Number of collections performed so far
+size_t gcCount()
+{
+    return numCollections;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "runtime.h"
+
+/**
+Keeps a value alive while C++ code holds on to it across calls
+into the interpreter. Roots must be released in reverse order of
+creation, which scoping guarantees.
+*/
+class GCRoot
+{
+private:
+
+    Value val;
+
+public:
+
+    GCRoot(Value val);
+    ~GCRoot();
+
+    GCRoot(const GCRoot&) = delete;
+    GCRoot& operator = (const GCRoot&) = delete;
+
+    operator Value () const { return val; }
+};
+
+/// Initialize the collector, enables automatic collections
+void initGC();
+
+/// Mark a value as reachable
+void gcMark(Value val);
+
+/// Mark a heap object as reachable
+void gcMarkPtr(refptr ptr);
+
+/// Test if a heap object was marked during the current collection
+bool gcMarked(refptr ptr);
+
+/// Perform a full collection
+void gcCollect();
+
+/// Number of collections performed so far
+size_t gcCount();
+
+/// Root marking hooks, implemented by the modules owning the roots
+void markRuntimeRoots();
+void markInterpRoots();
+void markPkgRoots();
+
+/// Hooks letting the interpreter keep only the code of reachable functions
+bool markInterpCode();
+void sweepInterpCode();
@@ -1,10 +1,20 @@
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <chrono>
+#include <mutex>
+#include <signal.h>
+#include <sys/time.h>
 #include "runtime.h"
 #include "parser.h"
 #include "interp.h"
 #include "packages.h"
+#include "gc.h"
+#include "x86.h"
 #include <math.h>
 
 /// Opcode enumeration
@@ -80,6 +90,7 @@ enum Opcode : uint16_t
     NEW_OBJECT,
     HAS_FIELD,
     SET_FIELD,
+    SET_FIELD_IMM,
     GET_FIELD,
     GET_FIELD_IMM,
 
@@ -93,6 +104,29 @@ enum Opcode : uint16_t
     GET_ELEM,
     SET_ELEM,
 
+    // Fused instructions, generated by compile()
+    GET_LOCAL_FIELD_IMM,
+    GET_LOCAL_ADD_IMM,
+    ADD_LOCAL_IMM,
+    IF_LOCAL_HAS_TAG,
+    IF_CMP_LOCAL_IMM,
+    IF_CMP_IMM,
+
+    // Variants not checking the tags of their operands, generated
+    // by compile() when the tags are known
+    ADD_I32_NOCHK,
+    SUB_I32_NOCHK,
+    MUL_I32_NOCHK,
+    LT_I32_NOCHK,
+    LE_I32_NOCHK,
+    GT_I32_NOCHK,
+    GE_I32_NOCHK,
+    EQ_I32_NOCHK,
+    ADD_F32_NOCHK,
+    SUB_F32_NOCHK,
+    MUL_F32_NOCHK,
+    DIV_F32_NOCHK,
+
     // Branch instructions
     JUMP,
     JUMP_STUB,
@@ -101,10 +135,54 @@ enum Opcode : uint16_t
     RET,
     THROW,
 
+    // Entry into native code generated by the JIT
+    NATIVE,
+
+    // Block version entry, counted by the profiler
+    PROF_ENTER,
+
     // Abort instruction
     ABORT
 };
 
+/**
+With GNU-compatible compilers, the interpreter uses direct threading:
+the code heap stores the address of each instruction's handler in
+execCode instead of its opcode, and each handler jumps directly to
+the next one. Defining ZETA_SWITCH_DISPATCH (configure
+--enable-switch-dispatch) selects the portable switch-based dispatch.
+*/
+#if defined(__GNUC__) && !defined(ZETA_SWITCH_DISPATCH)
+#define ZETA_THREADED_DISPATCH
+typedef void* OpcodeSlot;
+#else
+typedef Opcode OpcodeSlot;
+#endif
+
+#ifdef ZETA_THREADED_DISPATCH
+/// Instruction handler addresses, indexed by opcode
+void** opHandlers = nullptr;
+#endif
+
+/**
+Hot block versions are compiled to native code on x86-64, unless
+ZETA_NO_JIT is defined.
+*/
+#if defined(__x86_64__) && !defined(ZETA_NO_JIT)
+#define ZETA_JIT
+#endif
+
+/// Encode an opcode the way it is stored in the code heap
+inline OpcodeSlot encodeOp(Opcode op)
+{
+#ifdef ZETA_THREADED_DISPATCH
+    assert (opHandlers != nullptr);
+    return opHandlers[op];
+#else
+    return op;
+#endif
+}
+
 class CodeFragment
 {
 public:
@@ -124,6 +202,111 @@ public:
     }
 };
 
+/// Tag value used when the type of a value is not known
+const Tag TAG_UNKNOWN = 0xFF;
+
+/// Maximum number of temporaries in a frame. Calls check that the
+/// callee frame fits on the stack along with this many temporaries.
+const size_t MAX_TMPS = 1024;
+
+/**
+Code generation context. Tracks the tags known at compilation time
+for the temporaries and locals at a given point in a block version.
+Block versions are specialized on the context at their entry, so
+that type tests whose outcome is known can be resolved statically.
+*/
+class CodeGenCtx
+{
+public:
+
+    /// Known tags of the temporaries, bottom of the stack first
+    std::vector<Tag> tmpTags;
+
+    /// Known tags of the locals, missing entries are unknown
+    std::vector<Tag> localTags;
+
+    CodeGenCtx(uint16_t numTmps = 0)
+    : tmpTags(numTmps, TAG_UNKNOWN)
+    {
+    }
+
+    uint16_t numTmps() const
+    {
+        return tmpTags.size();
+    }
+
+    void push(Tag tag = TAG_UNKNOWN)
+    {
+        if (tmpTags.size() >= MAX_TMPS)
+            throw RunError("too many temporaries in a frame");
+
+        tmpTags.push_back(tag);
+    }
+
+    /// Pop one temporary and return its tag
+    Tag pop()
+    {
+        if (tmpTags.empty())
+            throw RunError("pop from an empty temporary stack");
+
+        auto tag = tmpTags.back();
+        tmpTags.pop_back();
+        return tag;
+    }
+
+    void pop(size_t numVals)
+    {
+        for (size_t i = 0; i < numVals; ++i)
+            pop();
+    }
+
+    /// Get the tag of a temporary, indexed from the top of the stack
+    Tag getTmp(size_t idx) const
+    {
+        if (idx >= tmpTags.size())
+            throw RunError("temporary stack index out of range");
+
+        return tmpTags[tmpTags.size() - 1 - idx];
+    }
+
+    Tag getLocal(size_t idx) const
+    {
+        return (idx < localTags.size())? localTags[idx]:TAG_UNKNOWN;
+    }
+
+    void setLocal(size_t idx, Tag tag)
+    {
+        if (idx >= localTags.size())
+        {
+            if (tag == TAG_UNKNOWN)
+                return;
+            localTags.resize(idx + 1, TAG_UNKNOWN);
+        }
+
+        localTags[idx] = tag;
+
+        // Keep the representation canonical, so that contexts
+        // can be compared for equality
+        while (!localTags.empty() && localTags.back() == TAG_UNKNOWN)
+            localTags.pop_back();
+    }
+
+    /// Test if nothing is known about any value in this context
+    bool isGeneric() const
+    {
+        for (auto tag : tmpTags)
+            if (tag != TAG_UNKNOWN)
+                return false;
+
+        return localTags.empty();
+    }
+
+    bool operator == (const CodeGenCtx& that) const
+    {
+        return tmpTags == that.tmpTags && localTags == that.localTags;
+    }
+};
+
 class BlockVersion : public CodeFragment
 {
 public:
@@ -138,16 +321,147 @@ public:
     uint16_t numTmps;
 
     /// Code generation context at block entry
-    //CodeGenCtx ctx;
+    CodeGenCtx ctx;
+
+    /// Number of entries counted towards native compilation
+    uint32_t hotCount = 0;
+
+    /// Native code for this version (null if not compiled)
+    uint8_t* nativeCode = nullptr;
+
+    /// End of the native code, including its out-of-line code
+    uint8_t* nativeEnd = nullptr;
+
+    /// Functions called directly from the native code, with the location
+    /// of the constant the callee gets compared against
+    std::vector<std::pair<refptr, uint8_t*>> nativeCallees;
 
-    BlockVersion(Object fun, Object block, uint16_t numTmps)
+    /// Exits from the native code written apart from it by jitLink
+    std::vector<uint8_t*> nativeExits;
+
+    /// Interpreter code entering the native code (null if none)
+    uint8_t* nativeStub = nullptr;
+
+    /// Locations of heap references embedded in the code
+    std::vector<Value*> codeRefs;
+
+    /// Call sites in the code
+    std::vector<struct CallInfo*> calls;
+
+    /// Information about the call returning to this version, if any
+    struct RetEntry* retEntry = nullptr;
+
+    /// Profiler counters for this version (null if not profiling)
+    struct ProfVersion* prof = nullptr;
+
+    BlockVersion(Object fun, Object block, const CodeGenCtx& ctx)
     : fun(fun),
       block(block),
-      numTmps(numTmps)
+      numTmps(ctx.numTmps()),
+      ctx(ctx)
+    {
+    }
+
+    /// Address at which the interpreter enters this version
+    uint8_t* entryPtr() const
     {
+        return nativeStub? nativeStub:startPtr;
     }
 };
 
+/// Profiler counters for a function, over all its block versions
+struct ProfFun
+{
+    /// Name shown in the reports
+    std::string label;
+
+    /// Counters summed over the versions when reporting
+    uint64_t calls = 0;
+    uint64_t callMisses = 0;
+    uint64_t callOps = 0;
+    uint64_t entries = 0;
+    uint64_t instrs = 0;
+    uint64_t fieldOps = 0;
+    uint64_t fieldMisses = 0;
+    uint64_t hostNanos = 0;
+    uint64_t samples = 0;
+    uint64_t numVersions = 0;
+    uint64_t codeBytes = 0;
+};
+
+/// Profiler counters for a block version
+struct ProfVersion
+{
+    /// Associated version (null once collected)
+    BlockVersion* version;
+
+    /// Function the version belongs to
+    ProfFun* fun;
+
+    /// Source position of the block, if known
+    std::string srcPos;
+
+    /// Instructions, field accesses and call sites in the block
+    uint32_t numInstrs = 0;
+    uint32_t numFieldOps = 0;
+    uint32_t numCallOps = 0;
+
+    /// Bytes of interpreter code generated for the version
+    uint32_t codeBytes = 0;
+
+    /// Number of times the version was entered
+    uint64_t entries = 0;
+
+    /// Number of calls entering the function at this version
+    uint64_t calls = 0;
+
+    /// Call and field inline cache misses in the version
+    uint64_t callMisses = 0;
+    uint64_t fieldMisses = 0;
+
+    /// Time spent in host functions called from the version
+    uint64_t hostNanos = 0;
+
+    /// Number of timer samples taken in the version
+    uint64_t samples = 0;
+};
+
+/// Whether the profiler is counting and sampling. Only the isolate
+/// profiling was enabled on is profiled, and only it may touch the
+/// profiler state below.
+thread_local bool profEnabled = false;
+
+/// Version entered last, which is the one executing
+thread_local ProfVersion* profCurVer = nullptr;
+
+/// Set by the timer signal when a sample should be taken
+volatile sig_atomic_t profSampleDue = 0;
+
+/// Number of versions compiled while profiling
+uint64_t profNumCompiles = 0;
+
+/// File to write the collapsed call stacks to, if any
+std::string profStacksFile;
+
+/// Counters for each live function, each function seen and each version
+std::unordered_map<refptr, ProfFun*> profFuns;
+std::vector<ProfFun*> profFunList;
+std::vector<ProfVersion*> profVersions;
+
+/// Sample counts for each call stack, outermost function first
+std::unordered_map<std::string, uint64_t> profStacks;
+
+/// Call counts and time spent in each host function
+struct ProfHostFn
+{
+    uint64_t calls = 0;
+    uint64_t nanos = 0;
+};
+std::unordered_map<HostFn*, ProfHostFn> profHostFns;
+
+/// Maximum number of frames recorded in a sampled call stack
+const size_t MAX_PROF_DEPTH = 256;
+
 /// Struct to associate information with a return address
 struct RetEntry
 {
@@ -181,52 +495,124 @@ struct CallInfo
 
     // Number of call site arguments
     uint16_t numArgs;
+
+    // Known argument tags, used to specialize the callee entry
+    // block (null if nothing is known about the arguments)
+    const CodeGenCtx* entryCtx = nullptr;
 };
 
 typedef std::vector<BlockVersion*> VersionList;
 
-/// Initial code heap size in bytes
-const size_t CODE_HEAP_INIT_SIZE = 1 << 20;
+/**
+Branch operands refer to their target block version until the branch
+is patched with the address of the compiled code. Version references
+are tagged with the top bit, which user space addresses never have.
+*/
+const uintptr_t VERSION_REF_BIT = uintptr_t(1) << 63;
+
+inline uint8_t* versionRef(BlockVersion* version)
+{
+    assert (!((uintptr_t)version & VERSION_REF_BIT));
+    return (uint8_t*)((uintptr_t)version | VERSION_REF_BIT);
+}
+
+__attribute__((always_inline)) inline bool isVersionRef(uint8_t* addr)
+{
+    return (uintptr_t)addr & VERSION_REF_BIT;
+}
+
+inline BlockVersion* refVersion(uint8_t* addr)
+{
+    assert (isVersionRef(addr));
+    return (BlockVersion*)((uintptr_t)addr & ~VERSION_REF_BIT);
+}
+
+/// Chunk of memory into which code gets compiled
+struct CodeChunk
+{
+    uint8_t* mem;
+
+    size_t size;
+
+    /// Number of live block versions with code in this chunk,
+    /// only computed while discarding code
+    size_t numUsers;
+};
+
+/// Minimum size of code heap chunks in bytes
+const size_t CODE_CHUNK_SIZE = 1 << 20;
+
+/// Maximum space a single compiled instruction may take, including
+/// the jump linking to the next chunk, in bytes
+const size_t MAX_INSTR_SIZE = 256;
 
 /// Initial stack size in words
 const size_t STACK_INIT_SIZE = 1 << 16;
 
-/// Flat array of bytes into which code gets compiled
-uint8_t* codeHeap = nullptr;
+/// Chunks making up the code heap, the last one being written to
+thread_local std::vector<CodeChunk> codeChunks;
 
-/// Limit pointer for the code heap
-uint8_t* codeHeapLimit = nullptr;
+/// Start of the code heap chunk being written to
+thread_local uint8_t* codeHeap = nullptr;
+
+/// Limit pointer for the code heap chunk being written to
+thread_local uint8_t* codeHeapLimit = nullptr;
 
 /// Current allocation pointer in the code heap
-uint8_t* codeHeapAlloc = nullptr;
+thread_local uint8_t* codeHeapAlloc = nullptr;
+
+/// Compiler data associated with a block object
+struct BlockInfo
+{
+    /// Block object, null if this entry is free
+    refptr block;
+
+    /// Versions of the block, for all functions using it
+    VersionList versions;
+};
+
+/// Block infos, indexed by the hidden slot of block objects minus one
+thread_local std::vector<BlockInfo> blockInfos;
 
-/// Map of block objects to lists of versions
-std::unordered_map<refptr, VersionList> versionMap;
+/// Indices of the free entries in blockInfos
+thread_local std::vector<uint32_t> freeBlockInfos;
 
-/// Map of instructions to block versions
-/// Note: this isn't defined for all instructions
-std::unordered_map<uint8_t*, BlockVersion*> instrMap;
+/// Range of code heap addresses holding the code of a block version
+struct CodeRange
+{
+    uint8_t* start;
+    uint8_t* end;
+    BlockVersion* version;
+};
 
-/// Map of return addresses to associated info
-std::unordered_map<BlockVersion*, RetEntry> retAddrMap;
+/// Code ranges of the compiled block versions, sorted by start address.
+/// Versions split across chunks have one range per chunk.
+thread_local std::vector<CodeRange> codeRanges;
+
+/// Map of interpreter code addresses to the block versions starting there
+thread_local std::unordered_map<uint8_t*, BlockVersion*> versionStarts;
 
 /// Lower stack limit (stack pointer must be greater than this)
-Value* stackLimit = nullptr;
+thread_local Value* stackLimit = nullptr;
 
 /// Stack base, initial stack pointer value (end of the stack memory array)
-Value* stackBase = nullptr;
+thread_local Value* stackBase = nullptr;
 
 /// Stack frame base pointer
-Value* framePtr = nullptr;
+thread_local Value* framePtr = nullptr;
 
 /// Current temp stack top pointer
-Value* stackPtr = nullptr;
+thread_local Value* stackPtr = nullptr;
 
 // Current instruction pointer
-uint8_t* instrPtr = nullptr;
+thread_local uint8_t* instrPtr = nullptr;
 
 /// Cache of all possible one-character string values
-Value charStrings[256];
+thread_local Value charStrings[256];
+
+/// Versions of the functions not yet found reachable
+/// during the current garbage collection
+thread_local std::unordered_map<refptr, VersionList> gcPendingFuns;
 
 /// Write a value to the code heap
 template <typename T> void writeCode(T val)
@@ -238,10 +624,58 @@ template <typename T> void writeCode(T val)
     assert (codeHeapAlloc <= codeHeapLimit);
 }
 
+/// Write an opcode to the code heap
+void writeCode(Opcode op)
+{
+    writeCode<OpcodeSlot>(encodeOp(op));
+}
+
+/// Write a heap reference to the code heap, and record its location
+/// so that the garbage collector can find it
+void writeCodeRef(BlockVersion* version, Value val)
+{
+    version->codeRefs.push_back((Value*)codeHeapAlloc);
+    writeCode(val);
+}
+
+/// Test if a number of bytes fit in the current code heap chunk
+bool codeFits(size_t numBytes)
+{
+    return size_t(codeHeapLimit - codeHeapAlloc) >= numBytes;
+}
+
+/**
+Start writing code into a new chunk of at least a given size. If
+requested, a jump to the new chunk is written into the current one,
+so that execution flows from one chunk into the next.
+*/
+void newCodeChunk(size_t minSize, bool link = false)
+{
+    auto size = std::max(CODE_CHUNK_SIZE, minSize);
+    CodeChunk chunk = { new uint8_t[size], size, 0 };
+
+    if (link)
+    {
+        writeCode(JUMP);
+        writeCode(chunk.mem);
+    }
+
+    codeChunks.push_back(chunk);
+    codeHeap = codeHeapAlloc = chunk.mem;
+    codeHeapLimit = chunk.mem + size;
+}
+
+/// Make sure that a number of bytes can be written contiguously
+/// into the code heap, moving to a new chunk if needed
+void reserveCode(size_t numBytes)
+{
+    if (!codeFits(numBytes))
+        newCodeChunk(numBytes);
+}
+
 /// Return a pointer to a value to read from the code stream
 template <typename T> __attribute__((always_inline)) inline T& readCode()
 {
-    assert (instrPtr + sizeof(T) <= codeHeapLimit);
     T* valPtr = (T*)instrPtr;
     instrPtr += sizeof(T);
     return *valPtr;
@@ -277,20 +711,37 @@ __attribute__((always_inline)) inline bool popBool()
     return (bool)val;
 }
 
+/// Get the payload of an int32 value, checking its tag
+__attribute__((always_inline)) inline int32_t checkInt32(Value val)
+{
+    if (!val.isInt32())
+        throw RunError("expected an int32 value, got " + val.toString());
+    return val.getWord().int32;
+}
+
 __attribute__((always_inline)) inline int32_t popInt32()
 {
-    // TODO: throw RunError if wrong type
-    auto val = popVal();
-    assert (val.isInt32());
-    return (int32_t)val;
+    return checkInt32(popVal());
 }
 
 __attribute__((always_inline)) inline float popFloat32()
 {
-    // TODO: throw RunError if wrong type
     auto val = popVal();
-    assert (val.isFloat32());
-    return (float)val;
+    if (!val.isFloat32())
+        throw RunError("expected a float32 value, got " + val.toString());
+    return val.getWord().float32;
+}
+
+/// Pop an int32 value whose tag is known at compile time
+__attribute__((always_inline)) inline int32_t popInt32NoChk()
+{
+    return popVal().getWord().int32;
+}
+
+/// Pop a float32 value whose tag is known at compile time
+__attribute__((always_inline)) inline float popFloat32NoChk()
+{
+    return popVal().getWord().float32;
 }
 
 __attribute__((always_inline)) inline String popStr()
@@ -309,9 +760,13 @@ __attribute__((always_inline)) inline Object popObj()
     return (Object)val;
 }
 
+/// Compute the number of bytes allocated for the code heap
 size_t codeHeapSize()
 {
-    return codeHeapAlloc - codeHeap;
+    size_t size = 0;
+    for (auto& chunk : codeChunks)
+        size += chunk.size;
+    return size;
 }
 
 /// Compute the stack size (number of slots allocated)
@@ -326,920 +781,3130 @@ __attribute__((always_inline)) inline size_t frameSize()
     return framePtr - stackPtr + 1;
 }
 
-/// Initialize the interpreter
+/// Check that a number of slots can be pushed for a new frame,
+/// along with the temporaries of the frame
+__attribute__((always_inline)) inline void checkFrameFits(size_t numSlots)
+{
+    if (size_t(stackPtr - stackLimit) < numSlots + MAX_TMPS)
+        throw RunError("stack overflow");
+}
+
+// Interpreter loop, defined below
+Value execCode();
+
+// Lookup of the version containing a code address, defined below
+BlockVersion* findVersion(uint8_t* addr);
+
+#ifdef ZETA_JIT
+// Native code generation setup and collection, defined below
+void initJit();
+void jitUnlinkCallees(BlockVersion* version);
+void jitSweepChunks();
+#endif
+
+/// Initialize the interpreter for the current isolate
 void initInterp()
 {
-    // Allocate the code heap
-    codeHeap = new uint8_t[CODE_HEAP_INIT_SIZE];
-    codeHeapLimit = codeHeap + CODE_HEAP_INIT_SIZE;
-    codeHeapAlloc = codeHeap;
+    // Allocate the first code heap chunk
+    newCodeChunk(CODE_CHUNK_SIZE);
 
     // Allocate the stack
     stackLimit = new Value[STACK_INIT_SIZE];
     stackBase = stackLimit + STACK_INIT_SIZE;
     stackPtr = stackBase;
+
+#ifdef ZETA_THREADED_DISPATCH
+    // Have the interpreter loop export its handler table,
+    // which is the same for all isolates
+    static std::once_flag handlersOnce;
+    std::call_once(handlersOnce, []
+    {
+        instrPtr = nullptr;
+        execCode();
+    });
+#endif
+
+#ifdef ZETA_JIT
+    initJit();
+#endif
+
+    initGC();
 }
 
-/// Get a version of a block. This version will be a stub
-/// until compiled
-BlockVersion* getBlockVersion(
-    Object fun,
-    Object block,
-    uint16_t numTmps,
-    bool forceNew = false
-)
+/// Free the compiled code and the stack of the current isolate
+void shutdownInterp()
 {
-    auto blockPtr = (refptr)block;
-    auto versionItr = versionMap.find((refptr)block);
-
-    // If there are no existing versions of this block
-    if (versionItr == versionMap.end())
-    {
-        versionMap[blockPtr] = VersionList();
-    }
-    else if (!forceNew)
+    for (auto& info : blockInfos)
     {
-        auto versions = versionItr->second;
-        assert (versions.size() > 0);
-
-        // For each version of this block
-        for (auto version : versions)
+        for (auto version : info.versions)
         {
-            if (version->fun != fun)
-            {
-                continue;
-            }
-
-            if (version->numTmps != numTmps)
-            {
-                throw RunError(
-                    "a basic block must always receive the same number of "
-                    "values on the temporary stack at its entry"
-                );
-            }
+            for (auto callInfo : version->calls)
+                delete callInfo->entryCtx;
 
-            return version;
+            delete version;
         }
     }
 
-    // Create a new version and add it to the list
-    auto& versionList = versionMap[blockPtr];
-    auto newVersion = new BlockVersion(fun, block, numTmps);
-    versionList.push_back(newVersion);
+    blockInfos.clear();
+    freeBlockInfos.clear();
+    codeRanges.clear();
+    versionStarts.clear();
 
-    return newVersion;
+    for (auto& chunk : codeChunks)
+        delete [] chunk.mem;
+
+    codeChunks.clear();
+    codeHeap = codeHeapLimit = codeHeapAlloc = nullptr;
+
+    delete [] stackLimit;
+    stackLimit = stackBase = stackPtr = framePtr = nullptr;
 }
 
-void genCall(
-    BlockVersion* version,
-    Object callInstr,
-    size_t numArgs,
-    uint16_t& numTmps
-)
+/// Mark the GC roots held by the interpreter
+void markInterpRoots()
 {
-    // Store a mapping of this instruction to the block version
-    instrMap[codeHeapAlloc] = version;
+    // The code of a function is only kept alive along with the
+    // function itself, which marking will tell
+    assert (gcPendingFuns.empty());
+    std::unordered_set<BlockVersion*> liveVersions;
+    for (auto& info : blockInfos)
+    {
+        for (auto version : info.versions)
+        {
+            gcPendingFuns[(refptr)version->fun].push_back(version);
+            liveVersions.insert(version);
+        }
+    }
 
-    // Arguments and the function object are popped off the stack,
-    // a return value or exception is pushed on the stack
-    numTmps -= numArgs;
+    // Temporaries and locals of all active frames
+    for (auto slot = stackPtr; slot < stackBase; ++slot)
+    {
+        gcMark(*slot);
 
-    // Create a return address entry unique to this call instruction
-    // and this block version
-    RetEntry retEntry;
-    retEntry.callInstr = (refptr)callInstr;
+        if (slot->getTag() != TAG_RAWPTR)
+            continue;
 
-    // Store the number of temporaries when the call is performed
-    // Note: this excludes the arguments and the function object
-    assert (numTmps >= 1);
-    retEntry.numTmps = numTmps - 1;
+        // The hidden local holding the function of a frame can be
+        // overwritten, so the functions of active frames are found
+        // through the return versions saved in frames, and through
+        // the instruction pointers saved by callFun
+        auto ptr = slot->getWord().ptr;
+        if (liveVersions.count((BlockVersion*)ptr))
+            gcMark(((BlockVersion*)ptr)->fun);
+        else if (auto version = ptr? findVersion((uint8_t*)ptr - 1):nullptr)
+            gcMark(version->fun);
+    }
 
-    // Get a version for the call continuation block
-    // Note: we force the creation of a new version unique to this call site
-    static ICache retToCache("ret_to");
-    auto retToBB = retToCache.getObj(callInstr);
-    auto retVer = getBlockVersion(version->fun, retToBB, numTmps, true);
-    retEntry.retVer = retVer;
+    // The function currently executing. The instruction pointer may
+    // be just past the last instruction of its version.
+    if (instrPtr)
+        if (auto version = findVersion(instrPtr - 1))
+            gcMark(version->fun);
 
-    if (callInstr.hasField("throw_to"))
+    for (size_t i = 0; i < 256; ++i)
+        gcMark(charStrings[i]);
+}
+
+/**
+Mark the blocks and embedded values of the compiled code of functions
+found reachable so far. Returns true if anything was marked, in which
+case marking must continue.
+*/
+bool markInterpCode()
+{
+    bool marked = false;
+
+    for (auto itr = gcPendingFuns.begin(); itr != gcPendingFuns.end();)
     {
-        // Get a version for the exception catch block
-        // Note: the catch block expects only one temporary as input
-        static ICache throwIC("throw_to");
-        auto throwBB = throwIC.getObj(callInstr);
-        auto throwVer = getBlockVersion(version->fun, throwBB, 1);
-        retEntry.excVer = throwVer;
-    }
+        if (!gcMarked(itr->first))
+        {
+            ++itr;
+            continue;
+        }
 
-    // Create an entry for the return address
-    retAddrMap[retVer] = retEntry;
+        for (auto version : itr->second)
+        {
+            gcMark(version->block);
+            for (auto ref : version->codeRefs)
+                gcMark(*ref);
+        }
 
-    writeCode(CALL);
+        itr = gcPendingFuns.erase(itr);
+        marked = true;
+    }
 
-    CallInfo callInfo;
-    callInfo.numArgs = numArgs;
-    callInfo.retVer = retVer;
-    writeCode(callInfo);
+    return marked;
 }
 
-std::string getOp(Array& instrs, size_t i)
+/// Count a reference to the code heap chunk containing an address
+void countChunkUser(uint8_t* addr)
 {
-    if (i >= instrs.length())
+    for (auto& chunk : codeChunks)
     {
-        //We reached the end of the bb
-        return "nop";
+        if (addr >= chunk.mem && addr < chunk.mem + chunk.size)
+        {
+            chunk.numUsers++;
+            return;
+        }
     }
-    auto instr = (Object)instrs.getElem(i);
-    static ICache opIC("op");
-    return (std::string)opIC.getStr(instr);
-};
+}
 
-void compile(BlockVersion* version)
+/**
+Discard the block versions of the functions left unmarked, and free
+the code heap chunks which no longer contain any live code.
+*/
+void sweepInterpCode()
 {
-    //std::cout << "compiling version" << std::endl;
-
-    auto block = version->block;
-
-    // Get the instructions array
-    static ICache instrsIC("instrs");
-    Array instrs = instrsIC.getArr(block);
+    if (gcPendingFuns.empty())
+        return;
 
-    if (instrs.length() == 0)
+    std::unordered_set<BlockVersion*> deadVersions;
+    for (auto& pair : gcPendingFuns)
     {
-        throw RunError("empty basic block");
-    }
-
-    // Mark the block start
-    version->startPtr = codeHeapAlloc;
+        for (auto version : pair.second)
+            deadVersions.insert(version);
 
-    // Get the size of the temp stack at the beginning of this version
-    uint16_t numTmps = version->numTmps;
+        // The address may be reused by another function
+        if (profEnabled)
+            profFuns.erase(pair.first);
+    }
+    gcPendingFuns.clear();
 
-    // For each instruction
-    for (size_t i = 0; i < instrs.length(); ++i)
+    auto isDead = [&deadVersions](BlockVersion* version)
     {
-        auto instrVal = instrs.getElem(i);
-        assert (instrVal.isObject());
-        auto instr = (Object)instrVal;
-
-        static ICache opIC("op");
-        auto op = (std::string)opIC.getStr(instr);
-
-        //std::cout << "op: " << op << std::endl;
-        //std::cout << "  numTmps=" << numTmps << std::endl;
-
-        if (op == "push")
-        {
-            static ICache valIC("val");
-            auto val = valIC.getField(instr);
-            std::string nextOp = getOp(instrs, i + 1);
-
-            if (nextOp == "add_i32" && val == Value::ONE)
-            {
-                i += 1;
-                writeCode(INC_I32);
-                continue;
-            }
-
-            if (nextOp == "sub_i32" && val == Value::ONE)
-            {
-                i += 1;
-                writeCode(DEC_I32);
-                continue;
-            }
-
-            if (nextOp == "get_field")
-            {
-                i += 1;
-                writeCode(GET_FIELD_IMM);
-                writeCode((String)val);
-                writeCode(size_t(0));
-                continue;
-            }
+        return deadVersions.count(version) > 0;
+    };
 
-            numTmps += 1;
-            writeCode(PUSH);
-            writeCode(val);
-            continue;
-        }
+    for (uint32_t i = 0; i < blockInfos.size(); ++i)
+    {
+        auto& info = blockInfos[i];
+        auto& versions = info.versions;
 
-        if (op == "pop")
-        {
-            numTmps -= 1;
-            writeCode(POP);
+        if (!info.block)
             continue;
-        }
 
-        if (op == "dup")
-        {
-            numTmps += 1;
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            writeCode(DUP);
-            writeCode(idx);
-            continue;
-        }
+        versions.erase(
+            std::remove_if(versions.begin(), versions.end(), isDead),
+            versions.end()
+        );
 
-        if (op == "swap")
+        // Free the entry, the block itself may be about to be freed
+        if (versions.empty())
         {
-            writeCode(SWAP);
+            Object(Value(info.block, TAG_OBJECT)).setHidden(0);
+            info.block = nullptr;
+            freeBlockInfos.push_back(i);
             continue;
         }
 
-        if (op == "get_local")
+        // Call sites may cache a function about to be freed
+        for (auto version : versions)
         {
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            if (getOp(instrs, i + 1) == "has_tag")
+            for (auto callInfo : version->calls)
             {
-                numTmps += 1;
-                auto nextInstr = (Object) instrs.getElem(i + 1);
-                static ICache tagIC("tag");
-                auto tagStr = (std::string)tagIC.getStr(nextInstr);
-                auto tag = strToTag(tagStr);
-                writeCode(LOCAL_HAS_TAG);
-                writeCode(idx);
-                writeCode(tag);
-                i += 1;
-                continue;
+                if (callInfo->lastFn && !gcMarked(callInfo->lastFn))
+                {
+                    callInfo->lastFn = nullptr;
+                    callInfo->entryVer = nullptr;
+                }
             }
 
-            numTmps += 1;
-            writeCode(GET_LOCAL);
-            writeCode(idx);
-            continue;
+#ifdef ZETA_JIT
+            jitUnlinkCallees(version);
+#endif
         }
+    }
 
-        if (op == "set_local")
-        {
-            numTmps -= 1;
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            writeCode(SET_LOCAL);
-            writeCode(idx);
-            continue;
-        }
+    codeRanges.erase(
+        std::remove_if(
+            codeRanges.begin(),
+            codeRanges.end(),
+            [&isDead](const CodeRange& range) { return isDead(range.version); }
+        ),
+        codeRanges.end()
+    );
 
-        //
-        // Integer operations
-        //
+    for (auto itr = versionStarts.begin(); itr != versionStarts.end();)
+        itr = isDead(itr->second)? versionStarts.erase(itr):std::next(itr);
 
-        if (op == "add_i32")
-        {
-            numTmps -= 1;
-            writeCode(ADD_I32);
-            continue;
-        }
+    for (auto version : deadVersions)
+    {
+        for (auto callInfo : version->calls)
+            delete callInfo->entryCtx;
 
-        if (op == "sub_i32")
-        {
-            numTmps -= 1;
-            writeCode(SUB_I32);
-            continue;
-        }
+        // The profiler counters outlive the version
+        if (version->prof)
+            version->prof->version = nullptr;
 
-        if (op == "mul_i32")
-        {
-            numTmps -= 1;
-            writeCode(MUL_I32);
-            continue;
-        }
+        delete version;
+    }
 
-        if (op == "div_i32")
-        {
-            numTmps -= 1;
-            writeCode(DIV_I32);
-            continue;
-        }
+    // Find the chunks which still hold the code of live versions
+    for (auto& chunk : codeChunks)
+        chunk.numUsers = 0;
 
-        if (op == "mod_i32")
+    for (auto& info : blockInfos)
+    {
+        for (auto version : info.versions)
         {
-            numTmps -= 1;
-            writeCode(MOD_I32);
-            continue;
+            if (version->startPtr)
+                countChunkUser(version->startPtr);
+            if (version->endPtr)
+                countChunkUser(version->endPtr - 1);
+            if (version->nativeStub)
+                countChunkUser(version->nativeStub);
         }
+    }
 
-        if (op == "shl_i32")
+    // The last chunk is still being written to
+    for (size_t i = 0; i + 1 < codeChunks.size();)
+    {
+        if (codeChunks[i].numUsers > 0)
         {
-            numTmps -= 1;
-            writeCode(SHL_I32);
+            ++i;
             continue;
         }
 
-        if (op == "shr_i32")
-        {
-            numTmps -= 1;
-            writeCode(SHR_I32);
-            continue;
-        }
+        delete [] codeChunks[i].mem;
+        codeChunks.erase(codeChunks.begin() + i);
+    }
 
-        if (op == "ushr_i32")
-        {
-            numTmps -= 1;
-            writeCode(USHR_I32);
-            continue;
-        }
+#ifdef ZETA_JIT
+    jitSweepChunks();
+#endif
+}
 
-        if (op == "and_i32")
-        {
-            numTmps -= 1;
-            writeCode(AND_I32);
-            continue;
-        }
+/// Get the list of versions of a block, stored in the hidden slot
+/// of the block object
+VersionList& getVersionList(Object block)
+{
+    auto idx = block.getHidden();
 
-        if (op == "or_i32")
+    if (idx == 0)
+    {
+        if (freeBlockInfos.empty())
         {
-            numTmps -= 1;
-            writeCode(OR_I32);
-            continue;
+            blockInfos.push_back(BlockInfo());
+            idx = blockInfos.size();
         }
-
-        if (op == "xor_i32")
+        else
         {
-            numTmps -= 1;
-            writeCode(XOR_I32);
-            continue;
+            idx = freeBlockInfos.back() + 1;
+            freeBlockInfos.pop_back();
         }
 
-        if (op == "not_i32")
-        {
-            writeCode(NOT_I32);
-            continue;
-        }
+        blockInfos[idx - 1].block = (refptr)block;
+        block.setHidden(idx);
+    }
 
-        if (op == "lt_i32")
-        {
-            numTmps -= 1;
-            writeCode(LT_I32);
-            continue;
-        }
+    assert (blockInfos[idx - 1].block == (refptr)block);
+    return blockInfos[idx - 1].versions;
+}
 
-        if (op == "le_i32")
-        {
-            numTmps -= 1;
-            writeCode(LE_I32);
-            continue;
-        }
+/// Record the code range of a compiled block version
+void addCodeRange(uint8_t* start, uint8_t* end, BlockVersion* version)
+{
+    CodeRange range = { start, end, version };
 
-        if (op == "gt_i32")
-        {
-            numTmps -= 1;
-            writeCode(GT_I32);
-            continue;
-        }
+    if (version->prof)
+        version->prof->codeBytes += end - start;
 
-        if (op == "ge_i32")
-        {
-            numTmps -= 1;
-            writeCode(GE_I32);
-            continue;
-        }
+    auto itr = std::upper_bound(
+        codeRanges.begin(),
+        codeRanges.end(),
+        range,
+        [](const CodeRange& a, const CodeRange& b) { return a.start < b.start; }
+    );
 
-        if (op == "eq_i32")
-        {
-            numTmps -= 1;
-            writeCode(EQ_I32);
-            continue;
-        }
+    codeRanges.insert(itr, range);
+}
 
-        //
-        // Floating-point ops
-        //
+/**
+Find the block version whose code contains a given address. When the
+next version was compiled over the jump ending a version, their ranges
+overlap, and the address belongs to the one starting last.
+*/
+BlockVersion* findVersion(uint8_t* addr)
+{
+    auto itr = std::upper_bound(
+        codeRanges.begin(),
+        codeRanges.end(),
+        addr,
+        [](uint8_t* addr, const CodeRange& range) { return addr < range.start; }
+    );
+
+    if (itr == codeRanges.begin())
+        return nullptr;
+
+    --itr;
+    return (addr < itr->end)? itr->version:nullptr;
+}
 
-        if (op == "add_f32")
-        {
-            numTmps -= 1;
-            writeCode(ADD_F32);
-            continue;
-        }
+/// Maximum number of specialized versions of a block, per function.
+/// Once this limit is reached, a generic version is used instead.
+const size_t MAX_VERSIONS = 5;
 
-        if (op == "sub_f32")
-        {
-            numTmps -= 1;
-            writeCode(SUB_F32);
-            continue;
-        }
+/// Get a version of a block specialized for a given code generation
+/// context. This version will be a stub until compiled
+BlockVersion* getBlockVersion(
+    Object fun,
+    Object block,
+    const CodeGenCtx& ctx,
+    bool forceNew = false
+)
+{
+    auto& versions = getVersionList(block);
 
-        if (op == "mul_f32")
-        {
-            numTmps -= 1;
-            writeCode(MUL_F32);
-            continue;
-        }
+    // Context used for the new version
+    auto newCtx = ctx;
 
-        if (op == "div_f32")
-        {
-            numTmps -= 1;
-            writeCode(DIV_F32);
-            continue;
-        }
+    if (!forceNew)
+    {
+        BlockVersion* genericVer = nullptr;
+        size_t numVersions = 0;
 
-        if (op == "lt_f32")
+        // For each version of this block
+        for (auto version : versions)
         {
-            numTmps -= 1;
-            writeCode(LT_F32);
-            continue;
-        }
+            if (version->fun != fun)
+            {
+                continue;
+            }
 
-        if (op == "le_f32")
-        {
-            numTmps -= 1;
-            writeCode(LE_F32);
-            continue;
-        }
+            if (version->numTmps != ctx.numTmps())
+            {
+                throw RunError(
+                    "a basic block must always receive the same number of "
+                    "values on the temporary stack at its entry"
+                );
+            }
 
-        if (op == "gt_f32")
-        {
-            numTmps -= 1;
-            writeCode(GT_F32);
-            continue;
-        }
+            if (version->ctx == ctx)
+            {
+                return version;
+            }
 
-        if (op == "ge_f32")
-        {
-            numTmps -= 1;
-            writeCode(GE_F32);
-            continue;
-        }
+            if (version->ctx.isGeneric())
+            {
+                genericVer = version;
+            }
 
-        if (op == "eq_f32")
-        {
-            numTmps -= 1;
-            writeCode(EQ_F32);
-            continue;
+            numVersions++;
         }
 
-        if (op == "sin_f32")
+        // If the version limit is reached, fall back to
+        // a version which assumes nothing about the context
+        if (numVersions >= MAX_VERSIONS)
         {
-            numTmps += 0;
-            writeCode(SIN_F32);
-            continue;
-        }
+            if (genericVer)
+                return genericVer;
 
-        if (op == "cos_f32")
-        {
-            numTmps += 0;
-            writeCode(COS_F32);
-            continue;
+            newCtx = CodeGenCtx(ctx.numTmps());
         }
+    }
 
-        if (op == "sqrt_f32")
-        {
-            numTmps += 0;
-            writeCode(SQRT_F32);
-            continue;
-        }
+    // Create a new version and add it to the list
+    auto newVersion = new BlockVersion(fun, block, newCtx);
+    versions.push_back(newVersion);
 
-        //
-        // Conversion ops
-        //
+    return newVersion;
+}
 
-        if (op == "i32_to_f32")
-        {
-            writeCode(I32_TO_F32);
-            continue;
-        }
+void genCall(
+    BlockVersion* version,
+    Object callInstr,
+    size_t numArgs,
+    CodeGenCtx& ctx
+)
+{
+    // The arguments become the first locals of the callee
+    // Note: the function object is on top of the arguments
+    CodeGenCtx entryCtx;
+    for (size_t i = 0; i < numArgs; ++i)
+        entryCtx.setLocal(i, ctx.getTmp(numArgs - i));
 
-        if (op == "i32_to_str")
-        {
-            writeCode(I32_TO_STR);
-            continue;
-        }
+    // Arguments and the function object are popped off the stack
+    ctx.pop(numArgs + 1);
 
-        if (op == "f32_to_i32")
-        {
-            writeCode(F32_TO_I32);
-            continue;
-        }
+    // Create a return address entry unique to this call instruction
+    // and this block version
+    RetEntry retEntry;
+    retEntry.callInstr = (refptr)callInstr;
 
-        if (op == "f32_to_str")
-        {
-            writeCode(F32_TO_STR);
-            continue;
-        }
+    // Store the number of temporaries when the call is performed
+    // Note: this excludes the arguments and the function object
+    retEntry.numTmps = ctx.numTmps();
 
-        if (op == "str_to_f32")
-        {
-            writeCode(STR_TO_F32);
-            continue;
-        }
+    // A return value or exception is pushed on the stack. The callee
+    // cannot write to our locals, so their known tags are preserved.
+    ctx.push();
 
-        //
-        // Miscellaneous ops
-        //
+    // Get a version for the call continuation block
+    // Note: we force the creation of a new version unique to this call site
+    static thread_local ICache retToCache("ret_to");
+    auto retToBB = retToCache.getObj(callInstr);
+    auto retVer = getBlockVersion(version->fun, retToBB, ctx, true);
+    retEntry.retVer = retVer;
 
-        if (op == "eq_bool")
-        {
-            numTmps -= 1;
-            writeCode(EQ_BOOL);
-            continue;
-        }
+    if (callInstr.hasField("throw_to"))
+    {
+        // Get a version for the exception catch block
+        // Note: the catch block expects only one temporary as input
+        static thread_local ICache throwIC("throw_to");
+        auto throwBB = throwIC.getObj(callInstr);
+        CodeGenCtx throwCtx(1);
+        throwCtx.localTags = ctx.localTags;
+        auto throwVer = getBlockVersion(version->fun, throwBB, throwCtx);
+        retEntry.excVer = throwVer;
+    }
 
-        if (op == "has_tag")
-        {
-            numTmps += 0;
-            static ICache tagIC("tag");
-            auto tagStr = (std::string)tagIC.getStr(instr);
-            auto tag = strToTag(tagStr);
+    writeCode(CALL);
+    version->calls.push_back((CallInfo*)codeHeapAlloc);
 
-            writeCode(HAS_TAG);
-            writeCode(tag);
-            continue;
-        }
+    CallInfo callInfo;
+    callInfo.numArgs = numArgs;
+    callInfo.retVer = retVer;
+    if (!entryCtx.isGeneric())
+        callInfo.entryCtx = new CodeGenCtx(entryCtx);
+    writeCode(callInfo);
 
-        if (op == "get_tag")
-        {
-            numTmps += 0;
-            writeCode(GET_TAG);
-            continue;
-        }
+    // The return address entry follows the call info
+    retVer->retEntry = (RetEntry*)codeHeapAlloc;
+    writeCode(retEntry);
+}
 
-        //
-        // String operations
-        //
+std::string getOp(Array& instrs, size_t i)
+{
+    if (i >= instrs.length())
+    {
+        //We reached the end of the bb
+        return "nop";
+    }
+    auto instr = (Object)instrs.getElem(i);
+    static thread_local ICache opIC("op");
+    return (std::string)opIC.getStr(instr);
+};
 
-        if (op == "str_len")
-        {
-            numTmps += 0;
-            writeCode(STR_LEN);
-            continue;
-        }
+/// Write the then and else targets of a branch instruction
+void writeBranchTargets(
+    BlockVersion* version,
+    Object branchInstr,
+    const CodeGenCtx& thenCtx,
+    const CodeGenCtx& elseCtx
+)
+{
+    static thread_local ICache thenIC("then");
+    static thread_local ICache elseIC("else");
+    auto thenBB = thenIC.getObj(branchInstr);
+    auto elseBB = elseIC.getObj(branchInstr);
+    auto thenVer = getBlockVersion(version->fun, thenBB, thenCtx);
+    auto elseVer = getBlockVersion(version->fun, elseBB, elseCtx);
+
+    writeCode(versionRef(thenVer));
+    writeCode(versionRef(elseVer));
+}
 
-        if (op == "get_char")
-        {
-            numTmps -= 1;
-            writeCode(GET_CHAR);
-            continue;
-        }
+/// Choose the variant of an operation on the two temporaries on top
+/// of the stack which doesn't check their tags, if both are known
+Opcode checkFreeOp(const CodeGenCtx& ctx, Tag tag, Opcode op, Opcode noChkOp)
+{
+    bool known = ctx.getTmp(0) == tag && ctx.getTmp(1) == tag;
+    return known? noChkOp:op;
+}
 
-        if (op == "get_char_code")
-        {
-            numTmps -= 1;
-            writeCode(GET_CHAR_CODE);
-            continue;
-        }
+/// Get the opcode checking the operand tags for a variant which doesn't
+Opcode checkedOp(Opcode op)
+{
+    switch (op)
+    {
+        case ADD_I32_NOCHK: return ADD_I32;
+        case SUB_I32_NOCHK: return SUB_I32;
+        case MUL_I32_NOCHK: return MUL_I32;
+        case LT_I32_NOCHK: return LT_I32;
+        case LE_I32_NOCHK: return LE_I32;
+        case GT_I32_NOCHK: return GT_I32;
+        case GE_I32_NOCHK: return GE_I32;
+        case EQ_I32_NOCHK: return EQ_I32;
+        case ADD_F32_NOCHK: return ADD_F32;
+        case SUB_F32_NOCHK: return SUB_F32;
+        case MUL_F32_NOCHK: return MUL_F32;
+        case DIV_F32_NOCHK: return DIV_F32;
+
+        default:
+        return op;
+    }
+}
 
-        if (op == "char_to_str")
-        {
-            numTmps += 0;
-            writeCode(CHAR_TO_STR);
-            continue;
-        }
+/// Test if an instruction is an int32 comparison
+bool isCmpI32(const std::string& op)
+{
+    return (
+        op == "lt_i32" ||
+        op == "le_i32" ||
+        op == "gt_i32" ||
+        op == "ge_i32" ||
+        op == "eq_i32"
+    );
+}
 
-        if (op == "str_cat")
-        {
-            numTmps -= 1;
-            writeCode(STR_CAT);
-            continue;
-        }
+/// Get the opcode for an int32 comparison
+Opcode cmpI32Opcode(const std::string& op)
+{
+    if (op == "lt_i32")
+        return LT_I32;
+    if (op == "le_i32")
+        return LE_I32;
+    if (op == "gt_i32")
+        return GT_I32;
+    if (op == "ge_i32")
+        return GE_I32;
+    assert (op == "eq_i32");
+    return EQ_I32;
+}
 
-        if (op == "eq_str")
-        {
-            numTmps -= 1;
-            writeCode(EQ_STR);
-            continue;
-        }
+/**
+Peephole pass generating fused instructions for common sequences
+of instructions. Returns the number of instructions consumed, or
+zero if no pattern matches at index i.
+Note: comparison opcodes written as operands are not encoded
+*/
+size_t compileFused(
+    BlockVersion* version,
+    Array& instrs,
+    size_t i,
+    CodeGenCtx& ctx
+)
+{
+    static thread_local ICache idxIC("idx");
+    static thread_local ICache valIC("val");
 
-        //
-        // Object operations
-        //
+    auto op0 = getOp(instrs, i);
+    auto op1 = getOp(instrs, i + 1);
+    auto op2 = getOp(instrs, i + 2);
+    auto op3 = getOp(instrs, i + 3);
 
-        if (op == "new_object")
-        {
-            numTmps += 0;
-            writeCode(NEW_OBJECT);
-            continue;
-        }
+    if (op0 == "get_local")
+    {
+        auto instr0 = (Object)instrs.getElem(i);
+        auto idx = (uint16_t)idxIC.getInt32(instr0);
 
-        if (op == "has_field")
+        // get_local a; has_tag t; if_true
+        if (op1 == "has_tag" && op2 == "if_true")
         {
-            numTmps -= 1;
-            writeCode(HAS_FIELD);
-            continue;
+            static thread_local ICache tagIC("tag");
+            auto instr1 = (Object)instrs.getElem(i + 1);
+            auto tag = strToTag((std::string)tagIC.getStr(instr1));
+            auto branchInstr = (Object)instrs.getElem(i + 2);
+
+            // If the tag of the local is known, the test is resolved
+            // statically and we jump directly to the branch taken
+            auto localTag = ctx.getLocal(idx);
+            if (localTag != TAG_UNKNOWN)
+            {
+                static thread_local ICache thenIC("then");
+                static thread_local ICache elseIC("else");
+                auto dstBB = (localTag == tag)?
+                    thenIC.getObj(branchInstr):elseIC.getObj(branchInstr);
+                auto dstVer = getBlockVersion(version->fun, dstBB, ctx);
+
+                writeCode(JUMP_STUB);
+                writeCode(dstVer);
+                return 3;
+            }
+
+            // The then branch knows the tag of the local
+            auto thenCtx = ctx;
+            thenCtx.setLocal(idx, tag);
+
+            writeCode(IF_LOCAL_HAS_TAG);
+            writeCode(idx);
+            writeCode(tag);
+            writeBranchTargets(version, branchInstr, thenCtx, ctx);
+            return 3;
         }
 
-        if (op == "set_field")
+        if (op1 != "push")
+            return 0;
+
+        auto val = valIC.getField((Object)instrs.getElem(i + 1));
+
+        // get_local a; push "name"; get_field
+        if (val.isString() && op2 == "get_field")
         {
-            numTmps -= 3;
-            writeCode(SET_FIELD);
-            continue;
+            ctx.push();
+            writeCode(GET_LOCAL_FIELD_IMM);
+            writeCode(idx);
+            writeCodeRef(version, String(val).intern());
+            writeCode(FieldPIC());
+            return 3;
         }
 
-        if (op == "get_field")
-        {
-            numTmps -= 1;
+        if (!val.isInt32())
+            return 0;
 
-            writeCode(GET_FIELD);
+        auto imm = (int32_t)val;
 
-            // Cached property slot index
-            writeCode(size_t(0));
+        // get_local a; push k; <cmp_i32>; if_true
+        if (isCmpI32(op2) && op3 == "if_true")
+        {
+            writeCode(IF_CMP_LOCAL_IMM);
+            writeCode(uint16_t(cmpI32Opcode(op2)));
+            writeCode(idx);
+            writeCode(imm);
 
-            continue;
+            // The comparison requires the local to be an int32
+            ctx.setLocal(idx, TAG_INT32);
+            writeBranchTargets(version, instrs.getElem(i + 3), ctx, ctx);
+            return 4;
         }
 
-        if (op == "get_field_list")
+        if (op2 == "add_i32" || op2 == "sub_i32")
         {
-            numTmps += 0;
+            if (op2 == "sub_i32")
+                imm = int32_t(0u - uint32_t(imm));
 
-            writeCode(GET_FIELD_LIST);
-            continue;
-        }
+            // get_local a; push k; add_i32; set_local a
+            if (op3 == "set_local")
+            {
+                auto instr3 = (Object)instrs.getElem(i + 3);
+                if (idxIC.getInt32(instr3) == idx)
+                {
+                    ctx.setLocal(idx, TAG_INT32);
+                    writeCode(ADD_LOCAL_IMM);
+                    writeCode(idx);
+                    writeCode(imm);
+                    return 4;
+                }
+            }
 
-        if (op == "eq_obj")
-        {
-            numTmps -= 1;
-            writeCode(EQ_OBJ);
-            continue;
+            // get_local a; push k; add_i32
+            ctx.push(TAG_INT32);
+            writeCode(GET_LOCAL_ADD_IMM);
+            writeCode(idx);
+            writeCode(imm);
+            return 3;
         }
 
-        //
-        // Array operations
-        //
+        return 0;
+    }
 
-        if (op == "new_array")
-        {
-            numTmps += 0;
-            writeCode(NEW_ARRAY);
-            continue;
-        }
+    // push k; <cmp_i32>; if_true
+    if (op0 == "push" && isCmpI32(op1) && op2 == "if_true")
+    {
+        auto val = valIC.getField((Object)instrs.getElem(i));
 
-        if (op == "array_len")
-        {
-            numTmps += 0;
-            writeCode(ARRAY_LEN);
-            continue;
-        }
+        if (!val.isInt32())
+            return 0;
 
-        if (op == "array_push")
-        {
-            numTmps -= 2;
-            writeCode(ARRAY_PUSH);
-            continue;
-        }
+        ctx.pop();
+        writeCode(IF_CMP_IMM);
+        writeCode(uint16_t(cmpI32Opcode(op1)));
+        writeCode((int32_t)val);
+        writeBranchTargets(version, instrs.getElem(i + 2), ctx, ctx);
+        return 3;
+    }
 
-        if (op == "set_elem")
-        {
-            numTmps -= 3;
-            writeCode(SET_ELEM);
-            continue;
-        }
+    return 0;
+}
 
-        if (op == "get_elem")
-        {
-            numTmps -= 1;
-            writeCode(GET_ELEM);
-            continue;
-        }
+/// Get the position of the first instruction in a block which has one
+std::string profBlockPos(Object block)
+{
+    static thread_local ICache instrsIC("instrs");
+    Array instrs = instrsIC.getArr(block);
 
-        //
-        // Branch instructions
-        //
+    for (size_t i = 0; i < instrs.length(); ++i)
+    {
+        auto instr = Object(instrs.getElem(i));
+        if (instr.hasField("src_pos"))
+            return posToString(instr.getField("src_pos"));
+    }
 
-        if (op == "jump")
-        {
-            numTmps += 0;
+    return "";
+}
 
-            static ICache toIC("to");
-            auto dstBB = toIC.getObj(instr);
-            auto dstVer = getBlockVersion(version->fun, dstBB, numTmps);
+/**
+Get the profiler record for a function. Functions have no names, so they
+are labelled with the name of the package field holding them, or else with
+the first source position found in their blocks, in breadth-first order
+from the entry block.
+*/
+ProfFun* getProfFun(Object fun)
+{
+    auto& profFun = profFuns[(refptr)fun];
+    if (profFun)
+        return profFun;
 
-            writeCode(JUMP_STUB);
-            writeCode(dstVer);
-            continue;
-        }
+    profFun = new ProfFun();
+    profFunList.push_back(profFun);
 
-        if (op == "if_true")
-        {
-            numTmps -= 1;
+    if (fun.hasField("name") && fun.getField("name").isString())
+    {
+        profFun->label = (std::string)fun.getField("name");
+        return profFun;
+    }
 
-            static ICache thenIC("then");
-            static ICache elseIC("else");
-            auto thenBB = thenIC.getObj(instr);
-            auto elseBB = elseIC.getObj(instr);
-            auto thenVer = getBlockVersion(version->fun, thenBB, numTmps);
-            auto elseVer = getBlockVersion(version->fun, elseBB, numTmps);
+    profFun->label = findExportName(fun);
+    if (profFun->label != "")
+        return profFun;
 
-            writeCode(IF_TRUE);
-            writeCode(thenVer);
-            writeCode(elseVer);
+    static const char* targetNames[] = {
+        "to", "then", "else", "ret_to", "throw_to"
+    };
 
-            continue;
-        }
+    std::vector<Object> queue = { fun.getFieldObj("entry") };
+    std::unordered_set<refptr> visited = { (refptr)queue[0] };
 
-        if (op == "call")
+    for (size_t i = 0; i < queue.size() && i < 64; ++i)
+    {
+        profFun->label = profBlockPos(queue[i]);
+        if (profFun->label != "")
+            return profFun;
+
+        Array instrs = queue[i].getFieldArr("instrs");
+        auto lastInstr = Object(instrs.getElem(instrs.length() - 1));
+
+        for (auto name : targetNames)
         {
-            static ICache numArgsCache("num_args");
-            auto numArgs = (int16_t)numArgsCache.getInt32(instr);
+            if (!lastInstr.hasField(name))
+                continue;
 
-            genCall(
-                version,
-                instr,
-                numArgs,
-                numTmps
+            auto target = lastInstr.getField(name);
+            if (target.isObject() && visited.insert((refptr)target).second)
+                queue.push_back(Object(target));
+        }
+    }
+
+    // Number the others in order of appearance, which is deterministic
+    profFun->label = "<anonymous#" + std::to_string(profFunList.size()) + ">";
+    return profFun;
+}
+
+/// Create the profiler counters for a version being compiled
+ProfVersion* newProfVersion(BlockVersion* version, Array instrs)
+{
+    auto prof = new ProfVersion();
+    prof->version = version;
+    prof->fun = getProfFun(version->fun);
+    prof->srcPos = profBlockPos(version->block);
+    prof->numInstrs = instrs.length();
+
+    for (size_t i = 0; i < instrs.length(); ++i)
+    {
+        static thread_local ICache opIC("op");
+        auto op = (std::string)opIC.getStr(Object(instrs.getElem(i)));
+
+        if (op == "get_field" || op == "set_field" || op == "has_field")
+            prof->numFieldOps++;
+        else if (op == "call")
+            prof->numCallOps++;
+    }
+
+    profVersions.push_back(prof);
+    profNumCompiles++;
+
+    return prof;
+}
+
+/// Current time in nanoseconds, for the host call timings
+uint64_t profNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+/// Record a sample of the call stack, walking the frames as throwExc does
+void profSample()
+{
+    profSampleDue = 0;
+    profCurVer->samples++;
+
+    std::vector<ProfFun*> funs;
+    auto fp = framePtr;
+    auto fun = profCurVer->version->fun;
+
+    while (funs.size() < MAX_PROF_DEPTH)
+    {
+        funs.push_back(getProfFun(fun));
+
+        static thread_local ICache numLocalsIC("num_locals");
+        auto numLocals = numLocalsIC.getInt32(fun);
+        auto retVer = (BlockVersion*)fp[-(numLocals + 2)].getWord().ptr;
+
+        // Stop at the frame entered from the host
+        if (retVer == nullptr)
+            break;
+
+        fp = (Value*)fp[-(numLocals + 1)].getWord().ptr;
+        fun = retVer->fun;
+    }
+
+    std::string stack;
+    for (auto itr = funs.rbegin(); itr != funs.rend(); ++itr)
+    {
+        if (!stack.empty())
+            stack += ";";
+        stack += (*itr)->label;
+    }
+
+    profStacks[stack]++;
+}
+
+/// Count the entry into a version, executed by PROF_ENTER
+__attribute__((always_inline)) inline void profEnter(ProfVersion* prof)
+{
+    prof->entries++;
+    profCurVer = prof;
+
+    if (profSampleDue)
+        profSample();
+}
+
+/**
+Charge the field cache misses of a field access instruction to the
+version executing it, given the miss count from before the access.
+The misses of lookups made by the compiler and host functions are not
+those of field accesses in the program, and are left out.
+*/
+__attribute__((always_inline)) inline void profFieldAccess(uint64_t numMisses)
+{
+    if (profEnabled && profCurVer)
+        profCurVer->fieldMisses += FieldPIC::numMisses - numMisses;
+}
+
+/// Account for the time taken by a host function call
+void profHostCall(HostFn* hostFn, ProfVersion* callerProf, uint64_t startTime)
+{
+    auto nanos = profNow() - startTime;
+
+    auto& profHost = profHostFns[hostFn];
+    profHost.calls++;
+    profHost.nanos += nanos;
+
+    if (callerProf)
+        callerProf->hostNanos += nanos;
+}
+
+/// Percentage of a count, or 0 if the total is 0
+double profPercent(uint64_t count, uint64_t total)
+{
+    return total? (100.0 * count / total):0.0;
+}
+
+/// Print the flat profile and write the collapsed call stacks
+void writeProfile()
+{
+    profEnabled = false;
+
+    uint64_t totalSamples = 0;
+    uint64_t totalInstrs = 0;
+    uint64_t totalCodeBytes = 0;
+
+    for (auto prof : profVersions)
+    {
+        auto fun = prof->fun;
+        fun->calls += prof->calls;
+        fun->callMisses += prof->callMisses;
+        fun->callOps += prof->entries * prof->numCallOps;
+        fun->entries += prof->entries;
+        fun->instrs += prof->entries * prof->numInstrs;
+        fun->fieldOps += prof->entries * prof->numFieldOps;
+        fun->fieldMisses += prof->fieldMisses;
+        fun->hostNanos += prof->hostNanos;
+        fun->samples += prof->samples;
+        fun->numVersions++;
+        fun->codeBytes += prof->codeBytes;
+
+        totalSamples += prof->samples;
+        totalInstrs += prof->entries * prof->numInstrs;
+        totalCodeBytes += prof->codeBytes;
+    }
+
+    std::vector<ProfFun*> funs = profFunList;
+
+    std::sort(
+        funs.begin(),
+        funs.end(),
+        [](ProfFun* a, ProfFun* b)
+        {
+            if (a->samples != b->samples)
+                return a->samples > b->samples;
+            return a->instrs > b->instrs;
+        }
+    );
+
+    std::vector<ProfVersion*> versions = profVersions;
+    std::sort(
+        versions.begin(),
+        versions.end(),
+        [](ProfVersion* a, ProfVersion* b)
+        {
+            if (a->samples != b->samples)
+                return a->samples > b->samples;
+            return a->entries * a->numInstrs > b->entries * b->numInstrs;
+        }
+    );
+
+    auto& out = std::cerr;
+    char line[512];
+
+    out << "profile: " << totalSamples << " samples, ";
+    out << totalInstrs << " instructions, ";
+    out << profNumCompiles << " versions compiled, ";
+    out << totalCodeBytes << " code bytes" << std::endl;
+
+    out << std::endl << "functions:" << std::endl;
+    snprintf(
+        line, sizeof(line),
+        "%7s %8s %9s %12s %9s %9s %10s %10s %8s %5s %8s  %s\n",
+        "self%", "samples", "calls", "instrs", "call-ops", "call-miss",
+        "field-ops", "field-miss", "host-ms", "vers", "bytes", "function"
+    );
+    out << line;
+
+    for (size_t i = 0; i < funs.size() && i < 30; ++i)
+    {
+        auto fun = funs[i];
+        if (fun->entries == 0)
+            continue;
+
+        snprintf(
+            line, sizeof(line),
+            "%6.2f%% %8llu %9llu %12llu %9llu %9llu %10llu %10llu %8.2f %5llu %8llu  %s\n",
+            profPercent(fun->samples, totalSamples),
+            (unsigned long long)fun->samples,
+            (unsigned long long)fun->calls,
+            (unsigned long long)fun->instrs,
+            (unsigned long long)fun->callOps,
+            (unsigned long long)fun->callMisses,
+            (unsigned long long)fun->fieldOps,
+            (unsigned long long)fun->fieldMisses,
+            fun->hostNanos / 1e6,
+            (unsigned long long)fun->numVersions,
+            (unsigned long long)fun->codeBytes,
+            fun->label.c_str()
+        );
+        out << line;
+    }
+
+    out << std::endl << "block versions:" << std::endl;
+    snprintf(
+        line, sizeof(line),
+        "%7s %8s %12s %10s %10s %10s %8s  %s\n",
+        "self%", "samples", "instrs", "entries", "field-ops", "field-miss",
+        "host-ms", "block"
+    );
+    out << line;
+
+    for (size_t i = 0; i < versions.size() && i < 20; ++i)
+    {
+        auto prof = versions[i];
+        if (prof->entries == 0)
+            continue;
+
+        auto blockName = prof->fun->label;
+        if (prof->srcPos != "" && prof->srcPos != blockName)
+            blockName += " (" + prof->srcPos + ")";
+
+        snprintf(
+            line, sizeof(line),
+            "%6.2f%% %8llu %12llu %10llu %10llu %10llu %8.2f  %s\n",
+            profPercent(prof->samples, totalSamples),
+            (unsigned long long)prof->samples,
+            (unsigned long long)(prof->entries * prof->numInstrs),
+            (unsigned long long)prof->entries,
+            (unsigned long long)(prof->entries * prof->numFieldOps),
+            (unsigned long long)prof->fieldMisses,
+            prof->hostNanos / 1e6,
+            blockName.c_str()
+        );
+        out << line;
+    }
+
+    if (!profHostFns.empty())
+    {
+        std::vector<std::pair<HostFn*, ProfHostFn>> hostFns(
+            profHostFns.begin(),
+            profHostFns.end()
+        );
+
+        std::sort(
+            hostFns.begin(),
+            hostFns.end(),
+            [](const std::pair<HostFn*, ProfHostFn>& a, const std::pair<HostFn*, ProfHostFn>& b)
+            {
+                return a.second.nanos > b.second.nanos;
+            }
+        );
+
+        out << std::endl << "host functions:" << std::endl;
+        snprintf(line, sizeof(line), "%10s %10s  %s\n", "calls", "ms", "function");
+        out << line;
+
+        for (auto& pair : hostFns)
+        {
+            snprintf(
+                line, sizeof(line),
+                "%10llu %10.2f  %s\n",
+                (unsigned long long)pair.second.calls,
+                pair.second.nanos / 1e6,
+                pair.first->getName().c_str()
             );
+            out << line;
+        }
+    }
+
+    if (profStacksFile != "")
+    {
+        std::ofstream file(profStacksFile);
+        if (!file)
+        {
+            out << "could not write profile stacks to \"" << profStacksFile << "\"" << std::endl;
+            return;
+        }
+
+        for (auto& pair : profStacks)
+            file << pair.first << " " << pair.second << "\n";
+    }
+}
+
+/// Interval between profiler samples, in microseconds
+const long PROF_SAMPLE_USECS = 1000;
+
+void enableProfiling(std::string stacksFile)
+{
+    // Native code does not execute the profiler instructions
+    disableJit();
+
+    profEnabled = true;
+    profStacksFile = stacksFile;
+
+    // The signal handler only flags that a sample is due, the sample
+    // itself is taken at the next block version entry
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = [](int) { profSampleDue = 1; };
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROF_SAMPLE_USECS;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    atexit(writeProfile);
+}
+
+void compile(BlockVersion* version)
+{
+    //std::cout << "compiling version" << std::endl;
+
+    auto block = version->block;
+
+    // Get the instructions array
+    static thread_local ICache instrsIC("instrs");
+    Array instrs = instrsIC.getArr(block);
+
+    if (instrs.length() == 0)
+    {
+        throw RunError("empty basic block");
+    }
+
+    // Mark the block start
+    reserveCode(MAX_INSTR_SIZE);
+    version->startPtr = codeHeapAlloc;
+    versionStarts[version->startPtr] = version;
+
+    // Start of the code written in the current chunk
+    auto rangeStart = codeHeapAlloc;
+
+    // Count the entries into the version when profiling
+    if (profEnabled)
+    {
+        version->prof = newProfVersion(version, instrs);
+        writeCode(PROF_ENTER);
+        writeCode(version->prof);
+    }
+
+    // Start from the code generation context at the version entry
+    auto ctx = version->ctx;
+
+    // For each instruction
+    for (size_t i = 0; i < instrs.length(); ++i)
+    {
+        auto instrVal = instrs.getElem(i);
+        assert (instrVal.isObject());
+        auto instr = (Object)instrVal;
+
+        // Continue in a new chunk when running out of space, making
+        // it large enough that the rest of the version fits
+        if (!codeFits(MAX_INSTR_SIZE))
+        {
+            auto linkEnd = codeHeapAlloc + sizeof(OpcodeSlot) + sizeof(uint8_t*);
+            newCodeChunk((instrs.length() - i) * MAX_INSTR_SIZE, true);
+            addCodeRange(rangeStart, linkEnd, version);
+            rangeStart = codeHeapAlloc;
+        }
 
+        // Try to generate a fused instruction first
+        auto numFused = compileFused(version, instrs, i, ctx);
+        if (numFused > 0)
+        {
+            i += numFused - 1;
             continue;
         }
 
-        if (op == "ret")
+        static thread_local ICache opIC("op");
+        auto op = (std::string)opIC.getStr(instr);
+
+        //std::cout << "op: " << op << std::endl;
+        //std::cout << "  numTmps=" << ctx.numTmps() << std::endl;
+
+        if (op == "push")
         {
-            numTmps -= 1;
+            static thread_local ICache valIC("val");
+            auto val = valIC.getField(instr);
+            std::string nextOp = getOp(instrs, i + 1);
 
-            // TODO: should report source position (src_pos)
-            // of function if this check fails
-            if (numTmps != 0)
+            if (nextOp == "add_i32" && val == Value::ONE)
             {
-                throw RunError(
-                    "there must be no values left on the temporary stack "
-                    "when returning from a function"
+                i += 1;
+                ctx.pop();
+                ctx.push(TAG_INT32);
+                writeCode(INC_I32);
+                continue;
+            }
+
+            if (nextOp == "sub_i32" && val == Value::ONE)
+            {
+                i += 1;
+                ctx.pop();
+                ctx.push(TAG_INT32);
+                writeCode(DEC_I32);
+                continue;
+            }
+
+            if (val.isString() && nextOp == "get_field")
+            {
+                i += 1;
+                ctx.pop();
+                ctx.push();
+                writeCode(GET_FIELD_IMM);
+                writeCodeRef(version, String(val).intern());
+                writeCode(FieldPIC());
+                continue;
+            }
+
+            // Constant field name, followed by the value to write
+            // and a set_field. The value is pushed without the name
+            // below it, so dup indices shift down by one.
+            if (val.isString() && getOp(instrs, i + 2) == "set_field")
+            {
+                auto valInstr = (Object)instrs.getElem(i + 1);
+                static thread_local ICache idxIC("idx");
+
+                bool simpleVal = (
+                    nextOp == "push" ||
+                    nextOp == "get_local" ||
+                    (nextOp == "dup" && idxIC.getInt32(valInstr) > 0)
                 );
+
+                if (simpleVal)
+                {
+                    if (nextOp == "push")
+                    {
+                        static thread_local ICache valIC("val");
+                        writeCode(PUSH);
+                        writeCodeRef(version, valIC.getField(valInstr));
+                    }
+                    else
+                    {
+                        auto idx = (uint16_t)idxIC.getInt32(valInstr);
+                        writeCode((nextOp == "dup")? DUP:GET_LOCAL);
+                        writeCode(uint16_t((nextOp == "dup")? (idx - 1):idx));
+                    }
+
+                    i += 2;
+                    ctx.pop();
+                    writeCode(SET_FIELD_IMM);
+                    writeCodeRef(version, String(val).intern());
+                    writeCode(FieldPIC());
+                    continue;
+                }
             }
 
-            writeCode(RET);
+
+            ctx.push(val.getTag());
+            writeCode(PUSH);
+            writeCodeRef(version, val);
             continue;
         }
 
-        if (op == "throw")
+        if (op == "pop")
+        {
+            ctx.pop();
+            writeCode(POP);
+            continue;
+        }
+
+        if (op == "dup")
+        {
+            static thread_local ICache idxIC("idx");
+            auto idx = (uint16_t)idxIC.getInt32(instr);
+            ctx.push(ctx.getTmp(idx));
+            writeCode(DUP);
+            writeCode(idx);
+            continue;
+        }
+
+        if (op == "swap")
+        {
+            auto tag0 = ctx.pop();
+            auto tag1 = ctx.pop();
+            ctx.push(tag0);
+            ctx.push(tag1);
+            writeCode(SWAP);
+            continue;
+        }
+
+        if (op == "get_local")
+        {
+            static thread_local ICache idxIC("idx");
+            auto idx = (uint16_t)idxIC.getInt32(instr);
+            if (getOp(instrs, i + 1) == "has_tag")
+            {
+                ctx.push(TAG_BOOL);
+                auto nextInstr = (Object) instrs.getElem(i + 1);
+                static thread_local ICache tagIC("tag");
+                auto tagStr = (std::string)tagIC.getStr(nextInstr);
+                auto tag = strToTag(tagStr);
+                i += 1;
+
+                // If the tag of the local is known, push the result
+                auto localTag = ctx.getLocal(idx);
+                if (localTag != TAG_UNKNOWN)
+                {
+                    writeCode(PUSH);
+                    writeCode((localTag == tag)? Value::TRUE:Value::FALSE);
+                    continue;
+                }
+
+                writeCode(LOCAL_HAS_TAG);
+                writeCode(idx);
+                writeCode(tag);
+                continue;
+            }
+
+            ctx.push(ctx.getLocal(idx));
+            writeCode(GET_LOCAL);
+            writeCode(idx);
+            continue;
+        }
+
+        if (op == "set_local")
         {
-            numTmps -= 1;
+            static thread_local ICache idxIC("idx");
+            auto idx = (uint16_t)idxIC.getInt32(instr);
+            ctx.setLocal(idx, ctx.pop());
+            writeCode(SET_LOCAL);
+            writeCode(idx);
+            continue;
+        }
+
+        //
+        // Integer operations
+        //
+
+        if (op == "add_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, ADD_I32, ADD_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            continue;
+        }
+
+        if (op == "sub_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, SUB_I32, SUB_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            continue;
+        }
+
+        if (op == "mul_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, MUL_I32, MUL_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            continue;
+        }
+
+        if (op == "div_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(DIV_I32);
+            continue;
+        }
+
+        if (op == "mod_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(MOD_I32);
+            continue;
+        }
+
+        if (op == "shl_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(SHL_I32);
+            continue;
+        }
+
+        if (op == "shr_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(SHR_I32);
+            continue;
+        }
+
+        if (op == "ushr_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(USHR_I32);
+            continue;
+        }
+
+        if (op == "and_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(AND_I32);
+            continue;
+        }
+
+        if (op == "or_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(OR_I32);
+            continue;
+        }
+
+        if (op == "xor_i32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(XOR_I32);
+            continue;
+        }
+
+        if (op == "not_i32")
+        {
+            ctx.pop();
+            ctx.push(TAG_INT32);
+            writeCode(NOT_I32);
+            continue;
+        }
+
+        if (op == "lt_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, LT_I32, LT_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            continue;
+        }
+
+        if (op == "le_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, LE_I32, LE_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            continue;
+        }
+
+        if (op == "gt_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, GT_I32, GT_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            continue;
+        }
+
+        if (op == "ge_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, GE_I32, GE_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            continue;
+        }
+
+        if (op == "eq_i32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_INT32, EQ_I32, EQ_I32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            continue;
+        }
+
+        //
+        // Floating-point ops
+        //
+
+        if (op == "add_f32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_FLOAT32, ADD_F32, ADD_F32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
+            continue;
+        }
+
+        if (op == "sub_f32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_FLOAT32, SUB_F32, SUB_F32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
+            continue;
+        }
+
+        if (op == "mul_f32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_FLOAT32, MUL_F32, MUL_F32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
+            continue;
+        }
+
+        if (op == "div_f32")
+        {
+            writeCode(checkFreeOp(ctx, TAG_FLOAT32, DIV_F32, DIV_F32_NOCHK));
+            ctx.pop(2);
+            ctx.push(TAG_FLOAT32);
+            continue;
+        }
+
+        if (op == "lt_f32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(LT_F32);
+            continue;
+        }
+
+        if (op == "le_f32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(LE_F32);
+            continue;
+        }
+
+        if (op == "gt_f32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(GT_F32);
+            continue;
+        }
+
+        if (op == "ge_f32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(GE_F32);
+            continue;
+        }
+
+        if (op == "eq_f32")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(EQ_F32);
+            continue;
+        }
+
+        if (op == "sin_f32")
+        {
+            ctx.pop();
+            ctx.push(TAG_FLOAT32);
+            writeCode(SIN_F32);
+            continue;
+        }
+
+        if (op == "cos_f32")
+        {
+            ctx.pop();
+            ctx.push(TAG_FLOAT32);
+            writeCode(COS_F32);
+            continue;
+        }
+
+        if (op == "sqrt_f32")
+        {
+            ctx.pop();
+            ctx.push(TAG_FLOAT32);
+            writeCode(SQRT_F32);
+            continue;
+        }
+
+        //
+        // Conversion ops
+        //
+
+        if (op == "i32_to_f32")
+        {
+            ctx.pop();
+            ctx.push(TAG_FLOAT32);
+            writeCode(I32_TO_F32);
+            continue;
+        }
+
+        if (op == "i32_to_str")
+        {
+            ctx.pop();
+            ctx.push(TAG_STRING);
+            writeCode(I32_TO_STR);
+            continue;
+        }
+
+        if (op == "f32_to_i32")
+        {
+            ctx.pop();
+            ctx.push(TAG_INT32);
+            writeCode(F32_TO_I32);
+            continue;
+        }
+
+        if (op == "f32_to_str")
+        {
+            ctx.pop();
+            ctx.push(TAG_STRING);
+            writeCode(F32_TO_STR);
+            continue;
+        }
+
+        if (op == "str_to_f32")
+        {
+            ctx.pop();
+            ctx.push(TAG_FLOAT32);
+            writeCode(STR_TO_F32);
+            continue;
+        }
+
+        //
+        // Miscellaneous ops
+        //
+
+        if (op == "eq_bool")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(EQ_BOOL);
+            continue;
+        }
+
+        if (op == "has_tag")
+        {
+            static thread_local ICache tagIC("tag");
+            auto tagStr = (std::string)tagIC.getStr(instr);
+            auto tag = strToTag(tagStr);
+
+            // If the tag of the value is known, replace it by the result
+            auto valTag = ctx.pop();
+            ctx.push(TAG_BOOL);
+            if (valTag != TAG_UNKNOWN)
+            {
+                writeCode(POP);
+                writeCode(PUSH);
+                writeCode((valTag == tag)? Value::TRUE:Value::FALSE);
+                continue;
+            }
+
+            writeCode(HAS_TAG);
+            writeCode(tag);
+            continue;
+        }
+
+        if (op == "get_tag")
+        {
+            ctx.pop();
+            ctx.push(TAG_STRING);
+            writeCode(GET_TAG);
+            continue;
+        }
+
+        //
+        // String operations
+        //
+
+        if (op == "str_len")
+        {
+            ctx.pop();
+            ctx.push(TAG_INT32);
+            writeCode(STR_LEN);
+            continue;
+        }
+
+        if (op == "get_char")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_STRING);
+            writeCode(GET_CHAR);
+            continue;
+        }
+
+        if (op == "get_char_code")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_INT32);
+            writeCode(GET_CHAR_CODE);
+            continue;
+        }
+
+        if (op == "char_to_str")
+        {
+            ctx.pop();
+            ctx.push(TAG_STRING);
+            writeCode(CHAR_TO_STR);
+            continue;
+        }
+
+        if (op == "str_cat")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_STRING);
+            writeCode(STR_CAT);
+            continue;
+        }
+
+        if (op == "eq_str")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(EQ_STR);
+            continue;
+        }
+
+        //
+        // Object operations
+        //
+
+        if (op == "new_object")
+        {
+            ctx.pop();
+            ctx.push(TAG_OBJECT);
+            writeCode(NEW_OBJECT);
+            continue;
+        }
+
+        if (op == "has_field")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(HAS_FIELD);
+            writeCode(FieldPIC());
+            continue;
+        }
+
+        if (op == "set_field")
+        {
+            ctx.pop(3);
+            writeCode(SET_FIELD);
+            writeCode(FieldPIC());
+            continue;
+        }
+
+        if (op == "get_field")
+        {
+            ctx.pop(2);
+            ctx.push();
+
+            writeCode(GET_FIELD);
+
+            // Cached object shapes and slot indices
+            writeCode(FieldPIC());
+
+            continue;
+        }
+
+        if (op == "get_field_list")
+        {
+            ctx.pop();
+            ctx.push(TAG_ARRAY);
+
+            writeCode(GET_FIELD_LIST);
+            continue;
+        }
+
+        if (op == "eq_obj")
+        {
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeCode(EQ_OBJ);
+            continue;
+        }
+
+        //
+        // Array operations
+        //
+
+        if (op == "new_array")
+        {
+            ctx.pop();
+            ctx.push(TAG_ARRAY);
+            writeCode(NEW_ARRAY);
+            continue;
+        }
+
+        if (op == "array_len")
+        {
+            ctx.pop();
+            ctx.push(TAG_INT32);
+            writeCode(ARRAY_LEN);
+            continue;
+        }
+
+        if (op == "array_push")
+        {
+            ctx.pop(2);
+            writeCode(ARRAY_PUSH);
+            continue;
+        }
+
+        if (op == "set_elem")
+        {
+            ctx.pop(3);
+            writeCode(SET_ELEM);
+            continue;
+        }
+
+        if (op == "get_elem")
+        {
+            ctx.pop(2);
+            ctx.push();
+            writeCode(GET_ELEM);
+            continue;
+        }
+
+        //
+        // Branch instructions
+        //
+
+        if (op == "jump")
+        {
+            static thread_local ICache toIC("to");
+            auto dstBB = toIC.getObj(instr);
+            auto dstVer = getBlockVersion(version->fun, dstBB, ctx);
+
+            writeCode(JUMP_STUB);
+            writeCode(dstVer);
+            continue;
+        }
+
+        if (op == "if_true")
+        {
+            ctx.pop();
+
+            writeCode(IF_TRUE);
+            writeBranchTargets(version, instr, ctx, ctx);
+
+            continue;
+        }
+
+        if (op == "call")
+        {
+            static thread_local ICache numArgsCache("num_args");
+            auto numArgs = (int16_t)numArgsCache.getInt32(instr);
+
+            genCall(
+                version,
+                instr,
+                numArgs,
+                ctx
+            );
+
+            continue;
+        }
+
+        if (op == "ret")
+        {
+            ctx.pop();
+
+            // TODO: should report source position (src_pos)
+            // of function if this check fails
+            if (ctx.numTmps() != 0)
+            {
+                throw RunError(
+                    "there must be no values left on the temporary stack "
+                    "when returning from a function"
+                );
+            }
+
+            writeCode(RET);
+            continue;
+        }
+
+        if (op == "throw")
+        {
+            ctx.pop();
+            writeCode(THROW);
+            continue;
+        }
+
+        if (op == "import")
+        {
+            // Push the import function on the stack
+            ctx.push(TAG_HOSTFN);
+            writeCode(PUSH);
+            writeCode(Value((refptr)&importFn, TAG_HOSTFN));
+
+            // Call the import function
+            genCall(
+                version,
+                instr,
+                1,
+                ctx
+            );
+
+            continue;
+        }
+
+        if (op == "abort")
+        {
+            ctx.pop();
+            writeCode(ABORT);
+            continue;
+        }
+
+        throw RunError("unhandled opcode in basic block \"" + op + "\"");
+    }
+
+    // Mark the block end
+    version->endPtr = codeHeapAlloc;
+    addCodeRange(rangeStart, version->endPtr, version);
+
+    //std::cout << "done compiling version" << std::endl;
+    //std::cout << codeHeapSize() << std::endl;
+}
+
+/// Get the source position for a given instruction, if available
+Value getSrcPos(uint8_t* instrPtr)
+{
+    auto version = findVersion(instrPtr);
+    if (!version)
+    {
+        std::cout << "no instr to block mapping" << std::endl;
+        return Value::UNDEF;
+    }
+
+    auto block = version->block;
+
+    static thread_local ICache instrsIC("instrs");
+    Array instrs = instrsIC.getArr(block);
+    assert (instrs.length() > 0);
+
+    // Traverse the instructions in reverse
+    for (int i = (int)instrs.length() - 1; i >= 0; --i)
+    {
+        auto instrVal = instrs.getElem(i);
+        assert (instrVal.isObject());
+        auto instr = Object(instrVal);
+
+        if (instr.hasField("src_pos"))
+            return instr.getField("src_pos");
+    }
+
+    return Value::UNDEF;
+}
+
+/// Implementation of the throw instruction
+void throwExc(
+    uint8_t* throwInstr,
+    Value excVal
+)
+{
+    // Get the current function
+    auto throwVer = findVersion(throwInstr);
+    assert (throwVer);
+    auto curFun = throwVer->fun;
+
+    // Until we are done unwinding the stack
+    for (;;)
+    {
+        //std::cout << "Unwinding frame" << std::endl;
+
+        // Get the number of locals in the function
+        static thread_local ICache numLocalsIC("num_locals");
+        auto numLocals = numLocalsIC.getInt32(curFun);
+
+        //std::cout << "numLocals=" << numLocals << std::endl;
+
+        // Get the saved stack ptr, frame ptr and return address
+        auto prevStackPtr = framePtr[-(numLocals + 0)];
+        auto prevFramePtr = framePtr[-(numLocals + 1)];
+        auto retAddr      = framePtr[-(numLocals + 2)];
+
+        assert (retAddr.getTag() == TAG_RAWPTR);
+        auto retVer = (BlockVersion*)retAddr.getWord().ptr;
+
+        // If we are at the top level
+        if (retVer == nullptr)
+        {
+            //std::cout << "Uncaught exception" << std::endl;
+
+            std::string errMsg;
+
+            if (excVal.isObject())
+            {
+                auto excObj = Object(excVal);
+
+                if (excObj.hasField("src_pos"))
+                {
+                    auto srcPosVal = excObj.getField("src_pos");
+                    errMsg += posToString(srcPosVal) + " - ";
+                }
+
+                if (excObj.hasField("msg"))
+                {
+                    auto errMsgVal = excObj.getField("msg");
+                    errMsg += errMsgVal.toString();
+                }
+                else
+                {
+                    errMsg += "uncaught user exception object";
+                }
+            }
+            else
+            {
+                errMsg = excVal.toString();
+            }
+
+            throw RunError(errMsg);
+        }
+
+        // Find the info associated with the return address
+        assert (retVer->retEntry);
+        auto& retEntry = *retVer->retEntry;
+
+        // Get the function associated with the return address
+        curFun = retEntry.retVer->fun;
+
+        // Update the stack and frame pointer
+        stackPtr = (Value*)prevStackPtr.getWord().ptr;
+        framePtr = (Value*)prevFramePtr.getWord().ptr;
+
+        // If there is an exception handler
+        if (retEntry.excVer)
+        {
+            //std::cout << "Found exception handler" << std::endl;
+            //std::cout << "numTmps=" << retEntry.numTmps << std::endl;
+            //std::cout << "frameSize()=" << frameSize() << std::endl;
+
+            // Clear the temporary stack
+            stackPtr += retEntry.numTmps;
+
+            // Push the exception value on the stack
+            pushVal(excVal);
+
+            // Compile exception handler if needed
+            if (!retEntry.excVer->startPtr)
+                compile(retEntry.excVer);
+
+            instrPtr = retEntry.excVer->startPtr;
+
+            // Done unwinding the stack
+            break;
+        }
+    }
+}
+
+#ifdef ZETA_JIT
+
+/*
+Native code generation. Block versions entered often enough are
+translated from their interpreter code into x86-64 machine code.
+Native code keeps all values in the interpreter stack and frame
+layout, and leaves the stack pointer in RBX and the frame pointer in
+R12 while it runs. A group of versions which branch to each other is
+compiled together into a region, so that loops and calls between
+them stay in native code. Instructions which can't be translated, or
+whose operands don't have the expected tags, exit back into the
+interpreter at the corresponding interpreter instruction. Native
+code never allocates, so it contains no GC safepoints.
+
+The native code heap is split into chunks. The code of a version is
+contiguous within a chunk, and the chunks left without the code of
+live versions after a collection get reused. Native code only
+branches to versions of other functions at call sites, which compare
+the callee against a constant. Those constants are cleared when the
+callee gets collected, so the call sites then exit to the interpreter.
+*/
+
+/// Number of entries into a block version before it gets compiled
+const uint32_t JIT_THRESHOLD = 500;
+
+/// Maximum number of block versions compiled together in a region
+const size_t JIT_MAX_REGION = 32;
+
+/// Size of the executable memory for native code
+const size_t JIT_HEAP_SIZE = 32 << 20;
+
+/// Size of the chunks of the native code heap
+const size_t JIT_CHUNK_SIZE = 1 << 20;
+
+/// Space kept in the native code heap to terminate a region
+const size_t JIT_RESERVE = 4096;
+
+/// Space needed in the current chunk to start compiling a version
+const size_t JIT_VERSION_SPACE = 16 << 10;
+
+/// Registers holding the interpreter state in native code
+const X86Reg REG_SP = RBX;
+const X86Reg REG_FP = R12;
+
+/// Size of a value in the stack, and offset of its tag
+const int32_t VAL_SIZE = 16;
+const int32_t VAL_TAG = 8;
+
+/// Assembler for the native code heap
+thread_local X86Asm jitAsm;
+
+/// Flag to disable native code generation in all isolates
+bool jitAllowed = true;
+
+/// Flag to enable or disable native code generation
+thread_local bool jitEnabled = true;
+
+/// Native code entry stub, called with the code address to run.
+/// Returns the interpreter address to continue execution at.
+thread_local uint8_t* (*jitEnter)(uint8_t*) = nullptr;
+
+/// Native code sequence returning to the interpreter,
+/// with the interpreter address to continue at in RAX
+thread_local uint8_t* jitExitStub = nullptr;
+
+/// Native code sequence linking a branch to a block version
+thread_local uint8_t* jitLinkStub = nullptr;
+
+/// Interpreter address to continue at when a link exits native code
+thread_local uint8_t* jitExitAddr = nullptr;
+
+/// Offset of the native code pointer in block version objects
+thread_local int32_t jitNativeCodeOfs = 0;
+
+/// Map of opcode handler slots to opcodes
+thread_local std::unordered_map<OpcodeSlot, Opcode> jitOpcodes;
+
+/// Chunk of the native code heap
+struct JitChunk
+{
+    /// Number of live block versions with code in this chunk,
+    /// only computed while discarding code
+    size_t numUsers = 0;
+
+    bool isFree = true;
+};
+
+/// Chunks of the native code heap, in address order
+thread_local std::vector<JitChunk> jitChunks;
+
+/// Indices of the free chunks
+thread_local std::vector<size_t> jitFreeChunks;
+
+/// Index of the chunk being written to
+thread_local size_t jitCurChunk = 0;
+
+/// Number of block versions left to the interpreter
+/// because the native code heap was full
+thread_local size_t jitNumSkipped = 0;
+
+/// Set of block versions being compiled into a region
+struct JitRegion
+{
+    /// Versions queued for compilation, in order
+    std::vector<BlockVersion*> versions;
+
+    /// Branches to queued versions waiting for their code address
+    std::unordered_map<BlockVersion*, std::vector<uint8_t*>> fixups;
+};
+
+/// Out-of-line native code of a block version, emitted after it
+struct JitTail
+{
+    /// Branches exiting to an interpreter instruction
+    std::vector<std::pair<uint8_t*, uint8_t*>> exits;
+
+    /// Branches linked lazily to block versions
+    std::vector<std::pair<uint8_t*, BlockVersion*>> links;
+
+    size_t size() const
+    {
+        return 16 * exits.size() + 48 * links.size();
+    }
+};
+
+uint8_t* jitLink(BlockVersion* ver, uint8_t* site, BlockVersion* owner);
+void jitCompile(BlockVersion* root);
+
+/// Emit a jump to an interpreter address, leaving native code
+void jitExitTo(uint8_t* instrAddr)
+{
+    jitAsm.mov(RAX, (uint64_t)instrAddr);
+    jitAsm.jmp(jitExitStub);
+}
+
+/// Initialize native code generation, disables it if unavailable
+void initJit()
+{
+    // Native code relies on the layout of values
+    Value testVal(Word(int64_t(-2)), TAG_ARRAY);
+    auto valBytes = (uint8_t*)&testVal;
+    bool layoutOk = (
+        sizeof(Value) == VAL_SIZE &&
+        *(int64_t*)valBytes == -2 &&
+        valBytes[VAL_TAG] == TAG_ARRAY
+    );
+
+    if (!jitAllowed || !layoutOk || !jitAsm.init(JIT_HEAP_SIZE))
+    {
+        jitEnabled = false;
+        return;
+    }
+
+    // The stubs go in the first chunk, which is never freed
+    jitChunks.resize(JIT_HEAP_SIZE / JIT_CHUNK_SIZE);
+    for (size_t i = jitChunks.size() - 1; i > 0; --i)
+        jitFreeChunks.push_back(i);
+    jitChunks[0].isFree = false;
+    jitCurChunk = 0;
+    jitAsm.setWindow(jitAsm.base(), jitAsm.base() + JIT_CHUNK_SIZE);
+
+    auto& a = jitAsm;
+
+    // Entry stub, saves the callee-saved registers we use, and
+    // loads the interpreter state. Three pushes keep the machine
+    // stack aligned for calls to helper functions.
+    jitEnter = (uint8_t* (*)(uint8_t*))a.pos();
+    a.push(RBX);
+    a.push(R12);
+    a.push(R13);
+    a.mov(RAX, (uint64_t)&stackPtr);
+    a.load64(REG_SP, RAX, 0);
+    a.mov(RAX, (uint64_t)&framePtr);
+    a.load64(REG_FP, RAX, 0);
+    a.jmp(RDI);
+
+    // Exit stub, stores the interpreter state back
+    jitExitStub = a.pos();
+    a.mov(RCX, (uint64_t)&stackPtr);
+    a.store64(RCX, 0, REG_SP);
+    a.mov(RCX, (uint64_t)&framePtr);
+    a.store64(RCX, 0, REG_FP);
+    a.pop(R13);
+    a.pop(R12);
+    a.pop(RBX);
+    a.ret();
+
+    // Link stub, continues in native code if the helper
+    // returns an address, or exits to the interpreter.
+    // The version to link to is in RDI, the branch to patch
+    // in RSI and the version the branch is in in RDX.
+    jitLinkStub = a.pos();
+    a.mov(RAX, (uint64_t)&jitLink);
+    a.call(RAX);
+    a.test64(RAX, RAX);
+    auto exitSite = a.jcc(CC_E);
+    a.jmp(RAX);
+    X86Asm::patchRel32(exitSite, a.pos());
+    a.mov(RAX, (uint64_t)&jitExitAddr);
+    a.load64(RAX, RAX, 0);
+    a.jmp(jitExitStub);
+
+    // Map opcode slots back to opcodes. Should two handlers share
+    // an address, the opcode can't be identified and is left out.
+    std::unordered_map<OpcodeSlot, size_t> slotCount;
+    for (size_t op = 0; op <= ABORT; ++op)
+        slotCount[encodeOp(Opcode(op))]++;
+    for (size_t op = 0; op <= ABORT; ++op)
+        if (slotCount[encodeOp(Opcode(op))] == 1)
+            jitOpcodes[encodeOp(Opcode(op))] = Opcode(op);
+
+    alignas(BlockVersion) uint8_t dummyBytes[sizeof(BlockVersion)];
+    auto dummy = (BlockVersion*)dummyBytes;
+    jitNativeCodeOfs = int32_t(
+        (uint8_t*)&dummy->nativeCode - dummyBytes
+    );
+}
+
+/// Get the chunk of the native code heap containing an address
+size_t jitChunkIdx(uint8_t* addr)
+{
+    assert (addr >= jitAsm.base() && addr < jitAsm.base() + jitAsm.size());
+    return (addr - jitAsm.base()) / JIT_CHUNK_SIZE;
+}
+
+/**
+Make sure that a number of bytes can be written contiguously into the
+native code heap, moving to a free chunk if needed. Returns false if
+the native code heap is full.
+*/
+bool jitReserve(size_t numBytes)
+{
+    assert (numBytes <= JIT_CHUNK_SIZE);
+
+    if (jitAsm.hasSpace(numBytes))
+        return true;
+
+    if (jitFreeChunks.empty())
+    {
+        jitNumSkipped++;
+        return false;
+    }
+
+    jitCurChunk = jitFreeChunks.back();
+    jitFreeChunks.pop_back();
+    jitChunks[jitCurChunk].isFree = false;
+
+    auto start = jitAsm.base() + jitCurChunk * JIT_CHUNK_SIZE;
+    jitAsm.setWindow(start, start + JIT_CHUNK_SIZE);
+    return true;
+}
+
+/// Make the native call sites of a live version stop calling
+/// functions about to be collected
+void jitUnlinkCallees(BlockVersion* version)
+{
+    auto& callees = version->nativeCallees;
+
+    for (auto itr = callees.begin(); itr != callees.end();)
+    {
+        if (gcMarked(itr->first))
+        {
+            ++itr;
+            continue;
+        }
+
+        // No object ever has a null address, so the callee
+        // check fails and the call exits to the interpreter
+        uint64_t nullFn = 0;
+        memcpy(itr->second, &nullFn, sizeof(nullFn));
+        itr = callees.erase(itr);
+    }
+}
+
+/// Free the chunks of the native code heap which no longer
+/// contain the code of live block versions
+void jitSweepChunks()
+{
+    if (!jitAsm.isInit())
+        return;
+
+    for (auto& chunk : jitChunks)
+        chunk.numUsers = 0;
+
+    for (auto& info : blockInfos)
+    {
+        for (auto version : info.versions)
+        {
+            if (!version->nativeCode)
+                continue;
+
+            jitChunks[jitChunkIdx(version->nativeCode)].numUsers++;
+            jitChunks[jitChunkIdx(version->nativeEnd - 1)].numUsers++;
+            for (auto exit : version->nativeExits)
+                jitChunks[jitChunkIdx(exit)].numUsers++;
+        }
+    }
+
+    // The first chunk holds the stubs, and the
+    // current one is still being written to
+    for (size_t i = 1; i < jitChunks.size(); ++i)
+    {
+        auto& chunk = jitChunks[i];
+        if (chunk.isFree || chunk.numUsers > 0 || i == jitCurChunk)
+            continue;
+
+        auto start = jitAsm.base() + i * JIT_CHUNK_SIZE;
+        jitAsm.discard(start, start + JIT_CHUNK_SIZE);
+        chunk.isFree = true;
+        jitFreeChunks.push_back(i);
+    }
+}
+
+/// Read an operand from interpreter code
+template <typename T> T jitRead(uint8_t*& ip)
+{
+    T val = *(T*)ip;
+    ip += sizeof(T);
+    return val;
+}
+
+/// Decode the opcode at a given interpreter address, returns
+/// ABORT for opcodes which native code doesn't implement
+Opcode jitDecode(uint8_t* ip)
+{
+    auto itr = jitOpcodes.find(*(OpcodeSlot*)ip);
+    if (itr == jitOpcodes.end())
+        return ABORT;
+
+    switch (itr->second)
+    {
+        case GET_LOCAL: case SET_LOCAL:
+        case PUSH: case POP: case DUP: case SWAP:
+        case ADD_I32: case SUB_I32: case MUL_I32:
+        case AND_I32: case OR_I32: case XOR_I32: case NOT_I32:
+        case SHL_I32: case SHR_I32: case USHR_I32:
+        case LT_I32: case LE_I32: case GT_I32: case GE_I32: case EQ_I32:
+        case ADD_I32_NOCHK: case SUB_I32_NOCHK: case MUL_I32_NOCHK:
+        case LT_I32_NOCHK: case LE_I32_NOCHK: case GT_I32_NOCHK:
+        case GE_I32_NOCHK: case EQ_I32_NOCHK:
+        case INC_I32: case DEC_I32:
+        case EQ_BOOL: case HAS_TAG: case LOCAL_HAS_TAG:
+        case GET_LOCAL_ADD_IMM: case ADD_LOCAL_IMM:
+        case IF_LOCAL_HAS_TAG: case IF_CMP_LOCAL_IMM: case IF_CMP_IMM:
+        case JUMP: case JUMP_STUB: case IF_TRUE:
+        case CALL: case RET:
+        return itr->second;
+
+        default:
+        return ABORT;
+    }
+}
+
+/// Get the condition code matching an int32 comparison opcode
+X86Cond jitCmpCond(uint16_t op)
+{
+    auto cmpOp = checkedOp(Opcode(op));
+
+    switch (cmpOp)
+    {
+        case LT_I32: return CC_L;
+        case LE_I32: return CC_LE;
+        case GT_I32: return CC_G;
+        case GE_I32: return CC_GE;
+        default:
+        assert (cmpOp == EQ_I32);
+        return CC_E;
+    }
+}
+
+/// Test if a block version can be compiled to native code
+bool jitCanCompile(BlockVersion* ver)
+{
+    return ver->startPtr && jitDecode(ver->startPtr) != ABORT;
+}
+
+/// Get the block version a branch operand refers to
+BlockVersion* jitBranchVersion(uint8_t* dstAddr)
+{
+    if (isVersionRef(dstAddr))
+        return refVersion(dstAddr);
+
+    auto itr = versionStarts.find(dstAddr);
+    return (itr != versionStarts.end())? itr->second:nullptr;
+}
+
+/// Queue a version for compilation in the current region, if possible
+bool jitQueue(JitRegion& region, BlockVersion* ver)
+{
+    if (ver->nativeCode || region.fixups.count(ver))
+        return true;
+
+    if (region.versions.size() >= JIT_MAX_REGION || !jitCanCompile(ver))
+        return false;
+
+    region.versions.push_back(ver);
+    region.fixups[ver];
+    return true;
+}
+
+/// Emit a jmp, or a jcc given a condition, to a block version
+void jitBranch(
+    JitRegion& region,
+    JitTail& tail,
+    BlockVersion* ver,
+    bool isCond = false,
+    X86Cond cond = CC_E
+)
+{
+    auto& a = jitAsm;
+    uint8_t* target = ver->nativeCode;
+    auto site = isCond? a.jcc(cond, target):a.jmp(target);
+
+    if (target)
+        return;
+
+    if (jitQueue(region, ver))
+        region.fixups[ver].push_back(site);
+    else
+        tail.links.push_back({ site, ver });
+}
+
+/// Emit a branch to the target of an interpreter branch operand
+void jitBranch(
+    JitRegion& region,
+    JitTail& tail,
+    uint8_t* dstAddr,
+    bool isCond = false,
+    X86Cond cond = CC_E
+)
+{
+    auto ver = jitBranchVersion(dstAddr);
+
+    if (ver)
+    {
+        jitBranch(region, tail, ver, isCond, cond);
+        return;
+    }
+
+    auto site = isCond? jitAsm.jcc(cond):jitAsm.jmp();
+    tail.exits.push_back({ site, dstAddr });
+}
+
+/// Emit a guard exiting to an instruction if a value doesn't have a tag
+void jitGuardTag(
+    JitTail& tail,
+    X86Reg base,
+    int32_t disp,
+    Tag tag,
+    uint8_t* instrAddr
+)
+{
+    jitAsm.cmp8(base, disp + VAL_TAG, tag);
+    auto site = jitAsm.jcc(CC_NE);
+    tail.exits.push_back({ site, instrAddr });
+}
+
+/// Emit a guard exiting to an instruction on a given condition
+void jitGuard(JitTail& tail, X86Cond cond, uint8_t* instrAddr)
+{
+    auto site = jitAsm.jcc(cond);
+    tail.exits.push_back({ site, instrAddr });
+}
+
+/// Copy a value from a memory location to another
+void jitCopyVal(X86Reg dst, int32_t dstDisp, X86Reg src, int32_t srcDisp)
+{
+    jitAsm.load64(RAX, src, srcDisp);
+    jitAsm.load64(RCX, src, srcDisp + VAL_TAG);
+    jitAsm.store64(dst, dstDisp, RAX);
+    jitAsm.store64(dst, dstDisp + VAL_TAG, RCX);
+}
+
+/// Push the value held in RAX with a given tag
+void jitPushRax(Tag tag)
+{
+    jitAsm.alu64(ALU_SUB, REG_SP, VAL_SIZE);
+    jitAsm.store64(REG_SP, 0, RAX);
+    jitAsm.store64(REG_SP, VAL_TAG, int32_t(tag));
+}
+
+/// Offset of a local variable relative to the frame pointer
+int32_t jitLocal(uint16_t idx)
+{
+    return -VAL_SIZE * int32_t(idx);
+}
+
+/**
+Compile one block version of a region, translating its interpreter
+instructions until the end of the block, or until an instruction
+native code doesn't implement.
+*/
+void jitVersion(JitRegion& region, BlockVersion* ver)
+{
+    auto& a = jitAsm;
+    JitTail tail;
+
+    ver->nativeCode = a.pos();
+
+    auto ip = ver->startPtr;
+
+    for (;;)
+    {
+        auto instrAddr = ip;
+
+        // The interpreter may have compiled the next block
+        // over the jump at the end of this one
+        if (instrAddr != ver->startPtr)
+        {
+            auto itr = versionStarts.find(instrAddr);
+            if (itr != versionStarts.end())
+            {
+                jitBranch(region, tail, itr->second);
+                break;
+            }
+        }
+
+        auto op = jitDecode(ip);
+
+        // Make sure the instruction and its out-of-line code fit
+        size_t maxSize = 256 + tail.size() + JIT_RESERVE;
+        if (op == CALL)
+        {
+            auto& callInfo = *(CallInfo*)(ip + sizeof(OpcodeSlot));
+            maxSize += 32 * callInfo.numLocals;
+        }
+
+        if (op == ABORT || ip == ver->endPtr || !a.hasSpace(maxSize))
+        {
+            jitExitTo(instrAddr);
+            break;
+        }
+
+        ip += sizeof(OpcodeSlot);
+
+        // Set when the instruction ends the translation
+        bool isBranch = false;
+
+        switch (op)
+        {
+            case GET_LOCAL:
+            {
+                auto idx = jitRead<uint16_t>(ip);
+                a.alu64(ALU_SUB, REG_SP, VAL_SIZE);
+                jitCopyVal(REG_SP, 0, REG_FP, jitLocal(idx));
+            }
+            break;
+
+            case SET_LOCAL:
+            {
+                auto idx = jitRead<uint16_t>(ip);
+                jitCopyVal(REG_FP, jitLocal(idx), REG_SP, 0);
+                a.alu64(ALU_ADD, REG_SP, VAL_SIZE);
+            }
+            break;
+
+            case PUSH:
+            {
+                auto val = jitRead<Value>(ip);
+                a.mov(RAX, (uint64_t)val.getWord().int64);
+                jitPushRax(val.getTag());
+            }
+            break;
+
+            case POP:
+            a.alu64(ALU_ADD, REG_SP, VAL_SIZE);
+            break;
+
+            case DUP:
+            {
+                auto idx = jitRead<uint16_t>(ip);
+                a.alu64(ALU_SUB, REG_SP, VAL_SIZE);
+                jitCopyVal(REG_SP, 0, REG_SP, VAL_SIZE * (int32_t(idx) + 1));
+            }
+            break;
+
+            case SWAP:
+            a.load64(RAX, REG_SP, 0);
+            a.load64(RCX, REG_SP, VAL_TAG);
+            a.load64(RDX, REG_SP, VAL_SIZE);
+            a.load64(RSI, REG_SP, VAL_SIZE + VAL_TAG);
+            a.store64(REG_SP, 0, RDX);
+            a.store64(REG_SP, VAL_TAG, RSI);
+            a.store64(REG_SP, VAL_SIZE, RAX);
+            a.store64(REG_SP, VAL_SIZE + VAL_TAG, RCX);
+            break;
+
+            case ADD_I32:
+            case SUB_I32:
+            case MUL_I32:
+            case AND_I32:
+            case OR_I32:
+            case XOR_I32:
+            case SHL_I32:
+            case SHR_I32:
+            case USHR_I32:
+            case ADD_I32_NOCHK:
+            case SUB_I32_NOCHK:
+            case MUL_I32_NOCHK:
+            {
+                // The operand tags of the variants are known
+                if (checkedOp(op) == op)
+                {
+                    jitGuardTag(tail, REG_SP, 0, TAG_INT32, instrAddr);
+                    jitGuardTag(tail, REG_SP, VAL_SIZE, TAG_INT32, instrAddr);
+                }
+
+                a.load32(RAX, REG_SP, VAL_SIZE);
+
+                switch (checkedOp(op))
+                {
+                    case ADD_I32: a.alu32(ALU_ADD, RAX, REG_SP, 0); break;
+                    case SUB_I32: a.alu32(ALU_SUB, RAX, REG_SP, 0); break;
+                    case AND_I32: a.alu32(ALU_AND, RAX, REG_SP, 0); break;
+                    case OR_I32: a.alu32(ALU_OR, RAX, REG_SP, 0); break;
+                    case XOR_I32: a.alu32(ALU_XOR, RAX, REG_SP, 0); break;
+                    case MUL_I32: a.imul32(RAX, REG_SP, 0); break;
+
+                    default:
+                    a.load32(RCX, REG_SP, 0);
+                    a.shift32(
+                        (op == SHL_I32)? SHIFT_SHL:
+                        (op == SHR_I32)? SHIFT_SAR:SHIFT_SHR,
+                        RAX
+                    );
+                }
+
+                a.movsxd(RAX, RAX);
+                a.alu64(ALU_ADD, REG_SP, VAL_SIZE);
+                a.store64(REG_SP, 0, RAX);
+            }
+            break;
+
+            case NOT_I32:
+            case INC_I32:
+            case DEC_I32:
+            {
+                jitGuardTag(tail, REG_SP, 0, TAG_INT32, instrAddr);
+                a.load32(RAX, REG_SP, 0);
+                if (op == NOT_I32)
+                    a.not32(RAX);
+                else
+                    a.alu32(ALU_ADD, RAX, (op == INC_I32)? 1:-1);
+                a.movsxd(RAX, RAX);
+                a.store64(REG_SP, 0, RAX);
+            }
+            break;
+
+            case LT_I32:
+            case LE_I32:
+            case GT_I32:
+            case GE_I32:
+            case EQ_I32:
+            case LT_I32_NOCHK:
+            case LE_I32_NOCHK:
+            case GT_I32_NOCHK:
+            case GE_I32_NOCHK:
+            case EQ_I32_NOCHK:
+            {
+                if (checkedOp(op) == op)
+                {
+                    jitGuardTag(tail, REG_SP, 0, TAG_INT32, instrAddr);
+                    jitGuardTag(tail, REG_SP, VAL_SIZE, TAG_INT32, instrAddr);
+                }
+
+                a.load32(RAX, REG_SP, VAL_SIZE);
+                a.alu32(ALU_CMP, RAX, REG_SP, 0);
+                a.setcc(jitCmpCond(op), RAX);
+                a.alu64(ALU_ADD, REG_SP, VAL_SIZE);
+                a.store64(REG_SP, 0, RAX);
+                a.store64(REG_SP, VAL_TAG, int32_t(TAG_BOOL));
+            }
+            break;
+
+            case EQ_BOOL:
+            {
+                jitGuardTag(tail, REG_SP, 0, TAG_BOOL, instrAddr);
+                jitGuardTag(tail, REG_SP, VAL_SIZE, TAG_BOOL, instrAddr);
+                a.load64(RAX, REG_SP, VAL_SIZE);
+                a.load64(RCX, REG_SP, 0);
+                a.alu64(ALU_CMP, RAX, RCX);
+                a.setcc(CC_E, RAX);
+                a.alu64(ALU_ADD, REG_SP, VAL_SIZE);
+                a.store64(REG_SP, 0, RAX);
+            }
+            break;
+
+            case HAS_TAG:
+            {
+                auto tag = jitRead<Tag>(ip);
+                a.cmp8(REG_SP, VAL_TAG, tag);
+                a.setcc(CC_E, RAX);
+                a.store64(REG_SP, 0, RAX);
+                a.store64(REG_SP, VAL_TAG, int32_t(TAG_BOOL));
+            }
+            break;
+
+            case LOCAL_HAS_TAG:
+            {
+                auto idx = jitRead<uint16_t>(ip);
+                auto tag = jitRead<Tag>(ip);
+                a.cmp8(REG_FP, jitLocal(idx) + VAL_TAG, tag);
+                a.setcc(CC_E, RAX);
+                jitPushRax(TAG_BOOL);
+            }
+            break;
+
+            case GET_LOCAL_ADD_IMM:
+            case ADD_LOCAL_IMM:
+            {
+                auto idx = jitRead<uint16_t>(ip);
+                auto imm = jitRead<int32_t>(ip);
+                jitGuardTag(tail, REG_FP, jitLocal(idx), TAG_INT32, instrAddr);
+                a.load32(RAX, REG_FP, jitLocal(idx));
+                a.alu32(ALU_ADD, RAX, imm);
+                a.movsxd(RAX, RAX);
+                if (op == ADD_LOCAL_IMM)
+                    a.store64(REG_FP, jitLocal(idx), RAX);
+                else
+                    jitPushRax(TAG_INT32);
+            }
+            break;
+
+            case IF_LOCAL_HAS_TAG:
+            {
+                auto idx = jitRead<uint16_t>(ip);
+                auto tag = jitRead<Tag>(ip);
+                auto thenAddr = jitRead<uint8_t*>(ip);
+                auto elseAddr = jitRead<uint8_t*>(ip);
+                a.cmp8(REG_FP, jitLocal(idx) + VAL_TAG, tag);
+                jitBranch(region, tail, thenAddr, true, CC_E);
+                jitBranch(region, tail, elseAddr);
+                isBranch = true;
+            }
+            break;
+
+            case IF_CMP_LOCAL_IMM:
+            {
+                auto cmpOp = jitRead<uint16_t>(ip);
+                auto idx = jitRead<uint16_t>(ip);
+                auto imm = jitRead<int32_t>(ip);
+                auto thenAddr = jitRead<uint8_t*>(ip);
+                auto elseAddr = jitRead<uint8_t*>(ip);
+                jitGuardTag(tail, REG_FP, jitLocal(idx), TAG_INT32, instrAddr);
+                a.cmp32(REG_FP, jitLocal(idx), imm);
+                jitBranch(region, tail, thenAddr, true, jitCmpCond(cmpOp));
+                jitBranch(region, tail, elseAddr);
+                isBranch = true;
+            }
+            break;
+
+            case IF_CMP_IMM:
+            {
+                auto cmpOp = jitRead<uint16_t>(ip);
+                auto imm = jitRead<int32_t>(ip);
+                auto thenAddr = jitRead<uint8_t*>(ip);
+                auto elseAddr = jitRead<uint8_t*>(ip);
+                jitGuardTag(tail, REG_SP, 0, TAG_INT32, instrAddr);
+                a.load32(RAX, REG_SP, 0);
+                a.alu64(ALU_ADD, REG_SP, VAL_SIZE);
+                a.alu32(ALU_CMP, RAX, imm);
+                jitBranch(region, tail, thenAddr, true, jitCmpCond(cmpOp));
+                jitBranch(region, tail, elseAddr);
+                isBranch = true;
+            }
+            break;
+
+            case JUMP:
+            {
+                auto dstAddr = jitRead<uint8_t*>(ip);
+
+                // Jumps to code which isn't the start of a version link
+                // the code heap chunks the version is split across
+                if (!jitBranchVersion(dstAddr))
+                {
+                    ip = dstAddr;
+                    continue;
+                }
+
+                jitBranch(region, tail, dstAddr);
+                isBranch = true;
+            }
+            break;
+
+            case JUMP_STUB:
+            {
+                auto dstVer = jitRead<BlockVersion*>(ip);
+                jitBranch(region, tail, dstVer);
+                isBranch = true;
+            }
+            break;
+
+            case IF_TRUE:
+            {
+                auto thenAddr = jitRead<uint8_t*>(ip);
+                auto elseAddr = jitRead<uint8_t*>(ip);
+                a.load64(RAX, REG_SP, 0);
+                a.loadU8(RCX, REG_SP, VAL_TAG);
+                a.alu64(ALU_ADD, REG_SP, VAL_SIZE);
+                a.alu32(ALU_CMP, RCX, TAG_BOOL);
+                jitBranch(region, tail, elseAddr, true, CC_NE);
+                a.alu64(ALU_CMP, RAX, int32_t(Value::TRUE.getWord().int64));
+                jitBranch(region, tail, thenAddr, true, CC_E);
+                jitBranch(region, tail, elseAddr);
+                isBranch = true;
+            }
+            break;
+
+            // Calls to the function cached by the call site are
+            // performed in native code, others exit to the interpreter
+            case CALL:
+            {
+                auto& callInfo = *(CallInfo*)ip;
+                auto entryVer = callInfo.entryVer;
 
-            // Store a mapping of this instruction to the block version
-            // Needed to retrieve the identity of the current function
-            instrMap[codeHeapAlloc] = version;
+                if (!callInfo.lastFn || !entryVer || !entryVer->startPtr)
+                {
+                    jitExitTo(instrAddr);
+                    isBranch = true;
+                    break;
+                }
 
-            writeCode(THROW);
-            continue;
-        }
+                int32_t numArgs = callInfo.numArgs;
+                int32_t numLocals = callInfo.numLocals;
 
-        if (op == "import")
-        {
-            // Push the import function on the stack
-            numTmps += 1;
-            writeCode(PUSH);
-            writeCode(Value((refptr)&importFn, TAG_HOSTFN));
+                // Check the callee identity
+                jitGuardTag(tail, REG_SP, 0, TAG_OBJECT, instrAddr);
+                a.mov64(RAX, (uint64_t)callInfo.lastFn);
+                ver->nativeCallees.push_back(
+                    { callInfo.lastFn, a.pos() - sizeof(uint64_t) }
+                );
+                a.load64(RCX, REG_SP, 0);
+                a.alu64(ALU_CMP, RCX, RAX);
+                jitGuard(tail, CC_NE, instrAddr);
+
+                // Check that the new frame and its temporaries fit on
+                // the stack, the interpreter reports the overflow
+                int32_t frameSize = VAL_SIZE * int32_t(
+                    numLocals - numArgs + 3 + MAX_TMPS
+                );
+                a.mov(RDX, (uint64_t)&stackLimit);
+                a.load64(RDX, RDX, 0);
+                a.lea(RCX, REG_SP, VAL_SIZE - frameSize);
+                a.alu64(ALU_CMP, RCX, RDX);
+                jitGuard(tail, CC_B, instrAddr);
+
+                // Compute the stack pointer to restore after the call,
+                // and point the frame pointer to the first argument
+                a.lea(RDX, REG_SP, VAL_SIZE * (1 + numArgs));
+                a.mov(RSI, REG_FP);
+                a.lea(REG_FP, REG_SP, VAL_SIZE * numArgs);
+
+                // Store the function object, then pop the arguments
+                // and callee, and push the callee locals
+                a.store64(REG_FP, jitLocal(numArgs), RAX);
+                a.store64(REG_FP, jitLocal(numArgs) + VAL_TAG, int32_t(TAG_OBJECT));
+                a.lea(REG_SP, REG_SP, VAL_SIZE * (1 - numLocals + numArgs));
+
+                // Clear the locals which are not parameters
+                for (int32_t i = numArgs + 1; i < numLocals; ++i)
+                {
+                    a.store64(REG_FP, jitLocal(i), 0);
+                    a.store64(REG_FP, jitLocal(i) + VAL_TAG, int32_t(TAG_UNDEF));
+                }
 
-            // Call the import function
-            genCall(
-                version,
-                instr,
-                1,
-                numTmps
-            );
+                a.mov(RAX, RDX);
+                jitPushRax(TAG_RAWPTR);
+                a.mov(RAX, RSI);
+                jitPushRax(TAG_RAWPTR);
+                a.mov(RAX, (uint64_t)callInfo.retVer);
+                jitPushRax(TAG_RAWPTR);
 
-            continue;
-        }
+                // Compile the call continuation along with the callee
+                jitQueue(region, callInfo.retVer);
 
-        if (op == "abort")
-        {
-            numTmps -= 1;
+                jitBranch(region, tail, entryVer);
+                isBranch = true;
+            }
+            break;
 
-            // Store a mapping of this instruction to the block version
-            // Needed to retrieve the source code position
-            instrMap[codeHeapAlloc] = version;
+            case RET:
+            {
+                // Top-level returns exit to the interpreter
+                a.cmp64(REG_SP, VAL_SIZE, 0);
+                jitGuard(tail, CC_E, instrAddr);
+
+                // Pop the return value, the return address, and
+                // restore the frame and stack pointers
+                a.load64(RAX, REG_SP, 0);
+                a.load64(RCX, REG_SP, VAL_TAG);
+                a.load64(RDX, REG_SP, VAL_SIZE);
+                a.load64(REG_FP, REG_SP, 2 * VAL_SIZE);
+                a.load64(REG_SP, REG_SP, 3 * VAL_SIZE);
+
+                // Push the return value
+                a.alu64(ALU_SUB, REG_SP, VAL_SIZE);
+                a.store64(REG_SP, 0, RAX);
+                a.store64(REG_SP, VAL_TAG, RCX);
+
+                // Continue in the native code of the return address,
+                // or let the link helper find where to continue
+                a.load64(RAX, RDX, jitNativeCodeOfs);
+                a.test64(RAX, RAX);
+                auto linkSite = a.jcc(CC_E);
+                a.jmp(RAX);
+                X86Asm::patchRel32(linkSite, a.pos());
+                a.mov(RDI, RDX);
+                a.mov(RSI, uint64_t(0));
+                a.jmp(jitLinkStub);
+                isBranch = true;
+            }
+            break;
 
-            writeCode(ABORT);
-            continue;
+            default:
+            assert (false);
         }
 
-        throw RunError("unhandled opcode in basic block \"" + op + "\"");
+        if (isBranch)
+            break;
     }
 
-    // Mark the block end
-    version->endPtr = codeHeapAlloc;
-
-    //std::cout << "done compiling version" << std::endl;
-    //std::cout << codeHeapSize() << std::endl;
-}
-
-/// Get the source position for a given instruction, if available
-Value getSrcPos(uint8_t* instrPtr)
-{
-    auto itr = instrMap.find(instrPtr);
-    if (itr == instrMap.end())
+    // Out-of-line exits to the interpreter
+    for (auto& exit : tail.exits)
     {
-        std::cout << "no instr to block mapping" << std::endl;
-        return Value::UNDEF;
+        X86Asm::patchRel32(exit.first, a.pos());
+        jitExitTo(exit.second);
     }
 
-    auto block = itr->second->block;
-
-    static ICache instrsIC("instrs");
-    Array instrs = instrsIC.getArr(block);
-    assert (instrs.length() > 0);
-
-    // Traverse the instructions in reverse
-    for (int i = (int)instrs.length() - 1; i >= 0; --i)
+    // Out-of-line links to versions outside of the region
+    for (auto& link : tail.links)
     {
-        auto instrVal = instrs.getElem(i);
-        assert (instrVal.isObject());
-        auto instr = Object(instrVal);
-
-        if (instr.hasField("src_pos"))
-            return instr.getField("src_pos");
+        X86Asm::patchRel32(link.first, a.pos());
+        a.mov(RDI, (uint64_t)link.second);
+        a.mov(RSI, (uint64_t)link.first);
+        a.mov(RDX, (uint64_t)ver);
+        a.jmp(jitLinkStub);
     }
 
-    return Value::UNDEF;
+    ver->nativeEnd = a.pos();
 }
 
-/// Implementation of the throw instruction
-void throwExc(
-    uint8_t* throwInstr,
-    Value excVal
-)
+/// Compile a hot block version, and the versions reachable
+/// from it, into a region of native code
+void jitCompile(BlockVersion* root)
 {
-    // Get the current function
-    auto itr = instrMap.find(throwInstr);
-    assert (itr != instrMap.end());
-    auto curFun = itr->second->fun;
+    if (!jitEnabled || !jitReserve(JIT_VERSION_SPACE))
+        return;
 
-    // Until we are done unwinding the stack
-    for (;;)
-    {
-        //std::cout << "Unwinding frame" << std::endl;
+    JitRegion region;
+    if (!jitQueue(region, root))
+        return;
 
-        // Get the number of locals in the function
-        static ICache numLocalsIC("num_locals");
-        auto numLocals = numLocalsIC.getInt32(curFun);
+    for (size_t i = 0; i < region.versions.size(); ++i)
+    {
+        auto ver = region.versions[i];
 
-        //std::cout << "numLocals=" << numLocals << std::endl;
+        if (jitReserve(JIT_VERSION_SPACE))
+        {
+            jitVersion(region, ver);
+        }
+        else
+        {
+            // Out of space, the version only exits to the interpreter
+            ver->nativeCode = jitAsm.pos();
+            jitExitTo(ver->startPtr);
+            ver->nativeEnd = jitAsm.pos();
+        }
+    }
 
-        // Get the saved stack ptr, frame ptr and return address
-        auto prevStackPtr = framePtr[-(numLocals + 0)];
-        auto prevFramePtr = framePtr[-(numLocals + 1)];
-        auto retAddr      = framePtr[-(numLocals + 2)];
+    // Patch the branches within the region, and make the interpreter
+    // enter the new native code
+    for (auto ver : region.versions)
+    {
+        for (auto site : region.fixups[ver])
+            X86Asm::patchRel32(site, ver->nativeCode);
+
+        ver->hotCount = JIT_THRESHOLD;
+        reserveCode(sizeof(OpcodeSlot) + sizeof(uint8_t*));
+        ver->nativeStub = codeHeapAlloc;
+        writeCode(NATIVE);
+        writeCode(ver->nativeCode);
+        versionStarts[ver->nativeStub] = ver;
+    }
+}
 
-        assert (retAddr.getTag() == TAG_RAWPTR);
-        auto retVer = (BlockVersion*)retAddr.getWord().ptr;
+/**
+Count an entry into a block version from the interpreter, compiling it
+once it becomes hot. Returns true once the version no longer needs
+to be counted, meaning branches to it can be patched.
+*/
+__attribute__((always_inline)) inline bool jitCount(BlockVersion* ver)
+{
+    if (ver->hotCount >= JIT_THRESHOLD)
+        return true;
 
-        // If we are at the top level
-        if (retVer == nullptr)
-        {
-            //std::cout << "Uncaught exception" << std::endl;
+    if (!jitEnabled)
+        return true;
 
-            std::string errMsg;
+    if (++ver->hotCount < JIT_THRESHOLD)
+        return false;
 
-            if (excVal.isObject())
-            {
-                auto excObj = Object(excVal);
+    jitCompile(ver);
+    return true;
+}
 
-                if (excObj.hasField("src_pos"))
-                {
-                    auto srcPosVal = excObj.getField("src_pos");
-                    errMsg += posToString(srcPosVal) + " - ";
-                }
+/**
+Helper called by native code to branch to a block version which is
+not yet compiled to native code. Returns the native code address to
+continue at, or null with jitExitAddr set to exit to the interpreter.
+Once the outcome is final, the branch at the given site, which is in
+the native code of the owner version, is patched.
+*/
+uint8_t* jitLink(BlockVersion* ver, uint8_t* site, BlockVersion* owner)
+{
+    // Have the interpreter compile the version through a stub
+    if (!ver->startPtr)
+    {
+        reserveCode(sizeof(OpcodeSlot) + sizeof(BlockVersion*));
+        jitExitAddr = codeHeapAlloc;
+        writeCode(JUMP_STUB);
+        writeCode(ver);
+        return nullptr;
+    }
 
-                if (excObj.hasField("msg"))
-                {
-                    auto errMsgVal = excObj.getField("msg");
-                    errMsg += errMsgVal.toString();
-                }
-                else
-                {
-                    errMsg += "uncaught user exception object";
-                }
-            }
-            else
-            {
-                errMsg = excVal.toString();
-            }
+    bool done = jitCount(ver);
 
-            throw RunError(errMsg);
-        }
+    if (ver->nativeCode)
+    {
+        if (site)
+            X86Asm::patchRel32(site, ver->nativeCode);
+        return ver->nativeCode;
+    }
 
-        // Find the info associated with the return address
-        assert (retAddrMap.find(retVer) != retAddrMap.end());
-        auto retEntry = retAddrMap[retVer];
+    // The version can't be compiled, exit directly from now on
+    if (done && site && jitAsm.hasSpace(JIT_RESERVE))
+    {
+        owner->nativeExits.push_back(jitAsm.pos());
+        X86Asm::patchRel32(site, jitAsm.pos());
+        jitExitTo(ver->startPtr);
+    }
 
-        // Get the function associated with the return address
-        curFun = retEntry.retVer->fun;
+    jitExitAddr = ver->startPtr;
+    return nullptr;
+}
 
-        // Update the stack and frame pointer
-        stackPtr = (Value*)prevStackPtr.getWord().ptr;
-        framePtr = (Value*)prevFramePtr.getWord().ptr;
+#endif
 
-        // If there is an exception handler
-        if (retEntry.excVer)
-        {
-            //std::cout << "Found exception handler" << std::endl;
-            //std::cout << "numTmps=" << retEntry.numTmps << std::endl;
-            //std::cout << "frameSize()=" << frameSize() << std::endl;
+/// Get the address at which the interpreter enters a compiled block
+/// version, counting the entry towards native compilation
+__attribute__((always_inline)) inline uint8_t* enterVersion(BlockVersion* ver)
+{
+#ifdef ZETA_JIT
+    jitCount(ver);
+#endif
+    return ver->entryPtr();
+}
 
-            // Clear the temporary stack
-            stackPtr += retEntry.numTmps;
+/// Disable native code generation
+void disableJit()
+{
+#ifdef ZETA_JIT
+    jitAllowed = false;
+    jitEnabled = false;
+#endif
+}
 
-            // Push the exception value on the stack
-            pushVal(excVal);
+/// Get statistics about the native code heap of the current isolate
+JitStats getJitStats()
+{
+    JitStats stats = { 0, 0 };
 
-            // Compile exception handler if needed
-            if (!retEntry.excVer->startPtr)
-                compile(retEntry.excVer);
+#ifdef ZETA_JIT
+    for (auto& chunk : jitChunks)
+        if (!chunk.isFree)
+            stats.heapBytes += JIT_CHUNK_SIZE;
 
-            instrPtr = retEntry.excVer->startPtr;
+    stats.numSkipped = jitNumSkipped;
+#endif
 
-            // Done unwinding the stack
-            break;
-        }
-    }
+    return stats;
 }
 
 void checkArgCount(
@@ -1282,10 +3947,17 @@ __attribute__((always_inline)) inline void userCall(
     // If the function does not match the inline cache
     if (callInfo.lastFn != (refptr)fun)
     {
+        if (profEnabled && profCurVer)
+            profCurVer->callMisses++;
+
         // Get a version for the function entry block
-        static ICache entryIC("entry");
+        static thread_local ICache entryIC("entry");
         auto entryBB = entryIC.getObj(fun);
-        auto entryVer = getBlockVersion(fun, entryBB, 0);
+        auto entryVer = getBlockVersion(
+            fun,
+            entryBB,
+            callInfo.entryCtx? *callInfo.entryCtx:CodeGenCtx()
+        );
 
         if (!entryVer->startPtr)
         {
@@ -1293,12 +3965,12 @@ __attribute__((always_inline)) inline void userCall(
             compile(entryVer);
         }
 
-        static ICache localsIC("num_locals");
+        static thread_local ICache localsIC("num_locals");
         auto nlocals = localsIC.getInt32(fun);
         assert(nlocals >= 0);
         auto numLocals = size_t(nlocals);
 
-        static ICache paramsIC("params");
+        static thread_local ICache paramsIC("params");
         auto params = paramsIC.getArr(fun);
         auto numParams = size_t(params.length());
 
@@ -1323,14 +3995,20 @@ __attribute__((always_inline)) inline void userCall(
     BlockVersion* entryVer = callInfo.entryVer;
     BlockVersion* retVer = callInfo.retVer;
 
+    if (profEnabled)
+        entryVer->prof->calls++;
+
     // Compute the stack pointer to restore after the call
     auto prevStackPtr = stackPtr + numArgs;
 
     // Save the current frame pointer
     auto prevFramePtr = framePtr;
 
+    // The callee locals replace the arguments, and
+    // three slots hold the return information
+    checkFrameFits(numLocals - numArgs + 3);
+
     // Point the frame pointer to the first argument
-    assert (stackPtr > stackLimit);
     framePtr = stackPtr + numArgs - 1;
 
     // Store the function/pointer argument
@@ -1339,12 +4017,54 @@ __attribute__((always_inline)) inline void userCall(
     // Pop the arguments, push the callee locals
     stackPtr -= numLocals - numArgs;
 
+    // Clear the locals which are not parameters, so that the
+    // garbage collector never sees stale values
+    for (size_t i = numArgs + 1; i < numLocals; ++i)
+        framePtr[-i] = Value::UNDEF;
+
     pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
     pushVal(Value((refptr)prevFramePtr, TAG_RAWPTR));
     pushVal(Value((refptr)retVer, TAG_RAWPTR));
 
     // Jump to the entry block of the function
-    instrPtr = entryVer->startPtr;
+    instrPtr = enterVersion(entryVer);
+}
+
+/**
+Throw an exception raised by a host function to the calling code
+*/
+void hostCallExc(
+    uint8_t* callInstr,
+    size_t numArgs,
+    BlockVersion* retVer,
+    Value excVal
+)
+{
+    // Pop the arguments from the stack
+    stackPtr += numArgs;
+
+    auto& retEntry = *retVer->retEntry;
+
+    // If there is an exception handler (throw_to field)
+    if (retEntry.excVer)
+    {
+        // Clear the temporary stack
+        stackPtr += retEntry.numTmps;
+
+        // Push the exception value on the stack
+        pushVal(excVal);
+
+        // Compile exception handler if needed
+        if (!retEntry.excVer->startPtr)
+            compile(retEntry.excVer);
+
+        instrPtr = retEntry.excVer->startPtr;
+    }
+    else
+    {
+        // Unwind the interpreter stack
+        throwExc(callInstr, excVal);
+    }
 }
 
 /**
@@ -1362,73 +4082,43 @@ __attribute__((always_inline)) inline void hostCall(
     // Check that the argument count matches
     checkArgCount(callInstr, hostFn->getNumParams(), numArgs);
 
-    // Pointer to the first argument
-    auto args = stackPtr + numArgs - 1;
+    // The arguments are passed in place, starting from the first one
+    auto args = HostArgs(stackPtr + numArgs - 1, numArgs);
+
+    // Host functions may reenter the interpreter, changing profCurVer
+    auto startTime = profEnabled? profNow():0;
+    auto callerProf = profCurVer;
 
     Value retVal;
 
     try
     {
-        // Call the host function
-        switch (numArgs)
-        {
-            case 0:
-            retVal = hostFn->call0();
-            break;
-
-            case 1:
-            retVal = hostFn->call1(args[0]);
-            break;
-
-            case 2:
-            retVal = hostFn->call2(args[0], args[-1]);
-            break;
-
-            case 3:
-            retVal = hostFn->call3(args[0], args[-1], args[-2]);
-            break;
-
-            default:
-            assert (false);
-        }
+        retVal = hostFn->call(args);
     }
 
-    catch (RunError err)
+    // Values thrown explicitly need no allocation
+    catch (HostThrow& exc)
     {
-        // Pop the arguments from the stack
-        stackPtr += numArgs;
-
-        // Create an exception object
-        auto excVal = Object::newObject();
-        auto errStr = String(err.toString());
-        excVal.setField("msg", errStr);
-
-        auto retEntry = retAddrMap[retVer];
-
-        // If there is an exception handler (throw_to field)
-        if (retEntry.excVer)
-        {
-            // Clear the temporary stack
-            stackPtr += retEntry.numTmps;
+        if (profEnabled)
+            profHostCall(hostFn, callerProf, startTime);
 
-            // Push the exception value on the stack
-            pushVal(excVal);
-
-            // Compile exception handler if needed
-            if (!retEntry.excVer->startPtr)
-                compile(retEntry.excVer);
+        hostCallExc(callInstr, numArgs, retVer, exc.getValue());
+        return;
+    }
 
-            instrPtr = retEntry.excVer->startPtr;
-        }
-        else
-        {
-            // Unwind the interpreter stack
-            throwExc(callInstr, excVal);
-        }
+    catch (RunError& err)
+    {
+        if (profEnabled)
+            profHostCall(hostFn, callerProf, startTime);
 
+        auto excVal = newErrorObj(err.toString());
+        hostCallExc(callInstr, numArgs, retVer, excVal);
         return;
     }
 
+    if (profEnabled)
+        profHostCall(hostFn, callerProf, startTime);
+
     // Pop the arguments from the stack
     stackPtr += numArgs;
 
@@ -1441,66 +4131,226 @@ __attribute__((always_inline)) inline void hostCall(
     instrPtr = retVer->startPtr;
 }
 
+/**
+Get the address of a branch target. If the target is still a block
+version stub, compile it and patch the branch with its address.
+*/
+__attribute__((always_inline)) inline uint8_t* branchTarget(uint8_t*& dstAddr)
+{
+    if (isVersionRef(dstAddr))
+    {
+        auto dstVer = refVersion(dstAddr);
+        if (!dstVer->startPtr)
+            compile(dstVer);
+
+#ifdef ZETA_JIT
+        // The branch is only patched once the target stops counting
+        if (!jitCount(dstVer))
+            return dstVer->startPtr;
+#endif
+
+        // Patch the branch
+        dstAddr = dstVer->entryPtr();
+    }
+
+    return dstAddr;
+}
+
+/// Evaluate an int32 comparison given its opcode
+__attribute__((always_inline)) inline bool cmpI32(uint16_t op, int32_t a, int32_t b)
+{
+    switch (op)
+    {
+        case LT_I32: return a < b;
+        case LE_I32: return a <= b;
+        case GT_I32: return a > b;
+        case GE_I32: return a >= b;
+        case EQ_I32: return a == b;
+        default:
+        assert (false);
+        return false;
+    }
+}
+
 /// Start/continue execution beginning at a current instruction
+/// Note: garbage collections are only triggered at branches and calls,
+/// where all live values are on the interpreter stack
 Value execCode()
 {
-    assert (instrPtr >= codeHeap);
-    assert (instrPtr < codeHeapLimit);
+#ifdef ZETA_THREADED_DISPATCH
+    // Handler addresses, in the same order as the Opcode enum
+    static void* handlers[] = {
+        &&op_GET_LOCAL,
+        &&op_SET_LOCAL,
+        &&op_PUSH,
+        &&op_POP,
+        &&op_DUP,
+        &&op_SWAP,
+        &&op_ADD_I32,
+        &&op_SUB_I32,
+        &&op_MUL_I32,
+        &&op_DIV_I32,
+        &&op_MOD_I32,
+        &&op_SHL_I32,
+        &&op_SHR_I32,
+        &&op_USHR_I32,
+        &&op_AND_I32,
+        &&op_OR_I32,
+        &&op_XOR_I32,
+        &&op_NOT_I32,
+        &&op_LT_I32,
+        &&op_LE_I32,
+        &&op_GT_I32,
+        &&op_GE_I32,
+        &&op_EQ_I32,
+        &&op_INC_I32,
+        &&op_DEC_I32,
+        &&op_ADD_F32,
+        &&op_SUB_F32,
+        &&op_MUL_F32,
+        &&op_DIV_F32,
+        &&op_LT_F32,
+        &&op_LE_F32,
+        &&op_GT_F32,
+        &&op_GE_F32,
+        &&op_EQ_F32,
+        &&op_SIN_F32,
+        &&op_COS_F32,
+        &&op_SQRT_F32,
+        &&op_I32_TO_F32,
+        &&op_I32_TO_STR,
+        &&op_F32_TO_I32,
+        &&op_F32_TO_STR,
+        &&op_STR_TO_F32,
+        &&op_EQ_BOOL,
+        &&op_HAS_TAG,
+        &&op_GET_TAG,
+        &&op_LOCAL_HAS_TAG,
+        &&op_STR_LEN,
+        &&op_GET_CHAR,
+        &&op_GET_CHAR_CODE,
+        &&op_CHAR_TO_STR,
+        &&op_STR_CAT,
+        &&op_EQ_STR,
+        &&op_NEW_OBJECT,
+        &&op_HAS_FIELD,
+        &&op_SET_FIELD,
+        &&op_SET_FIELD_IMM,
+        &&op_GET_FIELD,
+        &&op_GET_FIELD_IMM,
+        &&op_GET_FIELD_LIST,
+        &&op_EQ_OBJ,
+        &&op_NEW_ARRAY,
+        &&op_ARRAY_LEN,
+        &&op_ARRAY_PUSH,
+        &&op_GET_ELEM,
+        &&op_SET_ELEM,
+        &&op_GET_LOCAL_FIELD_IMM,
+        &&op_GET_LOCAL_ADD_IMM,
+        &&op_ADD_LOCAL_IMM,
+        &&op_IF_LOCAL_HAS_TAG,
+        &&op_IF_CMP_LOCAL_IMM,
+        &&op_IF_CMP_IMM,
+        &&op_ADD_I32_NOCHK,
+        &&op_SUB_I32_NOCHK,
+        &&op_MUL_I32_NOCHK,
+        &&op_LT_I32_NOCHK,
+        &&op_LE_I32_NOCHK,
+        &&op_GT_I32_NOCHK,
+        &&op_GE_I32_NOCHK,
+        &&op_EQ_I32_NOCHK,
+        &&op_ADD_F32_NOCHK,
+        &&op_SUB_F32_NOCHK,
+        &&op_MUL_F32_NOCHK,
+        &&op_DIV_F32_NOCHK,
+        &&op_JUMP,
+        &&op_JUMP_STUB,
+        &&op_IF_TRUE,
+        &&op_CALL,
+        &&op_RET,
+        &&op_THROW,
+        &&op_NATIVE,
+        &&op_PROF_ENTER,
+        &&op_ABORT
+    };
+
+    static_assert(
+        sizeof(handlers) / sizeof(handlers[0]) == ABORT + 1,
+        "handler table does not match the opcode enumeration"
+    );
+
+    // When called from initInterp, export the handler table
+    if (instrPtr == nullptr)
+    {
+        opHandlers = handlers;
+        return Value::UNDEF;
+    }
+
+    #define CASE(op) op_##op:
+    #define NEXT() opPtr = &readCode<OpcodeSlot>(); goto **opPtr
+#else
+    #define CASE(op) case op:
+    #define NEXT() break
+#endif
+
+    assert (instrPtr != nullptr);
+
+    // Code heap slot of the instruction being executed
+    OpcodeSlot* opPtr;
 
     // For each instruction to execute
     for (;;)
     {
-        auto& op = readCode<Opcode>();
-
-        //std::cout << "instr" << std::endl;
-        //std::cout << "op=" << (int)op << std::endl;
-        //std::cout << "  stack space: " << (stackBase - stackPtr) << std::endl;
-
-        switch (op)
+#ifdef ZETA_THREADED_DISPATCH
+        NEXT();
+#else
+        opPtr = &readCode<OpcodeSlot>();
+        switch (*opPtr)
+#endif
         {
-            case PUSH:
+            CASE(PUSH)
             {
                 auto val = readCode<Value>();
                 pushVal(val);
             }
-            break;
+            NEXT();
 
-            case POP:
+            CASE(POP)
             {
                 popVal();
             }
-            break;
+            NEXT();
 
-            case DUP:
+            CASE(DUP)
             {
                 // Read the index of the value to duplicate
                 auto idx = readCode<uint16_t>();
                 auto val = stackPtr[idx];
                 pushVal(val);
             }
-            break;
+            NEXT();
 
             // Swap the topmost two stack elements
-            case SWAP:
+            CASE(SWAP)
             {
                 auto v0 = popVal();
                 auto v1 = popVal();
                 pushVal(v0);
                 pushVal(v1);
             }
-            break;
+            NEXT();
 
             // Set a local variable
-            case SET_LOCAL:
+            CASE(SET_LOCAL)
             {
                 auto localIdx = readCode<uint16_t>();
                 //std::cout << "set localIdx=" << localIdx << std::endl;
                 assert (stackPtr > stackLimit);
                 framePtr[-localIdx] = popVal();
             }
-            break;
+            NEXT();
 
-            case GET_LOCAL:
+            CASE(GET_LOCAL)
             {
                 // Read the index of the value to push
                 auto localIdx = readCode<uint16_t>();
@@ -1509,9 +4359,9 @@ Value execCode()
                 auto val = framePtr[-localIdx];
                 pushVal(val);
             }
-            break;
+            NEXT();
 
-            case LOCAL_HAS_TAG:
+            CASE(LOCAL_HAS_TAG)
             {
                 // Read the index of the local value
                 auto localIdx = readCode<uint16_t>();
@@ -1523,291 +4373,291 @@ Value execCode()
                 auto valTag = val.getTag();
                 pushBool(valTag == testTag);
             }
-            break;
+            NEXT();
 
             //
             // Integer operations
             //
-            case INC_I32:
+            CASE(INC_I32)
             {
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 + 1));
             }
-            break;
-            case DEC_I32:
+            NEXT();
+            CASE(DEC_I32)
             {
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 - 1));
             }
-            break;
+            NEXT();
 
-            case ADD_I32:
+            CASE(ADD_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 + arg1));
             }
-            break;
+            NEXT();
 
-            case SUB_I32:
+            CASE(SUB_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 - arg1));
             }
-            break;
+            NEXT();
 
-            case MUL_I32:
+            CASE(MUL_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 * arg1));
             }
-            break;
+            NEXT();
 
-            case DIV_I32:
+            CASE(DIV_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 / arg1));
             }
-            break;
+            NEXT();
 
-            case MOD_I32:
+            CASE(MOD_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 % arg1));
             }
-            break;
+            NEXT();
 
-            case SHL_I32:
+            CASE(SHL_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 << arg1));
             }
-            break;
+            NEXT();
 
-            case SHR_I32:
+            CASE(SHR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 >> arg1));
             }
-            break;
+            NEXT();
 
-            case USHR_I32:
+            CASE(USHR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = (uint32_t)popInt32();
                 pushVal(Value::int32((int32_t)(arg0 >> arg1)));
             }
-            break;
+            NEXT();
 
-            case AND_I32:
+            CASE(AND_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 & arg1));
             }
-            break;
+            NEXT();
 
-            case OR_I32:
+            CASE(OR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 | arg1));
             }
-            break;
+            NEXT();
 
-            case XOR_I32:
+            CASE(XOR_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 ^ arg1));
             }
-            break;
+            NEXT();
 
-            case NOT_I32:
+            CASE(NOT_I32)
             {
                 auto arg0 = popInt32();
                 pushVal(Value::int32(~arg0));
             }
-            break;
+            NEXT();
 
-            case LT_I32:
+            CASE(LT_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 < arg1);
             }
-            break;
+            NEXT();
 
-            case LE_I32:
+            CASE(LE_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 <= arg1);
             }
-            break;
+            NEXT();
 
-            case GT_I32:
+            CASE(GT_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 > arg1);
             }
-            break;
+            NEXT();
 
-            case GE_I32:
+            CASE(GE_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 >= arg1);
             }
-            break;
+            NEXT();
 
-            case EQ_I32:
+            CASE(EQ_I32)
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT();
 
             //
             // Floating-point operations
             //
 
-            case ADD_F32:
+            CASE(ADD_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 + arg1));
             }
-            break;
+            NEXT();
 
-            case SUB_F32:
+            CASE(SUB_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 - arg1));
             }
-            break;
+            NEXT();
 
-            case MUL_F32:
+            CASE(MUL_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 * arg1));
             }
-            break;
+            NEXT();
 
-            case DIV_F32:
+            CASE(DIV_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 / arg1));
             }
-            break;
+            NEXT();
 
-            case LT_F32:
+            CASE(LT_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 < arg1);
             }
-            break;
+            NEXT();
 
-            case LE_F32:
+            CASE(LE_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 <= arg1);
             }
-            break;
+            NEXT();
 
-            case GT_F32:
+            CASE(GT_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 > arg1);
             }
-            break;
+            NEXT();
 
-            case GE_F32:
+            CASE(GE_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 >= arg1);
             }
-            break;
+            NEXT();
 
-            case EQ_F32:
+            CASE(EQ_F32)
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT();
 
-            case SIN_F32:
+            CASE(SIN_F32)
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(sin(arg)));
             }
-            break;
+            NEXT();
 
-            case COS_F32:
+            CASE(COS_F32)
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(cos(arg)));
             }
-            break;
+            NEXT();
 
-            case SQRT_F32:
+            CASE(SQRT_F32)
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(sqrt(arg)));
             }
-            break;
+            NEXT();
 
             //
             // Conversion operations
             //
 
-            case I32_TO_F32:
+            CASE(I32_TO_F32)
             {
                 auto arg0 = popInt32();
                 pushVal(Value::float32(arg0));
             }
-            break;
+            NEXT();
 
-            case I32_TO_STR:
+            CASE(I32_TO_STR)
             {
                 auto arg0 = popInt32();
                 String str = std::to_string(arg0);
                 pushVal(str);
             }
-            break;
+            NEXT();
 
-            case F32_TO_I32:
+            CASE(F32_TO_I32)
             {
                 auto arg0 = popFloat32();
                 pushVal(Value::int32(arg0));
             }
-            break;
+            NEXT();
 
-            case F32_TO_STR:
+            CASE(F32_TO_STR)
             {
                 auto arg0 = popFloat32();
                 String str = std::to_string(arg0);
                 pushVal(str);
             }
-            break;
+            NEXT();
 
-            case STR_TO_F32:
+            CASE(STR_TO_F32)
             {
                 auto arg0 = popStr();
 
@@ -1825,51 +4675,51 @@ Value execCode()
 
                 pushVal(Value::float32(val));
             }
-            break;
+            NEXT();
 
             //
             // Misc operations
             //
 
-            case EQ_BOOL:
+            CASE(EQ_BOOL)
             {
                 auto arg1 = popBool();
                 auto arg0 = popBool();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT();
 
             // Test if a value has a given tag
-            case HAS_TAG:
+            CASE(HAS_TAG)
             {
                 auto testTag = readCode<Tag>();
                 auto valTag = popVal().getTag();
                 pushBool(valTag == testTag);
             }
-            break;
+            NEXT();
 
             // Get the type tag associated with a value.
             // Note: this produces a string
-            case GET_TAG:
+            CASE(GET_TAG)
             {
                 auto valTag = popVal().getTag();
                 auto tagStr = tagToStr(valTag);
                 pushVal(String(tagStr));
             }
-            break;
+            NEXT();
 
             //
             // String operations
             //
 
-            case STR_LEN:
+            CASE(STR_LEN)
             {
                 auto str = popStr();
                 pushVal(Value::int32(str.length()));
             }
-            break;
+            NEXT();
 
-            case GET_CHAR:
+            CASE(GET_CHAR)
             {
                 auto idx = (size_t)popInt32();
                 auto str = popStr();
@@ -1891,9 +4741,9 @@ Value execCode()
 
                 pushVal(charStrings[ch]);
             }
-            break;
+            NEXT();
 
-            case GET_CHAR_CODE:
+            CASE(GET_CHAR_CODE)
             {
                 auto idx = (size_t)popInt32();
                 auto str = popStr();
@@ -1908,77 +4758,96 @@ Value execCode()
                 unsigned char ch = (unsigned char)str[idx];
                 pushVal(Value::int32(ch));
             }
-            break;
+            NEXT();
 
-            case CHAR_TO_STR:
+            CASE(CHAR_TO_STR)
             {
                 auto charCode = (char)popInt32();
                 char buf[2] = { (char)charCode, '\0' };
                 pushVal(String(buf));
             }
-            break;
+            NEXT();
 
-            case STR_CAT:
+            CASE(STR_CAT)
             {
                 auto a = popStr();
                 auto b = popStr();
                 auto c = String::concat(b, a);
                 pushVal(c);
             }
-            break;
+            NEXT();
 
-            case EQ_STR:
+            CASE(EQ_STR)
             {
                 auto arg1 = popStr();
                 auto arg0 = popStr();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT();
 
             //
             // Object operations
             //
 
-            case NEW_OBJECT:
+            CASE(NEW_OBJECT)
             {
                 auto capacity = popInt32();
                 auto obj = Object::newObject(capacity);
                 pushVal(obj);
             }
-            break;
+            NEXT();
 
-            case HAS_FIELD:
+            CASE(HAS_FIELD)
             {
-                auto fieldName = popStr();
+                auto fieldName = popStr().intern();
                 auto obj = popObj();
-                pushBool(obj.hasField(fieldName));
+                auto& pic = readCode<FieldPIC>();
+                auto numMisses = FieldPIC::numMisses;
+                pushBool(obj.hasField(fieldName, pic));
+                profFieldAccess(numMisses);
             }
-            break;
+            NEXT();
 
-            case SET_FIELD:
+            CASE(SET_FIELD)
             {
                 auto val = popVal();
-                auto fieldName = popStr();
+                auto fieldName = popStr().intern();
                 auto obj = popObj();
-                obj.setField(fieldName, val);
+                auto& pic = readCode<FieldPIC>();
+                auto numMisses = FieldPIC::numMisses;
+                obj.setField(fieldName, val, pic);
+                profFieldAccess(numMisses);
             }
-            break;
+            NEXT();
+
+            CASE(SET_FIELD_IMM)
+            {
+                auto& fieldName = readCode<String>();
+                auto& pic = readCode<FieldPIC>();
+                auto val = popVal();
+                auto obj = popObj();
+                auto numMisses = FieldPIC::numMisses;
+                obj.setField(fieldName, val, pic);
+                profFieldAccess(numMisses);
+            }
+            NEXT();
 
             // This instruction will abort execution if trying to
             // access a field that is not present on an object.
             // The running program is responsible for testing that
             // fields exist before attempting to read them.
-            case GET_FIELD:
+            CASE(GET_FIELD)
             {
-                auto fieldName = popStr();
+                auto fieldName = popStr().intern();
                 auto obj = popObj();
 
-                // Get the cached slot index
-                auto& slotIdx = readCode<size_t>();
+                // Get the cached shapes and slot indices
+                auto& pic = readCode<FieldPIC>();
 
                 Value val;
+                auto numMisses = FieldPIC::numMisses;
 
-                if (!obj.getField(fieldName, val, slotIdx))
+                if (!obj.getField(fieldName, val, pic))
                 {
                     throw RunError(
                         "get_field failed, missing field \"" +
@@ -1986,21 +4855,23 @@ Value execCode()
                     );
                 }
 
+                profFieldAccess(numMisses);
                 pushVal(val);
             }
-            break;
+            NEXT();
 
-            case GET_FIELD_IMM:
+            CASE(GET_FIELD_IMM)
             {
                 auto& fieldName = readCode<String>();
                 auto obj = popObj();
 
-                // Get the cached slot index
-                auto& slotIdx = readCode<size_t>();
+                // Get the cached shapes and slot indices
+                auto& pic = readCode<FieldPIC>();
 
                 Value val;
+                auto numMisses = FieldPIC::numMisses;
 
-                if (!obj.getField(fieldName, val, slotIdx))
+                if (!obj.getField(fieldName, val, pic))
                 {
                     throw RunError(
                         "get_field failed, missing field \"" +
@@ -2008,11 +4879,12 @@ Value execCode()
                     );
                 }
 
+                profFieldAccess(numMisses);
                 pushVal(val);
             }
-            break;
+            NEXT();
 
-            case GET_FIELD_LIST:
+            CASE(GET_FIELD_LIST)
             {
                 Value arg0 = popVal();
                 Array array = Array(0);
@@ -2023,44 +4895,44 @@ Value execCode()
                 }
                 pushVal(array);
             }
-            break;
+            NEXT();
 
-            case EQ_OBJ:
+            CASE(EQ_OBJ)
             {
                 Value arg1 = popVal();
                 Value arg0 = popVal();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT();
 
             //
             // Array operations
             //
 
-            case NEW_ARRAY:
+            CASE(NEW_ARRAY)
             {
                 auto len = popInt32();
                 auto array = Array(len);
                 pushVal(array);
             }
-            break;
+            NEXT();
 
-            case ARRAY_LEN:
+            CASE(ARRAY_LEN)
             {
                 auto arr = Array(popVal());
                 pushVal(Value::int32(arr.length()));
             }
-            break;
+            NEXT();
 
-            case ARRAY_PUSH:
+            CASE(ARRAY_PUSH)
             {
                 auto val = popVal();
                 auto arr = Array(popVal());
                 arr.push(val);
             }
-            break;
+            NEXT();
 
-            case SET_ELEM:
+            CASE(SET_ELEM)
             {
                 auto val = popVal();
                 auto idx = (size_t)popInt32();
@@ -2075,9 +4947,9 @@ Value execCode()
 
                 arr.setElem(idx, val);
             }
-            break;
+            NEXT();
 
-            case GET_ELEM:
+            CASE(GET_ELEM)
             {
                 auto idx = (size_t)popInt32();
                 auto arr = Array(popVal());
@@ -2091,13 +4963,219 @@ Value execCode()
 
                 pushVal(arr.getElem(idx));
             }
-            break;
+            NEXT();
+
+            //
+            // Fused instructions
+            //
+
+            CASE(GET_LOCAL_FIELD_IMM)
+            {
+                auto localIdx = readCode<uint16_t>();
+                auto& fieldName = readCode<String>();
+                auto& pic = readCode<FieldPIC>();
+
+                auto val = framePtr[-localIdx];
+                assert (val.isObject());
+                auto obj = (Object)val;
+                auto numMisses = FieldPIC::numMisses;
+
+                if (!obj.getField(fieldName, val, pic))
+                {
+                    throw RunError(
+                        "get_field failed, missing field \"" +
+                        (std::string)fieldName + "\""
+                    );
+                }
+
+                profFieldAccess(numMisses);
+                pushVal(val);
+            }
+            NEXT();
+
+            CASE(GET_LOCAL_ADD_IMM)
+            {
+                auto localIdx = readCode<uint16_t>();
+                auto imm = readCode<int32_t>();
+
+                auto val = checkInt32(framePtr[-localIdx]);
+                pushVal(Value::int32(val + imm));
+            }
+            NEXT();
+
+            CASE(ADD_LOCAL_IMM)
+            {
+                auto localIdx = readCode<uint16_t>();
+                auto imm = readCode<int32_t>();
+
+                auto& local = framePtr[-localIdx];
+                local = Value::int32(checkInt32(local) + imm);
+            }
+            NEXT();
+
+            CASE(IF_LOCAL_HAS_TAG)
+            {
+                if (vm.gcNeeded())
+                    gcCollect();
+
+                auto localIdx = readCode<uint16_t>();
+                auto testTag = readCode<Tag>();
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto val = framePtr[-localIdx];
+
+                if (val.getTag() == testTag)
+                    instrPtr = branchTarget(thenAddr);
+                else
+                    instrPtr = branchTarget(elseAddr);
+            }
+            NEXT();
+
+            CASE(IF_CMP_LOCAL_IMM)
+            {
+                if (vm.gcNeeded())
+                    gcCollect();
+
+                auto cmpOp = readCode<uint16_t>();
+                auto localIdx = readCode<uint16_t>();
+                auto imm = readCode<int32_t>();
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto val = checkInt32(framePtr[-localIdx]);
+
+                if (cmpI32(cmpOp, val, imm))
+                    instrPtr = branchTarget(thenAddr);
+                else
+                    instrPtr = branchTarget(elseAddr);
+            }
+            NEXT();
+
+            CASE(IF_CMP_IMM)
+            {
+                if (vm.gcNeeded())
+                    gcCollect();
+
+                auto cmpOp = readCode<uint16_t>();
+                auto imm = readCode<int32_t>();
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto arg0 = popInt32();
+
+                if (cmpI32(cmpOp, arg0, imm))
+                    instrPtr = branchTarget(thenAddr);
+                else
+                    instrPtr = branchTarget(elseAddr);
+            }
+            NEXT();
+
+            //
+            // Variants not checking the tags of their operands
+            //
+
+            CASE(ADD_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushVal(Value::int32(arg0 + arg1));
+            }
+            NEXT();
+
+            CASE(SUB_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushVal(Value::int32(arg0 - arg1));
+            }
+            NEXT();
+
+            CASE(MUL_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushVal(Value::int32(arg0 * arg1));
+            }
+            NEXT();
+
+            CASE(LT_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushBool(arg0 < arg1);
+            }
+            NEXT();
+
+            CASE(LE_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushBool(arg0 <= arg1);
+            }
+            NEXT();
+
+            CASE(GT_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushBool(arg0 > arg1);
+            }
+            NEXT();
+
+            CASE(GE_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushBool(arg0 >= arg1);
+            }
+            NEXT();
+
+            CASE(EQ_I32_NOCHK)
+            {
+                auto arg1 = popInt32NoChk();
+                auto arg0 = popInt32NoChk();
+                pushBool(arg0 == arg1);
+            }
+            NEXT();
+
+            CASE(ADD_F32_NOCHK)
+            {
+                auto arg1 = popFloat32NoChk();
+                auto arg0 = popFloat32NoChk();
+                pushVal(Value::float32(arg0 + arg1));
+            }
+            NEXT();
+
+            CASE(SUB_F32_NOCHK)
+            {
+                auto arg1 = popFloat32NoChk();
+                auto arg0 = popFloat32NoChk();
+                pushVal(Value::float32(arg0 - arg1));
+            }
+            NEXT();
+
+            CASE(MUL_F32_NOCHK)
+            {
+                auto arg1 = popFloat32NoChk();
+                auto arg0 = popFloat32NoChk();
+                pushVal(Value::float32(arg0 * arg1));
+            }
+            NEXT();
+
+            CASE(DIV_F32_NOCHK)
+            {
+                auto arg1 = popFloat32NoChk();
+                auto arg0 = popFloat32NoChk();
+                pushVal(Value::float32(arg0 / arg1));
+            }
+            NEXT();
 
             //
             // Branch instructions
             //
 
-            case JUMP_STUB:
+            CASE(JUMP_STUB)
             {
                 auto& dstAddr = readCode<uint8_t*>();
 
@@ -2113,75 +5191,64 @@ Value execCode()
                     {
                         // The jump is redundant, so we will write the
                         // next block over this jump instruction
-                        instrPtr = codeHeapAlloc = (uint8_t*)&op;
+                        instrPtr = codeHeapAlloc = (uint8_t*)opPtr;
                     }
 
                     compile(dstVer);
+                    instrPtr = dstVer->startPtr;
+                }
+#ifdef ZETA_JIT
+                else if (!jitCount(dstVer))
+                {
+                    // Keep counting entries until the target is hot
+                    instrPtr = dstVer->startPtr;
                 }
+#endif
                 else
                 {
                     // Patch the jump
-                    op = JUMP;
-                    dstAddr = dstVer->startPtr;
+                    *opPtr = encodeOp(JUMP);
+                    dstAddr = dstVer->entryPtr();
 
                     // Jump to the target
-                    instrPtr = dstVer->startPtr;
+                    instrPtr = dstAddr;
                 }
             }
-            break;
+            NEXT();
 
-            case JUMP:
+            CASE(JUMP)
             {
+                if (vm.gcNeeded())
+                    gcCollect();
+
                 auto& dstAddr = readCode<uint8_t*>();
                 instrPtr = dstAddr;
             }
-            break;
+            NEXT();
 
-            case IF_TRUE:
+            CASE(IF_TRUE)
             {
+                if (vm.gcNeeded())
+                    gcCollect();
+
                 auto& thenAddr = readCode<uint8_t*>();
                 auto& elseAddr = readCode<uint8_t*>();
 
                 auto arg0 = popVal();
 
                 if (arg0 == Value::TRUE)
-                {
-                    if (thenAddr < codeHeap || thenAddr >= codeHeapLimit)
-                    {
-                        //std::cout << "Patching then target" << std::endl;
-
-                        auto thenVer = (BlockVersion*)thenAddr;
-                        if (!thenVer->startPtr)
-                           compile(thenVer);
-
-                        // Patch the jump
-                        thenAddr = thenVer->startPtr;
-                    }
-
-                    instrPtr = thenAddr;
-                }
+                    instrPtr = branchTarget(thenAddr);
                 else
-                {
-                    if (elseAddr < codeHeap || elseAddr >= codeHeapLimit)
-                    {
-                       //std::cout << "Patching else target" << std::endl;
-
-                       auto elseVer = (BlockVersion*)elseAddr;
-                       if (!elseVer->startPtr)
-                           compile(elseVer);
-
-                       // Patch the jump
-                       elseAddr = elseVer->startPtr;
-                    }
-
-                    instrPtr = elseAddr;
-                }
+                    instrPtr = branchTarget(elseAddr);
             }
-            break;
+            NEXT();
 
             // Regular function call
-            case CALL:
+            CASE(CALL)
             {
+                if (vm.gcNeeded())
+                    gcCollect();
+
                 auto& callInfo = readCode<CallInfo>();
 
                 auto callee = popVal();
@@ -2196,7 +5263,7 @@ Value execCode()
                 if (callee.isObject())
                 {
                     userCall(
-                        (uint8_t*)&op,
+                        (uint8_t*)opPtr,
                         callee,
                         callInfo
                     );
@@ -2204,7 +5271,7 @@ Value execCode()
                 else if (callee.isHostFn())
                 {
                     hostCall(
-                        (uint8_t*)&op,
+                        (uint8_t*)opPtr,
                         callee,
                         callInfo.numArgs,
                         callInfo.retVer
@@ -2215,9 +5282,9 @@ Value execCode()
                   throw RunError("invalid callee at call site");
                 }
             }
-            break;
+            NEXT();
 
-            case RET:
+            CASE(RET)
             {
                 // TODO: figure out callee identity from version,
                 // caller identity from return address
@@ -2259,25 +5326,45 @@ Value execCode()
                     if (!retVer->startPtr)
                         compile(retVer);
 
-                    instrPtr = retVer->startPtr;
+                    instrPtr = enterVersion(retVer);
                 }
             }
-            break;
+            NEXT();
 
             // Throw an exception
-            case THROW:
+            CASE(THROW)
             {
                 // Pop the exception value
                 auto excVal = popVal();
-                throwExc((uint8_t*)&op, excVal);
+                throwExc((uint8_t*)opPtr, excVal);
             }
-            break;
+            NEXT();
+
+            // Run native code until it exits to the interpreter
+            CASE(NATIVE)
+            {
+                auto nativeCode = readCode<uint8_t*>();
+#ifdef ZETA_JIT
+                instrPtr = jitEnter(nativeCode);
+#else
+                (void)nativeCode;
+                assert (false);
+#endif
+            }
+            NEXT();
+
+            CASE(PROF_ENTER)
+            {
+                auto prof = readCode<ProfVersion*>();
+                profEnter(prof);
+            }
+            NEXT();
 
-            case ABORT:
+            CASE(ABORT)
             {
                 auto errMsg = (std::string)popStr();
 
-                auto srcPos = getSrcPos((uint8_t*)&op);
+                auto srcPos = getSrcPos((uint8_t*)opPtr);
                 if (srcPos != Value::UNDEF)
                     std::cout << posToString(srcPos) << " - ";
 
@@ -2293,14 +5380,19 @@ Value execCode()
 
                 exit(-1);
             }
-            break;
+            NEXT();
 
+#ifndef ZETA_THREADED_DISPATCH
             default:
             assert (false && "unhandled instruction in interpreter loop");
+#endif
         }
 
     }
 
+    #undef CASE
+    #undef NEXT
+
     assert (false);
 }
 
@@ -2330,6 +5422,8 @@ Value callFun(Object fun, ValueVec args)
         );
     }
 
+    checkFrameFits(numLocals + 4);
+
     // Store the stack size before the call
     auto preCallSz = stackSize();
 
@@ -2347,6 +5441,9 @@ Value callFun(Object fun, ValueVec args)
     stackPtr -= numLocals;
     assert (stackPtr >= stackLimit);
 
+    for (size_t i = 0; i < numLocals; ++i)
+        framePtr[-i] = Value::UNDEF;
+
     // Push the previous stack pointer, previous
     // frame pointer and return address
     pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
@@ -2364,12 +5461,13 @@ Value callFun(Object fun, ValueVec args)
     framePtr[-numParams] = fun;
 
     // Get the function entry block
-    static ICache entryIC("entry");
+    static thread_local ICache entryIC("entry");
     auto entryBlock = entryIC.getObj(fun);
-    auto entryVer = getBlockVersion(fun, entryBlock, 0);
+    auto entryVer = getBlockVersion(fun, entryBlock, CodeGenCtx());
 
     // Generate code for the entry block version
-    compile(entryVer);
+    if (!entryVer->startPtr)
+        compile(entryVer);
     assert (entryVer->length() > 0);
 
     // Begin execution at the entry block
@@ -2435,4 +5533,40 @@ void testInterp()
     assert (testRunImage("tests/vm/ex_rec_fact.zim") == Value::int32(5040));
     assert (testRunImage("tests/vm/ex_fibonacci.zim") == Value::int32(377));
     assert (testRunImage("tests/vm/float_ops.zim").toString() == "10.500000");
+    assert (testRunImage("tests/vm/fused_ops.zim") == Value::int32(47));
+    assert (testRunImage("tests/vm/type_tests.zim") == Value::int32(47));
+    assert (testRunImage("tests/vm/jit_exits.zim") == Value::int32(47));
+    assert (testRunImage("tests/vm/tag_checks.zim") == Value::int32(500005));
+
+    // Operands of unknown type are checked
+    auto tagChecksPkg = parseFile("tests/vm/tag_checks.zim");
+    assert (callExportFn(tagChecksPkg, "inc", { Value::int32(1) }) == Value::int32(2));
+    assert (callExportFn(tagChecksPkg, "bump", { Value::int32(1) }) == Value::int32(2));
+    assert (callExportFn(tagChecksPkg, "is_neg", { Value::int32(-1) }) == Value::TRUE);
+    for (auto fnName : { "inc", "bump", "is_neg" })
+    {
+        bool caught = false;
+        try
+        {
+            callExportFn(tagChecksPkg, fnName, { String("a") });
+        }
+        catch (RunError& e)
+        {
+            caught = true;
+        }
+        assert (caught);
+        (void)caught;
+    }
+
+    bool caught = false;
+    try
+    {
+        callExportFn(tagChecksPkg, "add", { String("a"), Value::int32(1) });
+    }
+    catch (RunError& e)
+    {
+        caught = true;
+    }
+    assert (caught);
+    (void)caught;
 }
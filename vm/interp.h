@@ -1,13 +1,44 @@
 #pragma once
 
 #include <vector>
+#include <string>
 #include "runtime.h"
 
 typedef std::vector<Value> ValueVec;
 
-/// Initialize the interpreter
+/// Initialize the interpreter for the current isolate
 void initInterp();
 
+/// Free the interpreter state of the current isolate
+void shutdownInterp();
+
+/// Disable native code generation
+void disableJit();
+
+/// Statistics about the native code heap
+struct JitStats
+{
+    /// Bytes of the heap chunks holding native code
+    size_t heapBytes;
+
+    /// Number of block versions left to the interpreter
+    /// because the heap was full
+    size_t numSkipped;
+};
+
+/// Get statistics about the native code heap of the current isolate
+JitStats getJitStats();
+
+/**
+Count and sample the execution of block versions, printing a profile
+report at exit and optionally writing the sampled call stacks to a file
+in the collapsed format used by flame graph tools. This disables the JIT.
+*/
+void enableProfiling(std::string stacksFile = "");
+
+/// Call a function object from C++ code
+Value callFun(Object fun, ValueVec args);
+
 /// Call a function exported by a package
 Value callExportFn(
     Object pkg,
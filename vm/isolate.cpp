@@ -0,0 +1,149 @@
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "isolate.h"
+#include "runtime.h"
+#include "interp.h"
+#include "packages.h"
+#include "parser.h"
+#include "gc.h"
+
+Isolate::Isolate()
+{
+    // Packages parsed by one isolate get loaded from images by the others
+    sharePkgImages();
+
+    thread = std::thread(&Isolate::run, this);
+}
+
+Isolate::~Isolate()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        cond.notify_all();
+    }
+
+    thread.join();
+}
+
+void Isolate::post(Task task)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(task);
+    cond.notify_all();
+}
+
+void Isolate::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return tasks.empty() && !busy; });
+
+    if (errorMsg != "")
+    {
+        auto msg = errorMsg;
+        errorMsg = "";
+        throw RunError(msg);
+    }
+}
+
+void Isolate::run()
+{
+    initInterp();
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for (;;)
+    {
+        cond.wait(lock, [this] { return !tasks.empty() || stopping; });
+        if (tasks.empty())
+            break;
+
+        auto task = tasks.front();
+        tasks.pop_front();
+        busy = true;
+        lock.unlock();
+
+        std::string msg;
+        try
+        {
+            task();
+        }
+        catch (RunError& err)
+        {
+            msg = err.toString();
+        }
+        catch (std::exception& err)
+        {
+            msg = err.what();
+        }
+
+        lock.lock();
+
+        if (msg != "" && errorMsg == "")
+            errorMsg = msg;
+
+        busy = false;
+        cond.notify_all();
+    }
+
+    lock.unlock();
+
+    // The heap and the other thread-local state go with the thread
+    shutdownInterp();
+}
+
+void testIsolate()
+{
+    std::cout << "isolates" << std::endl;
+
+    const size_t NUM_ISOLATES = 4;
+
+    // Each isolate loads and runs the same package, collecting
+    // garbage on its own heap
+    std::vector<Value> results(NUM_ISOLATES);
+    {
+        std::vector<std::unique_ptr<Isolate>> isolates;
+
+        for (size_t i = 0; i < NUM_ISOLATES; ++i)
+        {
+            isolates.emplace_back(new Isolate());
+            isolates[i]->post([&results, i]
+            {
+                auto pkg = load("tests/vm/ex_fibonacci.zim");
+                GCRoot pkgRoot(pkg);
+                gcCollect();
+                results[i] = callExportFn(pkg, "main");
+            });
+        }
+
+        for (auto& isolate : isolates)
+            isolate->wait();
+    }
+
+    for (auto result : results)
+        assert (result == Value::int32(377));
+
+    // Errors are reported to the thread waiting on the isolate
+    Isolate isolate;
+    isolate.post([] { load("tests/vm/non_existent_file.zim"); });
+
+    bool caught = false;
+    try
+    {
+        isolate.wait();
+    }
+    catch (RunError& err)
+    {
+        caught = err.toString().find("non_existent_file") != std::string::npos;
+    }
+    assert (caught);
+    (void)caught;
+
+    // The isolate keeps running tasks after an error
+    Value result;
+    isolate.post([&result] { result = Value::int32(String("foo").length()); });
+    isolate.wait();
+    assert (result == Value::int32(3));
+}
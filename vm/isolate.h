@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+Isolated instance of the VM, running on a thread of its own. All of
+the VM state is thread-local: the heap, the string pool, the object
+shapes, the code heap and the stack, the package cache, and the
+inline caches of the interpreter. Isolates therefore share no mutable
+state and run in parallel without locking, but values can't be passed
+from one isolate to another, only copied by serializing them.
+
+The main thread is an isolate too. What isolates share is immutable:
+the host functions, and the images of packages parsed from source,
+so that each package only gets parsed once in a process.
+*/
+class Isolate
+{
+public:
+
+    typedef std::function<void()> Task;
+
+    /// Start an isolate on a new thread
+    Isolate();
+
+    /// Run the queued tasks, then free the isolate and its thread
+    ~Isolate();
+
+    Isolate(const Isolate&) = delete;
+    Isolate& operator = (const Isolate&) = delete;
+
+    /// Queue a task to run in the isolate, tasks run in order
+    void post(Task task);
+
+    /**
+    Wait until the queued tasks are done. If a task failed with a run-time
+    error or an exception, the first such error is thrown again here.
+    */
+    void wait();
+
+private:
+
+    void run();
+
+    std::mutex mutex;
+
+    std::condition_variable cond;
+
+    /// Tasks not yet started
+    std::deque<Task> tasks;
+
+    /// Whether a task is running
+    bool busy = false;
+
+    /// Set when the isolate should stop once its tasks are done
+    bool stopping = false;
+
+    /// Message of the first error thrown by a task, if any
+    std::string errorMsg;
+
+    std::thread thread;
+};
+
+/// Unit test for isolates
+void testIsolate();
@@ -2,11 +2,55 @@
 #include <cstring>
 #include <iostream>
 #include <exception>
+#include <memory>
+#include <sys/resource.h>
 #include "parser.h"
+#include "serialize.h"
 #include "interp.h"
+#include "isolate.h"
 #include "packages.h"
+#include "gc.h"
+#include "simd.h"
+#include "specialize.h"
 #include "opt_parser.h"
 
+/**
+Print timing and memory statistics on stderr, as a JSON object
+following a "zeta-stats" tag. The time spent loading packages, which
+includes parsing source files, is reported apart from the run time.
+The heap and native code heap figures are those of the main isolate.
+The native code heap has a fixed size, and versions left to the
+interpreter while it is full are counted as jit_skipped.
+*/
+void printStats()
+{
+    auto totalMs = getTimeMs();
+    auto loadMs = getLoadTimeMs();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    auto jitStats = getJitStats();
+
+    fprintf(
+        stderr,
+        "zeta-stats {\"total_ms\": %.3f, \"load_ms\": %.3f, \"run_ms\": %.3f, "
+        "\"peak_rss_kb\": %ld, \"heap_bytes\": %zu, \"heap_peak_bytes\": %zu, "
+        "\"alloc_bytes\": %llu, \"gc_count\": %zu, "
+        "\"jit_heap_bytes\": %zu, \"jit_skipped\": %zu}\n",
+        totalMs,
+        loadMs,
+        totalMs - loadMs,
+        (long)usage.ru_maxrss,
+        vm.allocated(),
+        vm.peakAllocated(),
+        (unsigned long long)vm.totalAllocated(),
+        gcCount(),
+        jitStats.heapBytes,
+        jitStats.numSkipped
+    );
+}
+
 int runPkgMain(
     Object pkg,
     std::string pkgName,
@@ -64,13 +108,112 @@ int runPkgMain(
     return (int32_t)retVal;
 }
 
+/// Import or load a package and run its main function
+int runProgram(std::string pkgName, std::vector<std::string> progArgs)
+{
+    // Try importing and running the package
+    try
+    {
+        auto pkg = import(pkgName);
+        return runPkgMain(pkg, pkgName, progArgs);
+    }
+
+    // If the package failed to import
+    catch (ImportError e)
+    {
+        // Try loading the package as a local file
+        auto pkg = load(pkgName);
+
+        // This package is not in the package cache, so
+        // it must be kept alive explicitly
+        GCRoot pkgRoot(pkg);
+
+        // Initialize the package
+        if (pkg.hasField("init"))
+            callExportFn(pkg, "init");
+
+        return runPkgMain(pkg, pkgName, progArgs);
+    }
+}
+
+/**
+Run a program in several isolates at once, the main thread being
+one of them. Returns the first non-zero exit status, if any.
+*/
+int runIsolates(size_t numIsolates, std::string pkgName, std::vector<std::string> progArgs)
+{
+    std::vector<int> statuses(numIsolates, 0);
+    std::vector<std::unique_ptr<Isolate>> isolates;
+
+    for (size_t i = 1; i < numIsolates; ++i)
+    {
+        isolates.emplace_back(new Isolate());
+        isolates.back()->post([&statuses, i, pkgName, progArgs]
+        {
+            statuses[i] = runProgram(pkgName, progArgs);
+        });
+    }
+
+    statuses[0] = runProgram(pkgName, progArgs);
+
+    for (auto& isolate : isolates)
+    {
+        try
+        {
+            isolate->wait();
+        }
+        catch (RunError& e)
+        {
+            std::cout << "ERROR: " << e.toString() << std::endl;
+            statuses[0] = statuses[0]? statuses[0]:-1;
+        }
+    }
+
+    for (auto status : statuses)
+        if (status != 0)
+            return status;
+
+    return 0;
+}
+
+/// Prints statistics when main returns, while the heap of the main
+/// isolate is still alive, as it goes away with the thread-local state
+struct StatsPrinter
+{
+    bool enabled = false;
+
+    ~StatsPrinter()
+    {
+        if (enabled)
+            printStats();
+    }
+};
+
 int main(int argc, char** argv)
 {
     BoolOpt test('t', "test", false, "runs unit tests");
     BoolOpt help('h', "help", false, "prints this help message.");
+    BoolOpt noJit("no-jit", false, "disables native code generation");
+    BoolOpt noParseCache("no-parse-cache", false, "disables the on-disk cache of parsed packages");
+    BoolOpt prefetchPkgs("prefetch", false, "reads the imported packages in parallel");
+    BoolOpt stats("stats", false, "prints timing and memory statistics at exit");
+    UintOpt isolates("isolates", 1, "runs the program in this many isolates in parallel");
+    BoolOpt profile("profile", false, "prints an execution profile at exit");
+    StrOpt profileStacks("profile-stacks", "", "writes sampled call stacks for flame graphs to a file");
+    StrOpt binImage("bin-image", "", "writes the package to a binary image file instead of running it");
     OptParser parser;
     parser.add(test);
     parser.add(help);
+    parser.add(noJit);
+    parser.add(noParseCache);
+    parser.add(prefetchPkgs);
+    parser.add(stats);
+    parser.add(isolates);
+    parser.add(profile);
+    parser.add(profileStacks);
+    parser.add(binImage);
+
+    StatsPrinter statsPrinter;
 
     try
     {
@@ -85,37 +228,48 @@ int main(int argc, char** argv)
 
         initInterp();
 
+        if (noJit())
+            disableJit();
+
+        if (noParseCache())
+            disableParseCache();
+
+        statsPrinter.enabled = stats();
+
+        if (profile() || profileStacks.get() != "")
+            enableProfiling(profileStacks.get());
+
         // If we are in test mode
         if (test())
         {
             testRuntime();
+            testSimd();
             testParser();
+            testSerialize();
             testInterp();
+            testSpecialize();
+            testIsolate();
             testOptParser();
             return 0;
         }
 
         auto pkgName = parser.getProgramName();
 
-        // Try importing and running the package
-        try
+        // If we are converting a package into a binary image
+        if (binImage.get() != "")
         {
-            auto pkg = import(pkgName);
-            return runPkgMain(pkg, pkgName, parser.getProgramArgs());
+            auto pkg = load(pkgName);
+            writeBinImage(binImage.get(), pkg);
+            return 0;
         }
 
-        // If the package failed to import
-        catch (ImportError e)
-        {
-            // Try loading the package as a local file
-            auto pkg = load(pkgName);
+        if (prefetchPkgs())
+            prefetch(pkgName);
 
-            // Initialize the package
-            if (pkg.hasField("init"))
-                callExportFn(pkg, "init");
+        if (isolates.get() > 1)
+            return runIsolates(isolates.get(), pkgName, parser.getProgramArgs());
 
-            return runPkgMain(pkg, pkgName, parser.getProgramArgs());
-        }
+        return runProgram(pkgName, parser.getProgramArgs());
     }
 
     catch (ParseException& e)
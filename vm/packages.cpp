@@ -1,12 +1,27 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "util.h"
 #include "packages.h"
 #include "parser.h"
 #include "serialize.h"
 #include "interp.h"
+#include "isolate.h"
+#include "gc.h"
+#include "simd.h"
+#include "specialize.h"
 
 #ifdef HAVE_SDL2
 #include <SDL.h>
@@ -16,6 +31,15 @@ HostFn::HostFn(std::string name, size_t numParams, void* fptr)
 : name(name),
   numParams(numParams),
   fptr(fptr)
+{
+    // Functions with more parameters take them as HostArgs
+    assert (numParams <= 3);
+}
+
+HostFn::HostFn(std::string name, size_t numParams, HostFnArgs argsFptr)
+: name(name),
+  numParams(numParams),
+  argsFptr(argsFptr)
 {
 }
 
@@ -51,20 +75,60 @@ Value HostFn::call3(Value arg0, Value arg1, Value arg2)
     return f3(arg0, arg1, arg2);
 }
 
+void addHostFn(Object pkgObj, HostFn* fnObj)
+{
+    auto fnVal = Value((refptr)fnObj, TAG_HOSTFN);
+
+    auto nameStr = String(fnObj->getName());
+
+    assert (!pkgObj.hasField(nameStr));
+
+    pkgObj.setField(nameStr, fnVal);
+}
+
 void setHostFn(
     Object pkgObj,
-    std::string name,
+    const char* name,
     size_t numParams,
     void* fptr
 )
 {
-    auto fnObj = new HostFn(name, numParams, fptr);
+    addHostFn(pkgObj, new HostFn(name, numParams, fptr));
+}
 
-    auto fnVal = Value((refptr)fnObj, TAG_HOSTFN);
+void setHostFn(
+    Object pkgObj,
+    const char* name,
+    size_t numParams,
+    HostFnArgs argsFptr
+)
+{
+    addHostFn(pkgObj, new HostFn(name, numParams, argsFptr));
+}
 
-    assert (!pkgObj.hasField(name));
+/// Export a host function with typed parameters, see HostThunk
+#define SET_TYPED_HOST_FN(pkgObj, name, fn)             \
+    setHostFn(                                          \
+        pkgObj,                                         \
+        name,                                           \
+        HostThunk<decltype(&fn), &fn>::NUM_PARAMS,      \
+        HostThunk<decltype(&fn), &fn>::call             \
+    )
 
-    pkgObj.setField(name, fnVal);
+Object newErrorObj(std::string msg)
+{
+    auto errObj = Object::newObject();
+    errObj.setField("msg", String(msg));
+    return errObj;
+}
+
+/// Time at which the VM started
+static auto vmStartTime = std::chrono::steady_clock::now();
+
+double getTimeMs()
+{
+    auto elapsed = std::chrono::steady_clock::now() - vmStartTime;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
 }
 
 //============================================================================
@@ -97,12 +161,82 @@ namespace core_vm_0
         return String(str);
     }
 
+    /// Serialize data into a ZIM file, without building the output in memory
+    Value serialize_to_file(Value val, Value fileName, Value minify)
+    {
+        if (!fileName.isString())
+            throw RunError("serialize_to_file expects a file name string");
+
+        serializeToFile((std::string)fileName, val, minify == Value::TRUE);
+        return Value::UNDEF;
+    }
+
+    /// Trigger a full garbage collection
+    Value gc_collect()
+    {
+        gcCollect();
+        return Value::UNDEF;
+    }
+
+    /// Get the number of garbage collections performed so far
+    Value gc_count()
+    {
+        return Value::int32((int32_t)gcCount());
+    }
+
+    /// Get the number of bytes allocated in the heap
+    Value heap_size()
+    {
+        return Value::int32((int32_t)std::min(vm.allocated(), size_t(INT32_MAX)));
+    }
+
+    /// Get the time elapsed since the VM started, in milliseconds
+    Value time_ms()
+    {
+        return Value::float32(float(getTimeMs()));
+    }
+
+    /// Freeze an object so that its fields can no longer be changed,
+    /// returns the object. Nested objects are not frozen.
+    Value freeze(Value obj)
+    {
+        if (!obj.isObject())
+            throw RunError("freeze expects an object");
+
+        Object(obj).freeze();
+        return obj;
+    }
+
+    Value is_frozen(Value obj)
+    {
+        bool frozen = obj.isObject() && Object(obj).isFrozen();
+        return frozen? Value::TRUE:Value::FALSE;
+    }
+
+    /// Specialize a function for constant values of some of its
+    /// parameters, given as an object mapping names to values
+    Value specialize(Value fun, Value args)
+    {
+        if (!fun.isObject() || !args.isObject())
+            throw RunError("specialize expects a function and an object");
+
+        return ::specialize(Object(fun), Object(args));
+    }
+
     Value get_pkg()
     {
         auto exports = Object::newObject(32);
         setHostFn(exports, "import"       , 1, (void*)import);
         setHostFn(exports, "parse"        , 1, (void*)parse);
         setHostFn(exports, "serialize"    , 2, (void*)serialize);
+        setHostFn(exports, "serialize_to_file", 3, (void*)serialize_to_file);
+        setHostFn(exports, "gc_collect"   , 0, (void*)gc_collect);
+        setHostFn(exports, "gc_count"     , 0, (void*)gc_count);
+        setHostFn(exports, "heap_size"    , 0, (void*)heap_size);
+        setHostFn(exports, "time_ms"      , 0, (void*)time_ms);
+        setHostFn(exports, "freeze"       , 1, (void*)freeze);
+        setHostFn(exports, "is_frozen"    , 1, (void*)is_frozen);
+        setHostFn(exports, "specialize"   , 2, (void*)specialize);
         return exports;
     }
 };
@@ -115,25 +249,19 @@ HostFn importFn("import", 1, (void*)core_vm_0::import);
 
 namespace core_io_0
 {
-    Value print_int32(Value val)
+    void print_int32(int32_t val)
     {
-        assert (val.isInt32());
-        std::cout << (int32_t)val;
-        return Value::UNDEF;
+        std::cout << val;
     }
 
-    Value print_float32(Value val)
+    void print_float32(float val)
     {
-        assert (val.isFloat32());
-        std::cout << (float)val;
-        return Value::UNDEF;
+        std::cout << val;
     }
 
-    Value print_str(Value val)
+    void print_str(String str)
     {
-        assert (val.isString());
-        std::cout << (std::string)val;
-        return Value::UNDEF;
+        std::cout << (std::string)str;
     }
 
     Value read_file(Value fileName)
@@ -141,7 +269,7 @@ namespace core_io_0
         assert (fileName.isString());
         auto nameStr = (std::string)fileName;
 
-        FILE* file = fopen(nameStr.c_str(), "r");
+        FILE* file = fopen(nameStr.c_str(), "rb");
 
         if (!file)
         {
@@ -153,23 +281,20 @@ namespace core_io_0
         size_t len = ftell(file);
         fseek(file, 0, SEEK_SET);
 
-        char* buf = (char*)malloc(len+1);
-
-        // Read into the allocated buffer
+        // Read directly into a string which isn't interned
+        auto str = String::alloc(len);
+        auto buf = (char*)((refptr)str + String::OF_DATA);
         size_t read = fread(buf, 1, len, file);
 
+        // Close the input file
+        fclose(file);
+
         if (read != len)
         {
             throw RunError("failed to read file \"" + nameStr + "\"");
         }
 
-        // Add a null terminator to the string
-        buf[len] = '\0';
-
-        // Close the input file
-        fclose(file);
-
-        return String(buf);
+        return str;
     }
 
     Value write_file(Value fileName, Value data)
@@ -200,49 +325,1097 @@ namespace core_io_0
         return Value::TRUE;
     }
 
-    Value read_line()
+    /// Size of the buffers of opened files
+    const size_t FILE_BUF_SIZE = 1 << 16;
+
+    /**
+    Files opened by the current isolate, indexed by handle. Handles 0, 1
+    and 2 are the standard input, output and error streams. Files left
+    open are closed, and their writes flushed, when the isolate ends.
+    */
+    struct FileTable
     {
-        char* lineBuf = nullptr;
-        size_t bufSize = 0;
+        std::vector<FILE*> files = { stdin, stdout, stderr };
 
-        auto numRead = getdelim(&lineBuf, &bufSize, '\n', stdin);
+        ~FileTable()
+        {
+            for (size_t i = 3; i < files.size(); ++i)
+                if (files[i])
+                    fclose(files[i]);
+        }
+    };
 
-        if (numRead <= 0)
+    thread_local FileTable fileTable;
+
+    /// Buffer lines are read into
+    thread_local char* lineBuf = nullptr;
+    thread_local size_t lineBufSize = 0;
+
+    FILE* getFile(int32_t handle)
+    {
+        auto& files = fileTable.files;
+
+        if (handle < 0 || size_t(handle) >= files.size() || !files[handle])
+            throw RunError("invalid file handle");
+
+        return files[handle];
+    }
+
+    /**
+    Open a file, with a mode of "r" (read), "w" (write) or "a" (append).
+    Returns a handle to pass to the other file functions.
+    */
+    int32_t open_file(String fileName, String mode)
+    {
+        auto nameStr = (std::string)fileName;
+
+        const char* modeStr;
+        if (mode == "r")
+            modeStr = "rb";
+        else if (mode == "w")
+            modeStr = "wb";
+        else if (mode == "a")
+            modeStr = "ab";
+        else
+            throw RunError("invalid file mode \"" + (std::string)mode + "\"");
+
+        FILE* file = fopen(nameStr.c_str(), modeStr);
+
+        if (!file)
         {
-            free(lineBuf);
+            throw RunError("failed to open file \"" + nameStr + "\"");
+        }
+
+        setvbuf(file, nullptr, _IOFBF, FILE_BUF_SIZE);
+
+        // Reuse the handles of closed files
+        auto& files = fileTable.files;
+        for (size_t i = 3; i < files.size(); ++i)
+        {
+            if (!files[i])
+            {
+                files[i] = file;
+                return i;
+            }
+        }
+
+        files.push_back(file);
+        return files.size() - 1;
+    }
+
+    /// Close a file, flushing its writes
+    void close_file(int32_t handle)
+    {
+        auto file = getFile(handle);
+
+        if (handle < 3)
+            throw RunError("cannot close the standard streams");
+
+        fileTable.files[handle] = nullptr;
+
+        if (fclose(file) != 0)
+            throw RunError("failed to close file");
+    }
+
+    /// Read up to a given number of bytes from a file
+    /// Returns undefined at the end of the file
+    Value read_chunk(int32_t handle, int32_t maxBytes)
+    {
+        auto file = getFile(handle);
+
+        if (maxBytes <= 0)
+            throw RunError("read_chunk expects a positive size");
+
+        // Read into a buffer first, since fewer bytes may be available
+        thread_local std::vector<char> buf;
+        buf.resize(maxBytes);
+        auto numRead = fread(buf.data(), 1, maxBytes, file);
+
+        if (numRead == 0)
+        {
+            if (ferror(file))
+                throw RunError("failed to read file");
             return Value::UNDEF;
         }
 
+        auto str = String::alloc(numRead);
+        memcpy((refptr)str + String::OF_DATA, buf.data(), numRead);
+        return str;
+    }
+
+    /// Read a line from a file, without its end of line characters
+    /// Returns undefined at the end of the file
+    Value read_file_line(int32_t handle)
+    {
+        auto file = getFile(handle);
+
+        auto numRead = getdelim(&lineBuf, &lineBufSize, '\n', file);
+
+        if (numRead <= 0)
+            return Value::UNDEF;
+
         // Clear trailing end of line characters
-        for (ssize_t i = 0; i < numRead; ++i)
+        size_t len = numRead;
+        while (len > 0 && (lineBuf[len - 1] == '\n' || lineBuf[len - 1] == '\r'))
+            len--;
+
+        auto str = String::alloc(len);
+        memcpy((refptr)str + String::OF_DATA, lineBuf, len);
+        return str;
+    }
+
+    /// Read a line from the standard input
+    Value read_line()
+    {
+        return read_file_line(0);
+    }
+
+    /// Write a string to a file, the writes are buffered
+    void write_str(int32_t handle, String str)
+    {
+        auto file = getFile(handle);
+
+        // Keep the output in order with what std::cout printed
+        if (file == stdout)
+            std::cout.flush();
+
+        auto len = str.length();
+        if (fwrite(str.getDataPtr(), 1, len, file) != len)
+            throw RunError("failed to write file");
+    }
+
+    /// Write the buffered data of a file
+    void flush_file(int32_t handle)
+    {
+        if (fflush(getFile(handle)) != 0)
+            throw RunError("failed to write file");
+    }
+
+    /**
+    Map a file into memory, as an array of uint8 bytes. The file is read
+    lazily, as the array gets accessed, and writes to the array are not
+    written back. The file must not be truncated while the array is live.
+    */
+    Value map_file(String fileName)
+    {
+        return Array::mapFile(fileName);
+    }
+
+    Value get_pkg()
+    {
+        auto exports = Object::newObject(32);
+        SET_TYPED_HOST_FN(exports, "print_int32", print_int32);
+        SET_TYPED_HOST_FN(exports, "print_float32", print_float32);
+        SET_TYPED_HOST_FN(exports, "print_str", print_str);
+        setHostFn(exports, "read_file"    , 1, (void*)read_file);
+        setHostFn(exports, "write_file"   , 2, (void*)write_file);
+        setHostFn(exports, "read_line"    , 0, (void*)read_line);
+        exports.setField("stdin", Value::int32(0));
+        exports.setField("stdout", Value::int32(1));
+        exports.setField("stderr", Value::int32(2));
+        SET_TYPED_HOST_FN(exports, "open_file", open_file);
+        SET_TYPED_HOST_FN(exports, "close_file", close_file);
+        SET_TYPED_HOST_FN(exports, "read_chunk", read_chunk);
+        SET_TYPED_HOST_FN(exports, "read_file_line", read_file_line);
+        SET_TYPED_HOST_FN(exports, "write_str", write_str);
+        SET_TYPED_HOST_FN(exports, "flush_file", flush_file);
+        SET_TYPED_HOST_FN(exports, "map_file", map_file);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/array/0 package
+//============================================================================
+
+namespace core_array_0
+{
+    Value newTyped(ElemType type, Value lenVal)
+    {
+        if (!lenVal.isInt32() || (int32_t)lenVal < 0)
+            throw RunError("typed array length must be a non-negative int32");
+
+        return Array::newTyped(type, (int32_t)lenVal);
+    }
+
+    /// Create a zero-filled array of int32 elements
+    Value new_int32(Value len)
+    {
+        return newTyped(ELEM_INT32, len);
+    }
+
+    /// Create a zero-filled array of float32 elements
+    Value new_float32(Value len)
+    {
+        return newTyped(ELEM_FLOAT32, len);
+    }
+
+    /// Create a zero-filled array of uint8 elements
+    Value new_uint8(Value len)
+    {
+        return newTyped(ELEM_UINT8, len);
+    }
+
+    /// Create a zero-filled array of int16 elements
+    Value new_int16(Value len)
+    {
+        return newTyped(ELEM_INT16, len);
+    }
+
+    /// Get the element type of an array, as a string
+    Value elem_type(Value arrVal)
+    {
+        if (!arrVal.isArray())
+            throw RunError("elem_type expects an array");
+
+        return String(elemTypeToStr(Array(arrVal).getElemType()));
+    }
+
+    /// Error thrown by copy, allocated once with the package
+    thread_local Value rangeError;
+
+    /**
+    Copy count elements from src starting at srcIdx to dst starting at
+    dstIdx. The arrays may be the same, with overlapping ranges.
+    */
+    Value copy(HostArgs args)
+    {
+        auto dst = fromHostArg<Array>(args[0]);
+        auto dstIdx = fromHostArg<int32_t>(args[1]);
+        auto src = fromHostArg<Array>(args[2]);
+        auto srcIdx = fromHostArg<int32_t>(args[3]);
+        auto count = fromHostArg<int32_t>(args[4]);
+
+        if (dstIdx < 0 || srcIdx < 0 || count < 0 ||
+            size_t(dstIdx) + count > dst.length() ||
+            size_t(srcIdx) + count > src.length())
+        {
+            throw HostThrow(rangeError);
+        }
+
+        auto type = dst.getElemType();
+
+        // Typed arrays of the same type are copied in bulk
+        if (type != ELEM_VALUE && type == src.getElemType())
+        {
+            auto elemSize = Array::elemSize(type);
+            memmove(
+                dst.getElemPtr() + dstIdx * elemSize,
+                src.getElemPtr() + srcIdx * elemSize,
+                count * elemSize
+            );
+            return Value::UNDEF;
+        }
+
+        // Copy in the direction which doesn't overwrite the source first
+        if (dstIdx <= srcIdx)
+        {
+            for (int32_t i = 0; i < count; ++i)
+                dst.setElem(dstIdx + i, src.getElem(srcIdx + i));
+        }
+        else
         {
-            size_t idx = numRead - 1 - i;
+            for (int32_t i = count - 1; i >= 0; --i)
+                dst.setElem(dstIdx + i, src.getElem(srcIdx + i));
+        }
+
+        return Value::UNDEF;
+    }
+
+    /**
+    Get a new array with the elements from start (inclusive) to end
+    (exclusive). The result is an array of values, whatever the type of
+    the source array.
+    */
+    Value slice(Array arr, int32_t start, int32_t end)
+    {
+        if (end <= start)
+            return Array(0);
+
+        if (start < 0 || uint32_t(end) > arr.length())
+            throw RunError("slice index out of range");
+
+        Array result(end - start);
+        for (int32_t i = start; i < end; ++i)
+            result.push(arr.getElem(i));
+
+        return result;
+    }
+
+    /// Get a new array with the elements of a followed by those of b
+    Value concat(Array a, Array b)
+    {
+        auto lenA = a.length();
+        auto lenB = b.length();
+
+        Array result(lenA + lenB);
+        for (size_t i = 0; i < lenA; ++i)
+            result.push(a.getElem(i));
+        for (size_t i = 0; i < lenB; ++i)
+            result.push(b.getElem(i));
+
+        return result;
+    }
+
+    Value get_pkg()
+    {
+        rangeError = newErrorObj("array copy out of range");
+
+        auto exports = Object::newObject(32);
+        exports.setField("range_error", rangeError);
+        setHostFn(exports, "copy"         , 5, copy);
+        setHostFn(exports, "new_int32"    , 1, (void*)new_int32);
+        setHostFn(exports, "new_float32"  , 1, (void*)new_float32);
+        setHostFn(exports, "new_uint8"    , 1, (void*)new_uint8);
+        setHostFn(exports, "new_int16"    , 1, (void*)new_int16);
+        setHostFn(exports, "elem_type"    , 1, (void*)elem_type);
+        SET_TYPED_HOST_FN(exports, "slice", slice);
+        SET_TYPED_HOST_FN(exports, "concat", concat);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/string/0 package
+//============================================================================
+
+/**
+Native string operations, which the std/string library delegates to.
+Results are built into a single flat string, allocated once its length
+is known, instead of being concatenated one character at a time.
+Indices are byte offsets, as with the string instructions.
+*/
+namespace core_string_0
+{
+    /// Get the characters of a string allocated with String::alloc
+    char* chars(String str)
+    {
+        return (char*)((refptr)str + String::OF_DATA);
+    }
+
+    /// Copy a range of characters into a new string
+    String newString(const char* src, size_t len)
+    {
+        auto str = String::alloc(len);
+        memcpy(chars(str), src, len);
+        return str;
+    }
+
+    /// Find the first occurrence of a needle in a range of characters,
+    /// returns nullptr if there is none
+    const char* find(
+        const char* hay,
+        size_t hayLen,
+        const char* needle,
+        size_t needleLen
+    )
+    {
+        if (needleLen == 1)
+            return (const char*)memchr(hay, needle[0], hayLen);
+
+        return (const char*)memmem(hay, hayLen, needle, needleLen);
+    }
+
+    /// Get the index of the first occurrence of a needle at or after
+    /// a start index, or -1 if there is none
+    int32_t index_of(String str, String needle, int32_t start)
+    {
+        auto len = str.length();
+
+        if (start < 0 || uint32_t(start) > len)
+            throw RunError("index_of, start index out of range");
+
+        auto needleLen = needle.length();
+        if (needleLen == 0)
+            return start;
+
+        auto data = str.getDataPtr();
+        auto pos = find(data + start, len - start, needle.getDataPtr(), needleLen);
+        return pos? int32_t(pos - data):-1;
+    }
+
+    /// Get the characters from start (inclusive) to end (exclusive)
+    Value substring(String str, int32_t start, int32_t end)
+    {
+        if (end <= start)
+            return String("");
+
+        if (start < 0 || uint32_t(end) > str.length())
+            throw RunError("substring index out of range");
+
+        if (start == 0 && uint32_t(end) == str.length())
+            return str;
+
+        return newString(str.getDataPtr() + start, end - start);
+    }
+
+    /**
+    Split a string at each occurrence of a delimiter. Empty strings
+    between consecutive delimiters are left out of the result.
+    */
+    Value split(String str, String delim)
+    {
+        auto len = str.length();
+        auto delimLen = delim.length();
+
+        if (len == 0)
+            return Array(0);
+        if (delimLen == 0)
+            throw RunError("split, empty delimiter");
 
-            if (lineBuf[idx] == '\n' || lineBuf[idx] == '\r')
+        auto data = str.getDataPtr();
+        auto delimData = delim.getDataPtr();
+        auto end = data + len;
+
+        // Count the parts first, so that the array is allocated once
+        size_t numParts = 0;
+        for (auto cur = data; cur < end;)
+        {
+            auto next = find(cur, end - cur, delimData, delimLen);
+            if (!next)
+                next = end;
+            if (next != cur)
+                numParts++;
+            cur = next + delimLen;
+        }
+
+        Array parts(numParts);
+        GCRoot partsRoot(parts);
+
+        // The characters don't move when the parts get allocated
+        for (auto cur = data; cur < end;)
+        {
+            auto next = find(cur, end - cur, delimData, delimLen);
+            if (!next)
+                next = end;
+            if (next != cur)
+                parts.push(newString(cur, next - cur));
+            cur = next + delimLen;
+        }
+
+        return parts;
+    }
+
+    /// Join an array of strings, with a delimiter between each of them
+    Value join(Array strs, String delim)
+    {
+        auto numStrs = strs.length();
+        if (numStrs == 0)
+            return String("");
+
+        // Flatten the strings before allocating the result,
+        // since flattening ropes allocates
+        size_t len = delim.length() * (numStrs - 1);
+        delim.getDataPtr();
+        for (size_t i = 0; i < numStrs; ++i)
+        {
+            auto elem = strs.getElem(i);
+            if (!elem.isString())
+                throw RunError("join expects an array of strings");
+            String(elem).getDataPtr();
+            len += String(elem).length();
+        }
+
+        auto result = String::alloc(len);
+        auto dst = chars(result);
+
+        for (size_t i = 0; i < numStrs; ++i)
+        {
+            if (i > 0)
             {
-                lineBuf[idx] = '\0';
+                memcpy(dst, delim.getDataPtr(), delim.length());
+                dst += delim.length();
             }
-            else
-            {
+
+            auto str = String(strs.getElem(i));
+            memcpy(dst, str.getDataPtr(), str.length());
+            dst += str.length();
+        }
+
+        return result;
+    }
+
+    /// Replace all occurrences of a needle by a replacement string
+    Value replace(String str, String needle, String repl)
+    {
+        auto len = str.length();
+        auto needleLen = needle.length();
+        auto replLen = repl.length();
+
+        if (needleLen == 0)
+            return str;
+
+        auto data = str.getDataPtr();
+        auto needleData = needle.getDataPtr();
+        auto replData = repl.getDataPtr();
+        auto end = data + len;
+
+        size_t numMatches = 0;
+        for (auto cur = data; (cur = find(cur, end - cur, needleData, needleLen));)
+        {
+            numMatches++;
+            cur += needleLen;
+        }
+
+        if (numMatches == 0)
+            return str;
+
+        auto result = String::alloc(len - numMatches * needleLen + numMatches * replLen);
+        auto dst = chars(result);
+
+        for (auto cur = data; cur < end;)
+        {
+            auto next = find(cur, end - cur, needleData, needleLen);
+            if (!next)
+                next = end;
+
+            memcpy(dst, cur, next - cur);
+            dst += next - cur;
+
+            if (next == end)
                 break;
+
+            memcpy(dst, replData, replLen);
+            dst += replLen;
+            cur = next + needleLen;
+        }
+
+        return result;
+    }
+
+    /// Map each ASCII character of a string through a function
+    Value mapChars(String str, int (*fn)(int))
+    {
+        auto len = str.length();
+        auto data = str.getDataPtr();
+        auto result = String::alloc(len);
+        auto dst = chars(result);
+
+        for (size_t i = 0; i < len; ++i)
+        {
+            auto c = data[i];
+            dst[i] = (c & 0x80)? c:char(fn(c));
+        }
+
+        return result;
+    }
+
+    Value to_lower(String str)
+    {
+        return mapChars(str, tolower);
+    }
+
+    Value to_upper(String str)
+    {
+        return mapChars(str, toupper);
+    }
+
+    /// Check that a radix is between 2 and 36
+    void checkRadix(const char* fnName, int32_t radix)
+    {
+        if (radix < 2 || radix > 36)
+            throw RunError(std::string(fnName) + ", radix must be between 2 and 36");
+    }
+
+    /**
+    Parse an integer in a given radix, with an optional minus sign.
+    Digits above 9 are letters, in either case. Throws an error if the
+    string isn't a valid int32.
+    */
+    int32_t parse_int(String str, int32_t radix)
+    {
+        checkRadix("parse_int", radix);
+
+        auto len = str.length();
+        auto data = str.getDataPtr();
+
+        size_t pos = 0;
+        bool negative = len > 0 && data[0] == '-';
+        if (negative)
+            pos++;
+
+        if (pos == len)
+            throw RunError("\"" + std::string(data, len) + "\" is not a number");
+
+        int64_t num = 0;
+        for (; pos < len; ++pos)
+        {
+            auto c = tolower((unsigned char)data[pos]);
+            int32_t digit = isdigit(c)? (c - '0'):isalpha(c)? (c - 'a' + 10):radix;
+
+            if (digit >= radix)
+            {
+                throw RunError(
+                    "character " + std::string(1, data[pos]) +
+                    " is not a numeral in base " + std::to_string(radix)
+                );
             }
+
+            num = num * radix + digit;
+            if (num > int64_t(INT32_MAX) + 1)
+                throw RunError("parse_int, number out of range");
         }
 
-        auto str = String(lineBuf);
-        free(lineBuf);
+        if (negative)
+            num = -num;
+        if (num > INT32_MAX)
+            throw RunError("parse_int, number out of range");
 
-        return str;
+        return int32_t(num);
+    }
+
+    /// Format an integer in a given radix, with lowercase letter digits
+    Value int_to_str(int32_t val, int32_t radix)
+    {
+        checkRadix("int_to_str", radix);
+
+        // Digits are produced from the least significant one
+        char buf[40];
+        auto end = buf + sizeof(buf);
+        auto cur = end;
+
+        int64_t num = val;
+        bool negative = num < 0;
+        if (negative)
+            num = -num;
+
+        do
+        {
+            auto digit = num % radix;
+            *--cur = char(digit < 10? ('0' + digit):('a' + digit - 10));
+            num /= radix;
+        } while (num != 0);
+
+        if (negative)
+            *--cur = '-';
+
+        return newString(cur, end - cur);
+    }
+
+    Value get_pkg()
+    {
+        auto exports = Object::newObject(32);
+        SET_TYPED_HOST_FN(exports, "index_of", index_of);
+        SET_TYPED_HOST_FN(exports, "substring", substring);
+        SET_TYPED_HOST_FN(exports, "split", split);
+        SET_TYPED_HOST_FN(exports, "join", join);
+        SET_TYPED_HOST_FN(exports, "replace", replace);
+        SET_TYPED_HOST_FN(exports, "to_lower", to_lower);
+        SET_TYPED_HOST_FN(exports, "to_upper", to_upper);
+        SET_TYPED_HOST_FN(exports, "parse_int", parse_int);
+        SET_TYPED_HOST_FN(exports, "int_to_str", int_to_str);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/simd/0 package
+//============================================================================
+
+namespace core_simd_0
+{
+    /// Check that a value is a typed array with a given element type
+    Array getArray(const char* fnName, Value val, ElemType type)
+    {
+        if (!val.isArray() || Array(val).getElemType() != type)
+        {
+            throw RunError(
+                std::string(fnName) + " expects " +
+                elemTypeToStr(type) + " arrays"
+            );
+        }
+
+        return Array(val);
+    }
+
+    /// Check that two arrays have the same length
+    size_t checkLength(const char* fnName, Array a, Array b)
+    {
+        if (a.length() != b.length())
+            throw RunError(std::string(fnName) + ", array lengths differ");
+
+        return a.length();
+    }
+
+    float getFloat(const char* fnName, Value val)
+    {
+        if (!val.isFloat32())
+            throw RunError(std::string(fnName) + " expects float32 scalars");
+
+        return (float)val;
+    }
+
+    float* floats(Array arr)
+    {
+        return (float*)arr.getElemPtr();
+    }
+
+    /// Binary element-wise operation dst = a op b
+    Value binOp(
+        const char* fnName,
+        void (*kernel)(float*, const float*, const float*, size_t),
+        Value dstVal,
+        Value aVal,
+        Value bVal
+    )
+    {
+        auto dst = getArray(fnName, dstVal, ELEM_FLOAT32);
+        auto a = getArray(fnName, aVal, ELEM_FLOAT32);
+        auto b = getArray(fnName, bVal, ELEM_FLOAT32);
+        checkLength(fnName, dst, a);
+        auto len = checkLength(fnName, dst, b);
+        kernel(floats(dst), floats(a), floats(b), len);
+        return Value::UNDEF;
+    }
+
+    Value add(Value dst, Value a, Value b)
+    {
+        return binOp("add", simdAdd, dst, a, b);
+    }
+
+    Value mul(Value dst, Value a, Value b)
+    {
+        return binOp("mul", simdMul, dst, a, b);
+    }
+
+    /// Multiply-add, dst = dst + a * b
+    Value fma(Value dst, Value a, Value b)
+    {
+        return binOp("fma", simdMulAdd, dst, a, b);
+    }
+
+    /// dst = src * k
+    Value scale(Value dstVal, Value srcVal, Value k)
+    {
+        auto dst = getArray("scale", dstVal, ELEM_FLOAT32);
+        auto src = getArray("scale", srcVal, ELEM_FLOAT32);
+        auto len = checkLength("scale", dst, src);
+        simdScale(floats(dst), floats(src), getFloat("scale", k), len);
+        return Value::UNDEF;
+    }
+
+    /// Clamp the elements of an array in place
+    Value clamp(Value arrVal, Value lo, Value hi)
+    {
+        auto arr = getArray("clamp", arrVal, ELEM_FLOAT32);
+        simdClamp(
+            floats(arr),
+            getFloat("clamp", lo),
+            getFloat("clamp", hi),
+            arr.length()
+        );
+        return Value::UNDEF;
+    }
+
+    Value f32_to_u8(Value dstVal, Value srcVal)
+    {
+        auto dst = getArray("f32_to_u8", dstVal, ELEM_UINT8);
+        auto src = getArray("f32_to_u8", srcVal, ELEM_FLOAT32);
+        auto len = checkLength("f32_to_u8", dst, src);
+        simdF32ToU8(dst.getElemPtr(), floats(src), len);
+        return Value::UNDEF;
+    }
+
+    Value u8_to_f32(Value dstVal, Value srcVal)
+    {
+        auto dst = getArray("u8_to_f32", dstVal, ELEM_FLOAT32);
+        auto src = getArray("u8_to_f32", srcVal, ELEM_UINT8);
+        auto len = checkLength("u8_to_f32", dst, src);
+        simdU8ToF32(floats(dst), src.getElemPtr(), len);
+        return Value::UNDEF;
+    }
+
+    Value f32_to_i16(Value dstVal, Value srcVal)
+    {
+        auto dst = getArray("f32_to_i16", dstVal, ELEM_INT16);
+        auto src = getArray("f32_to_i16", srcVal, ELEM_FLOAT32);
+        auto len = checkLength("f32_to_i16", dst, src);
+        simdF32ToI16((int16_t*)dst.getElemPtr(), floats(src), len);
+        return Value::UNDEF;
+    }
+
+    Value i16_to_f32(Value dstVal, Value srcVal)
+    {
+        auto dst = getArray("i16_to_f32", dstVal, ELEM_FLOAT32);
+        auto src = getArray("i16_to_f32", srcVal, ELEM_INT16);
+        auto len = checkLength("i16_to_f32", dst, src);
+        simdI16ToF32(floats(dst), (int16_t*)src.getElemPtr(), len);
+        return Value::UNDEF;
+    }
+
+    Value sum(Value arrVal)
+    {
+        auto arr = getArray("sum", arrVal, ELEM_FLOAT32);
+        return Value::float32(simdSum(floats(arr), arr.length()));
+    }
+
+    Value min(Value arrVal)
+    {
+        auto arr = getArray("min", arrVal, ELEM_FLOAT32);
+        if (arr.length() == 0)
+            throw RunError("min of an empty array");
+        return Value::float32(simdMin(floats(arr), arr.length()));
+    }
+
+    Value max(Value arrVal)
+    {
+        auto arr = getArray("max", arrVal, ELEM_FLOAT32);
+        if (arr.length() == 0)
+            throw RunError("max of an empty array");
+        return Value::float32(simdMax(floats(arr), arr.length()));
+    }
+
+    /// Get the name of the instruction set used
+    Value isa()
+    {
+        return String(simdIsa());
+    }
+
+    Value get_pkg()
+    {
+        auto exports = Object::newObject(32);
+        setHostFn(exports, "add"          , 3, (void*)add);
+        setHostFn(exports, "mul"          , 3, (void*)mul);
+        setHostFn(exports, "fma"          , 3, (void*)fma);
+        setHostFn(exports, "scale"        , 3, (void*)scale);
+        setHostFn(exports, "clamp"        , 3, (void*)clamp);
+        setHostFn(exports, "f32_to_u8"    , 2, (void*)f32_to_u8);
+        setHostFn(exports, "u8_to_f32"    , 2, (void*)u8_to_f32);
+        setHostFn(exports, "f32_to_i16"   , 2, (void*)f32_to_i16);
+        setHostFn(exports, "i16_to_f32"   , 2, (void*)i16_to_f32);
+        setHostFn(exports, "sum"          , 1, (void*)sum);
+        setHostFn(exports, "min"          , 1, (void*)min);
+        setHostFn(exports, "max"          , 1, (void*)max);
+        setHostFn(exports, "isa"          , 0, (void*)isa);
+        return exports;
+    }
+}
+
+//============================================================================
+// core/parallel/0 package
+//============================================================================
+
+/**
+Parallel loops in the SPMD style: a kernel function runs once for each
+index of a typed output array, on several threads, and its results are
+written into the output array. The calling thread takes part in the loop,
+with worker isolates running on the other threads. Threads take chunks
+of indices from a shared counter, so that faster threads do more of them.
+
+Each thread runs a private copy of the kernel, and of all the objects it
+references, including the globals of its package. Kernels therefore can't
+mutate shared objects: their writes only change their own copies, and are
+lost once the loop is done. The result of a kernel must only depend on its
+argument, and the only effect of a loop is on its output array.
+*/
+namespace core_parallel_0
+{
+    /// Average number of chunks each thread runs, for load balancing
+    const size_t CHUNKS_PER_THREAD = 8;
+
+    /// Number of threads loops run on, the calling one included
+    std::atomic<size_t> numThreads(std::max(1u, std::thread::hardware_concurrency()));
+
+    /// Isolates running loops on the other threads, created as needed.
+    /// These are never freed, since a program may exit from one of them.
+    std::mutex workersMutex;
+    std::vector<Isolate*> workers;
+
+    /// Set while the current thread runs a kernel, nested loops
+    /// then run on this thread only
+    thread_local bool inKernel = false;
+
+    /// Parallel loop, shared by the threads running it
+    struct Loop
+    {
+        /// Image of the kernel and of everything it references
+        std::string image;
+
+        HostFnTable hostFns;
+
+        /// Raw elements of the output array, and of the input array if any
+        uint8_t* outData;
+        ElemType outType;
+        const uint8_t* srcData = nullptr;
+        ElemType srcType = ELEM_VALUE;
+
+        size_t length;
+
+        size_t chunkSize;
+
+        /// Next index to run, past the end once all are taken
+        std::atomic<size_t> nextIdx;
+
+        std::mutex mutex;
+
+        std::condition_variable cond;
+
+        /// Number of threads running chunks
+        size_t numActive = 0;
+
+        /// Message of the first error raised by the kernel
+        std::string errorMsg;
+    };
+
+    /// Run chunks of a loop on the current thread, until none are left
+    void runChunks(std::shared_ptr<Loop> loop)
+    {
+        {
+            std::lock_guard<std::mutex> lock(loop->mutex);
+            if (loop->nextIdx >= loop->length)
+                return;
+            loop->numActive++;
+        }
+
+        auto wasInKernel = inKernel;
+        std::string errorMsg;
+
+        try
+        {
+            auto kernelVal = parseBinImage(
+                (const uint8_t*)loop->image.data(),
+                loop->image.size(),
+                "parallel kernel",
+                &loop->hostFns
+            );
+            GCRoot kernelRoot(kernelVal);
+            auto kernel = Object(kernelVal);
+
+            inKernel = true;
+
+            for (;;)
+            {
+                auto startIdx = loop->nextIdx.fetch_add(loop->chunkSize);
+                if (startIdx >= loop->length)
+                    break;
+
+                auto endIdx = std::min(startIdx + loop->chunkSize, loop->length);
+                for (auto i = startIdx; i < endIdx; ++i)
+                {
+                    auto arg = loop->srcData?
+                        Array::readTyped(loop->srcData, loop->srcType, i):
+                        Value::int32(int32_t(i));
+
+                    auto result = callFun(kernel, { arg });
+                    Array::writeTyped(loop->outData, loop->outType, i, result);
+                }
+            }
+        }
+        catch (RunError& err)
+        {
+            errorMsg = err.toString();
+        }
+
+        inKernel = wasInKernel;
+
+        std::lock_guard<std::mutex> lock(loop->mutex);
+
+        // Stop the other threads at their next chunk
+        if (errorMsg != "")
+        {
+            if (loop->errorMsg == "")
+                loop->errorMsg = errorMsg;
+            loop->nextIdx = loop->length;
+        }
+
+        loop->numActive--;
+        loop->cond.notify_all();
+    }
+
+    /// Run a kernel over the indices of an output array,
+    /// passing it the elements of an input array if there is one
+    Value runLoop(const char* fnName, Value outVal, Value srcVal, Value kernelVal)
+    {
+        auto isTyped = [](Value val)
+        {
+            return val.isArray() && Array(val).getElemType() != ELEM_VALUE;
+        };
+
+        if (!isTyped(outVal))
+            throw RunError(std::string(fnName) + " expects a typed output array");
+        if (srcVal != Value::UNDEF && !isTyped(srcVal))
+            throw RunError(std::string(fnName) + " expects a typed input array");
+        if (!kernelVal.isObject())
+            throw RunError(std::string(fnName) + " expects a kernel function");
+
+        auto out = Array(outVal);
+        auto loop = std::make_shared<Loop>();
+        loop->image = serializeBin(kernelVal, &loop->hostFns);
+        loop->outData = out.getElemPtr();
+        loop->outType = out.getElemType();
+        loop->length = out.length();
+        loop->nextIdx = 0;
+
+        if (srcVal != Value::UNDEF)
+        {
+            auto src = Array(srcVal);
+            if (src.length() != out.length())
+                throw RunError(std::string(fnName) + " expects arrays of the same length");
+
+            loop->srcData = src.getElemPtr();
+            loop->srcType = src.getElemType();
+        }
+
+        auto threads = inKernel? 1:std::max(size_t(1), std::min(numThreads.load(), loop->length));
+        loop->chunkSize = std::max(size_t(1), loop->length / (threads * CHUNKS_PER_THREAD));
+
+        {
+            std::lock_guard<std::mutex> lock(workersMutex);
+
+            while (workers.size() + 1 < threads)
+                workers.push_back(new Isolate());
+
+            for (size_t i = 0; i + 1 < threads; ++i)
+                workers[i]->post([loop] { runChunks(loop); });
+        }
+
+        runChunks(loop);
+
+        // Threads which only start once all chunks are taken do nothing
+        std::unique_lock<std::mutex> lock(loop->mutex);
+        loop->cond.wait(lock, [&loop] { return loop->numActive == 0; });
+
+        if (loop->errorMsg != "")
+            throw RunError(loop->errorMsg);
+
+        return Value::UNDEF;
+    }
+
+    /// Set out[i] = kernel(i) for all indices of the output array
+    Value map_range(Value outVal, Value kernelVal)
+    {
+        return runLoop("map_range", outVal, Value::UNDEF, kernelVal);
+    }
+
+    /// Set out[i] = kernel(src[i]) for all indices of the arrays
+    Value map_array(Value outVal, Value srcVal, Value kernelVal)
+    {
+        return runLoop("map_array", outVal, srcVal, kernelVal);
+    }
+
+    /// Get the number of threads loops run on
+    Value num_threads()
+    {
+        return Value::int32(int32_t(numThreads.load()));
+    }
+
+    /// Set the number of threads loops run on, the calling one included
+    Value set_num_threads(Value countVal)
+    {
+        if (!countVal.isInt32() || (int32_t)countVal < 1)
+            throw RunError("set_num_threads expects a positive int32");
+
+        numThreads = size_t(int32_t(countVal));
+        return Value::UNDEF;
     }
 
     Value get_pkg()
     {
         auto exports = Object::newObject(32);
-        setHostFn(exports, "print_int32"  , 1, (void*)print_int32);
-        setHostFn(exports, "print_float32", 1, (void*)print_float32);
-        setHostFn(exports, "print_str"    , 1, (void*)print_str);
-        setHostFn(exports, "read_file"    , 1, (void*)read_file);
-        setHostFn(exports, "write_file"   , 2, (void*)write_file);
-        setHostFn(exports, "read_line"    , 0, (void*)read_line);
+        setHostFn(exports, "map_range"      , 2, (void*)map_range);
+        setHostFn(exports, "map_array"      , 3, (void*)map_array);
+        setHostFn(exports, "num_threads"    , 0, (void*)num_threads);
+        setHostFn(exports, "set_num_threads", 1, (void*)set_num_threads);
         return exports;
     }
 }
@@ -257,11 +1430,13 @@ namespace core_window_0
     size_t width = 0;
     size_t height = 0;
 
-    std::vector<uint8_t> pixelBuffer;
-
     SDL_Window* window = nullptr;
     SDL_Renderer* renderer = nullptr;
-    SDL_Texture* texture = nullptr;
+
+    /// Streaming textures, used alternately so that uploading a frame
+    /// can overlap with the rendering of the previous one
+    SDL_Texture* textures[2] = { nullptr, nullptr };
+    size_t curTexture = 0;
 
     Value create_window(
         Value titleVal,
@@ -286,15 +1461,18 @@ namespace core_window_0
 
         renderer = SDL_CreateRenderer(window, -1, 0);
 
-        texture = SDL_CreateTexture(
-            renderer,
-            SDL_PIXELFORMAT_RGBA8888,
-            SDL_TEXTUREACCESS_STATIC,
-            width,
-            height
-        );
-
-        pixelBuffer.resize(width * height * 4, 0);
+        // RGBA32 has the R, G, B, A byte order in memory
+        // regardless of endianness
+        for (auto& texture : textures)
+        {
+            texture = SDL_CreateTexture(
+                renderer,
+                SDL_PIXELFORMAT_RGBA32,
+                SDL_TEXTUREACCESS_STREAMING,
+                width,
+                height
+            );
+        }
 
         SDL_ShowWindow(window);
 
@@ -307,13 +1485,16 @@ namespace core_window_0
         // For now, only one window is supported
         assert (handle == Value((refptr)window, TAG_RAWPTR));
 
-        SDL_DestroyTexture(texture);
+        for (auto& texture : textures)
+        {
+            SDL_DestroyTexture(texture);
+            texture = nullptr;
+        }
+
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
         SDL_Quit();
 
-        pixelBuffer.clear();
-
         return Value::UNDEF;
     }
 
@@ -340,25 +1521,76 @@ namespace core_window_0
         return Value::TRUE;
     }
 
+    /**
+    Draw a frame of pixels, which may be:
+    - a uint8 array of RGBA pixels (width*height*4), copied as is
+    - a uint8 array of RGB pixels (width*height*3)
+    - an array of int32 RGB components (width*height*3)
+    */
     Value draw_pixels(Value handle, Value pixelsArray)
     {
         // For now, only one window is supported
         assert (handle == Value((refptr)window, TAG_RAWPTR));
 
+        if (!pixelsArray.isArray())
+            throw RunError("draw_pixels expects an array of pixels");
+
         auto pixels = (Array)pixelsArray;
+        auto numPixels = width * height;
+        auto isBytes = pixels.getElemType() == ELEM_UINT8;
 
-        assert (pixels.length() == width * height * 3);
+        if (!(isBytes && pixels.length() == numPixels * 4) &&
+            pixels.length() != numPixels * 3)
+            throw RunError("draw_pixels, invalid pixel array length");
 
-        for (size_t pixIdx = 0; pixIdx < width * height; ++pixIdx)
+        auto texture = textures[curTexture];
+        curTexture = (curTexture + 1) % 2;
+
+        // Write directly into the texture memory
+        uint8_t* dst;
+        int pitch;
+        if (SDL_LockTexture(texture, NULL, (void**)&dst, &pitch) != 0)
+            throw RunError("draw_pixels, failed to lock texture");
+
+        if (isBytes && pixels.length() == numPixels * 4)
+        {
+            auto src = pixels.getElemPtr();
+            for (size_t y = 0; y < height; ++y)
+                memcpy(dst + y * pitch, src + y * width * 4, width * 4);
+        }
+        else if (isBytes)
+        {
+            auto src = pixels.getElemPtr();
+            for (size_t y = 0; y < height; ++y)
+            {
+                auto row = dst + y * pitch;
+                for (size_t x = 0; x < width; ++x, src += 3)
+                {
+                    row[4*x+0] = src[0];
+                    row[4*x+1] = src[1];
+                    row[4*x+2] = src[2];
+                    row[4*x+3] = 255;
+                }
+            }
+        }
+        else
         {
-            // SDL's RGBA888 is actually ABGR, because of course.
-            pixelBuffer[4*pixIdx+0] = 255;
-            pixelBuffer[4*pixIdx+1] = (uint8_t)(int32_t)pixels.getElem(3*pixIdx+2);
-            pixelBuffer[4*pixIdx+2] = (uint8_t)(int32_t)pixels.getElem(3*pixIdx+1);
-            pixelBuffer[4*pixIdx+3] = (uint8_t)(int32_t)pixels.getElem(3*pixIdx+0);
+            size_t idx = 0;
+            for (size_t y = 0; y < height; ++y)
+            {
+                auto row = dst + y * pitch;
+                for (size_t x = 0; x < width; ++x, idx += 3)
+                {
+                    row[4*x+0] = (uint8_t)(int32_t)pixels.getElem(idx+0);
+                    row[4*x+1] = (uint8_t)(int32_t)pixels.getElem(idx+1);
+                    row[4*x+2] = (uint8_t)(int32_t)pixels.getElem(idx+2);
+                    row[4*x+3] = 255;
+                }
+            }
         }
 
-        SDL_UpdateTexture(texture, NULL, &pixelBuffer[0], width * 4);
+        SDL_UnlockTexture(texture);
+
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, NULL, NULL);
@@ -422,6 +1654,11 @@ namespace core_audio_0
         return Value::int32(devId);
     }
 
+    /**
+    Queue audio samples for playback. Samples in a float32 array are
+    queued as is, without copying, and must already be in [-1, 1].
+    Other arrays must hold float32 values, which get clamped.
+    */
     Value queue_samples(
         Value dev,
         Value samplesArray
@@ -442,23 +1679,42 @@ namespace core_audio_0
         if (samples.length() == 0)
             return Value::UNDEF;
 
-        float samples_buf[samples.length()];
+        int result;
 
-        for (size_t i = 0; i < samples.length(); i++)
+        if (samples.getElemType() == ELEM_FLOAT32)
+        {
+            result = SDL_QueueAudio(
+                devID,
+                samples.getElemPtr(),
+                samples.length() * sizeof(float)
+            );
+        }
+        else
         {
-            auto elem = samples.getElem(i);
+            std::vector<float> samples_buf(samples.length());
 
-            if (!elem.isFloat32())
+            for (size_t i = 0; i < samples.length(); i++)
             {
-                throw RunError("audio samples must be float32");
+                auto elem = samples.getElem(i);
+
+                if (!elem.isFloat32())
+                {
+                    throw RunError("audio samples must be float32");
+                }
+
+                float sample = (float)elem > 1.0f ? 1.0f : elem;
+                sample = sample < -1.0f ? -1.0f : sample;
+                samples_buf[i] = sample;
             }
 
-            float sample = (float)elem > 1.0f ? 1.0f : elem;
-            sample = sample < -1.0f ? -1.0f : sample;
-            samples_buf[i] = sample;
+            result = SDL_QueueAudio(
+                devID,
+                &samples_buf[0],
+                samples_buf.size() * sizeof(float)
+            );
         }
 
-        if (SDL_QueueAudio(devID, samples_buf, sizeof(samples_buf)) != 0)
+        if (result != 0)
         {
             return Value::FALSE;
         }
@@ -511,12 +1767,319 @@ namespace core_audio_0
 //============================================================================
 
 // Cache of loaded packages
-std::unordered_map<std::string, Value> pkgCache;
+thread_local std::unordered_map<std::string, Value> pkgCache;
+
+/// Mark the GC roots held by the package system
+void markPkgRoots()
+{
+    for (auto& pair : pkgCache)
+        gcMark(pair.second);
+
+    // The export field can be overwritten, so mark the error directly
+    gcMark(core_array_0::rangeError);
+}
+
+std::string findExportName(Value val)
+{
+    for (auto& pair : pkgCache)
+    {
+        auto pkg = Object(pair.second);
+
+        for (ObjFieldItr itr(pkg); itr.valid(); itr.next())
+        {
+            auto name = itr.get();
+            auto field = pkg.getField(name.c_str());
+
+            if (field == val)
+                return pair.first + "." + name;
+
+            if (!field.isObject())
+                continue;
+
+            // Look one level down, for methods of exported objects
+            auto obj = Object(field);
+            for (ObjFieldItr objItr(obj); objItr.valid(); objItr.next())
+            {
+                auto subName = objItr.get();
+                if (obj.getField(subName.c_str()) == val)
+                    return pair.first + "." + name + "." + subName;
+            }
+        }
+    }
+
+    return "";
+}
+
+/// Flag to enable the on-disk cache of parsed packages
+static bool parseCacheEnabled = true;
+
+void disableParseCache()
+{
+    parseCacheEnabled = false;
+}
+
+/// 64-bit FNV-1a hash, used as a cache key
+static uint64_t hash64(const std::string& str, uint64_t hash = 14695981039346656037ULL)
+{
+    for (auto ch : str)
+    {
+        hash ^= uint8_t(ch);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+Get the directory in which parsed packages are cached,
+creating it if needed. Returns an empty string if there
+is no usable cache directory.
+*/
+static std::string getParseCacheDir()
+{
+    std::string baseDir;
+
+    if (auto xdgCache = getenv("XDG_CACHE_HOME"))
+    {
+        baseDir = xdgCache;
+    }
+    else if (auto homeDir = getenv("HOME"))
+    {
+        baseDir = std::string(homeDir) + "/.cache";
+    }
+
+    if (baseDir == "")
+        return "";
+
+    mkdir(baseDir.c_str(), 0755);
+    auto cacheDir = baseDir + "/zeta";
+    mkdir(cacheDir.c_str(), 0755);
+
+    struct stat st;
+    if (stat(cacheDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+        return "";
+
+    return cacheDir;
+}
+
+/**
+Get the path of the cache entry for a package parsed by a language
+package. The key covers the source path and contents, which end up
+in source positions, and the version of the language package, as
+identified by its name, size and modification time.
+*/
+static std::string getParseCachePath(Input& input, std::string langPkgName)
+{
+    auto cacheDir = getParseCacheDir();
+    if (cacheDir == "")
+        return "";
+
+    std::string langPkgId = langPkgName;
+    struct stat st;
+    auto langPkgPath = PKGS_DIR + langPkgName + "/package";
+    if (stat(langPkgPath.c_str(), &st) == 0)
+    {
+        langPkgId += "@" + std::to_string(st.st_size);
+        langPkgId += "@" + std::to_string(st.st_mtime);
+    }
+
+    auto hash = hash64(std::to_string(BIN_IMAGE_VERSION));
+    hash = hash64(langPkgId, hash);
+    hash = hash64(input.getSrcName(), hash);
+    hash = hash64(input.getInputStr(), hash);
+
+    char hashStr[17];
+    snprintf(hashStr, sizeof(hashStr), "%016llx", (unsigned long long)hash);
+
+    return cacheDir + "/" + hashStr + ".zimb";
+}
+
+/**
+Store a parsed package in the cache. The image is written to a
+temporary file first, so concurrent processes never read a
+partially written entry. Failures only mean a cold start next time.
+*/
+static void writeParseCache(std::string cachePath, Value exportVal)
+{
+    auto tmpPath = cachePath + "." + std::to_string(getpid()) + ".tmp";
+
+    try
+    {
+        writeBinImage(tmpPath, exportVal);
+
+        if (rename(tmpPath.c_str(), cachePath.c_str()) != 0)
+            unlink(tmpPath.c_str());
+    }
+    catch (RunError& err)
+    {
+        unlink(tmpPath.c_str());
+    }
+}
+
+/// Package data read ahead of time by prefetching
+struct PrefetchedPkg
+{
+    /// Set once the data was read
+    bool done = false;
+
+    /// Package source or text image
+    std::string srcData;
+
+    /// Binary image, read from the package file or from the parse cache
+    std::string imgData;
+};
+
+static void takePrefetched(std::string pkgPath, PrefetchedPkg& pkg);
+
+/**
+Images of the packages parsed from source, shared between isolates so
+that each package only gets parsed once. Images never change once
+published. An isolate about to parse a text image waits for any other
+isolate parsing it, as parsing these runs no code which could wait in
+turn. Packages parsed by language packages are published by whichever
+isolate gets done first.
+*/
+static struct SharedImages
+{
+    std::mutex mutex;
+
+    std::condition_variable cond;
+
+    /// Set once there is more than one isolate
+    bool enabled = false;
+
+    struct Entry
+    {
+        /// Binary image, null until published
+        std::shared_ptr<const std::string> image;
+
+        /// Whether a text image is being parsed
+        bool parsing = false;
+    };
+
+    /// Entries by package path
+    std::unordered_map<std::string, Entry> entries;
+} sharedImages;
+
+void sharePkgImages()
+{
+    std::lock_guard<std::mutex> lock(sharedImages.mutex);
+    sharedImages.enabled = true;
+}
+
+/**
+Find the shared image of a package. If requested, waits for another
+isolate parsing the package, or else claims the package, which must
+then be published with publishImage, even if parsing fails.
+*/
+static std::shared_ptr<const std::string> findSharedImage(std::string pkgPath, bool claim)
+{
+    std::unique_lock<std::mutex> lock(sharedImages.mutex);
+
+    if (!sharedImages.enabled)
+        return nullptr;
+
+    auto& entry = sharedImages.entries[pkgPath];
+
+    if (claim)
+    {
+        sharedImages.cond.wait(lock, [&entry] { return !entry.parsing; });
+        entry.parsing = !entry.image;
+    }
+
+    return entry.image;
+}
+
+/// Publish the image of a package parsed from source, if shared.
+/// An undefined value only releases the claim on the package.
+static void publishImage(std::string pkgPath, Value exportVal)
+{
+    if (!sharedImages.enabled)
+        return;
+
+    std::shared_ptr<const std::string> image;
+    if (exportVal.isObject())
+    {
+        try
+        {
+            image = std::make_shared<const std::string>(serializeBin(exportVal));
+        }
+        catch (RunError& err)
+        {
+            // Values which can't be serialized stay unshared
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(sharedImages.mutex);
+
+    auto& entry = sharedImages.entries[pkgPath];
+    if (!entry.image)
+        entry.image = image;
+    entry.parsing = false;
+    sharedImages.cond.notify_all();
+}
+
+/// Time spent loading packages so far, in milliseconds
+static thread_local double loadTimeMs = 0;
+
+/// Number of package loads in progress
+static thread_local size_t loadDepth = 0;
+
+/// Adds the duration of a load to loadTimeMs, counting nested loads once
+struct LoadTimer
+{
+    double startMs;
+
+    LoadTimer() : startMs(loadDepth++ == 0? getTimeMs():0) {}
+
+    ~LoadTimer()
+    {
+        if (--loadDepth == 0)
+            loadTimeMs += getTimeMs() - startMs;
+    }
+};
+
+double getLoadTimeMs()
+{
+    return loadTimeMs;
+}
 
 /// Load a package based on its path
 Object load(std::string pkgPath)
 {
-    Input input(pkgPath);
+    LoadTimer loadTimer;
+
+    // Packages another isolate parsed are loaded from their image
+    if (auto image = findSharedImage(pkgPath, false))
+    {
+        return Object(parseBinImage(
+            (const uint8_t*)image->data(), image->size(), pkgPath
+        ));
+    }
+
+    // Use the package data read by prefetching, if any
+    PrefetchedPkg prefetched;
+    takePrefetched(pkgPath, prefetched);
+    auto& imgData = prefetched.imgData;
+
+    // Binary images are mapped into memory, without parsing
+    if (prefetched.srcData == "" && (imgData != "" || isBinImage(pkgPath)))
+    {
+        auto exportVal = (imgData != "")?
+            parseBinImage((const uint8_t*)imgData.data(), imgData.size(), pkgPath):
+            loadBinImage(pkgPath);
+
+        if (!exportVal.isObject())
+        {
+            throw RunError("exports value is not an object");
+        }
+
+        return Object(exportVal);
+    }
+
+    Input input = (prefetched.srcData != "")?
+        Input(std::move(prefetched.srcData), pkgPath):
+        Input(pkgPath);
 
     Value exportVal;
 
@@ -528,6 +2091,26 @@ Object load(std::string pkgPath)
     {
         //std::cout << "Loading language package" << std::endl;
 
+        // If this package was already parsed, load it from the cache
+        auto cachePath = parseCacheEnabled? getParseCachePath(input, langPkgName):"";
+        if (cachePath != "" && (imgData != "" || isBinImage(cachePath)))
+        {
+            try
+            {
+                exportVal = (imgData != "")?
+                    parseBinImage((const uint8_t*)imgData.data(), imgData.size(), cachePath):
+                    loadBinImage(cachePath);
+            }
+            catch (ParseError& err)
+            {
+                // Invalid cache entries get parsed and written again
+                exportVal = Value::UNDEF;
+            }
+
+            if (exportVal.isObject())
+                return Object(exportVal);
+        }
+
         auto langPkg = import(langPkgName);
 
         if (!langPkg.hasField("parse_input"))
@@ -553,11 +2136,30 @@ Object load(std::string pkgPath)
         exportVal = callExportFn(langPkg, "parse_input", args);
 
         //std::cout << "Returned from parse_input" << std::endl;
+
+        if (cachePath != "" && exportVal.isObject())
+            writeParseCache(cachePath, exportVal);
+
+        publishImage(pkgPath, exportVal);
+    }
+    else if (auto image = findSharedImage(pkgPath, true))
+    {
+        exportVal = parseBinImage((const uint8_t*)image->data(), image->size(), pkgPath);
     }
     else
     {
         // Parse the package file contents
-        exportVal = parseInput(input);
+        try
+        {
+            exportVal = parseInput(input);
+        }
+        catch (...)
+        {
+            publishImage(pkgPath, Value::UNDEF);
+            throw;
+        }
+
+        publishImage(pkgPath, exportVal);
     }
 
     if (!exportVal.isObject())
@@ -577,6 +2179,14 @@ Value getCorePkg(std::string pkgName)
         return core_vm_0::get_pkg();
     if (pkgName == "core/io/0")
         return core_io_0::get_pkg();
+    if (pkgName == "core/array/0")
+        return core_array_0::get_pkg();
+    if (pkgName == "core/string/0")
+        return core_string_0::get_pkg();
+    if (pkgName == "core/simd/0")
+        return core_simd_0::get_pkg();
+    if (pkgName == "core/parallel/0")
+        return core_parallel_0::get_pkg();
     if (pkgName == "core/window/0")
         return core_window_0::get_pkg();
     if (pkgName == "core/audio/0")
@@ -585,18 +2195,12 @@ Value getCorePkg(std::string pkgName)
     return Value::UNDEF;
 }
 
-/// Import a package based on its name, and perform caching
-Object import(std::string pkgName)
+/**
+Find the package file for a package name. Returns an empty
+string if there is no file, as is the case for core packages.
+*/
+static std::string findPkgPath(std::string pkgName)
 {
-    // If the package is already loaded
-    auto itr = pkgCache.find(pkgName);
-    if (itr != pkgCache.end())
-    {
-        return Object(itr->second);
-    }
-
-    std::string pkgPath = "";
-
     // If this is a local import
     if (pkgName.substr(0, 2) == "./")
     {
@@ -605,26 +2209,207 @@ Object import(std::string pkgName)
             throw ImportError("local package not found \"" + pkgName + "\"");
         }
 
-        pkgPath = pkgName;
+        return pkgName;
     }
 
     // Otherwise, this is a global import
-    else
+    if (!regex_match(pkgName, std::regex("([a-z0-9]+/)*[0-9]+")))
     {
-        if (!regex_match(pkgName, std::regex("([a-z0-9]+/)*[0-9]+")))
-        {
-            throw ImportError("invalid global package name \"" + pkgName + "\"");
-        }
+        throw ImportError("invalid global package name \"" + pkgName + "\"");
+    }
+
+    // Look in the package directory
+    auto pkgDirPath = PKGS_DIR + pkgName + "/package";
+
+    if (fileExists(pkgDirPath))
+    {
+        return pkgDirPath;
+    }
+
+    return "";
+}
+
+/**
+Read a package file ahead of time. Doesn't touch the heap, so this
+can run on any thread. Returns the names of the packages it imports,
+when these can be found without parsing it.
+*/
+static std::vector<std::string> readPkgData(std::string pkgPath, PrefetchedPkg& pkg)
+{
+    auto data = readFile(pkgPath);
+
+    if (data.compare(0, sizeof(BIN_IMAGE_MAGIC), BIN_IMAGE_MAGIC, sizeof(BIN_IMAGE_MAGIC)) == 0)
+    {
+        pkg.imgData = std::move(data);
+        return findBinImageImports((const uint8_t*)pkg.imgData.data(), pkg.imgData.size());
+    }
+
+    Input input(data, pkgPath);
+    pkg.srcData = std::move(data);
+
+    // The imports of text images are only known after parsing them
+    auto langPkgName = parseLang(input);
+    if (langPkgName == "")
+        return {};
+
+    // If this package is in the parse cache, read the cache entry
+    auto cachePath = parseCacheEnabled? getParseCachePath(input, langPkgName):"";
+    if (cachePath != "" && isBinImage(cachePath))
+    {
+        pkg.imgData = readFile(cachePath);
+        return findBinImageImports((const uint8_t*)pkg.imgData.data(), pkg.imgData.size());
+    }
+
+    return { langPkgName };
+}
+
+/**
+Prefetching state. Threads resolve package names, read the package
+files and find the packages they import, which they prefetch in turn.
+Turning the package data into heap values happens in load(), on the
+main thread, and the packages get initialized in the usual order.
+*/
+static struct Prefetcher
+{
+    std::mutex mutex;
+
+    std::condition_variable cond;
+
+    /// Package names left to prefetch, and those already seen
+    std::vector<std::string> queue;
+    std::unordered_set<std::string> seenNames;
+
+    /// Prefetched packages, by path
+    std::unordered_map<std::string, PrefetchedPkg> pkgs;
+
+    std::vector<std::thread> threads;
+
+    /// Number of threads prefetching a package
+    size_t numBusy = 0;
 
-        // Look in the package directory
-        auto pkgDirPath = PKGS_DIR + pkgName + "/package";
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
 
-        if (fileExists(pkgDirPath))
+        for (;;)
         {
-            pkgPath = pkgDirPath;
+            // Wait for work, stopping once all prefetching is done
+            cond.wait(lock, [this] { return !queue.empty() || numBusy == 0; });
+            if (queue.empty())
+                break;
+
+            auto pkgName = queue.back();
+            queue.pop_back();
+            numBusy++;
+            lock.unlock();
+
+            std::string pkgPath;
+            try
+            {
+                pkgPath = findPkgPath(pkgName);
+            }
+            catch (ImportError& err)
+            {
+                // Programs passed on the command line are plain paths
+                if (fileExists(pkgName))
+                    pkgPath = pkgName;
+            }
+
+            lock.lock();
+
+            if (pkgPath == "" || pkgs.find(pkgPath) != pkgs.end())
+            {
+                numBusy--;
+                cond.notify_all();
+                continue;
+            }
+
+            auto& entry = pkgs[pkgPath];
+            lock.unlock();
+
+            PrefetchedPkg pkg;
+            std::vector<std::string> imports;
+            try
+            {
+                imports = readPkgData(pkgPath, pkg);
+            }
+            catch (RunError& err)
+            {
+                // Errors get reported when the package is loaded
+                pkg = PrefetchedPkg();
+            }
+
+            lock.lock();
+
+            // Note: references to map elements stay valid on insertion
+            entry.srcData = std::move(pkg.srcData);
+            entry.imgData = std::move(pkg.imgData);
+            entry.done = true;
+
+            for (auto& name : imports)
+            {
+                if (seenNames.insert(name).second)
+                    queue.push_back(name);
+            }
+
+            numBusy--;
+            cond.notify_all();
         }
     }
 
+    ~Prefetcher()
+    {
+        for (auto& thread : threads)
+            thread.join();
+    }
+} prefetcher;
+
+void prefetch(std::string pkgName)
+{
+    std::lock_guard<std::mutex> lock(prefetcher.mutex);
+
+    if (!prefetcher.seenNames.insert(pkgName).second)
+        return;
+    prefetcher.queue.push_back(pkgName);
+    prefetcher.cond.notify_all();
+
+    if (prefetcher.threads.empty())
+    {
+        auto numThreads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+        for (size_t i = 0; i < numThreads; ++i)
+            prefetcher.threads.push_back(std::thread(&Prefetcher::run, &prefetcher));
+    }
+}
+
+/// Take the prefetched data for a package path, waiting if it is being read
+static void takePrefetched(std::string pkgPath, PrefetchedPkg& pkg)
+{
+    std::unique_lock<std::mutex> lock(prefetcher.mutex);
+
+    auto itr = prefetcher.pkgs.find(pkgPath);
+    if (itr == prefetcher.pkgs.end())
+        return;
+
+    // Prefetch threads may insert into the map while we wait, which
+    // invalidates iterators but not references
+    auto& entry = itr->second;
+    prefetcher.cond.wait(lock, [&entry] { return entry.done; });
+    pkg = std::move(entry);
+    prefetcher.pkgs.erase(pkgPath);
+}
+
+/// Import a package based on its name, and perform caching
+Object import(std::string pkgName)
+{
+    // If the package is already loaded
+    auto itr = pkgCache.find(pkgName);
+    if (itr != pkgCache.end())
+    {
+        return Object(itr->second);
+    }
+
+    auto pkgPath = findPkgPath(pkgName);
+
     // If a package file was found for the given package name
     if (pkgPath != "")
     {
@@ -1,7 +1,42 @@
 #pragma once
 
+#include <cassert>
+#include <cstddef>
 #include "runtime.h"
 
+/**
+Arguments of a host function call, read in place from the interpreter
+stack. The stack grows down, so the arguments are stored in reverse order.
+*/
+class HostArgs
+{
+private:
+
+    /// Location of the first argument
+    Value* first;
+
+    size_t numArgs;
+
+public:
+
+    HostArgs(Value* first, size_t numArgs)
+    : first(first),
+      numArgs(numArgs)
+    {
+    }
+
+    Value operator [] (size_t idx) const
+    {
+        assert (idx < numArgs);
+        return first[-(ptrdiff_t)idx];
+    }
+
+    size_t size() const { return numArgs; }
+};
+
+/// Host function receiving its arguments in place, with no limit on arity
+typedef Value (*HostFnArgs)(HostArgs args);
+
 /**
 Host function wrapper
 */
@@ -13,7 +48,11 @@ private:
 
     size_t numParams;
 
-    void* fptr;
+    /// Function taking up to 3 values as separate parameters
+    void* fptr = nullptr;
+
+    /// Function taking its arguments as HostArgs
+    HostFnArgs argsFptr = nullptr;
 
 public:
 
@@ -23,12 +62,164 @@ public:
         void* fptr
     );
 
+    HostFn(
+        std::string name,
+        size_t numParams,
+        HostFnArgs argsFptr
+    );
+
     Value call0();
     Value call1(Value arg0);
     Value call2(Value arg0, Value arg1);
     Value call3(Value arg0, Value arg1, Value arg2);
 
+    /// Call the function with arguments on the interpreter stack
+    Value call(HostArgs args)
+    {
+        assert (args.size() == numParams);
+
+        if (argsFptr)
+            return argsFptr(args);
+
+        switch (numParams)
+        {
+            case 0: return call0();
+            case 1: return call1(args[0]);
+            case 2: return call2(args[0], args[1]);
+            default: return call3(args[0], args[1], args[2]);
+        }
+    }
+
     size_t getNumParams() const { return numParams; }
+
+    const std::string& getName() const { return name; }
+};
+
+/**
+Exception thrown by host functions to throw a given value to the calling
+code, such as an error object allocated ahead of time. Errors thrown as a
+plain RunError instead get wrapped in a new exception object.
+*/
+class HostThrow : public RunError
+{
+private:
+
+    Value val;
+
+public:
+
+    HostThrow(Value val) : RunError("host function exception"), val(val) {}
+
+    Value getValue() const { return val; }
+};
+
+/// Create an error object with a message, the form in which RunError
+/// exceptions from host functions are thrown to the calling code
+Object newErrorObj(std::string msg);
+
+/// Conversion of host function arguments to C++ types, for HostThunk
+template <typename T> T fromHostArg(Value val);
+
+template <> inline Value fromHostArg<Value>(Value val)
+{
+    return val;
+}
+
+template <> inline int32_t fromHostArg<int32_t>(Value val)
+{
+    if (!val.isInt32())
+        throw RunError("expected int32 argument");
+    return (int32_t)val;
+}
+
+template <> inline float fromHostArg<float>(Value val)
+{
+    if (!val.isFloat32())
+        throw RunError("expected float32 argument");
+    return (float)val;
+}
+
+template <> inline String fromHostArg<String>(Value val)
+{
+    if (!val.isString())
+        throw RunError("expected string argument");
+    return String(val);
+}
+
+template <> inline Array fromHostArg<Array>(Value val)
+{
+    if (!val.isArray())
+        throw RunError("expected array argument");
+    return Array(val);
+}
+
+template <> inline Object fromHostArg<Object>(Value val)
+{
+    if (!val.isObject())
+        throw RunError("expected object argument");
+    return Object(val);
+}
+
+/// Conversion of host function return values from C++ types
+inline Value toHostRet(Value val) { return val; }
+inline Value toHostRet(int32_t val) { return Value::int32(val); }
+inline Value toHostRet(float val) { return Value::float32(val); }
+inline Value toHostRet(bool val) { return val? Value::TRUE:Value::FALSE; }
+
+/// Sequence of argument indices, used to expand the thunk parameters
+template <size_t... Idxs> struct HostArgIdxs {};
+
+template <size_t N, size_t... Idxs>
+struct MakeHostArgIdxs : MakeHostArgIdxs<N - 1, N - 1, Idxs...> {};
+
+template <size_t... Idxs>
+struct MakeHostArgIdxs<0, Idxs...>
+{
+    typedef HostArgIdxs<Idxs...> type;
+};
+
+/**
+Thunk calling a host function with typed parameters, such as int32_t,
+float or String. The arguments are checked and converted in place, so
+that the function itself needs no type checks and can have any arity.
+*/
+template <typename F, F fn> struct HostThunk;
+
+template <typename R, typename... Params, R (*fn)(Params...)>
+struct HostThunk<R (*)(Params...), fn>
+{
+    static const size_t NUM_PARAMS = sizeof...(Params);
+
+    template <size_t... Idxs>
+    static Value callIdxs(HostArgs args, HostArgIdxs<Idxs...>)
+    {
+        (void)args;
+        return toHostRet(fn(fromHostArg<Params>(args[Idxs])...));
+    }
+
+    static Value call(HostArgs args)
+    {
+        return callIdxs(args, typename MakeHostArgIdxs<NUM_PARAMS>::type());
+    }
+};
+
+template <typename... Params, void (*fn)(Params...)>
+struct HostThunk<void (*)(Params...), fn>
+{
+    static const size_t NUM_PARAMS = sizeof...(Params);
+
+    template <size_t... Idxs>
+    static Value callIdxs(HostArgs args, HostArgIdxs<Idxs...>)
+    {
+        (void)args;
+        fn(fromHostArg<Params>(args[Idxs])...);
+        return Value::UNDEF;
+    }
+
+    static Value call(HostArgs args)
+    {
+        return callIdxs(args, typename MakeHostArgIdxs<NUM_PARAMS>::type());
+    }
 };
 
 class ImportError : public RunError
@@ -42,6 +233,27 @@ public:
 /// User-facing import function, used to implement the import instruction
 extern HostFn importFn;
 
+/// Get the time elapsed since the VM started, in milliseconds
+double getTimeMs();
+
+/// Get the time spent loading and parsing packages, in milliseconds,
+/// including the time the language packages take to parse them
+double getLoadTimeMs();
+
+/// Disable the on-disk cache of parsed packages
+void disableParseCache();
+
+/// Share the packages parsed from source between isolates, see isolate.h
+void sharePkgImages();
+
+/// Start reading a package and the packages it imports in parallel,
+/// so that they are ready when imported
+void prefetch(std::string pkgName);
+
+/// Find the name under which a value is exported by a loaded
+/// package, as "package.field", or an empty string if it is not
+std::string findExportName(Value val);
+
 /// Load a package based on its path
 Object load(std::string pkgPath);
 
@@ -29,10 +29,9 @@ std::string readFile(std::string fileName)
 
     //printf("%ld bytes\n", len);
 
-    char* buf = (char*)malloc(len+1);
-
-    // Read into the allocated buffer
-    size_t read = fread(buf, 1, len, file);
+    // Read directly into the string buffer
+    std::string str(len, '\0');
+    size_t read = fread(&str[0], 1, len, file);
 
     if (read != len)
     {
@@ -40,13 +39,58 @@ std::string readFile(std::string fileName)
         assert (false);
     }
 
-    // Add a null terminator to the string
-    buf[len] = '\0';
-
     // Close the input file
     fclose(file);
 
-    return std::string(buf);
+    return str;
+}
+
+/// Character classes, used to scan over many characters at once
+enum : uint8_t
+{
+    // Characters accepted in the input
+    CH_VALID        = 1 << 0,
+
+    // Whitespace characters
+    CH_SPACE        = 1 << 1,
+
+    // Characters which can start or continue identifiers
+    CH_IDENT_START  = 1 << 2,
+    CH_IDENT        = 1 << 3,
+
+    // Characters which stand for themselves in string literals
+    CH_STR          = 1 << 4
+};
+
+static struct CharClasses
+{
+    uint8_t table[256];
+
+    CharClasses()
+    {
+        for (int ch = 0; ch < 256; ++ch)
+        {
+            uint8_t cls = 0;
+
+            if ((ch >= 0x20 && ch <= 0x7E) || ch == '\n' || ch == '\t' || ch == '\r')
+                cls |= CH_VALID;
+            if (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r')
+                cls |= CH_SPACE;
+            if (ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'))
+                cls |= CH_IDENT_START | CH_IDENT;
+            if (ch >= '0' && ch <= '9')
+                cls |= CH_IDENT;
+            if ((cls & CH_VALID) && ch != '\\' && ch != '\n' && ch != '\r')
+                cls |= CH_STR;
+
+            table[ch] = cls;
+        }
+    }
+} charClasses;
+
+static inline uint8_t chClass(char ch)
+{
+    return charClasses.table[(uint8_t)ch];
 }
 
 Input::Input(std::string fileName)
@@ -60,24 +104,64 @@ Input::Input(std::string fileName)
 Input::Input(std::string str, std::string srcName)
 {
     this->srcName = srcName;
-    this->inStr = str;
+    this->inStr = std::move(str);
     this->strIdx = 0;
-    this->lineNo = 1;
-    this->colNo = 1;
+    this->posIdx = 0;
+    this->posLineNo = 1;
+    this->posLineStart = 0;
 }
 
 Input::~Input()
 {
 }
 
+void Input::updatePos() const
+{
+    // If we moved backwards, count lines from the start
+    if (strIdx < posIdx)
+    {
+        posIdx = 0;
+        posLineNo = 1;
+        posLineStart = 0;
+    }
+
+    auto base = inStr.data();
+    auto ptr = base + posIdx;
+    auto end = base + strIdx;
+
+    while (ptr < end)
+    {
+        auto eol = (const char*)memchr(ptr, '\n', end - ptr);
+        if (!eol)
+            break;
+
+        posLineNo++;
+        posLineStart = (eol + 1) - base;
+        ptr = eol + 1;
+    }
+
+    posIdx = strIdx;
+}
+
+size_t Input::getLineNo() const
+{
+    updatePos();
+    return posLineNo;
+}
+
+size_t Input::getColNo() const
+{
+    updatePos();
+    return strIdx - posLineStart + 1;
+}
+
 /// Read a character from the input
 char Input::readCh()
 {
     char ch = peek();
 
     // Strictly reject invalid input characters
-    if ((ch < 0x20 || ch > 0x7E) &&
-        (ch != '\n' && ch != '\t' && ch != '\r'))
+    if (!(chClass(ch) & CH_VALID))
     {
         char hexStr[64];
         sprintf(hexStr, "0x%02X", (int)ch);
@@ -89,16 +173,6 @@ char Input::readCh()
 
     this->strIdx++;
 
-    if (ch == '\n')
-    {
-        lineNo++;
-        colNo = 1;
-    }
-    else
-    {
-        colNo++;
-    }
-
     return ch;
 }
 
@@ -108,15 +182,6 @@ bool Input::eof()
     return peek('\0');
 }
 
-/// Peek at a character from the input
-char Input::peek()
-{
-    if (strIdx >= inStr.length())
-        return '\0';
-
-    return inStr[strIdx];
-}
-
 /// Peek to see if a specific character is next in the input
 bool Input::peek(char ch)
 {
@@ -126,31 +191,7 @@ bool Input::peek(char ch)
 /// Peek to check if a string is next in the input
 bool Input::peek(const std::string& str)
 {
-    size_t idx = 0;
-
-    for (; idx < str.length(); idx++)
-    {
-        if (this->strIdx + idx >= this->inStr.length())
-            return false;
-
-        if (str[idx] != this->inStr[this->strIdx + idx])
-            return false;
-    }
-
-    return true;
-}
-
-/// Try and match a given character in the input
-/// The character is consumed if matched
-bool Input::match(char ch)
-{
-    if (peek(ch))
-    {
-        readCh();
-        return true;
-    }
-
-    return false;
+    return inStr.compare(strIdx, str.length(), str) == 0;
 }
 
 /// Try and match a given string in the input
@@ -168,6 +209,15 @@ bool Input::match(const std::string& str)
     return false;
 }
 
+/// Fail if the input doesn't match a given character
+void Input::expect(char ch)
+{
+    if (!match(ch))
+    {
+        throw ParseError(*this, "expected to find '" + std::string(1, ch) + "'");
+    }
+}
+
 /// Fail if the input doesn't match a given string
 void Input::expect(const std::string str)
 {
@@ -180,43 +230,46 @@ void Input::expect(const std::string str)
 /// Consume whitespace and comments
 void Input::eatWS()
 {
-    //std::cout << "entering eatWS" << std::endl;
+    auto ptr = curPtr();
+    auto end = endPtr();
 
     // Until the end of the whitespace
     for (;;)
     {
-        // If we are at the end of the input, stop
-        if (eof())
-        {
-            return;
-        }
-
         // Consume whitespace characters
-        if (isspace(peek()))
-        {
-            readCh();
-            continue;
-        }
+        while (ptr < end && (chClass(*ptr) & CH_SPACE))
+            ptr++;
 
         // If this is a single-line comment
-        if (match('#'))
+        if (ptr < end && *ptr == '#')
         {
-            // Read until and end of line is reached
-            for (;;)
-            {
-                if (eof())
-                    return;
+            // Find the end of the line
+            auto eol = (const char*)memchr(ptr, '\n', end - ptr);
+            auto lineEnd = eol? eol:end;
 
-                if (readCh() == '\n')
-                    break;
+            // Comments can only contain valid input characters
+            for (; ptr < lineEnd; ++ptr)
+            {
+                if (!(chClass(*ptr) & CH_VALID))
+                {
+                    strIdx = ptr - inStr.data();
+                    readCh();
+                }
             }
 
+            ptr = eol? (eol + 1):end;
             continue;
         }
 
         // This isn't whitespace, stop
         break;
     }
+
+    strIdx = ptr - inStr.data();
+
+    // Report whitespace characters which are not valid input
+    if (ptr < end && isspace(*ptr))
+        readCh();
 }
 
 // Forward declaration
@@ -274,7 +327,7 @@ Value parseFloatingPart(Input& input, bool neg, char literal[64])
         else
             break;
     }
-    input.expect("f");
+    input.expect('f');
     float floatVal = atof(literal);
     if (neg)
     {
@@ -286,11 +339,29 @@ Value parseFloatingPart(Input& input, bool neg, char literal[64])
 /**
 Parse a string literal
 */
-std::string parseStringLit(Input& input, char endCh)
+String parseStringLit(Input& input, char endCh)
 {
     //std::cout << "parseStringLit" << std::endl;
 
-    std::string str;
+    auto start = input.curPtr();
+    auto end = input.endPtr();
+
+    // Scan up to the first character needing special handling
+    auto ptr = start;
+    while (ptr < end && *ptr != endCh && (chClass(*ptr) & CH_STR))
+        ptr++;
+
+    // If the string has no escape sequences, intern
+    // it straight from the input, without copying it
+    if (ptr < end && *ptr == endCh)
+    {
+        input.skip(ptr - start + 1);
+        return String(start, ptr - start);
+    }
+
+    // Parse the rest of the string character by character
+    std::string str(start, ptr - start);
+    input.skip(ptr - start);
 
     for (;;)
     {
@@ -376,7 +447,23 @@ std::string parseStringLit(Input& input, char endCh)
         str += ch;
     }
 
-    return str;
+    return String(str);
+}
+
+/// Scan an identifier, returning its length
+static size_t scanIdent(Input& input)
+{
+    auto start = input.curPtr();
+    auto end = input.endPtr();
+
+    if (start == end || !(chClass(*start) & CH_IDENT_START))
+        throw ParseError(input, "invalid identifier start");
+
+    auto ptr = start + 1;
+    while (ptr < end && (chClass(*ptr) & CH_IDENT))
+        ptr++;
+
+    return ptr - start;
 }
 
 /**
@@ -384,32 +471,37 @@ Parse an identifier string
 */
 std::string parseIdentStr(Input& input)
 {
-    std::string ident;
-
-    char firstCh = input.peek();
-
-    if (firstCh != '_' && !isalpha(firstCh))
-        throw ParseError(input, "invalid identifier start");
+    auto start = input.curPtr();
+    auto len = scanIdent(input);
+    input.skip(len);
 
-    for (;;)
-    {
-        // Peek at the next character
-        char ch = input.peek();
+    return std::string(start, len);
+}
 
-        if (!isalnum(ch) && ch != '_')
-            break;
+/**
+Parse an identifier as an interned string
+*/
+String parseIdent(Input& input)
+{
+    auto start = input.curPtr();
+    auto len = scanIdent(input);
+    input.skip(len);
 
-        // Consume this character
-        ident += input.readCh();
-    }
+    return String(start, len);
+}
 
-    if (ident.size() == 0)
-        throw ParseError(input, "invalid identifier");
+/**
+Parse an object field name, which can be a string literal
+*/
+String parseFieldName(Input& input)
+{
+    if (input.match('"'))
+        return parseStringLit(input, '"');
 
-    // Sanity check on the parsed identifier string
-    assert (isValidIdent(ident));
+    if (input.match('\''))
+        return parseStringLit(input, '\'');
 
-    return ident;
+    return parseIdent(input);
 }
 
 /**
@@ -447,7 +539,7 @@ std::vector<Value> parseExprList(Input& input, char endCh)
         }
 
         // If this is not the first element, there must be a separator
-        input.expect(",");
+        input.expect(',');
     }
 
     return exprs;
@@ -491,25 +583,10 @@ Value parseObject(Input& input)
         }
 
         // Parse the field name
-        std::string fieldName;
-
-        if (input.peek('"'))
-        {
-            input.readCh();
-            fieldName = parseStringLit(input, '"');
-        }
-        else if (input.peek('\''))
-        {
-            input.readCh();
-            fieldName = parseStringLit(input, '\'');
-        }
-        else
-        {
-            fieldName = parseIdentStr(input);
-        }
+        auto fieldName = parseFieldName(input);
 
         input.eatWS();
-        input.expect(":");
+        input.expect(':');
 
         // Parse an expression
         auto expr = parseExpr(input);
@@ -527,7 +604,7 @@ Value parseObject(Input& input)
         }
 
         // If this is not the first element, there must be a separator
-        input.expect(",");
+        input.expect(',');
     }
 
     return obj;
@@ -561,11 +638,11 @@ Value parseExpr(Input& input)
     // String literal
     if (input.match('\''))
     {
-        return String(parseStringLit(input, '\''));
+        return parseStringLit(input, '\'');
     }
     if (input.match('\"'))
     {
-        return String(parseStringLit(input, '\"'));
+        return parseStringLit(input, '\"');
     }
 
     // Array expression
@@ -585,7 +662,7 @@ Value parseExpr(Input& input)
     if (input.match('@'))
     {
         // Produce an image reference placeholder
-        return ImgRef(parseIdentStr(input));
+        return ImgRef(parseIdent(input));
     }
 
     // Special values
@@ -720,7 +797,8 @@ Value resolveRefs(
                 {
                     auto elemVal = arr.getElem(i);
                     auto newVal = processRef(globalDefs, stack, elemVal);
-                    arr.setElem(i, newVal);
+                    if (elemVal.getTag() == TAG_IMGREF)
+                        arr.setElem(i, newVal);
                 }
             }
             break;
@@ -732,12 +810,13 @@ Value resolveRefs(
                 // For each object field
                 for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
                 {
-                    auto fieldName = itr.get();
+                    auto fieldName = itr.getName();
                     auto fieldVal = obj.getField(fieldName);
 
                     auto newVal = processRef(globalDefs, stack, fieldVal);
 
-                    obj.setField(fieldName, newVal);
+                    if (fieldVal.getTag() == TAG_IMGREF)
+                        obj.setField(fieldName, newVal);
                     assert (obj.getField(fieldName).getTag() != TAG_IMGREF);
                 }
             }
@@ -781,7 +860,7 @@ Value parseInput(Input& input)
 
         // Match the assignment operator
         input.eatWS();
-        input.expect("=");
+        input.expect('=');
 
         // Cannot assign a global def to another global def
         input.eatWS();
@@ -808,7 +887,7 @@ Value parseInput(Input& input)
         // Every top-level expression must end with a semicolon
         // This allows splitting the input without fully parsing it
         input.eatWS();
-        input.expect(";");
+        input.expect(';');
     }
 
     // Parse the final expression. This is the value this image exports,
@@ -816,7 +895,7 @@ Value parseInput(Input& input)
     auto exports = parseExpr(input);
 
     input.eatWS();
-    input.expect(";");
+    input.expect(';');
 
     // If there remains unparsed input
     input.eatWS();
@@ -1021,6 +1100,13 @@ void testParser()
     testParseFail("'\\x0G';");
     testParseFail("'test invalid\\iescape seq'");
     testParseFail("'foo");
+    testParse("'a\"b';");
+    testParse("\"a'b\";");
+    testParseFail("'new\nline';");
+    testParseFail("'bad \x01 char';");
+
+    // Strings are interned whether or not they contain escapes
+    assert (parseString("'foo\\x62ar';", "test") == parseString("'foobar';", "test"));
 
     // Array literals
     testParse("[];", TAG_ARRAY);
@@ -1049,6 +1135,7 @@ void testParser()
     testParse("[ 1# comment\n,2 ];");
     testParseFail("1; /* comment */");
     testParseFail("1; # comment\n!1");
+    testParseFail("1; # bad \x01 char");
 
     // Global definitions
     testParse("x = 1; 1;", TAG_INT32);
@@ -1066,6 +1153,17 @@ void testParser()
     testParse("x = 1; y = 2; [@x, @y, 3];", TAG_ARRAY);
     testParseFail("x = 1; y = @x; @x");
 
+    // Source positions of errors
+    try
+    {
+        parseString("[1,\n  2,\n 3 x];", "pos_test");
+        assert (false);
+    }
+    catch (ParseError& err)
+    {
+        assert (err.toString() == "pos_test@3:4 - expected to find ','");
+    }
+
     // Parse test image files
     testParseFile("tests/vm/ex_image2.zim");
     testParseFile("tests/vm/ex_image.zim");
@@ -21,11 +21,16 @@ private:
     /// Current index in the input string
     size_t strIdx;
 
-    /// Current line number
-    size_t lineNo;
+    /// Position up to which line numbers were computed, the
+    /// line number there and the index where that line starts
+    /// Note: line and column numbers are computed lazily, only
+    /// when needed to report source positions
+    mutable size_t posIdx;
+    mutable size_t posLineNo;
+    mutable size_t posLineStart;
 
-    /// Current column number
-    size_t colNo;
+    /// Update the line number information up to the current index
+    void updatePos() const;
 
 public:
 
@@ -42,7 +47,13 @@ public:
     bool eof();
 
     /// Peek at a character from the input
-    char peek();
+    char peek()
+    {
+        if (strIdx >= inStr.length())
+            return '\0';
+
+        return inStr[strIdx];
+    }
 
     /// Peek to see if a specific character is next in the input
     bool peek(char ch);
@@ -52,27 +63,49 @@ public:
 
     /// Try and match a given character in the input
     /// The character is consumed if matched
-    bool match(char ch);
+    bool match(char ch)
+    {
+        if (peek() != ch)
+            return false;
+
+        readCh();
+        return true;
+    }
 
     /// Try and match a given string in the input
     /// The string is consumed if matched
     bool match(const std::string& str);
 
+    /// Fail if the input doesn't match a given character
+    void expect(char ch);
+
     /// Fail if the input doesn't match a given string
     void expect(const std::string str);
 
     /// Consume whitespace and comments
     void eatWS();
 
+    /// Get a pointer to the current position and to the end of the input,
+    /// for scanning over multiple characters at once
+    const char* curPtr() const { return inStr.data() + strIdx; }
+    const char* endPtr() const { return inStr.data() + inStr.length(); }
+
+    /// Consume characters which were already scanned and validated
+    void skip(size_t numChars)
+    {
+        assert (strIdx + numChars <= inStr.length());
+        strIdx += numChars;
+    }
+
     /// Get the entire input as a string
-    std::string getInputStr() const { return inStr; }
+    const std::string& getInputStr() const { return inStr; }
 
     /// Get the current index in the input
     size_t getInputIdx() const { return strIdx; }
 
     std::string getSrcName() const { return srcName; }
-    size_t getLineNo() const { return lineNo; }
-    size_t getColNo() const { return colNo; }
+    size_t getLineNo() const;
+    size_t getColNo() const;
 };
 
 /**
@@ -104,6 +137,9 @@ public:
     }
 };
 
+/// Read an entire file at once
+std::string readFile(std::string fileName);
+
 // Parse the optional language directive at the beginning of a file
 std::string parseLang(Input& input);
 
@@ -1,8 +1,15 @@
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "runtime.h"
+#include "gc.h"
 
 /// Undefined value constant
 /// Note: zeroed memory is automatically undefined
@@ -17,15 +24,15 @@ const Value Value::ZERO(Word(int64_t(0)), TAG_INT32);
 const Value Value::ONE(Word(int64_t(1)), TAG_INT32);
 const Value Value::TWO(Word(int64_t(2)), TAG_INT32);
 
-// Global virtual machine instance
-VM vm;
-// Global string pool
-StringPool stringPool;
+// Virtual machine instance of the current isolate
+thread_local VM vm;
+// String pool of the current isolate
+thread_local StringPool stringPool;
 
 /// Produce a string representation of a value
 std::string Value::toString() const
 {
-    switch (tag)
+    switch (getTag())
     {
         case TAG_UNDEF:
         return "$undef";
@@ -34,10 +41,10 @@ std::string Value::toString() const
         return (*this == Value::TRUE)? "$true":"$false";
 
         case TAG_INT32:
-        return std::to_string(word.int32);
+        return std::to_string(getWord().int32);
 
         case TAG_FLOAT32:
-        return std::to_string(word.float32);
+        return std::to_string(getWord().float32);
 
         case TAG_STRING:
         return (std::string)*this;
@@ -56,7 +63,7 @@ std::string Value::toString() const
 /// Determine if this value is of a pointer type
 bool Value::isPointer() const
 {
-    switch (tag)
+    switch (getTag())
     {
         case TAG_STRING:
         case TAG_ARRAY:
@@ -78,10 +85,91 @@ Value::operator std::string () const
 
 VM::VM()
 {
+    for (size_t i = 0; i < NUM_POOLS; ++i)
+    {
+        pools[i].blockSize = (
+            (i < POOL_WORD_MAX / POOL_GRAIN)?
+            ((i + 1) * POOL_GRAIN):
+            (POOL_WORD_MAX + (i + 1 - POOL_WORD_MAX / POOL_GRAIN) * POOL_COARSE_GRAIN)
+        );
+    }
+
+    assert (pools[NUM_POOLS - 1].blockSize == POOL_MAX);
+}
+
+/// Free the C++ data owned by a heap block about to be freed
+static void freeBlockData(refptr ptr)
+{
+    auto header = *(uint64_t*)ptr;
+
+    if ((Tag)header != TAG_OBJECT)
+        return;
+
+    // Objects which were extended hand their shape over to the
+    // object they were extended into, and then have none
+    auto shape = *(Shape**)(ptr + Object::OF_SHAPE);
+    if (shape)
+        Shape::freeDict(shape);
+}
+
+VM::~VM()
+{
+    for (auto& pool : pools)
+    {
+        for (auto slab : pool.slabs)
+        {
+            auto limit = slab + (SLAB_SIZE / pool.blockSize) * pool.blockSize;
+
+            for (auto ptr = slab; ptr < limit; ptr += pool.blockSize)
+                if (*(uint64_t*)ptr != 0)
+                    freeBlockData(ptr);
+
+            ::free(slab);
+        }
+    }
+
+    for (auto& pair : largeObjs)
+    {
+        freeBlockData(pair.first);
+        ::free(pair.first);
+    }
+
+    for (auto& pair : mappedObjs)
+        munmap(pair.second.base, pair.second.len);
 }
 
 StringPool::StringPool()
+: slots(INIT_SLOTS, nullptr)
+{
+}
+
+/// Get the size class index for a given block size
+size_t VM::poolIdx(size_t size)
 {
+    assert (size > 0 && size <= POOL_MAX);
+
+    if (size <= POOL_WORD_MAX)
+        return (size - 1) / POOL_GRAIN;
+
+    return (
+        POOL_WORD_MAX / POOL_GRAIN +
+        (size - POOL_WORD_MAX - 1) / POOL_COARSE_GRAIN
+    );
+}
+
+/// Allocate a new slab for a pool
+void VM::newSlab(Pool& pool)
+{
+    // Note: calloc gives us zeroed memory, so blocks
+    // bump-allocated from a fresh slab need no clearing
+    auto slab = (refptr)calloc(1, SLAB_SIZE);
+
+    if (!slab)
+        throw RunError("failed to allocate heap slab");
+
+    pool.slabs.push_back(slab);
+    pool.bumpPtr = slab;
+    pool.bumpLimit = slab + (SLAB_SIZE / pool.blockSize) * pool.blockSize;
 }
 
 /**
@@ -90,8 +178,48 @@ Note that this function guarantees that the memory is zeroed out
 */
 Value VM::alloc(uint32_t size, Tag tag)
 {
-    // FIXME: use an alloc pool of some kind
-    auto ptr = (refptr)calloc(1, size);
+    // Free blocks are recognized by their zero header
+    assert (tag != TAG_UNDEF);
+
+    // Every block must be able to hold a header and a free list link
+    if (size < 2 * HEADER_SIZE)
+        size = 2 * HEADER_SIZE;
+
+    refptr ptr;
+
+    if (size <= POOL_MAX)
+    {
+        auto& pool = pools[poolIdx(size)];
+
+        // Reuse a freed block if possible
+        if (pool.freeList)
+        {
+            ptr = pool.freeList;
+            pool.freeList = *(refptr*)(ptr + HEADER_SIZE);
+            memset(ptr, 0, pool.blockSize);
+        }
+        else
+        {
+            if (pool.bumpPtr == pool.bumpLimit)
+                newSlab(pool);
+
+            ptr = pool.bumpPtr;
+            pool.bumpPtr += pool.blockSize;
+        }
+
+        pool.numBlocks++;
+        totalBytes += pool.blockSize;
+    }
+    else
+    {
+        ptr = (refptr)calloc(1, size);
+
+        if (!ptr)
+            throw RunError("failed to allocate large object");
+
+        largeObjs[ptr] = size;
+        totalBytes += size;
+    }
 
     // Set the tag in the object header
     *(Tag*)ptr = tag;
@@ -100,6 +228,208 @@ Value VM::alloc(uint32_t size, Tag tag)
     return Value(ptr, tag);
 }
 
+/**
+Return a block of memory to the heap
+Note: the size must be the one the block was allocated with
+*/
+void VM::free(refptr ptr, size_t size)
+{
+    assert (ptr != nullptr);
+
+    // The allocated size only peaks before blocks are freed
+    peakBytes = std::max(peakBytes, totalBytes);
+    auto prevBytes = totalBytes;
+
+    if (size < 2 * HEADER_SIZE)
+        size = 2 * HEADER_SIZE;
+
+    if (size <= POOL_MAX)
+    {
+        auto& pool = pools[poolIdx(size)];
+        assert (pool.numBlocks > 0);
+
+        // Free blocks have a zero header, which is never
+        // a valid tag for heap-allocated values
+        *(uint64_t*)ptr = 0;
+        *(refptr*)(ptr + HEADER_SIZE) = pool.freeList;
+        pool.freeList = ptr;
+
+        pool.numBlocks--;
+        totalBytes -= pool.blockSize;
+    }
+    else
+    {
+        auto itr = largeObjs.find(ptr);
+        assert (itr != largeObjs.end());
+        totalBytes -= itr->second;
+        largeObjs.erase(itr);
+        ::free(ptr);
+    }
+
+    freedBytes += prevBytes - totalBytes;
+}
+
+Value VM::mapFile(int fd, size_t fileSize, size_t dataOfs, Tag tag)
+{
+    assert (tag != TAG_UNDEF);
+
+    // The block starts in an anonymous page, which holds its header,
+    // and the file gets mapped right after that page
+    auto pageSize = size_t(sysconf(_SC_PAGESIZE));
+    assert (dataOfs <= pageSize);
+    auto mapLen = pageSize + fileSize;
+
+    auto base = (refptr)mmap(
+        nullptr,
+        mapLen,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+
+    if (base == MAP_FAILED)
+        throw RunError("failed to map file into memory");
+
+    if (fileSize > 0)
+    {
+        auto data = mmap(
+            base + pageSize,
+            fileSize,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED,
+            fd,
+            0
+        );
+
+        if (data == MAP_FAILED)
+        {
+            munmap(base, mapLen);
+            throw RunError("failed to map file into memory");
+        }
+    }
+
+    auto ptr = base + pageSize - dataOfs;
+    *(Tag*)ptr = tag;
+    mappedObjs[ptr] = { base, mapLen };
+
+    return Value(ptr, tag);
+}
+
+/**
+Free all unmarked blocks and clear the mark bit on the others
+Note: free blocks have a zero header, so they are skipped
+*/
+void VM::sweep()
+{
+    peakBytes = std::max(peakBytes, totalBytes);
+    auto prevBytes = totalBytes;
+
+    for (auto& pool : pools)
+    {
+        for (auto slab : pool.slabs)
+        {
+            auto limit = slab + (SLAB_SIZE / pool.blockSize) * pool.blockSize;
+
+            for (auto ptr = slab; ptr < limit; ptr += pool.blockSize)
+            {
+                auto& header = *(uint64_t*)ptr;
+
+                if (header == 0)
+                    continue;
+
+                if (header & HEADER_MSK_MARK)
+                {
+                    header &= ~HEADER_MSK_MARK;
+                    continue;
+                }
+
+                freeBlockData(ptr);
+                header = 0;
+                *(refptr*)(ptr + HEADER_SIZE) = pool.freeList;
+                pool.freeList = ptr;
+
+                pool.numBlocks--;
+                totalBytes -= pool.blockSize;
+            }
+        }
+    }
+
+    for (auto itr = largeObjs.begin(); itr != largeObjs.end();)
+    {
+        auto ptr = itr->first;
+        auto& header = *(uint64_t*)ptr;
+
+        if (header & HEADER_MSK_MARK)
+        {
+            header &= ~HEADER_MSK_MARK;
+            ++itr;
+            continue;
+        }
+
+        freeBlockData(ptr);
+        totalBytes -= itr->second;
+        ::free(ptr);
+        itr = largeObjs.erase(itr);
+    }
+
+    for (auto itr = mappedObjs.begin(); itr != mappedObjs.end();)
+    {
+        auto& header = *(uint64_t*)itr->first;
+
+        if (header & HEADER_MSK_MARK)
+        {
+            header &= ~HEADER_MSK_MARK;
+            ++itr;
+            continue;
+        }
+
+        munmap(itr->second.base, itr->second.len);
+        itr = mappedObjs.erase(itr);
+    }
+
+    freedBytes += prevBytes - totalBytes;
+}
+
+/// Get the total number of bytes currently allocated
+size_t VM::allocated() const
+{
+    return totalBytes;
+}
+
+/// Get the largest number of bytes allocated at any one time
+size_t VM::peakAllocated() const
+{
+    return std::max(peakBytes, totalBytes);
+}
+
+/// Get the number of bytes allocated since the heap was created
+uint64_t VM::totalAllocated() const
+{
+    return freedBytes + totalBytes;
+}
+
+/// Get the block size of a given pool
+size_t VM::poolBlockSize(size_t poolIdx) const
+{
+    assert (poolIdx < NUM_POOLS);
+    return pools[poolIdx].blockSize;
+}
+
+/// Get the number of blocks allocated in a given pool
+size_t VM::poolBlocks(size_t poolIdx) const
+{
+    assert (poolIdx < NUM_POOLS);
+    return pools[poolIdx].numBlocks;
+}
+
+/// Get the number of slabs owned by a given pool
+size_t VM::poolSlabs(size_t poolIdx) const
+{
+    assert (poolIdx < NUM_POOLS);
+    return pools[poolIdx].slabs.size();
+}
+
 void Wrapper::setNextPtr(refptr obj, refptr nextPtr)
 {
     // Get the object header
@@ -135,7 +465,17 @@ refptr Wrapper::getObjPtr()
 
 String::String(std::string str)
 {
-    this->val = stringPool.getString(str);
+    this->val = stringPool.getString(str.data(), str.length());
+}
+
+String::String(const char* str)
+{
+    this->val = stringPool.getString(str, strlen(str));
+}
+
+String::String(const char* str, size_t len)
+{
+    this->val = stringPool.getString(str, len);
 }
 
 String::String(Value value)
@@ -156,10 +496,106 @@ const char* String::getDataPtr() const
 {
     auto ptr = (refptr)val;
     assert (ptr != nullptr);
+
+    if (*(uint64_t*)ptr & HEADER_MSK_ROPE)
+        ptr = flatten(ptr);
+
     auto strdata = (char*)(ptr + OF_DATA);
     return strdata;
 }
 
+refptr String::flatten(refptr rope)
+{
+    auto& left = *(refptr*)(rope + OF_LEFT);
+    auto& right = *(refptr*)(rope + OF_RIGHT);
+
+    // Already flattened
+    if (right == nullptr)
+        return left;
+
+    auto len = *(uint32_t*)(rope + OF_LEN);
+    auto flat = (refptr)alloc(len);
+    auto dst = (char*)(flat + OF_DATA);
+
+    // Copy the leaves from left to right, without recursing,
+    // since ropes built by appending are deep
+    std::vector<refptr> stack = { rope };
+    while (!stack.empty())
+    {
+        auto ptr = stack.back();
+        stack.pop_back();
+
+        if (*(uint64_t*)ptr & HEADER_MSK_ROPE)
+        {
+            auto r = *(refptr*)(ptr + OF_RIGHT);
+            auto l = *(refptr*)(ptr + OF_LEFT);
+
+            if (r)
+                stack.push_back(r);
+            stack.push_back(l);
+            continue;
+        }
+
+        auto leafLen = *(uint32_t*)(ptr + OF_LEN);
+        memcpy(dst, ptr + OF_DATA, leafLen);
+        dst += leafLen;
+    }
+
+    assert (dst == (char*)(flat + OF_DATA) + len);
+
+    // The halves are no longer needed
+    left = flat;
+    right = nullptr;
+
+    return flat;
+}
+
+String String::alloc(size_t len)
+{
+    if (len > UINT32_MAX)
+        throw RunError("string too long");
+
+    auto val = vm.alloc(memSize(len), TAG_STRING);
+    auto ptr = (refptr)val;
+
+    // Zeroed memory provides the null terminator
+    *(uint32_t*)(ptr + OF_LEN) = len;
+
+    return String(val);
+}
+
+String String::intern() const
+{
+    if (isInterned())
+        return *this;
+
+    auto ptr = (refptr)val;
+    if (isRope())
+        ptr = flatten(ptr);
+
+    return String(stringPool.intern(ptr));
+}
+
+uint32_t String::hashChars(const char* str, size_t len)
+{
+    auto hash = uint32_t(murmurHash2(str, len, 1337));
+    return hash? hash:1;
+}
+
+uint32_t String::hash() const
+{
+    auto ptr = (refptr)val;
+    auto hash = getHash(ptr);
+
+    if (hash == 0)
+    {
+        hash = hashChars(getDataPtr(), length());
+        setHash(ptr, hash);
+    }
+
+    return hash;
+}
+
 /// Casting operator to extract a string value
 String::operator std::string ()
 {
@@ -174,6 +610,28 @@ bool String::operator == (const char* that) const
     return strcmp(getDataPtr(), that) == 0;
 }
 
+bool String::operator == (String that) const
+{
+    if (val == that.val)
+        return true;
+
+    // Distinct interned strings always differ
+    if (isInterned() && that.isInterned())
+        return false;
+
+    auto len = length();
+    if (len != that.length())
+        return false;
+
+    // Compare hash codes only if both are already known
+    auto hashA = getHash(val);
+    auto hashB = getHash(that.val);
+    if (hashA && hashB && hashA != hashB)
+        return false;
+
+    return memcmp(getDataPtr(), that.getDataPtr(), len) == 0;
+}
+
 /// Get the ith character code
 char String::operator [] (size_t i)
 {
@@ -185,19 +643,37 @@ char String::operator [] (size_t i)
 
 String String::concat(String a, String b)
 {
-    auto lenA = a.length();
-    auto lenB = b.length();
+    size_t lenA = a.length();
+    size_t lenB = b.length();
 
-    std::string c;
-    c.resize(lenA + lenB);
+    if (lenA == 0)
+        return b;
+    if (lenB == 0)
+        return a;
 
-    for (size_t i = 0; i < lenA; ++i)
-        c[i] = a[i];
+    auto len = lenA + lenB;
 
-    for (size_t i = 0; i < lenB; ++i)
-        c[lenA + i] = b[i];
+    // Short strings are cheaper to copy than to link
+    if (len <= MAX_FLAT_CAT)
+    {
+        auto c = alloc(len);
+        auto dst = (char*)((refptr)c.val + OF_DATA);
+        memcpy(dst, a.getDataPtr(), lenA);
+        memcpy(dst + lenA, b.getDataPtr(), lenB);
+        return c;
+    }
+
+    if (len > UINT32_MAX)
+        throw RunError("string too long");
+
+    auto val = vm.alloc(ROPE_SIZE, TAG_STRING);
+    auto ptr = (refptr)val;
+    *(uint64_t*)ptr |= HEADER_MSK_ROPE;
+    *(uint32_t*)(ptr + OF_LEN) = len;
+    *(refptr*)(ptr + OF_LEFT) = (refptr)a.val;
+    *(refptr*)(ptr + OF_RIGHT) = (refptr)b.val;
 
-    return String(c);
+    return String(val);
 }
 
 /// Allocate a new array of a given length
@@ -225,6 +701,85 @@ Array::Array(Value value)
     this->val = value;
 }
 
+size_t Array::elemSize(ElemType type)
+{
+    switch (type)
+    {
+        case ELEM_VALUE:    return sizeof(Word) + sizeof(Tag);
+        case ELEM_INT32:    return sizeof(int32_t);
+        case ELEM_FLOAT32:  return sizeof(float);
+        case ELEM_UINT8:    return sizeof(uint8_t);
+        case ELEM_INT16:    return sizeof(int16_t);
+    }
+
+    assert (false);
+    return 0;
+}
+
+Array Array::alloc(ElemType type, size_t cap)
+{
+    if (type == ELEM_VALUE)
+        return Array(cap);
+
+    if (cap > UINT32_MAX || cap * elemSize(type) > UINT32_MAX - OF_DATA)
+        throw RunError("typed array too large");
+
+    auto val = vm.alloc(OF_DATA + cap * elemSize(type), TAG_ARRAY);
+    auto ptr = (refptr)val;
+    *(uint64_t*)ptr |= uint64_t(type) << HEADER_IDX_ELEMS;
+    *(uint32_t*)(ptr + OF_CAP) = cap;
+    *(uint32_t*)(ptr + OF_LEN) = 0;
+
+    return Array(val);
+}
+
+Array Array::newTyped(ElemType type, size_t len)
+{
+    assert (type != ELEM_VALUE);
+
+    // Zeroed memory provides the initial elements
+    auto arr = alloc(type, len);
+    *(uint32_t*)((refptr)arr.val + OF_LEN) = len;
+
+    return arr;
+}
+
+Array Array::mapFile(std::string path)
+{
+    auto fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw RunError("failed to open file \"" + path + "\"");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) > UINT32_MAX)
+    {
+        close(fd);
+        throw RunError("failed to map file \"" + path + "\"");
+    }
+
+    Value val;
+    try
+    {
+        val = vm.mapFile(fd, st.st_size, OF_DATA, TAG_ARRAY);
+    }
+    catch (RunError&)
+    {
+        close(fd);
+        throw;
+    }
+
+    // The mapping stays valid once the file is closed
+    close(fd);
+
+    auto ptr = (refptr)val;
+    *(uint64_t*)ptr |= uint64_t(ELEM_UINT8) << HEADER_IDX_ELEMS;
+    *(uint32_t*)(ptr + OF_CAP) = st.st_size;
+    *(uint32_t*)(ptr + OF_LEN) = st.st_size;
+
+    return Array(val);
+}
+
 size_t Array::getCap()
 {
     auto ptr = getObjPtr();
@@ -239,36 +794,116 @@ uint32_t Array::length()
     return len;
 }
 
+uint8_t* Array::getElemPtr()
+{
+    assert (getElemType() != ELEM_VALUE);
+    return getObjPtr() + OF_DATA;
+}
+
+/// Write an element into the data of an array object, checking
+/// that the value matches the element type of typed arrays
+static void writeElem(refptr ptr, ElemType type, size_t i, Value v)
+{
+    auto data = ptr + Array::OF_DATA;
+
+    if (type == ELEM_VALUE)
+    {
+        auto cap = *(uint32_t*)(ptr + Array::OF_CAP);
+        auto words = (Word*)data;
+        auto tags  = (Tag*) (data + cap * sizeof(Word));
+        words[i] = v.getWord();
+        tags[i] = v.getTag();
+        return;
+    }
+
+    Array::writeTyped(data, type, i, v);
+}
+
+void Array::writeTyped(uint8_t* data, ElemType type, size_t i, Value v)
+{
+    switch (type)
+    {
+        case ELEM_INT32:
+        if (!v.isInt32())
+            throw RunError("int32 array elements must be int32 values");
+        ((int32_t*)data)[i] = (int32_t)v;
+        return;
+
+        case ELEM_FLOAT32:
+        if (!v.isFloat32())
+            throw RunError("float32 array elements must be float32 values");
+        ((float*)data)[i] = (float)v;
+        return;
+
+        case ELEM_UINT8:
+        if (!v.isInt32() || (int32_t)v < 0 || (int32_t)v > UINT8_MAX)
+            throw RunError("uint8 array elements must be int32 values in [0, 255]");
+        data[i] = (uint8_t)(int32_t)v;
+        return;
+
+        case ELEM_INT16:
+        if (!v.isInt32() || (int32_t)v < INT16_MIN || (int32_t)v > INT16_MAX)
+            throw RunError("int16 array elements must be int32 values in [-32768, 32767]");
+        ((int16_t*)data)[i] = (int16_t)(int32_t)v;
+        return;
+
+        case ELEM_VALUE:
+        break;
+    }
+
+    assert (false);
+}
+
+Value Array::readTyped(const uint8_t* data, ElemType type, size_t i)
+{
+    switch (type)
+    {
+        case ELEM_INT32:
+        return Value::int32(((int32_t*)data)[i]);
+
+        case ELEM_FLOAT32:
+        return Value::float32(((float*)data)[i]);
+
+        case ELEM_UINT8:
+        return Value::int32(data[i]);
+
+        case ELEM_INT16:
+        return Value::int32(((int16_t*)data)[i]);
+
+        case ELEM_VALUE:
+        break;
+    }
+
+    assert (false);
+    return Value::UNDEF;
+}
+
 /// Set the value of the ith element
 void Array::setElem(size_t i, Value v)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
-
-    assert (length() <= getCap());
-    assert (i < length());
-    words[i] = v.getWord();
-    tags[i] = v.getTag();
+    assert (i < *(uint32_t*)(ptr + OF_LEN));
+    writeElem(ptr, getElemType(), i, v);
 }
 
 /// Get the value of the ith element
 Value Array::getElem(size_t i)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto data = ptr + OF_DATA;
+    assert (i < *(uint32_t*)(ptr + OF_LEN));
 
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
+    auto type = getElemType();
 
-    assert (length() <= getCap());
-    assert (i < length());
-    auto word = words[i];
-    auto tag = tags[i];
+    if (type == ELEM_VALUE)
+    {
+        auto cap = *(uint32_t*)(ptr + OF_CAP);
+        auto words = (Word*)data;
+        auto tags  = (Tag*) (data + cap * sizeof(Word));
+        return Value(words[i], tags[i]);
+    }
 
-    return Value(word, tag);
+    return readTyped(data, type, i);
 }
 
 void Array::push(Value val)
@@ -276,6 +911,7 @@ void Array::push(Value val)
     auto ptr = getObjPtr();
     auto cap = getCap();
     auto len = length();
+    auto type = getElemType();
     assert (len <= cap);
 
     // If the array is at capacity
@@ -284,11 +920,19 @@ void Array::push(Value val)
         // Create a new array with twice the capacity
         auto newCap = 2 * cap + 1;
         //std::cerr << "extending array capacity from " << cap << " to " << newCap << std::endl;
-        auto newArr = Array(newCap);
+        auto newArr = alloc(type, newCap);
 
         // Copy elements to the new array
-        for (size_t i = 0; i < len; ++i)
-            newArr.push(getElem(i));
+        if (type == ELEM_VALUE)
+        {
+            for (size_t i = 0; i < len; ++i)
+                newArr.push(getElem(i));
+        }
+        else
+        {
+            memcpy(newArr.getElemPtr(), ptr + OF_DATA, len * elemSize(type));
+            *(uint32_t*)((refptr)newArr.val + OF_LEN) = len;
+        }
 
         // Set the next pointer on this object
         auto rootObjPtr = (refptr)this->val;
@@ -301,11 +945,7 @@ void Array::push(Value val)
         //std::cout << "done extending array" << std::endl;
     }
 
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
-
-    words[len] = val.getWord();
-    tags[len] = val.getTag();
+    writeElem(ptr, type, len, val);
 
     // Increment the length
     *(uint32_t*)(ptr + OF_LEN) = len + 1;
@@ -329,6 +969,217 @@ Array Array::concat(Array a, Array b)
 }
 */
 
+Shape::Shape(Shape* parent, refptr name)
+: parent(parent),
+  name(name),
+  slotIdx(parent? parent->numSlots:0),
+  numSlots(parent? parent->numSlots + 1:0)
+{
+}
+
+Shape* Shape::empty()
+{
+    static thread_local Shape* emptyShape = new Shape(nullptr, nullptr);
+    return emptyShape;
+}
+
+/// Test if a field name is an identifier, [A-Za-z_$][A-Za-z0-9_$]*
+static bool isIdentName(refptr name)
+{
+    auto len = *(uint32_t*)(name + String::OF_LEN);
+    auto chars = (const char*)(name + String::OF_DATA);
+
+    if (len == 0 || isdigit((unsigned char)chars[0]))
+        return false;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        auto c = (unsigned char)chars[i];
+        if (!isalnum(c) && c != '_' && c != '$')
+            return false;
+    }
+
+    return true;
+}
+
+Shape* Shape::toDict()
+{
+    std::vector<refptr> names;
+    getNames(names);
+
+    size_t numTableSlots = 8;
+    while (numTableSlots < 2 * (names.size() + 1))
+        numTableSlots *= 2;
+
+    auto shape = new Shape(nullptr, nullptr);
+    shape->dict = new Dict();
+    shape->dict->slots.assign(numTableSlots, uint32_t(NOT_FOUND));
+
+    for (auto fieldName : names)
+        shape->dictAdd(fieldName);
+
+    return shape;
+}
+
+void Shape::dictAdd(refptr fieldName)
+{
+    auto& slots = dict->slots;
+
+    // Keep the table at most half full
+    if (2 * (numSlots + 1) > slots.size())
+    {
+        slots.assign(2 * slots.size(), uint32_t(NOT_FOUND));
+        auto mask = slots.size() - 1;
+
+        for (uint32_t i = 0; i < numSlots; ++i)
+        {
+            auto idx = String::getHash(dict->names[i]) & mask;
+            while (slots[idx] != NOT_FOUND)
+                idx = (idx + 1) & mask;
+            slots[idx] = i;
+        }
+    }
+
+    auto mask = slots.size() - 1;
+    auto idx = String::getHash(fieldName) & mask;
+    while (slots[idx] != NOT_FOUND)
+        idx = (idx + 1) & mask;
+
+    slots[idx] = numSlots;
+    dict->names.push_back(fieldName);
+    numSlots++;
+}
+
+void Shape::freeDict(Shape* shape)
+{
+    if (!shape->dict)
+        return;
+
+    delete shape->dict;
+    delete shape;
+}
+
+uint32_t Shape::getSlotIdx(refptr fieldName)
+{
+    if (dict)
+    {
+        auto& slots = dict->slots;
+        auto mask = slots.size() - 1;
+
+        for (auto idx = String::getHash(fieldName) & mask;; idx = (idx + 1) & mask)
+        {
+            auto slotIdx = slots[idx];
+
+            if (slotIdx == NOT_FOUND || dict->names[slotIdx] == fieldName)
+                return slotIdx;
+        }
+    }
+
+    // For small shapes, walk the parent chain
+    if (numSlots <= MAP_MIN_SLOTS)
+    {
+        for (auto shape = this; shape->parent; shape = shape->parent)
+        {
+            if (shape->name == fieldName)
+                return shape->slotIdx;
+        }
+
+        return NOT_FOUND;
+    }
+
+    if (slotMap == nullptr)
+    {
+        slotMap = new std::unordered_map<refptr, uint32_t>();
+
+        for (auto shape = this; shape->parent; shape = shape->parent)
+            (*slotMap)[shape->name] = shape->slotIdx;
+    }
+
+    auto itr = slotMap->find(fieldName);
+
+    if (itr == slotMap->end())
+        return NOT_FOUND;
+
+    return itr->second;
+}
+
+Shape* Shape::addField(refptr fieldName)
+{
+    assert (getSlotIdx(fieldName) == NOT_FOUND);
+
+    if (dict)
+    {
+        dictAdd(fieldName);
+        return this;
+    }
+
+    auto itr = transitions.find(fieldName);
+
+    if (itr != transitions.end())
+        return itr->second;
+
+    // Objects used as maps switch to dictionary mode, instead of
+    // growing the shape tree with each new key
+    if (numSlots >= DICT_MIN_SLOTS || !isIdentName(fieldName))
+    {
+        auto shape = toDict();
+        shape->dictAdd(fieldName);
+        return shape;
+    }
+
+    auto shape = new Shape(this, fieldName);
+    transitions[fieldName] = shape;
+    return shape;
+}
+
+void Shape::getNames(std::vector<refptr>& names) const
+{
+    if (dict)
+    {
+        names = dict->names;
+        return;
+    }
+
+    names.resize(numSlots);
+
+    for (auto shape = this; shape->parent; shape = shape->parent)
+        names[shape->slotIdx] = shape->name;
+}
+
+thread_local uint64_t FieldPIC::numMisses = 0;
+
+uint32_t FieldPIC::miss(Shape* shape, refptr fieldName)
+{
+    // Dictionary shapes change in place, and may get freed
+    if (shape->isDict())
+        return shape->getSlotIdx(fieldName);
+
+    numMisses++;
+
+    // The entries are only valid for one field name
+    if (fieldName != name)
+    {
+        name = fieldName;
+
+        for (size_t i = 0; i < NUM_ENTRIES; ++i)
+            shapes[i] = nullptr;
+    }
+
+    auto slotIdx = shape->getSlotIdx(fieldName);
+
+    // Evict the oldest entry
+    for (size_t i = NUM_ENTRIES - 1; i > 0; --i)
+    {
+        shapes[i] = shapes[i - 1];
+        slotIdxs[i] = slotIdxs[i - 1];
+    }
+
+    shapes[0] = shape;
+    slotIdxs[0] = slotIdx;
+
+    return slotIdx;
+}
+
 /// Allocate a new empty object
 Object Object::newObject(size_t cap)
 {
@@ -342,10 +1193,10 @@ Object Object::newObject(size_t cap)
     auto val = vm.alloc(numBytes, TAG_OBJECT);
     auto ptr = (refptr)val;
 
-    // Set the object capacity
+    // Set the object capacity and shape
     *(uint32_t*)(ptr + OF_CAP) = cap;
-
-    // TODO: init object shape, when shapes actually implemented!
+    *(uint32_t*)(ptr + OF_HIDDEN) = 0;
+    *(Shape**)(ptr + OF_SHAPE) = Shape::empty();
 
     // No field initialization necessary
 
@@ -367,140 +1218,165 @@ size_t Object::getCap()
     return cap;
 }
 
-size_t Object::getSlotIdx(
-    refptr ptr,
-    size_t cap,
-    String fieldName,
-    bool newField
-)
+Shape* Object::getShape()
 {
-    auto values = (Value*)(ptr + OF_FIELDS);
-
-    // FIXME: for now, we use a dumb key-pair linear search strategy
-    size_t idx = 0;
-    for (; idx < cap; idx += 2)
-    {
-        // Empty slot, property name not found
-        if (values[idx] == Value::UNDEF)
-            return newField? idx:cap;
-
-        assert (values[idx].isString());
-
-        // Slot found
-        if ((String)values[idx] == fieldName)
-            return idx;
-    }
-
-    return cap;
+    auto ptr = getObjPtr();
+    return *(Shape**)(ptr + OF_SHAPE);
 }
 
 bool Object::hasField(String fieldName)
 {
-    auto ptr = getObjPtr();
-    auto cap = getCap();
+    // Shapes identify field names by their interned string
+    if (!fieldName.isInterned())
+        fieldName = fieldName.intern();
 
-    auto slotIdx = getSlotIdx(ptr, cap, fieldName, false);
-
-    return (slotIdx < cap);
+    auto slotIdx = getShape()->getSlotIdx(fieldName);
+    return (slotIdx != Shape::NOT_FOUND);
 }
 
 void Object::setField(String name, Value value)
 {
+    if (isFrozen())
+    {
+        throw RunError(
+            "cannot set field \"" + (std::string)name + "\" of frozen object"
+        );
+    }
+
+    if (!name.isInterned())
+        name = name.intern();
+
     auto ptr = getObjPtr();
     auto cap = getCap();
+    auto shape = getShape();
 
-    auto slotIdx = getSlotIdx(ptr, cap, name, true);
+    auto slotIdx = shape->getSlotIdx(name);
 
-    // If we've exceeded the object capacity
-    if (slotIdx >= cap)
+    // If this is a new field, transition to a new shape
+    if (slotIdx == Shape::NOT_FOUND)
     {
-        // Create a new object with twice the capacity
-        assert (cap > 0);
-        auto newCap = 2 * cap;
-        //std::cout << "extending object capacity from " << cap << " to " << newCap << std::endl;
-        auto newObj = Object::newObject(newCap);
+        slotIdx = shape->getNumSlots();
 
-        // Copy properties to the new object
-        for (auto itr = ObjFieldItr(*this); itr.valid(); itr.next())
+        // If we've exceeded the object capacity
+        if (slotIdx >= cap)
         {
-            auto fieldName = itr.get();
-            auto fieldVal = getField(fieldName);
-            newObj.setField(fieldName, fieldVal);
+            // Create a new object with twice the capacity
+            assert (cap > 0);
+            auto newCap = 2 * cap;
+            auto newObj = Object::newObject(newCap);
+            auto newPtr = newObj.getObjPtr();
+
+            // Move the shape, and copy the hidden slot and field values
+            // to the new object
+            *(Shape**)(newPtr + OF_SHAPE) = shape;
+            *(Shape**)(ptr + OF_SHAPE) = nullptr;
+            *(uint32_t*)(newPtr + OF_HIDDEN) = *(uint32_t*)(ptr + OF_HIDDEN);
+            memcpy(newPtr + OF_FIELDS, ptr + OF_FIELDS, slotIdx * sizeof(Word));
+            memcpy(
+                newPtr + OF_FIELDS + newCap * sizeof(Word),
+                ptr + OF_FIELDS + cap * sizeof(Word),
+                slotIdx * sizeof(Tag)
+            );
+
+            // Set the next pointer on this object
+            auto rootObjPtr = (refptr)val;
+            setNextPtr(rootObjPtr, newPtr);
+            assert (getObjPtr() != ptr);
+
+            ptr = newPtr;
+            cap = newCap;
         }
 
-        // Set the next pointer on this object
-        auto newObjPtr = newObj.getObjPtr();
-        auto rootObjPtr = (refptr)val;
-        setNextPtr(rootObjPtr, newObjPtr);
-        assert (getObjPtr() != ptr);
-
-        ptr = getObjPtr();
-        cap = getCap();
+        *(Shape**)(ptr + OF_SHAPE) = shape->addField(name);
     }
 
     // Write the new property
-    assert (slotIdx + 1 < cap);
-    auto values = (Value*)(ptr + OF_FIELDS);
-    values[slotIdx + 0] = name;
-    values[slotIdx + 1] = value;
+    assert (slotIdx < cap);
+    auto words = (Word*)(ptr + OF_FIELDS);
+    auto tags  = (Tag*) (ptr + OF_FIELDS + cap * sizeof(Word));
+    words[slotIdx] = value.getWord();
+    tags[slotIdx] = value.getTag();
 }
 
 Value Object::getField(String name)
 {
+    if (!name.isInterned())
+        name = name.intern();
+
     auto ptr = getObjPtr();
     auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
 
-    size_t slotIdx = getSlotIdx(ptr, cap, name, false);
+    auto slotIdx = getShape()->getSlotIdx(name);
+    assert (slotIdx != Shape::NOT_FOUND);
 
-    assert (slotIdx < cap);
-    return values[slotIdx + 1];
+    auto words = (Word*)(ptr + OF_FIELDS);
+    auto tags  = (Tag*) (ptr + OF_FIELDS + cap * sizeof(Word));
+    return Value(words[slotIdx], tags[slotIdx]);
 }
 
-bool Object::getField(const String& fieldName, Value& value, size_t& idxCache)
+bool Object::hasField(String name, FieldPIC& pic)
 {
-    auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
-
-    //std::cout << "Lookup" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-    //std::cout << "  idxCache=" << idxCache << std::endl;
+    auto slotIdx = pic.lookup(getShape(), name);
+    return (slotIdx != Shape::NOT_FOUND);
+}
 
-    if (idxCache < cap)
+void Object::setField(String name, Value value, FieldPIC& pic)
+{
+    if (isFrozen())
     {
-        auto nameSlot = values[idxCache];
-        if (nameSlot.isString())
-        {
-            auto nameSlotStr = String(nameSlot);
-            if (nameSlotStr == fieldName)
-            {
-                //std::cout << "  cache hit" << std::endl;
-                value = values[idxCache + 1];
-                return true;
-            }
-        }
+        throw RunError(
+            "cannot set field \"" + (std::string)name + "\" of frozen object"
+        );
     }
 
-    //std::cout << "cache miss" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
+    auto ptr = getObjPtr();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto shape = *(Shape**)(ptr + OF_SHAPE);
 
-    size_t slotIdx = getSlotIdx(ptr, cap, fieldName, false);
+    auto slotIdx = pic.lookup(shape, name);
 
-    if (slotIdx >= cap)
+    // Adding a new field changes the shape, take the slow path
+    if (slotIdx == Shape::NOT_FOUND)
     {
-        return false;
+        setField(name, value);
+        return;
     }
 
-    idxCache = slotIdx;
+    auto words = (Word*)(ptr + OF_FIELDS);
+    auto tags  = (Tag*) (ptr + OF_FIELDS + cap * sizeof(Word));
+    words[slotIdx] = value.getWord();
+    tags[slotIdx] = value.getTag();
+}
+
+bool Object::getField(String name, Value& value, FieldPIC& pic)
+{
+    auto ptr = getObjPtr();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto shape = *(Shape**)(ptr + OF_SHAPE);
+
+    auto slotIdx = pic.lookup(shape, name);
 
-    //std::cout << "  cache miss" << std::endl;
-    //std::cout << "  slotIdx=" << slotIdx << std::endl;
+    if (slotIdx == Shape::NOT_FOUND)
+        return false;
 
-    value = values[slotIdx + 1];
+    auto words = (Word*)(ptr + OF_FIELDS);
+    auto tags  = (Tag*) (ptr + OF_FIELDS + cap * sizeof(Word));
+    value = Value(words[slotIdx], tags[slotIdx]);
     return true;
 }
 
+uint32_t Object::getHidden()
+{
+    auto ptr = getObjPtr();
+    return *(uint32_t*)(ptr + OF_HIDDEN);
+}
+
+void Object::setHidden(uint32_t val)
+{
+    auto ptr = getObjPtr();
+    *(uint32_t*)(ptr + OF_HIDDEN) = val;
+}
+
 int32_t Object::getFieldInt32(std::string name)
 {
     if (!hasField(name))
@@ -543,45 +1419,28 @@ Array Object::getFieldArr(std::string name)
 ObjFieldItr::ObjFieldItr(Object obj)
 : obj(obj)
 {
+    obj.getShape()->getNames(names);
 }
 
 bool ObjFieldItr::valid()
 {
-    //std::cout << "valid" << std::endl;
-
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    return slotIdx < cap && values[slotIdx].isString();
+    return slotIdx < names.size();
 }
 
 std::string ObjFieldItr::get()
 {
-    auto ptr = obj.getObjPtr();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    //std::cout << "cap=" << cap << std::endl;
-    //std::cout << "tag=" << (int)values[slotIdx].getTag() << std::endl;
-
-    assert (values[slotIdx].isString());
+    return getName();
+}
 
-    return values[slotIdx];
+String ObjFieldItr::getName()
+{
+    assert (valid());
+    return String(Value(names[slotIdx], TAG_STRING));
 }
 
 void ObjFieldItr::next()
 {
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    slotIdx += 2;
-
-    if (slotIdx >= cap)
-        return;
-
-    if (values[slotIdx] == Value::UNDEF)
-        slotIdx = cap;
+    slotIdx++;
 }
 
 ImgRef::ImgRef(String symbol)
@@ -656,50 +1515,110 @@ int64_t murmurHash2(const void* key, size_t len, uint64_t seed)
 }
 
 
-Value StringPool::getString(std::string str)
+/// Mark all interned strings, these are never collected
+void StringPool::markStrings()
 {
-    auto iter = pool.find(str);
-    if (iter == pool.end())
+    for (auto ptr : slots)
+        if (ptr)
+            gcMark(Value(ptr, TAG_STRING));
+}
+
+size_t StringPool::findSlot(const char* str, size_t len, uint32_t hash) const
+{
+    auto mask = slots.size() - 1;
+
+    for (auto idx = hash & mask;; idx = (idx + 1) & mask)
     {
-        return newString(str);
+        auto ptr = slots[idx];
+
+        if (ptr == nullptr)
+            return idx;
+
+        if (String::getHash(ptr) == hash &&
+            *(uint32_t*)(ptr + String::OF_LEN) == len &&
+            memcmp(ptr + String::OF_DATA, str, len) == 0)
+            return idx;
     }
-    return iter->second;
 }
 
-Value StringPool::newString(std::string str)
+void StringPool::insert(size_t slotIdx, refptr ptr)
 {
-    auto len = str.length();
-    // Compute the string object size
-    auto numBytes = String::memSize(len);
+    assert (slots[slotIdx] == nullptr);
 
-    // Allocate memory
-    auto val = vm.alloc(numBytes, TAG_STRING);
-    auto ptr = (refptr)val;
+    *(uint64_t*)ptr |= HEADER_MSK_INTERNED;
+    slots[slotIdx] = ptr;
+    numStrings++;
 
-    // Set the string length
-    *(uint32_t*)(ptr + String::OF_LEN) = len;
+    // Keep the load factor at most one half
+    if (2 * numStrings > slots.size())
+        grow();
+}
 
-    // Copy the string data
-    strcpy((char*)(ptr + String::OF_DATA), str.c_str());
-    pool.insert({str, val});
-    return val;
+void StringPool::grow()
+{
+    std::vector<refptr> oldSlots(2 * slots.size(), nullptr);
+    std::swap(slots, oldSlots);
+
+    auto mask = slots.size() - 1;
+
+    for (auto ptr : oldSlots)
+    {
+        if (ptr == nullptr)
+            continue;
+
+        auto hash = String::getHash(ptr);
+        auto idx = hash & mask;
+        while (slots[idx] != nullptr)
+            idx = (idx + 1) & mask;
+        slots[idx] = ptr;
+    }
 }
 
-bool isValidIdent(std::string identStr)
+Value StringPool::getString(const char* str, size_t len)
+{
+    auto hash = String::hashChars(str, len);
+    auto slotIdx = findSlot(str, len, hash);
+
+    if (slots[slotIdx])
+        return Value(slots[slotIdx], TAG_STRING);
+
+    auto ptr = (refptr)(Value)String::alloc(len);
+    memcpy(ptr + String::OF_DATA, str, len);
+    String::setHash(ptr, hash);
+
+    insert(slotIdx, ptr);
+    return Value(ptr, TAG_STRING);
+}
+
+Value StringPool::intern(refptr ptr)
+{
+    assert (!(*(uint64_t*)ptr & HEADER_MSK_ROPE));
+
+    auto str = String(Value(ptr, TAG_STRING));
+    auto slotIdx = findSlot(str.getDataPtr(), str.length(), str.hash());
+
+    if (slots[slotIdx])
+        return Value(slots[slotIdx], TAG_STRING);
+
+    insert(slotIdx, ptr);
+    return Value(ptr, TAG_STRING);
+}
+
+bool isValidIdent(const char* str, size_t len)
 {
-    if (identStr.length() == 0)
+    if (len == 0)
         return false;
 
     // First character must be underscore or a letter
-    if (identStr[0] != '_' && !isalpha(identStr[0]))
+    if (str[0] != '_' && !isalpha(str[0]))
     {
         return false;
     }
 
     // Remaining characters must be underscore or alphanumerical
-    for (size_t i = 1; i < identStr.length(); ++i)
+    for (size_t i = 1; i < len; ++i)
     {
-        auto ch = identStr[i];
+        auto ch = str[i];
         if (!isalnum(ch) && ch != '_')
             return false;
     }
@@ -707,6 +1626,11 @@ bool isValidIdent(std::string identStr)
     return true;
 }
 
+bool isValidIdent(std::string identStr)
+{
+    return isValidIdent(identStr.data(), identStr.length());
+}
+
 Tag strToTag(std::string str)
 {
     if (str == "undef")     return TAG_UNDEF;
@@ -741,6 +1665,26 @@ std::string tagToStr(Tag tag)
     }
 }
 
+std::string elemTypeToStr(ElemType type)
+{
+    switch (type)
+    {
+        case ELEM_VALUE:    return "value";
+        case ELEM_INT32:    return "int32";
+        case ELEM_FLOAT32:  return "float32";
+        case ELEM_UINT8:    return "uint8";
+        case ELEM_INT16:    return "int16";
+        default:
+        assert (false);
+    }
+}
+
+/// Mark the GC roots held by the runtime
+void markRuntimeRoots()
+{
+    stringPool.markStrings();
+}
+
 std::string posToString(Value srcPos)
 {
     assert (srcPos.isObject());
@@ -762,6 +1706,71 @@ void testRuntime()
 {
     std::cout << "runtime tests" << std::endl;
 
+    // Values keep their payloads and tags
+    {
+        assert (Value::int32(-5).getWord().int64 == -5);
+        assert ((int32_t)Value::int32(INT32_MIN) == INT32_MIN);
+        assert ((float)Value::float32(-1.5f) == -1.5f);
+        assert (Value::float32(2.0f) == Value::float32(2.0f));
+        assert (Value::ZERO != Value::FALSE);
+        assert (Value() == Value::UNDEF);
+
+        uint8_t buf[1];
+        assert (Value(buf, TAG_RAWPTR).getWord().ptr == buf);
+        assert (Value(buf, TAG_RAWPTR).getTag() == TAG_RAWPTR);
+        (void)buf;
+
+#ifdef ZETA_COMPACT_VALUE
+        static_assert (sizeof(Value) == 8, "compact values take 64 bits");
+#endif
+    }
+
+    // Heap allocation
+    {
+        VM heap;
+        assert (heap.allocated() == 0);
+
+        // Small blocks are rounded up to their size class
+        auto a = (refptr)heap.alloc(20, TAG_STRING);
+        assert (heap.allocated() == 24);
+        assert (heap.poolBlocks(2) == 1);
+        assert (heap.poolBlockSize(2) == 24);
+
+        // Freed blocks are recycled, and come back zeroed
+        memset(a + HEADER_SIZE, 0xFF, 16);
+        heap.free(a, 20);
+        assert (heap.allocated() == 0);
+        assert (heap.poolBlocks(2) == 0);
+        auto b = (refptr)heap.alloc(24, TAG_ARRAY);
+        assert (b == a);
+        assert (*b == TAG_ARRAY);
+        for (size_t i = 1; i < 24; ++i)
+            assert (b[i] == 0);
+        (void)b;
+
+        // Coarse size classes
+        heap.alloc(300, TAG_OBJECT);
+        assert (heap.allocated() == 24 + 320);
+
+        // Large objects
+        auto c = (refptr)heap.alloc(VM::POOL_MAX + 1, TAG_ARRAY);
+        assert (heap.numLargeObjs() == 1);
+        assert (heap.allocated() == 24 + 320 + VM::POOL_MAX + 1);
+        heap.free(c, VM::POOL_MAX + 1);
+        assert (heap.numLargeObjs() == 0);
+
+        // Peak and cumulative sizes account for the freed blocks
+        assert (heap.peakAllocated() == 24 + 320 + VM::POOL_MAX + 1);
+        assert (heap.totalAllocated() == 24 + 24 + 320 + VM::POOL_MAX + 1);
+
+        // Filling more than one slab
+        auto n = 2 * VM::SLAB_SIZE / 16;
+        for (size_t i = 0; i < n; ++i)
+            heap.alloc(16, TAG_STRING);
+        assert (heap.poolBlocks(1) == n);
+        assert (heap.poolSlabs(1) == 2);
+    }
+
     // Strings
     auto str = String("foobar");
     assert (str.length() == 6);
@@ -773,6 +1782,37 @@ void testRuntime()
     assert (str == str2);
     assert ((std::string)str == (std::string)str2);
 
+    // Long concatenations produce ropes, which are not interned
+    auto rope = String(std::string(40, 'a'));
+    for (size_t i = 0; i < 100; ++i)
+        rope = String::concat(rope, str);
+    assert (rope.isRope());
+    assert (!rope.isInterned());
+    assert (rope.length() == 40 + 100 * 6);
+    assert (rope[40 + 6 * 50 + 3] == 'b');
+    auto interned = rope.intern();
+    assert (interned.isInterned());
+    assert (interned == rope);
+    assert (interned == rope.intern());
+    assert (String::concat(str, String("")) == str);
+
+    // Interning from characters and in place
+    assert ((Value)String("foobarbaz", 6) == (Value)str);
+    assert (str.hash() == String::hashChars("foobar", 6));
+    auto flat = String::concat(str, String("qux"));
+    assert (!flat.isInterned());
+    assert ((Value)flat.intern() == (Value)flat);
+    assert ((Value)String("foobarqux") == (Value)flat);
+
+    // Growing the string pool
+    auto numInterned = stringPool.numInterned();
+    for (size_t i = 0; i < 5000; ++i)
+        String("pool_test_" + std::to_string(i));
+    assert (stringPool.numInterned() == numInterned + 5000);
+    assert ((Value)String("pool_test_17") == (Value)String("pool_test_17"));
+    assert (stringPool.numInterned() == numInterned + 5000);
+    (void)numInterned;
+
     // Arrays
     auto arr = Array(2);
     assert (arr.length() == 0);
@@ -809,6 +1849,44 @@ void testRuntime()
     assert(arr3.getElem(1) == Value::ONE);
     assert(arr3.getElem(2) == Value::TWO);
 
+    // Typed arrays
+    auto bytes = Array::newTyped(ELEM_UINT8, 3);
+    assert (bytes.getElemType() == ELEM_UINT8);
+    assert (bytes.length() == 3);
+    assert (bytes.getElem(2) == Value::ZERO);
+    bytes.setElem(1, Value::int32(200));
+    assert (bytes.getElemPtr()[1] == 200);
+    for (int32_t i = 0; i < 10; ++i)
+        bytes.push(Value::int32(i));
+    assert (bytes.length() == 13);
+    assert (bytes.getElemType() == ELEM_UINT8);
+    assert (bytes.getElem(1) == Value::int32(200));
+    assert (bytes.getElem(12) == Value::int32(9));
+    try
+    {
+        bytes.setElem(0, Value::int32(256));
+        assert (false);
+    }
+    catch (RunError& err)
+    {
+    }
+    auto floats = Array::newTyped(ELEM_FLOAT32, 2);
+    floats.setElem(0, Value::float32(0.5f));
+    assert (((float*)floats.getElemPtr())[0] == 0.5f);
+    assert ((float)floats.getElem(1) == 0.0f);
+
+    // Arrays mapped from files, unmapped once collected
+    {
+        auto mapped = Array::mapFile("tests/vm/ex_fibonacci.zim");
+        assert (mapped.getElemType() == ELEM_UINT8);
+        assert (mapped.length() > 0);
+        assert (vm.numMappedObjs() == 1);
+        mapped.setElem(0, Value::int32('X'));
+        assert (mapped.getElem(0) == Value::int32('X'));
+        gcCollect();
+        assert (vm.numMappedObjs() == 0);
+    }
+
     // Objects
     auto obj = Object::newObject();
     assert (!obj.hasField("foo"));
@@ -827,4 +1905,110 @@ void testRuntime()
     for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
         fieldStr += itr.get();
     assert (fieldStr == "foobar");
+
+    // Polymorphic inline caches
+    {
+        // Objects with the field at different slots, and more
+        // distinct shapes than there are cache entries
+        std::vector<Object> objs;
+        for (size_t i = 0; i < 2 * FieldPIC::NUM_ENTRIES; ++i)
+        {
+            auto o = Object::newObject();
+            for (size_t j = 0; j < i; ++j)
+                o.setField("f" + std::to_string(j), Value::ZERO);
+            o.setField("x", Value::int32(i));
+            objs.push_back(o);
+        }
+
+        FieldPIC pic;
+        Value val;
+
+        for (size_t k = 0; k < 2; ++k)
+        {
+            for (size_t i = 0; i < objs.size(); ++i)
+            {
+                assert (objs[i].getField(String("x"), val, pic));
+                assert (val == Value::int32(i));
+            }
+        }
+
+        // Changing the field name flushes the cache
+        assert (!objs[0].getField(String("f0"), val, pic));
+        assert (objs[1].getField(String("f0"), val, pic) && val == Value::ZERO);
+        assert (objs[1].hasField(String("f0"), pic));
+        assert (!objs[0].hasField(String("f0"), pic));
+
+        // Writes through the cache, and field additions
+        FieldPIC setPic;
+        objs[1].setField(String("y"), Value::ONE, setPic);
+        objs[1].setField(String("y"), Value::TWO, setPic);
+        objs[2].setField(String("y"), Value::ONE, setPic);
+        assert (objs[1].getField("y") == Value::TWO);
+        assert (objs[2].getField("y") == Value::ONE);
+        assert (objs[1].getField("x") == Value::int32(1));
+    }
+
+    // Object extension, and shapes with many fields
+    {
+        auto o = Object::newObject();
+
+        for (int32_t i = 0; i < 40; ++i)
+            o.setField("f" + std::to_string(i), Value::int32(i));
+
+        for (int32_t i = 0; i < 40; ++i)
+            assert (o.getField("f" + std::to_string(i)) == Value::int32(i));
+
+        assert (!o.hasField("f40"));
+
+        size_t numFields = 0;
+        for (auto itr = ObjFieldItr(o); itr.valid(); itr.next(), ++numFields)
+            assert (itr.get() == "f" + std::to_string(numFields));
+        assert (numFields == 40);
+    }
+
+    // Dictionary mode, for objects used as maps
+    {
+        auto o = Object::newObject();
+        o.setField("a", Value::ONE);
+        o.setField("b c", Value::TWO);
+        assert (o.isDict());
+        assert (o.getField("a") == Value::ONE);
+        assert (o.getField("b c") == Value::TWO);
+
+        auto m = Object::newObject();
+        GCRoot mRoot(m);
+        size_t numKeys = 4 * Shape::DICT_MIN_SLOTS;
+        for (size_t i = 0; i < numKeys; ++i)
+        {
+            assert (m.isDict() == (i > Shape::DICT_MIN_SLOTS));
+            m.setField("k" + std::to_string(i), Value::int32(i));
+        }
+
+        // Dead dictionary objects get their shape freed
+        gcCollect();
+
+        FieldPIC pic;
+        Value val;
+        for (size_t i = 0; i < numKeys; ++i)
+        {
+            assert (m.getField(String("k" + std::to_string(i)), val, pic));
+            assert (val == Value::int32(i));
+        }
+        assert (!m.getField(String("k"), val, pic));
+
+        // Fields added after a cached miss are found
+        m.setField("k", Value::ONE);
+        assert (m.getField(String("k"), val, pic) && val == Value::ONE);
+        m.setField(String("k"), Value::TWO, pic);
+        assert (m.getField("k") == Value::TWO);
+
+        // Iteration is in insertion order
+        size_t numFields = 0;
+        for (auto itr = ObjFieldItr(m); itr.valid(); itr.next(), ++numFields)
+        {
+            if (numFields < numKeys)
+                assert (itr.get() == "k" + std::to_string(numFields));
+        }
+        assert (numFields == numKeys + 1);
+    }
 }
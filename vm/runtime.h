@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <string>
 #include <cstring>
+#include <vector>
 #include <unordered_map>
 
 /// Type tag, 8 bits
@@ -33,6 +34,26 @@ const size_t HEADER_SIZE = sizeof(intptr_t);
 const size_t HEADER_IDX_NEXT = 15;
 const size_t HEADER_MSK_NEXT = 1 << HEADER_IDX_NEXT;
 
+/// Bit flag used by the garbage collector to mark reachable objects
+const size_t HEADER_IDX_MARK = 14;
+const size_t HEADER_MSK_MARK = 1 << HEADER_IDX_MARK;
+
+/// Bit flag set on strings held by the string pool
+const size_t HEADER_IDX_INTERNED = 13;
+const size_t HEADER_MSK_INTERNED = 1 << HEADER_IDX_INTERNED;
+
+/// Bit flag set on strings which are concatenation (rope) nodes
+const size_t HEADER_IDX_ROPE = 12;
+const size_t HEADER_MSK_ROPE = 1 << HEADER_IDX_ROPE;
+
+/// Bits holding the element type of arrays (see ElemType)
+const size_t HEADER_IDX_ELEMS = 9;
+const size_t HEADER_MSK_ELEMS = 7 << HEADER_IDX_ELEMS;
+
+/// Bit flag set on objects whose fields can no longer be changed
+const size_t HEADER_IDX_FROZEN = 8;
+const size_t HEADER_MSK_FROZEN = 1 << HEADER_IDX_FROZEN;
+
 /// Offset of the next pointer
 const size_t OBJ_OF_NEXT = HEADER_SIZE;
 
@@ -43,7 +64,7 @@ union Word
 {
     Word(refptr p) { ptr = p; }
     Word(int64_t v) { int64 = v; }
-    Word(float v) { float32 = v; }
+    Word(float v) { int64 = 0; float32 = v; }
     Word() {}
 
     float float32;
@@ -55,13 +76,26 @@ union Word
 
 /**
 Tagged value pair type (64-bit word + tag)
+
+With ZETA_COMPACT_VALUE defined, values are packed into 64 bits, the tag
+being stored above a 56-bit payload. Pointers fit because user space
+addresses are below 2^47, and 32-bit payloads fit trivially. Values are
+then half as large on the stack and in the code heap, but the JIT, which
+depends on the layout of values, is disabled.
 */
 class Value
 {
 private:
 
+#ifdef ZETA_COMPACT_VALUE
+    static const int TAG_SHIFT = 56;
+    static const uint64_t PAYLOAD_MASK = (uint64_t(1) << TAG_SHIFT) - 1;
+
+    uint64_t bits;
+#else
     Word word;
     Tag tag;
+#endif
 
 public:
 
@@ -73,25 +107,39 @@ public:
     static const Value TRUE;
     static const Value FALSE;
 
-    Value() : Value(UNDEF.word, UNDEF.tag) {}
+    Value() : Value(Word(int64_t(0)), TAG_UNDEF) {}
     Value(refptr p, Tag t) : Value(Word(p), t) {}
+#ifdef ZETA_COMPACT_VALUE
+    Value(Word w, Tag t)
+    : bits((uint64_t(w.int64) & PAYLOAD_MASK) | (uint64_t(t) << TAG_SHIFT))
+    {
+        // The payload must survive sign extension from 56 bits
+        assert (getWord().int64 == w.int64);
+    }
+#else
     Value(Word w, Tag t) : word(w), tag(t) {};
+#endif
     ~Value() {}
 
     // Static constructors. These are needed because of type ambiguity.
     static Value int32(int32_t v) { return Value(Word((int64_t)v), TAG_INT32); }
     static Value float32(float v) { return Value(Word(v), TAG_FLOAT32); }
 
-    bool isBool() const { return tag == TAG_BOOL; }
-    bool isInt32() const { return tag == TAG_INT32; }
-    bool isFloat32() const { return tag == TAG_FLOAT32; }
-    bool isString() const { return tag == TAG_STRING; }
-    bool isObject() const { return tag == TAG_OBJECT; }
-    bool isArray() const { return tag == TAG_ARRAY; }
-    bool isHostFn() const { return tag == TAG_HOSTFN; }
-
+    bool isBool() const { return getTag() == TAG_BOOL; }
+    bool isInt32() const { return getTag() == TAG_INT32; }
+    bool isFloat32() const { return getTag() == TAG_FLOAT32; }
+    bool isString() const { return getTag() == TAG_STRING; }
+    bool isObject() const { return getTag() == TAG_OBJECT; }
+    bool isArray() const { return getTag() == TAG_ARRAY; }
+    bool isHostFn() const { return getTag() == TAG_HOSTFN; }
+
+#ifdef ZETA_COMPACT_VALUE
+    Word getWord() const { return Word(int64_t(bits << (64 - TAG_SHIFT)) >> (64 - TAG_SHIFT)); }
+    Tag getTag() const { return Tag(bits >> TAG_SHIFT); }
+#else
     Word getWord() const { return word; }
     Tag getTag() const { return tag; }
+#endif
 
     bool isPointer() const;
 
@@ -99,34 +147,41 @@ public:
 
     inline operator bool () const
     {
-        assert (tag == TAG_BOOL);
-        return word.int64? 1:0;
+        assert (getTag() == TAG_BOOL);
+        return getWord().int64? 1:0;
     }
 
     inline operator int32_t () const
     {
-        assert (tag == TAG_INT32);
-        return word.int32;
+        assert (getTag() == TAG_INT32);
+        return getWord().int32;
     }
 
     inline operator float () const
     {
-        assert (tag == TAG_FLOAT32);
-        return word.float32;
+        assert (getTag() == TAG_FLOAT32);
+        return getWord().float32;
     }
 
     inline operator refptr () const
     {
         assert (isPointer());
-        return word.ptr;
+        return getWord().ptr;
     }
 
     operator std::string () const;
 
+#ifdef ZETA_COMPACT_VALUE
+    bool operator == (const Value& that) const
+    {
+        return this->bits == that.bits;
+    }
+#else
     bool operator == (const Value& that) const
     {
         return this->word.int64 == that.word.int64 && this->tag == that.tag;
     }
+#endif
 
     bool operator != (const Value& that) const
     {
@@ -139,24 +194,139 @@ Virtual Machine object (singleton)
 */
 class VM
 {
+public:
+
+    /// Block size granularity for the small size classes
+    static const size_t POOL_GRAIN = sizeof(intptr_t);
+
+    /// Largest block size served by the word-granular pools (32 words)
+    static const size_t POOL_WORD_MAX = 32 * POOL_GRAIN;
+
+    /// Block size granularity above 32 words
+    static const size_t POOL_COARSE_GRAIN = 64;
+
+    /// Largest block size served by a pool, bigger blocks are large objects
+    static const size_t POOL_MAX = 1024;
+
+    /// Number of size classes (pools)
+    static const size_t NUM_POOLS = (
+        POOL_WORD_MAX / POOL_GRAIN +
+        (POOL_MAX - POOL_WORD_MAX) / POOL_COARSE_GRAIN
+    );
+
+    /// Size of the slabs pools carve their blocks out of
+    static const size_t SLAB_SIZE = 1 << 16;
+
 private:
 
-    // TODO: total memory size allocated
+    /**
+    Pool of fixed-size blocks, allocated by bumping a pointer
+    into the current slab, or taken from a free list
+    */
+    struct Pool
+    {
+        /// Size of the blocks in this pool
+        size_t blockSize = 0;
+
+        /// List of freed blocks, linked through their second word
+        refptr freeList = nullptr;
 
-    // TODO: dynamically grow pools?
+        /// Bump allocation pointer and limit in the current slab
+        refptr bumpPtr = nullptr;
+        refptr bumpLimit = nullptr;
+
+        /// Slabs owned by this pool
+        std::vector<refptr> slabs;
+
+        /// Number of blocks currently allocated from this pool
+        size_t numBlocks = 0;
+    };
+
+    /// Small object pools, indexed by size class
+    Pool pools[NUM_POOLS];
+
+    /// Large objects, mapped to their size in bytes
+    std::unordered_map<refptr, size_t> largeObjs;
+
+    /// Memory mapping holding a block mapped from a file
+    struct Mapping
+    {
+        refptr base;
+        size_t len;
+    };
 
-    // TODO: pools for sizes up to 32 (words)
+    /// Blocks mapped from files, see mapFile
+    std::unordered_map<refptr, Mapping> mappedObjs;
 
-    // TODO: number of elements allocated in each pool
+    /// Total memory size allocated, in bytes
+    size_t totalBytes = 0;
+
+    /// Largest allocated size seen before a block was freed, in bytes
+    size_t peakBytes = 0;
+
+    /// Total memory size freed so far, in bytes
+    uint64_t freedBytes = 0;
+
+    /// Allocated size at which the next collection should happen
+    size_t gcThreshold = SIZE_MAX;
+
+    /// Get the size class index for a given block size
+    static size_t poolIdx(size_t size);
+
+    /// Allocate a new slab for a pool
+    void newSlab(Pool& pool);
 
 public:
 
     VM();
+    ~VM();
 
     /// Allocate a block of memory on the heap
     Value alloc(uint32_t size, Tag tag);
 
+    /// Return a block of memory to the heap
+    void free(refptr ptr, size_t size);
+
+    /**
+    Allocate a block whose contents, from a given offset on, are those
+    of a file mapped into memory. The pages of the file are read lazily,
+    and writes to them are private to the process. Mapped blocks are not
+    counted in the allocated size, since their pages are file-backed.
+    */
+    Value mapFile(int fd, size_t fileSize, size_t dataOfs, Tag tag);
+
+    /// Get the total number of bytes currently allocated
     size_t allocated() const;
+
+    /// Get the largest number of bytes allocated at any one time
+    size_t peakAllocated() const;
+
+    /// Get the number of bytes allocated since the heap was created
+    uint64_t totalAllocated() const;
+
+    /// Get the block size of a given pool
+    size_t poolBlockSize(size_t poolIdx) const;
+
+    /// Get the number of blocks allocated in a given pool
+    size_t poolBlocks(size_t poolIdx) const;
+
+    /// Get the number of slabs owned by a given pool
+    size_t poolSlabs(size_t poolIdx) const;
+
+    /// Get the number of large objects currently allocated
+    size_t numLargeObjs() const { return largeObjs.size(); }
+
+    /// Get the number of blocks currently mapped from files
+    size_t numMappedObjs() const { return mappedObjs.size(); }
+
+    /// Set the allocated size at which a collection should be triggered
+    void setGCThreshold(size_t numBytes) { gcThreshold = numBytes; }
+
+    /// Test if enough memory was allocated to warrant a collection
+    bool gcNeeded() const { return totalBytes >= gcThreshold; }
+
+    /// Free all unmarked blocks and clear the mark bit on the others
+    void sweep();
 };
 
 /**
@@ -235,9 +405,27 @@ public:
 /**
 Wrapper to manipulate string values
 Note: strings are UTF-8 and null-terminated
+
+Strings produced by concatenation may be rope nodes, which reference
+their two halves instead of holding character data. A rope node is
+flattened the first time its characters are needed, after which it
+references the resulting flat string through its left half.
+
+Strings created from C++ are interned, so that they can be compared
+by identity. Concatenation results are not, until interned on demand,
+for instance when they get used as field names.
+
+The hash code of a string is cached in the upper half of its header
+once computed. A cached hash of zero means it wasn't computed yet.
 */
 class String : public Wrapper
 {
+private:
+
+    /// Find the flat string holding the characters of a rope node,
+    /// flattening it if needed
+    static refptr flatten(refptr rope);
+
 public:
 
     /// Offset and size of the length and data fields
@@ -245,6 +433,34 @@ public:
     static const size_t SZ_LEN = sizeof(uint32_t);
     static const size_t OF_DATA = OF_LEN + SZ_LEN;
 
+    /// Offset of the cached hash code, within the header
+    static const size_t OF_HASH = HEADER_SIZE - sizeof(uint32_t);
+
+    /// Read and write the cached hash code of a string object
+    /// Note: these go through memcpy because the header is
+    ///       otherwise accessed as a 64-bit word
+    static uint32_t getHash(refptr ptr)
+    {
+        uint32_t hash;
+        memcpy(&hash, ptr + OF_HASH, sizeof(hash));
+        return hash;
+    }
+    static void setHash(refptr ptr, uint32_t hash)
+    {
+        memcpy(ptr + OF_HASH, &hash, sizeof(hash));
+    }
+
+    /// Offsets of the halves of rope nodes
+    static const size_t OF_LEFT = OF_LEN + 2 * SZ_LEN;
+    static const size_t OF_RIGHT = OF_LEFT + sizeof(refptr);
+
+    /// Size of rope nodes
+    static const size_t ROPE_SIZE = OF_RIGHT + sizeof(refptr);
+
+    /// Concatenations up to this length are copied instead of
+    /// producing a rope node
+    static const size_t MAX_FLAT_CAT = 32;
+
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t len)
     {
@@ -252,8 +468,36 @@ public:
     }
 
     String(std::string str);
+    String(const char* str);
+    String(const char* str, size_t len);
     String(Value value);
 
+    /// Allocate a flat string which isn't interned, with
+    /// uninitialized character data
+    static String alloc(size_t len);
+
+    /// Test if this string is held by the string pool
+    bool isInterned() const
+    {
+        return *(uint64_t*)val.getWord().ptr & HEADER_MSK_INTERNED;
+    }
+
+    /// Test if this string is a rope node
+    bool isRope() const
+    {
+        return *(uint64_t*)val.getWord().ptr & HEADER_MSK_ROPE;
+    }
+
+    /// Get the interned string with the same characters
+    /// Note: flat strings get interned in place, without copying
+    String intern() const;
+
+    /// Hash a sequence of characters, the result is never zero
+    static uint32_t hashChars(const char* str, size_t len);
+
+    /// Get the hash code of the string, computing it if needed
+    uint32_t hash() const;
+
     /// Get the length of the string
     uint32_t length() const;
 
@@ -267,10 +511,8 @@ public:
     /// Comparison with a string literal
     bool operator == (const char* that) const;
 
-    // FIXME: temporary until string interning is implemented
-    bool operator == (String that) {
-        return val == that.val;
-    }
+    /// Comparison of the characters of two strings
+    bool operator == (String that) const;
 
     /// Get the ith character code
     char operator [] (size_t i);
@@ -279,9 +521,27 @@ public:
     static String concat(String a, String b);
 };
 
+/// Element types of arrays
+enum ElemType : uint8_t
+{
+    /// Arbitrary values, stored as a word and a tag
+    ELEM_VALUE = 0,
+
+    /// Raw elements, without tags
+    ELEM_INT32,
+    ELEM_FLOAT32,
+    ELEM_UINT8,
+    ELEM_INT16
+};
+
 /**
 Array value wrapper
 Note: arrays have a fixed length set at allocation time
+
+Typed arrays hold elements of a single type, stored without tags,
+which the header records in its element type bits. Writing a value
+of another type into a typed array is an error. The element type
+is also set on the objects an array is extended into.
 */
 class Array : public Wrapper
 {
@@ -291,6 +551,9 @@ private:
     /// Note: we want to avoid publicly exposing the array capacity
     size_t getCap();
 
+    /// Allocate an array object with a given capacity
+    static Array alloc(ElemType type, size_t cap);
+
 public:
 
     /// Offset and size of the fields
@@ -306,15 +569,41 @@ public:
         return OF_DATA + cap * sizeof(Word) + cap * sizeof(Tag);
     }
 
+    /// Get the size of one element of a typed array
+    static size_t elemSize(ElemType type);
+
     /// Allocate a new array of a given length
     Array(size_t minCap);
 
     /// Create an array wrapper from a tagged value
     Array(Value value);
 
+    /// Allocate a typed array of a given length, filled with zeroes
+    static Array newTyped(ElemType type, size_t len);
+
+    /// Map a file into memory as a uint8 array, without reading it
+    /// Note: the file must not be truncated while the array is live
+    static Array mapFile(std::string path);
+
     /// Get the length of the array
     uint32_t length();
 
+    /// Get the type of the elements of the array
+    ElemType getElemType() const
+    {
+        auto header = *(uint64_t*)val.getWord().ptr;
+        return ElemType((header & HEADER_MSK_ELEMS) >> HEADER_IDX_ELEMS);
+    }
+
+    /// Get a pointer to the raw elements of a typed array
+    /// Warning: this pointer is invalidated if the array grows
+    uint8_t* getElemPtr();
+
+    /// Read or write the ith of the raw elements of a typed array,
+    /// writes check that the value matches the element type
+    static Value readTyped(const uint8_t* data, ElemType type, size_t i);
+    static void writeTyped(uint8_t* data, ElemType type, size_t i, Value v);
+
     /// Set the value of the ith element
     void setElem(size_t i, Value v);
 
@@ -328,8 +617,152 @@ public:
     //static Array concat(Array a, Array b);
 };
 
+/**
+Object shape (hidden class)
+Shapes form a tree rooted at the empty shape, where each shape adds
+one field to its parent. Objects which had the same fields added in
+the same order share the same shape, so that a field lookup can be
+reduced to a shape check and a fixed slot index.
+
+Objects used as maps, which get many fields or fields whose names
+aren't identifiers, switch to dictionary mode. They then get a shape
+of their own, holding a hash table of their field names, which grows
+in place as fields are added. Dictionary shapes are not shared, and
+get freed along with their object.
+
+Note: shared shapes live on the C++ heap and are never freed. Field
+names are interned strings, which are never collected. Each isolate
+has a shape tree of its own, since field names belong to its string
+pool.
+*/
+class Shape
+{
+private:
+
+    /// Field names and slot indices of a dictionary shape
+    struct Dict
+    {
+        /// Field names, in slot order
+        std::vector<refptr> names;
+
+        /// Open addressing table of slot indices, with linear probing
+        /// on the hash codes of the field names
+        std::vector<uint32_t> slots;
+    };
+
+    /// Parent shape, null for the empty shape
+    Shape* parent;
+
+    /// Name of the field added by this shape
+    refptr name;
+
+    /// Slot index of the field added by this shape
+    uint32_t slotIdx;
+
+    /// Number of fields in objects of this shape
+    uint32_t numSlots;
+
+    /// Shapes derived from this one by adding a field
+    std::unordered_map<refptr, Shape*> transitions;
+
+    /// Name to slot map, built lazily for shapes with many fields
+    std::unordered_map<refptr, uint32_t>* slotMap = nullptr;
+
+    /// Hash table of a dictionary shape, null for shared shapes
+    Dict* dict = nullptr;
+
+    Shape(Shape* parent, refptr name);
+
+    /// Create a dictionary shape with the fields of this one
+    Shape* toDict();
+
+    /// Add a field to a dictionary shape, in place
+    void dictAdd(refptr fieldName);
+
+public:
+
+    /// Number of fields above which lookups go through the slot map
+    static const size_t MAP_MIN_SLOTS = 16;
+
+    /// Number of fields at which objects switch to dictionary mode
+    static const size_t DICT_MIN_SLOTS = 256;
+
+    /// Slot index returned by lookups when a field is not found
+    static const uint32_t NOT_FOUND = UINT32_MAX;
+
+    /// Get the empty root shape
+    static Shape* empty();
+
+    /// Free the shape of a dead object, if it is a dictionary shape
+    static void freeDict(Shape* shape);
+
+    /// Test if this is the shape of an object in dictionary mode
+    bool isDict() const { return dict != nullptr; }
+
+    /// Get the number of fields in objects of this shape
+    uint32_t getNumSlots() const { return numSlots; }
+
+    /// Get the slot index for a field, or NOT_FOUND
+    uint32_t getSlotIdx(refptr fieldName);
+
+    /// Get the shape obtained by adding a field to this one.
+    /// For dictionary shapes, this is the same shape.
+    Shape* addField(refptr fieldName);
+
+    /// Get the field names, in slot order
+    void getNames(std::vector<refptr>& names) const;
+};
+
+/**
+Polymorphic inline cache for field accesses
+Maps up to NUM_ENTRIES object shapes to slot indices for a given
+field name, most recently added entries first. Misses are cached
+too, since a shape never loses fields. The cache is flushed when
+the field name changes, which only happens for instructions taking
+the field name from the stack. Dictionary shapes are never cached,
+since they change in place and get freed.
+*/
+class FieldPIC
+{
+public:
+
+    static const size_t NUM_ENTRIES = 4;
+
+private:
+
+    /// Field name the entries are valid for
+    refptr name = nullptr;
+
+    /// Cached shapes and the corresponding slot indices
+    Shape* shapes[NUM_ENTRIES] = {};
+    uint32_t slotIdxs[NUM_ENTRIES] = {};
+
+    /// Look up and cache the slot index on a cache miss
+    uint32_t miss(Shape* shape, refptr fieldName);
+
+public:
+
+    /// Number of misses over all caches, read by the profiler
+    static thread_local uint64_t numMisses;
+
+    /// Get the slot index for a field, or Shape::NOT_FOUND
+    uint32_t lookup(Shape* shape, refptr fieldName)
+    {
+        if (fieldName == name)
+        {
+            for (size_t i = 0; i < NUM_ENTRIES; ++i)
+                if (shapes[i] == shape)
+                    return slotIdxs[i];
+        }
+
+        return miss(shape, fieldName);
+    }
+};
+
 /**
 Object value wrapper
+Field values are stored as words followed by tags, as in arrays.
+The field names live in the object's shape.
 */
 class Object : public Wrapper
 {
@@ -338,33 +771,27 @@ class Object : public Wrapper
     /// Get the object's capacity
     size_t getCap();
 
-    /// Find the slot index at which a field is stored
-    size_t getSlotIdx(
-        refptr ptr,
-        size_t cap,
-        String fieldName,
-        bool newField
-    );
+    /// Get the object's shape
+    Shape* getShape();
 
 public:
 
-    /// Minimum guaranteed object capacity
-    static const size_t MIN_CAP = 16;
+    /// Minimum guaranteed object capacity, in fields
+    static const size_t MIN_CAP = 8;
 
     /// Offset and size of the fields
     static const size_t OF_CAP = HEADER_SIZE;
     static const size_t SZ_CAP = sizeof(uint32_t);
-    static const size_t OF_SHAPE = OF_CAP + SZ_CAP;
-    static const size_t SZ_SHAPE = sizeof(refptr);
+    static const size_t OF_HIDDEN = OF_CAP + SZ_CAP;
+    static const size_t SZ_HIDDEN = sizeof(uint32_t);
+    static const size_t OF_SHAPE = OF_HIDDEN + SZ_HIDDEN;
+    static const size_t SZ_SHAPE = sizeof(Shape*);
     static const size_t OF_FIELDS = OF_SHAPE + SZ_SHAPE;
 
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t cap)
     {
-        // FIXME: for now, we store tagged values, this will change
-        // once we have proper shapes implemented
-        //return OF_FIELDS + cap * sizeof(Word);
-        return OF_FIELDS + cap * sizeof(Value);
+        return OF_FIELDS + cap * sizeof(Word) + cap * sizeof(Tag);
     }
 
     /// Allocate a new empty object
@@ -376,12 +803,27 @@ public:
     void setField(String name, Value val);
     Value getField(String name);
 
-    /// Property lookup with a slot index cache
-    bool getField(const String& name, Value& value, size_t& idxCache);
+    /// Property accesses with a polymorphic inline cache
+    /// Note: these expect the field name to be interned
+    bool hasField(String name, FieldPIC& pic);
+    void setField(String name, Value val, FieldPIC& pic);
+    bool getField(String name, Value& value, FieldPIC& pic);
+
+    /// Hidden slot, not visible as a field, which lets the VM associate
+    /// its own data with an object. It is zero for new objects.
+    uint32_t getHidden();
+    void setHidden(uint32_t val);
 
-    bool hasField(std::string name) { return hasField(String(name)); }
-    void setField(std::string name, Value val) { return setField(String(name), val); }
-    Value getField(std::string name) { return getField(String(name)); }
+    /// Test if the object is in dictionary mode, see Shape
+    bool isDict() { return getShape()->isDict(); }
+
+    /// Freeze the object, setting or adding fields is then an error.
+    /// Frozen objects let code reading their fields be specialized.
+    void freeze() { *(uint64_t*)val.getWord().ptr |= HEADER_MSK_FROZEN; }
+    bool isFrozen() const
+    {
+        return *(uint64_t*)val.getWord().ptr & HEADER_MSK_FROZEN;
+    }
 
     // Property lookups with type checking
     int32_t getFieldInt32(std::string name);
@@ -396,15 +838,15 @@ class ICache
 {
 private:
 
-    // Cached slot index
-    size_t slotIdx = 0;
+    // Cached shapes and slot indices
+    FieldPIC pic;
 
     // Field name to look up
     String fieldName;
 
 public:
 
-    ICache(std::string fieldName)
+    ICache(const char* fieldName)
     : fieldName(fieldName)
     {
     }
@@ -413,7 +855,7 @@ public:
     {
         Value val;
 
-        if (!obj.getField(fieldName, val, slotIdx))
+        if (!obj.getField(fieldName, val, pic))
         {
             throw RunError("missing field \"" + (std::string)fieldName + "\"");
         }
@@ -459,6 +901,9 @@ private:
 
     Object obj;
 
+    /// Field names, in insertion order
+    std::vector<refptr> names;
+
     size_t slotIdx = 0;
 
 public:
@@ -469,6 +914,9 @@ public:
 
     std::string get();
 
+    /// Get the current field name, without copying it
+    String getName();
+
     void next();
 };
 
@@ -496,29 +944,51 @@ int64_t murmurHash2(const void* key, size_t len, uint64_t seed);
 class StringPool
 {
 private:
-    class StringHasher
-    {
-    public:
-        size_t operator()(const std::string str) const
-        {
-            auto len = str.length();
-            auto ptr = str.c_str();
-            return (size_t)murmurHash2(ptr, len, 1337);
-        }
-    };
-    std::unordered_map<std::string, Value, StringHasher> pool;
-    Value newString(std::string str);
+
+    /// Initial number of slots, must be a power of two
+    static const size_t INIT_SLOTS = 1024;
+
+    /// Open addressing table of interned strings, with linear probing.
+    /// Strings are never removed, and their cached hash codes are
+    /// used when growing the table.
+    std::vector<refptr> slots;
+
+    size_t numStrings = 0;
+
+    /// Find the slot holding a string with the given characters,
+    /// or the empty slot where it should be inserted
+    size_t findSlot(const char* str, size_t len, uint32_t hash) const;
+
+    /// Insert a string into an empty slot
+    void insert(size_t slotIdx, refptr ptr);
+
+    /// Double the number of slots
+    void grow();
 
 public:
+
     StringPool();
-    Value getString(std::string str);
+
+    /// Get the interned string with the given characters,
+    /// creating it if needed
+    Value getString(const char* str, size_t len);
+
+    /// Get the interned string with the same characters as
+    /// a flat string, adding that string to the pool if needed
+    Value intern(refptr ptr);
+
+    /// Get the number of interned strings
+    size_t numInterned() const { return numStrings; }
+
+    void markStrings();
 };
 
-/// Global virtual machine instance
-extern VM vm;
+/// Virtual machine instance of the current isolate, see isolate.h
+extern thread_local VM vm;
 
 /// Check if a string is a valid identifier
 bool isValidIdent(std::string identStr);
+bool isValidIdent(const char* str, size_t len);
 
 /// Get the tag enumeration value for a given tag string
 Tag strToTag(std::string str);
@@ -526,6 +996,9 @@ Tag strToTag(std::string str);
 /// Get the string representation for a type tag
 std::string tagToStr(Tag tag);
 
+/// Get the string representation for an array element type
+std::string elemTypeToStr(ElemType type);
+
 /// Get a string representation of a source position object
 std::string posToString(Value srcPos);
 
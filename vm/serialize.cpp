@@ -1,81 +1,205 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <unordered_set>
 #include <unordered_map>
 #include <vector>
 #include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "serialize.h"
+#include "parser.h"
+#include "packages.h"
+
+/**
+Buffered output sink for the text serializer. The output is flushed
+to a file descriptor whenever the buffer fills up, or accumulated in
+memory if there is no file descriptor.
+*/
+class OutSink
+{
+private:
 
-// Forward declaration
-std::string nameOrRepr(
-    Value val,
-    std::unordered_map<refptr, std::string>& valNames,
-    bool minify,
-    std::string indent
-);
+    static const size_t FLUSH_SIZE = 1 << 16;
 
-std::string escapeStr(std::string str)
-{
-    std::string out = "\"";
+    int fd;
+
+    std::string buf;
 
-    for (size_t i = 0; i < str.size(); ++i)
+public:
+
+    OutSink(int fd = -1) : fd(fd) {}
+
+    void write(char ch)
     {
-        unsigned char ch = str[i];
+        buf += ch;
 
-        if (ch == '\n')
-        {
-            out += "\\n";
-            continue;
-        }
+        if (fd >= 0 && buf.size() >= FLUSH_SIZE)
+            flush();
+    }
 
-        if (ch == '\r')
-        {
-            out += "\\r";
-            continue;
-        }
+    void write(const char* str, size_t len)
+    {
+        buf.append(str, len);
 
-        if (ch == '\t')
-        {
-            out += "\\t";
-            continue;
-        }
+        if (fd >= 0 && buf.size() >= FLUSH_SIZE)
+            flush();
+    }
+
+    void write(const char* str)
+    {
+        write(str, strlen(str));
+    }
+
+    void writeInt(int64_t val)
+    {
+        char intStr[24];
+        auto len = snprintf(intStr, sizeof(intStr), "%lld", (long long)val);
+        write(intStr, len);
+    }
+
+    void writeSpaces(size_t num)
+    {
+        buf.append(num, ' ');
+    }
+
+    void flush()
+    {
+        if (fd < 0)
+            return;
 
-        if (ch == '\\')
+        size_t numWritten = 0;
+        while (numWritten < buf.size())
         {
-            out += "\\\\";
-            continue;
+            auto ret = ::write(fd, buf.data() + numWritten, buf.size() - numWritten);
+            if (ret <= 0)
+                throw RunError("failed to write serialized output");
+            numWritten += ret;
         }
 
-        if (ch == '\"')
+        buf.clear();
+    }
+
+    std::string& getBuf()
+    {
+        return buf;
+    }
+};
+
+/**
+Flat table mapping value pointers to name indices, using open
+addressing and linear probing. Index 0 marks values which were
+visited, but have no name.
+*/
+class PtrTable
+{
+private:
+
+    struct Entry
+    {
+        refptr ptr;
+        uint32_t idx;
+    };
+
+    std::vector<Entry> slots;
+
+    size_t numEntries = 0;
+
+    size_t findSlot(refptr ptr) const
+    {
+        auto mask = slots.size() - 1;
+        auto hash = uint64_t(ptr) * 0x9E3779B97F4A7C15ULL;
+        auto slotIdx = (hash >> 32) & mask;
+
+        while (slots[slotIdx].ptr && slots[slotIdx].ptr != ptr)
+            slotIdx = (slotIdx + 1) & mask;
+
+        return slotIdx;
+    }
+
+public:
+
+    PtrTable() : slots(1024, Entry{ nullptr, 0 }) {}
+
+    /// Find the name index of a pointer, returns nullptr if absent
+    uint32_t* find(refptr ptr)
+    {
+        auto& entry = slots[findSlot(ptr)];
+        return entry.ptr? &entry.idx:nullptr;
+    }
+
+    /// Add a pointer to the table, with no name
+    void insert(refptr ptr)
+    {
+        // Keep the load factor at or below 1/2
+        if (2 * (numEntries + 1) > slots.size())
         {
-            out += "\\\"";
-            continue;
+            std::vector<Entry> oldSlots(2 * slots.size(), Entry{ nullptr, 0 });
+            oldSlots.swap(slots);
+
+            for (auto& entry : oldSlots)
+                if (entry.ptr)
+                    slots[findSlot(entry.ptr)] = entry;
         }
 
-        if (ch == '\'')
+        auto& entry = slots[findSlot(ptr)];
+        assert (entry.ptr == nullptr);
+        entry = Entry{ ptr, 0 };
+        numEntries++;
+    }
+};
+
+/// Write an escaped string literal
+static void writeStr(OutSink& out, const char* str, size_t len)
+{
+    out.write('"');
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned char ch = str[i];
+
+        switch (ch)
         {
-            out += "\\\'";
-            continue;
+            case '\n': out.write("\\n", 2); continue;
+            case '\r': out.write("\\r", 2); continue;
+            case '\t': out.write("\\t", 2); continue;
+            case '\\': out.write("\\\\", 2); continue;
+            case '\"': out.write("\\\"", 2); continue;
+            case '\'': out.write("\\\'", 2); continue;
         }
 
         if (ch >= 32 && ch <= 126)
         {
-            out += ch;
+            out.write(ch);
             continue;
         }
 
         char hexStr[8];
-        sprintf(hexStr, "\\x%02X", (int)ch);
-        out += hexStr;
+        snprintf(hexStr, sizeof(hexStr), "\\x%02X", (int)ch);
+        out.write(hexStr, 4);
     }
 
-    return out + "\"";
+    out.write('"');
 }
 
-/// Generate the output string for a value
-std::string genString(
+/// Write a value's name if it has one, otherwise its representation
+static void writeNameOrRepr(
+    OutSink& out,
     Value val,
-    std::unordered_map<refptr, std::string>& valNames,
+    PtrTable& valNames,
     bool minify,
-    std::string indent
+    size_t indent
+);
+
+/// Write the representation of a value
+static void writeRepr(
+    OutSink& out,
+    Value val,
+    PtrTable& valNames,
+    bool minify,
+    size_t indent
 )
 {
     switch (val.getTag())
@@ -85,23 +209,23 @@ std::string genString(
             auto arr = Array(val);
             auto len = arr.length();
 
-            std::string out = "[";
+            out.write('[');
 
             // For each array element
             for (size_t i = 0; i < len; ++i)
             {
                 auto elemVal = arr.getElem(i);
-                out += nameOrRepr(elemVal, valNames, minify, indent);
+                writeNameOrRepr(out, elemVal, valNames, minify, indent);
 
                 if (i < len - 1)
                 {
-                    out += ",";
+                    out.write(',');
                     if (!minify)
-                        out += " ";
+                        out.write(' ');
                 }
             }
 
-            return out + "]";
+            out.write(']');
         }
         break;
 
@@ -109,7 +233,7 @@ std::string genString(
         {
             auto obj = Object(val);
 
-            std::string out = "{";
+            out.write('{');
 
             // First field being printed
             bool first = true;
@@ -117,114 +241,112 @@ std::string genString(
             // For each object field
             for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
             {
-                auto fieldName = itr.get();
+                auto fieldName = itr.getName();
                 auto fieldVal = obj.getField(fieldName);
 
                 if (first)
                     first = false;
                 else
-                    out += ",";
+                    out.write(',');
 
                 // Indent this field
                 if (!minify)
                 {
-                    out += "\n";
-                    out += indent + "  ";
+                    out.write('\n');
+                    out.writeSpaces(indent + 2);
                 }
 
-                if (isValidIdent(fieldName))
-                    out += fieldName;
+                auto nameChars = fieldName.getDataPtr();
+                auto nameLen = fieldName.length();
+
+                if (isValidIdent(nameChars, nameLen))
+                    out.write(nameChars, nameLen);
                 else
-                    out += escapeStr(fieldName);
+                    writeStr(out, nameChars, nameLen);
 
-                out += ":";
+                out.write(':');
 
-                out += nameOrRepr(
-                    fieldVal,
-                    valNames,
-                    minify,
-                    indent + "  "
-                );
+                writeNameOrRepr(out, fieldVal, valNames, minify, indent + 2);
             }
 
             // Indent the closing brace
             if (!minify)
             {
-                out += "\n";
-                out += indent;
+                out.write('\n');
+                out.writeSpaces(indent);
             }
 
-            out += "}";
-
-            return out;
+            out.write('}');
         }
         break;
 
         // TODO: naming of long strings
         case TAG_STRING:
         {
-            auto str = (std::string)val;
-            return escapeStr(str);
+            auto str = String(val);
+            writeStr(out, str.getDataPtr(), str.length());
         }
         break;
 
         case TAG_UNDEF:
-        return std::string("$undef");
+        out.write("$undef");
+        break;
 
         case TAG_BOOL:
-        return std::string((val == Value::TRUE)? "$true":"$false");
+        out.write((val == Value::TRUE)? "$true":"$false");
+        break;
 
         case TAG_INT32:
-        return std::to_string(int32_t(val));
+        out.writeInt(int32_t(val));
+        break;
 
         case TAG_FLOAT32:
-        return std::to_string(float(val)) + "f";
+        {
+            char floatStr[64];
+            auto len = snprintf(floatStr, sizeof(floatStr), "%ff", float(val));
+            out.write(floatStr, len);
+        }
+        break;
 
         default:
         auto tagStr = tagToStr(val.getTag());
         throw RunError("cannot serialize values with tag \"" + tagStr + "\"");
     }
-};
+}
 
-/// Produce a value's name if it has one, otherwise its string representation
-std::string nameOrRepr(
+static void writeNameOrRepr(
+    OutSink& out,
     Value val,
-    std::unordered_map<refptr, std::string>& valNames,
+    PtrTable& valNames,
     bool minify,
-    std::string indent
+    size_t indent
 )
 {
-    if (!val.isPointer())
-        return genString(val, valNames, minify, indent);
+    if (val.isPointer())
+    {
+        auto nameIdx = valNames.find((refptr)val);
 
-    auto ptr = (refptr)val;
-    if (valNames.find(ptr) != valNames.end())
-        return "@" + valNames[ptr];
+        if (nameIdx && *nameIdx)
+        {
+            out.write("@n_", 3);
+            out.writeInt(*nameIdx);
+            return;
+        }
+    }
 
-    return genString(val, valNames, minify, indent);
-};
+    writeRepr(out, val, valNames, minify, indent);
+}
 
 /// Serialize the graph indirectly referenced by a root value
-std::string serialize(Value rootVal, bool minify)
+static void serialize(OutSink& out, Value rootVal, bool minify)
 {
-    // Visited set for the naming traversal
-    std::unordered_set<refptr> visited;
-
-    // Map of objects to names
-    // Notes: only objects with multiple references get a name
-    std::unordered_map<refptr, std::string> valNames;
+    // Visited values, and the name indices of the values which
+    // have multiple references and get assigned a name
+    PtrTable valNames;
 
     // List of objects with assigned names
     std::vector<Value> namedObjs;
 
-    size_t lastIdx = 0;
-
-    /// Generate a name for a value
-    auto genName = [&lastIdx] (Value val)
-    {
-        return "n_" + std::to_string(++lastIdx);
-    };
-
     // Stack of nodes to visit
     std::vector<Value> stack;
 
@@ -243,7 +365,7 @@ std::string serialize(Value rootVal, bool minify)
         auto ptr = (refptr)node;
 
         // If this value has been previously visited
-        if (visited.find(ptr) != visited.end())
+        if (auto nameIdx = valNames.find(ptr))
         {
             // If minification is disabled and this is a short string
             if (!minify && node.isString() && String(node).length() <= 16)
@@ -253,10 +375,10 @@ std::string serialize(Value rootVal, bool minify)
 
             // This value has multiple reference, and
             // should get an assigned name
-            if (valNames.find(ptr) == valNames.end())
+            if (*nameIdx == 0)
             {
-                valNames[ptr] = genName(node);
                 namedObjs.push_back(node);
+                *nameIdx = uint32_t(namedObjs.size());
             }
 
             // Don't visit this value's children
@@ -264,7 +386,7 @@ std::string serialize(Value rootVal, bool minify)
         }
 
         // Mark the value as visited
-        visited.insert(ptr);
+        valNames.insert(ptr);
 
         switch (node.getTag())
         {
@@ -289,8 +411,7 @@ std::string serialize(Value rootVal, bool minify)
                 // For each object field
                 for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
                 {
-                    auto fieldName = itr.get();
-                    auto fieldVal = obj.getField(fieldName);
+                    auto fieldVal = obj.getField(itr.getName());
                     stack.push_back(fieldVal);
                 }
             }
@@ -309,23 +430,708 @@ std::string serialize(Value rootVal, bool minify)
         }
     }
 
-    std::string out;
-
     // For each object with an assigned name
     for (size_t i = 0; i < namedObjs.size(); ++i)
     {
-        auto val = namedObjs[i];
-        auto ptr = (refptr)val;
-        auto name = valNames[ptr];
-
-        out += name + " = " + genString(val, valNames, minify, "") + ";";
+        out.write("n_", 2);
+        out.writeInt(i + 1);
+        out.write(" = ", 3);
+        writeRepr(out, namedObjs[i], valNames, minify, 0);
+        out.write(';');
 
         if (!minify)
-            out += "\n\n";
+            out.write("\n\n", 2);
     }
 
     // Write the root/exported value
-    out += nameOrRepr(rootVal, valNames, minify, "") + ";";
+    writeNameOrRepr(out, rootVal, valNames, minify, 0);
+    out.write(';');
+}
+
+std::string serialize(Value rootVal, bool minify)
+{
+    OutSink out;
+    serialize(out, rootVal, minify);
+    return std::move(out.getBuf());
+}
+
+void serializeToFile(std::string fileName, Value rootVal, bool minify)
+{
+    auto fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        throw RunError("failed to open file \"" + fileName + "\"");
+
+    try
+    {
+        OutSink out(fd);
+        out.write("#zeta-image\n\n");
+        serialize(out, rootVal, minify);
+        out.flush();
+        close(fd);
+    }
+    catch (RunError& err)
+    {
+        close(fd);
+        throw;
+    }
+}
+
+/// Cell of the binary image value stream
+struct BinCell
+{
+    uint32_t payload;
+    uint32_t tag;
+};
+
+/// Header of binary image files
+struct BinHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numStrings;
+    uint32_t numNodes;
+    uint32_t numCells;
+    uint32_t strDataSize;
+    uint32_t reserved;
+    BinCell root;
+};
+
+std::string serializeBin(Value rootVal, HostFnTable* hostFns)
+{
+    // Arrays and objects, in the order of their indices
+    std::vector<Value> nodes;
+    std::unordered_map<refptr, uint32_t> nodeIdxs;
+
+    // Strings are deduplicated by content
+    std::vector<std::string> strs;
+    std::unordered_map<std::string, uint32_t> strIdxs;
+
+    auto getStrIdx = [&strs, &strIdxs] (std::string str)
+    {
+        auto itr = strIdxs.find(str);
+        if (itr != strIdxs.end())
+            return itr->second;
+
+        auto idx = uint32_t(strs.size());
+        strIdxs[str] = idx;
+        strs.push_back(str);
+        return idx;
+    };
+
+    // Assign indices to the nodes reachable from the root
+    std::vector<Value> stack = { rootVal };
+    while (!stack.empty())
+    {
+        auto node = stack.back();
+        stack.pop_back();
+
+        if (!node.isArray() && !node.isObject())
+            continue;
+
+        auto ptr = (refptr)node;
+        if (nodeIdxs.find(ptr) != nodeIdxs.end())
+            continue;
+
+        nodeIdxs[ptr] = uint32_t(nodes.size());
+        nodes.push_back(node);
+
+        if (node.isArray())
+        {
+            auto arr = Array(node);
+            for (size_t i = 0; i < arr.length(); ++i)
+                stack.push_back(arr.getElem(i));
+        }
+        else
+        {
+            auto obj = Object(node);
+            for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
+                stack.push_back(obj.getField(itr.get()));
+        }
+    }
+
+    // Host functions get an index in the table, if there is one
+    std::unordered_map<HostFn*, uint32_t> hostFnIdxs;
+
+    auto encode = [&nodeIdxs, &getStrIdx, &hostFnIdxs, hostFns] (Value val)
+    {
+        BinCell cell = { 0, val.getTag() };
+
+        switch (val.getTag())
+        {
+            case TAG_UNDEF:
+            break;
+
+            case TAG_BOOL:
+            cell.payload = (val == Value::TRUE)? 1:0;
+            break;
+
+            case TAG_INT32:
+            cell.payload = uint32_t(int32_t(val));
+            break;
+
+            case TAG_FLOAT32:
+            {
+                auto f = float(val);
+                memcpy(&cell.payload, &f, sizeof(f));
+            }
+            break;
+
+            case TAG_STRING:
+            cell.payload = getStrIdx((std::string)val);
+            break;
+
+            case TAG_ARRAY:
+            case TAG_OBJECT:
+            cell.payload = nodeIdxs[(refptr)val];
+            break;
+
+            case TAG_HOSTFN:
+            if (hostFns)
+            {
+                auto fn = (HostFn*)val.getWord().ptr;
+                auto itr = hostFnIdxs.find(fn);
+                if (itr == hostFnIdxs.end())
+                {
+                    itr = hostFnIdxs.insert({ fn, uint32_t(hostFns->size()) }).first;
+                    hostFns->push_back(fn);
+                }
+                cell.payload = itr->second;
+                break;
+            }
+            // Fall through
+
+            default:
+            auto tagStr = tagToStr(val.getTag());
+            throw RunError("cannot serialize values with tag \"" + tagStr + "\"");
+        }
+
+        return cell;
+    };
+
+    // Write the value stream
+    std::vector<BinCell> cells;
+    std::vector<uint32_t> nodeTable;
+
+    for (auto node : nodes)
+    {
+        nodeTable.push_back(uint32_t(cells.size()));
+
+        if (node.isArray())
+        {
+            auto arr = Array(node);
+            cells.push_back({ arr.length(), TAG_ARRAY });
+
+            for (size_t i = 0; i < arr.length(); ++i)
+                cells.push_back(encode(arr.getElem(i)));
+        }
+        else
+        {
+            auto obj = Object(node);
+            auto countIdx = cells.size();
+            cells.push_back({ 0, TAG_OBJECT });
+
+            for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
+            {
+                auto fieldName = itr.get();
+                cells.push_back({ getStrIdx(fieldName), TAG_STRING });
+                cells.push_back(encode(obj.getField(fieldName)));
+                cells[countIdx].payload++;
+            }
+        }
+    }
+
+    auto root = encode(rootVal);
+
+    // Write the string data
+    std::string strData;
+    std::vector<uint32_t> strTable;
+
+    for (auto& str : strs)
+    {
+        strTable.push_back(uint32_t(strData.size()));
+        auto len = uint32_t(str.size());
+        strData.append((char*)&len, sizeof(len));
+        strData.append(str);
+    }
+
+    if (cells.size() > UINT32_MAX / sizeof(BinCell) || strData.size() > UINT32_MAX)
+        throw RunError("value graph too large for a binary image");
+
+    BinHeader header;
+    memcpy(header.magic, BIN_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = BIN_IMAGE_VERSION;
+    header.numStrings = uint32_t(strs.size());
+    header.numNodes = uint32_t(nodes.size());
+    header.numCells = uint32_t(cells.size());
+    header.strDataSize = uint32_t(strData.size());
+    header.reserved = 0;
+    header.root = root;
+
+    std::string out;
+    out.append((char*)&header, sizeof(header));
+    out.append((char*)strTable.data(), strTable.size() * sizeof(uint32_t));
+    out.append((char*)nodeTable.data(), nodeTable.size() * sizeof(uint32_t));
+    out.append((char*)cells.data(), cells.size() * sizeof(BinCell));
+    out.append(strData);
 
     return out;
 }
+
+void writeBinImage(std::string fileName, Value val)
+{
+    auto data = serializeBin(val);
+
+    FILE* file = fopen(fileName.c_str(), "wb");
+
+    if (!file)
+        throw RunError("failed to open file \"" + fileName + "\"");
+
+    auto written = fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+
+    if (written != data.size())
+        throw RunError("failed to write file \"" + fileName + "\"");
+}
+
+bool isBinImage(std::string fileName)
+{
+    FILE* file = fopen(fileName.c_str(), "rb");
+
+    if (!file)
+        return false;
+
+    char magic[sizeof(BIN_IMAGE_MAGIC)];
+    auto read = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+
+    return (
+        read == sizeof(magic) &&
+        memcmp(magic, BIN_IMAGE_MAGIC, sizeof(magic)) == 0
+    );
+}
+
+/// Header and section offsets of a binary image
+struct BinLayout
+{
+    BinHeader header;
+
+    // Section offsets, computed in 64 bits so they can't overflow
+    uint64_t offStrTable;
+    uint64_t offNodeTable;
+    uint64_t offCells;
+    uint64_t offStrData;
+};
+
+/// Read and validate the header of a binary image
+static BinLayout readBinLayout(const uint8_t* data, size_t size, std::string srcName)
+{
+    auto fail = [&srcName] (std::string msg)
+    {
+        throw ParseError(srcName + " - invalid binary image, " + msg);
+    };
+
+    BinLayout layout;
+    auto& header = layout.header;
+
+    if (size < sizeof(header))
+        fail("truncated header");
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, BIN_IMAGE_MAGIC, sizeof(header.magic)) != 0)
+        fail("bad magic number");
+    if (header.version != BIN_IMAGE_VERSION)
+        fail("unsupported version " + std::to_string(header.version));
+
+    layout.offStrTable = sizeof(header);
+    layout.offNodeTable = layout.offStrTable + uint64_t(header.numStrings) * sizeof(uint32_t);
+    layout.offCells = layout.offNodeTable + uint64_t(header.numNodes) * sizeof(uint32_t);
+    layout.offStrData = layout.offCells + uint64_t(header.numCells) * sizeof(BinCell);
+
+    if (layout.offStrData + header.strDataSize != size)
+        fail("section sizes don't match the file size");
+
+    return layout;
+}
+
+Value parseBinImage(
+    const uint8_t* data,
+    size_t size,
+    std::string srcName,
+    const HostFnTable* hostFns
+)
+{
+    auto fail = [&srcName] (std::string msg)
+    {
+        throw ParseError(srcName + " - invalid binary image, " + msg);
+    };
+
+    auto layout = readBinLayout(data, size, srcName);
+    auto& header = layout.header;
+    auto offStrTable = layout.offStrTable;
+    auto offNodeTable = layout.offNodeTable;
+    auto offCells = layout.offCells;
+    auto offStrData = layout.offStrData;
+
+    auto read32 = [data] (uint64_t offset)
+    {
+        uint32_t val;
+        memcpy(&val, data + offset, sizeof(val));
+        return val;
+    };
+
+    auto readCell = [data, offCells] (uint64_t idx)
+    {
+        BinCell cell;
+        memcpy(&cell, data + offCells + idx * sizeof(BinCell), sizeof(cell));
+        return cell;
+    };
+
+    // Intern the strings, without copying the ones already in the pool
+    std::vector<Value> strs(header.numStrings);
+    for (size_t i = 0; i < strs.size(); ++i)
+    {
+        uint64_t offset = read32(offStrTable + i * sizeof(uint32_t));
+        if (offset + sizeof(uint32_t) > header.strDataSize)
+            fail("string offset out of bounds");
+
+        uint64_t len = read32(offStrData + offset);
+        if (offset + sizeof(uint32_t) + len > header.strDataSize)
+            fail("string length out of bounds");
+
+        auto chars = (const char*)data + offStrData + offset + sizeof(uint32_t);
+        strs[i] = String(chars, len);
+    }
+
+    // Allocate the arrays and objects, so that references
+    // to them can be relocated in a single pass
+    std::vector<Value> nodes(header.numNodes);
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        uint64_t cellIdx = read32(offNodeTable + i * sizeof(uint32_t));
+        if (cellIdx >= header.numCells)
+            fail("node offset out of bounds");
+
+        auto cell = readCell(cellIdx);
+        uint64_t numCells = (cell.tag == TAG_OBJECT)? 2 * uint64_t(cell.payload):cell.payload;
+        if (cellIdx + 1 + numCells > header.numCells)
+            fail("node contents out of bounds");
+
+        if (cell.tag == TAG_ARRAY)
+            nodes[i] = Array(cell.payload);
+        else if (cell.tag == TAG_OBJECT)
+            nodes[i] = Object::newObject(cell.payload);
+        else
+            fail("invalid node tag");
+    }
+
+    auto decode = [&] (BinCell cell)
+    {
+        switch (cell.tag)
+        {
+            case TAG_UNDEF:
+            return Value::UNDEF;
+
+            case TAG_BOOL:
+            return cell.payload? Value::TRUE:Value::FALSE;
+
+            case TAG_INT32:
+            return Value::int32(int32_t(cell.payload));
+
+            case TAG_FLOAT32:
+            {
+                float f;
+                memcpy(&f, &cell.payload, sizeof(f));
+                return Value::float32(f);
+            }
+
+            case TAG_STRING:
+            if (cell.payload >= strs.size())
+                fail("string index out of bounds");
+            return strs[cell.payload];
+
+            case TAG_ARRAY:
+            case TAG_OBJECT:
+            if (cell.payload >= nodes.size() || nodes[cell.payload].getTag() != cell.tag)
+                fail("invalid node reference");
+            return nodes[cell.payload];
+
+            case TAG_HOSTFN:
+            if (!hostFns || cell.payload >= hostFns->size())
+                fail("invalid host function reference");
+            return Value((refptr)(*hostFns)[cell.payload], TAG_HOSTFN);
+
+            default:
+            fail("invalid value tag");
+            return Value::UNDEF;
+        }
+    };
+
+    // Fill in the node contents
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        uint64_t cellIdx = read32(offNodeTable + i * sizeof(uint32_t));
+        auto count = readCell(cellIdx).payload;
+
+        if (nodes[i].isArray())
+        {
+            auto arr = Array(nodes[i]);
+            for (size_t j = 0; j < count; ++j)
+                arr.push(decode(readCell(cellIdx + 1 + j)));
+            continue;
+        }
+
+        auto obj = Object(nodes[i]);
+        for (size_t j = 0; j < count; ++j)
+        {
+            auto nameCell = readCell(cellIdx + 1 + 2 * j);
+            if (nameCell.tag != TAG_STRING)
+                fail("field names must be strings");
+
+            auto fieldName = decode(nameCell);
+            auto fieldVal = decode(readCell(cellIdx + 2 + 2 * j));
+            obj.setField(String(fieldName), fieldVal);
+        }
+    }
+
+    return decode(header.root);
+}
+
+std::vector<std::string> findBinImageImports(const uint8_t* data, size_t size)
+{
+    std::vector<std::string> pkgNames;
+
+    BinLayout layout;
+    try
+    {
+        layout = readBinLayout(data, size, "");
+    }
+    catch (ParseError& err)
+    {
+        return pkgNames;
+    }
+
+    auto& header = layout.header;
+    const BinCell undefCell = { 0, TAG_UNDEF };
+
+    // Reads are bounds-checked, since the image wasn't fully validated
+    auto read32 = [data] (uint64_t offset)
+    {
+        uint32_t val;
+        memcpy(&val, data + offset, sizeof(val));
+        return val;
+    };
+
+    auto readCell = [&] (uint64_t idx)
+    {
+        BinCell cell = undefCell;
+        if (idx < header.numCells)
+            memcpy(&cell, data + layout.offCells + idx * sizeof(BinCell), sizeof(cell));
+        return cell;
+    };
+
+    auto nodeStart = [&] (uint32_t nodeIdx) -> uint64_t
+    {
+        if (nodeIdx >= header.numNodes)
+            return UINT64_MAX;
+        return read32(layout.offNodeTable + uint64_t(nodeIdx) * sizeof(uint32_t));
+    };
+
+    // Get the characters of a string cell, or nullptr if it isn't a string
+    auto getChars = [&] (BinCell cell, uint64_t& len) -> const char*
+    {
+        if (cell.tag != TAG_STRING || cell.payload >= header.numStrings)
+            return nullptr;
+
+        uint64_t offset = read32(layout.offStrTable + uint64_t(cell.payload) * sizeof(uint32_t));
+        if (offset + sizeof(uint32_t) > header.strDataSize)
+            return nullptr;
+
+        len = read32(layout.offStrData + offset);
+        if (offset + sizeof(uint32_t) + len > header.strDataSize)
+            return nullptr;
+
+        return (const char*)data + layout.offStrData + offset + sizeof(uint32_t);
+    };
+
+    auto strEq = [&] (BinCell cell, const char* str)
+    {
+        uint64_t len;
+        auto chars = getChars(cell, len);
+        return chars && len == strlen(str) && memcmp(chars, str, len) == 0;
+    };
+
+    // Get the value of an object field, or undef if it is missing
+    auto getField = [&] (BinCell objCell, const char* name)
+    {
+        if (objCell.tag != TAG_OBJECT)
+            return undefCell;
+
+        auto start = nodeStart(objCell.payload);
+        auto count = readCell(start).payload;
+
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            if (strEq(readCell(start + 1 + 2 * i), name))
+                return readCell(start + 2 + 2 * i);
+        }
+
+        return undefCell;
+    };
+
+    // Imports are compiled into a push of the package
+    // name, followed by an import instruction
+    for (uint32_t nodeIdx = 0; nodeIdx < header.numNodes; ++nodeIdx)
+    {
+        auto start = nodeStart(nodeIdx);
+        auto head = readCell(start);
+        if (head.tag != TAG_ARRAY)
+            continue;
+
+        for (uint64_t i = 1; i < head.payload; ++i)
+        {
+            auto instr = readCell(start + 1 + i);
+            if (!strEq(getField(instr, "op"), "import"))
+                continue;
+
+            auto prev = readCell(start + i);
+            if (!strEq(getField(prev, "op"), "push"))
+                continue;
+
+            uint64_t len;
+            auto chars = getChars(getField(prev, "val"), len);
+            if (!chars)
+                continue;
+
+            auto pkgName = std::string(chars, len);
+            if (std::find(pkgNames.begin(), pkgNames.end(), pkgName) == pkgNames.end())
+                pkgNames.push_back(pkgName);
+        }
+    }
+
+    return pkgNames;
+}
+
+Value loadBinImage(std::string fileName)
+{
+    auto fd = open(fileName.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw ParseError("failed to open file \"" + fileName + "\"");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        throw ParseError("failed to read file \"" + fileName + "\"");
+    }
+
+    auto size = size_t(st.st_size);
+    auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        throw ParseError("failed to map file \"" + fileName + "\"");
+
+    try
+    {
+        auto val = parseBinImage((const uint8_t*)data, size, fileName);
+        munmap(data, size);
+        return val;
+    }
+    catch (...)
+    {
+        munmap(data, size);
+        throw;
+    }
+}
+
+void testSerialize()
+{
+    std::cout << "binary image tests" << std::endl;
+
+    // A graph with shared references, a cycle and every value kind
+    auto shared = Array(2);
+    shared.push(Value::float32(1.5f));
+    shared.push(String("s\0t", 3));
+    auto obj = Object::newObject();
+    obj.setField("arr", shared);
+    obj.setField("again", shared);
+    obj.setField("self", obj);
+    obj.setField("n", Value::int32(-7));
+    obj.setField("b", Value::TRUE);
+    obj.setField("u", Value::UNDEF);
+
+    auto data = serializeBin(obj);
+    auto bytes = (const uint8_t*)data.data();
+    auto val = parseBinImage(bytes, data.size(), "test");
+
+    assert (val.isObject());
+    auto obj2 = Object(val);
+    assert (obj2.getField("self") == val);
+    assert (obj2.getField("arr") == obj2.getField("again"));
+    assert (obj2.getField("n") == Value::int32(-7));
+    assert (obj2.getField("b") == Value::TRUE);
+    assert (obj2.hasField("u") && obj2.getField("u") == Value::UNDEF);
+    auto arr2 = Array(obj2.getField("arr"));
+    assert (arr2.length() == 2);
+    assert ((float)arr2.getElem(0) == 1.5f);
+    assert ((Value)String(arr2.getElem(1)) == (Value)String("s\0t", 3));
+    assert (String(arr2.getElem(1)).length() == 3);
+
+    // Non-object roots
+    auto data2 = serializeBin(Value::int32(3));
+    auto val2 = parseBinImage((const uint8_t*)data2.data(), data2.size(), "test");
+    assert (val2 == Value::int32(3));
+
+    // Imports can be found without loading the image
+    auto push = Object::newObject();
+    push.setField("op", String("push"));
+    push.setField("val", String("std/foo/0"));
+    auto importInstr = Object::newObject();
+    importInstr.setField("op", String("import"));
+    auto instrs = Array(2);
+    instrs.push(push);
+    instrs.push(importInstr);
+    auto data3 = serializeBin(instrs);
+    auto imports = findBinImageImports((const uint8_t*)data3.data(), data3.size());
+    assert (imports.size() == 1 && imports[0] == "std/foo/0");
+
+    // Host functions can only be serialized with a table
+    auto fnArr = Array(2);
+    fnArr.push(Value((refptr)&importFn, TAG_HOSTFN));
+    fnArr.push(Value((refptr)&importFn, TAG_HOSTFN));
+    HostFnTable hostFns;
+    auto data4 = serializeBin(fnArr, &hostFns);
+    assert (hostFns.size() == 1);
+    auto arr4 = Array(parseBinImage((const uint8_t*)data4.data(), data4.size(), "test", &hostFns));
+    assert (arr4.getElem(1) == Value((refptr)&importFn, TAG_HOSTFN));
+
+    try
+    {
+        serializeBin(fnArr);
+        assert (false);
+    }
+    catch (RunError& e)
+    {
+    }
+
+    try
+    {
+        parseBinImage((const uint8_t*)data4.data(), data4.size(), "test");
+        assert (false);
+    }
+    catch (ParseError& e)
+    {
+    }
+
+    // Truncated images are rejected
+    try
+    {
+        parseBinImage(bytes, data.size() - 1, "test");
+        assert (false);
+    }
+    catch (ParseError& e)
+    {
+    }
+}
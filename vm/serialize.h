@@ -1,6 +1,67 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "runtime.h"
 
-std::string serialize(Value val, bool indent);
+/// Serialize a value graph into the text image format (ZIM)
+std::string serialize(Value val, bool minify);
+
+/// Write a value graph to a text image file, streaming the output
+void serializeToFile(std::string fileName, Value val, bool minify);
+
+/**
+Binary image format (ZIM-B), a compact equivalent of text ZIM images
+which loads without parsing. All fields are little-endian:
+
+- header: magic, version, table sizes and the root value
+- string table: offsets of the strings in the string data
+- node table: for each array or object, the index of its first cell
+  in the value stream. References to nodes are node indices, which
+  get relocated to heap pointers through this table.
+- value stream: 8-byte cells holding a 32-bit payload and a tag.
+  Each node starts with a cell holding its tag and element count,
+  followed by its elements, or by name and value cells for objects.
+- string data: each string as a 32-bit length and its characters
+*/
+const char BIN_IMAGE_MAGIC[8] = { '#', 'z', 'e', 't', 'a', 'b', 'i', 'n' };
+const uint32_t BIN_IMAGE_VERSION = 1;
+
+class HostFn;
+
+/**
+Table of the host functions referenced by a binary image. Host functions
+can't be written to files, but images which stay in the process can
+refer to them by their index in this table, for example to copy values
+from one isolate to another.
+*/
+typedef std::vector<HostFn*> HostFnTable;
+
+/// Serialize a value graph into the binary image format, with host
+/// functions added to a table if one is given
+std::string serializeBin(Value val, HostFnTable* hostFns = nullptr);
+
+/// Write a value graph to a file in the binary image format
+void writeBinImage(std::string fileName, Value val);
+
+/// Test if a file holds a binary image
+bool isBinImage(std::string fileName);
+
+/// Load a binary image from a file, by mapping it into memory
+Value loadBinImage(std::string fileName);
+
+/// Load a binary image from a buffer, with the table of host
+/// functions it was serialized with, if any
+Value parseBinImage(
+    const uint8_t* data,
+    size_t size,
+    std::string srcName,
+    const HostFnTable* hostFns = nullptr
+);
+
+/// Find the names of the packages imported by the code in a binary
+/// image, without loading it. This doesn't touch the heap.
+std::vector<std::string> findBinImageImports(const uint8_t* data, size_t size);
+
+/// Unit test for the binary image format
+void testSerialize();
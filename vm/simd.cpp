@@ -0,0 +1,423 @@
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include "simd.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+const char* simdIsa()
+{
+#if defined(SIMD_SSE2)
+    return "sse2";
+#elif defined(SIMD_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+void simdAdd(float* dst, const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+#elif defined(SIMD_NEON)
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = a[i] + b[i];
+}
+
+void simdMul(float* dst, const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+#elif defined(SIMD_NEON)
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(dst + i, vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = a[i] * b[i];
+}
+
+void simdMulAdd(float* dst, const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    for (; i + 4 <= n; i += 4)
+    {
+        auto prod = _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), prod));
+    }
+#elif defined(SIMD_NEON)
+    for (; i + 4 <= n; i += 4)
+    {
+        auto prod = vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), prod));
+    }
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = dst[i] + a[i] * b[i];
+}
+
+void simdScale(float* dst, const float* src, float k, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    auto vk = _mm_set1_ps(k);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), vk));
+#elif defined(SIMD_NEON)
+    auto vk = vdupq_n_f32(k);
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(dst + i, vmulq_f32(vld1q_f32(src + i), vk));
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = src[i] * k;
+}
+
+/// Scalar clamping, comparisons with NaN are false
+static inline float clamp(float x, float lo, float hi)
+{
+    x = (x < lo)? lo:x;
+    return (x > hi)? hi:x;
+}
+
+void simdClamp(float* dst, float lo, float hi, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    // The second operand is returned when either is NaN
+    auto vlo = _mm_set1_ps(lo);
+    auto vhi = _mm_set1_ps(hi);
+    for (; i + 4 <= n; i += 4)
+    {
+        auto x = _mm_loadu_ps(dst + i);
+        _mm_storeu_ps(dst + i, _mm_min_ps(vhi, _mm_max_ps(vlo, x)));
+    }
+#elif defined(SIMD_NEON)
+    // NaN propagates through vmaxq/vminq
+    auto vlo = vdupq_n_f32(lo);
+    auto vhi = vdupq_n_f32(hi);
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(dst + i, vminq_f32(vmaxq_f32(vld1q_f32(dst + i), vlo), vhi));
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = clamp(dst[i], lo, hi);
+}
+
+/// Scalar saturating conversion, NaN converts to zero
+static inline int32_t convert(float x, float lo, float hi)
+{
+    if (std::isnan(x))
+        return 0;
+
+    return (int32_t)lrintf(clamp(x, lo, hi));
+}
+
+#if defined(SIMD_SSE2)
+/// Clamp and convert four floats, rounding to nearest
+static inline __m128i convert4(__m128 x, __m128 vlo, __m128 vhi)
+{
+    // Zero out NaN elements
+    x = _mm_and_ps(x, _mm_cmpord_ps(x, x));
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, vlo), vhi));
+}
+#elif defined(SIMD_NEON)
+static inline int32x4_t convert4(float32x4_t x, float32x4_t vlo, float32x4_t vhi)
+{
+    // NaN elements stay NaN, which vcvtnq converts to zero
+    return vcvtnq_s32_f32(vminq_f32(vmaxq_f32(x, vlo), vhi));
+}
+#endif
+
+void simdF32ToU8(uint8_t* dst, const float* src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    auto vlo = _mm_set1_ps(0);
+    auto vhi = _mm_set1_ps(UINT8_MAX);
+    for (; i + 8 <= n; i += 8)
+    {
+        auto a = convert4(_mm_loadu_ps(src + i), vlo, vhi);
+        auto b = convert4(_mm_loadu_ps(src + i + 4), vlo, vhi);
+        auto w = _mm_packs_epi32(a, b);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(w, w));
+    }
+#elif defined(SIMD_NEON)
+    auto vlo = vdupq_n_f32(0);
+    auto vhi = vdupq_n_f32(UINT8_MAX);
+    for (; i + 8 <= n; i += 8)
+    {
+        auto a = convert4(vld1q_f32(src + i), vlo, vhi);
+        auto b = convert4(vld1q_f32(src + i + 4), vlo, vhi);
+        auto w = vcombine_u16(vqmovun_s32(a), vqmovun_s32(b));
+        vst1_u8(dst + i, vqmovn_u16(w));
+    }
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = (uint8_t)convert(src[i], 0, UINT8_MAX);
+}
+
+void simdU8ToF32(float* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    auto zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8)
+    {
+        auto w = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i)), zero);
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)));
+    }
+#elif defined(SIMD_NEON)
+    for (; i + 8 <= n; i += 8)
+    {
+        auto w = vmovl_u8(vld1_u8(src + i));
+        vst1q_f32(dst + i, vcvtq_f32_u32(vmovl_u16(vget_low_u16(w))));
+        vst1q_f32(dst + i + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(w))));
+    }
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = src[i];
+}
+
+void simdF32ToI16(int16_t* dst, const float* src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    auto vlo = _mm_set1_ps(INT16_MIN);
+    auto vhi = _mm_set1_ps(INT16_MAX);
+    for (; i + 8 <= n; i += 8)
+    {
+        auto a = convert4(_mm_loadu_ps(src + i), vlo, vhi);
+        auto b = convert4(_mm_loadu_ps(src + i + 4), vlo, vhi);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+    }
+#elif defined(SIMD_NEON)
+    auto vlo = vdupq_n_f32(INT16_MIN);
+    auto vhi = vdupq_n_f32(INT16_MAX);
+    for (; i + 8 <= n; i += 8)
+    {
+        auto a = convert4(vld1q_f32(src + i), vlo, vhi);
+        auto b = convert4(vld1q_f32(src + i + 4), vlo, vhi);
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+    }
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = (int16_t)convert(src[i], INT16_MIN, INT16_MAX);
+}
+
+void simdI16ToF32(float* dst, const int16_t* src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    for (; i + 8 <= n; i += 8)
+    {
+        // Sign-extend by shifting each value down from the high half
+        auto w = _mm_loadu_si128((const __m128i*)(src + i));
+        auto lo = _mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16);
+        auto hi = _mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16);
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(lo));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(hi));
+    }
+#elif defined(SIMD_NEON)
+    for (; i + 8 <= n; i += 8)
+    {
+        auto w = vld1q_s16(src + i);
+        vst1q_f32(dst + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(w))));
+        vst1q_f32(dst + i + 4, vcvtq_f32_s32(vmovl_s16(vget_high_s16(w))));
+    }
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = src[i];
+}
+
+float simdSum(const float* src, size_t n)
+{
+    size_t i = 0;
+    float sum = 0;
+
+#if defined(SIMD_SSE2) || defined(SIMD_NEON)
+    float lanes[4];
+#if defined(SIMD_SSE2)
+    auto acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_add_ps(acc, _mm_loadu_ps(src + i));
+    _mm_storeu_ps(lanes, acc);
+#else
+    auto acc = vdupq_n_f32(0);
+    for (; i + 4 <= n; i += 4)
+        acc = vaddq_f32(acc, vld1q_f32(src + i));
+    vst1q_f32(lanes, acc);
+#endif
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+    for (; i < n; ++i)
+        sum += src[i];
+
+    return sum;
+}
+
+float simdMin(const float* src, size_t n)
+{
+    size_t i = 0;
+    float min = std::numeric_limits<float>::infinity();
+
+#if defined(SIMD_SSE2) || defined(SIMD_NEON)
+    float lanes[4];
+#if defined(SIMD_SSE2)
+    // The accumulator is returned when an element is NaN
+    auto acc = _mm_set1_ps(min);
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_min_ps(_mm_loadu_ps(src + i), acc);
+    _mm_storeu_ps(lanes, acc);
+#else
+    auto acc = vdupq_n_f32(min);
+    for (; i + 4 <= n; i += 4)
+        acc = vminnmq_f32(acc, vld1q_f32(src + i));
+    vst1q_f32(lanes, acc);
+#endif
+    for (auto lane : lanes)
+        min = (lane < min)? lane:min;
+#endif
+
+    for (; i < n; ++i)
+        min = (src[i] < min)? src[i]:min;
+
+    return min;
+}
+
+float simdMax(const float* src, size_t n)
+{
+    size_t i = 0;
+    float max = -std::numeric_limits<float>::infinity();
+
+#if defined(SIMD_SSE2) || defined(SIMD_NEON)
+    float lanes[4];
+#if defined(SIMD_SSE2)
+    auto acc = _mm_set1_ps(max);
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_max_ps(_mm_loadu_ps(src + i), acc);
+    _mm_storeu_ps(lanes, acc);
+#else
+    auto acc = vdupq_n_f32(max);
+    for (; i + 4 <= n; i += 4)
+        acc = vmaxnmq_f32(acc, vld1q_f32(src + i));
+    vst1q_f32(lanes, acc);
+#endif
+    for (auto lane : lanes)
+        max = (lane > max)? lane:max;
+#endif
+
+    for (; i < n; ++i)
+        max = (src[i] > max)? src[i]:max;
+
+    return max;
+}
+
+void testSimd()
+{
+    // Lengths which aren't a multiple of the vector width,
+    // so that both the vector and scalar loops get tested
+    const size_t N = 21;
+    float a[N], b[N], c[N];
+
+    for (size_t i = 0; i < N; ++i)
+    {
+        a[i] = float(i);
+        b[i] = float(2 * i) - 10.0f;
+    }
+
+    simdAdd(c, a, b, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (c[i] == a[i] + b[i]);
+
+    simdMul(c, a, b, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (c[i] == a[i] * b[i]);
+
+    simdMulAdd(c, a, a, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (c[i] == a[i] * b[i] + a[i] * a[i]);
+
+    simdScale(c, a, 0.5f, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (c[i] == a[i] * 0.5f);
+
+    simdScale(c, b, 1.0f, N);
+    c[3] = NAN;
+    simdClamp(c, -2.0f, 2.0f, N);
+    for (size_t i = 0; i < N; ++i)
+        assert ((i == 3)? std::isnan(c[i]):(c[i] == clamp(b[i], -2.0f, 2.0f)));
+
+    assert (simdSum(a, N) == float(N * (N - 1) / 2));
+    assert (simdSum(a, 0) == 0.0f);
+    assert (simdMin(b, N) == -10.0f);
+    assert (simdMax(b, N) == float(2 * (N - 1)) - 10.0f);
+    assert (simdMin(c, N) == -2.0f);
+    assert (simdMax(c, N) == 2.0f);
+    assert (simdMax(a, 0) == -std::numeric_limits<float>::infinity());
+
+    // Rounding, saturation and NaN handling in conversions
+    float f[N];
+    for (size_t i = 0; i < N; ++i)
+        f[i] = float(i) * 40.5f - 100.0f;
+    f[9] = NAN;
+    f[17] = 1e10f;
+    f[18] = -1e10f;
+
+    uint8_t u8[N];
+    simdF32ToU8(u8, f, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (u8[i] == convert(f[i], 0, UINT8_MAX));
+    assert (u8[0] == 0 && u8[9] == 0 && u8[17] == 255 && u8[18] == 0);
+    assert (u8[3] == 22);
+
+    simdU8ToF32(c, u8, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (c[i] == float(u8[i]));
+
+    for (size_t i = 0; i < N; ++i)
+        f[i] *= 100.0f;
+
+    int16_t i16[N];
+    simdF32ToI16(i16, f, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (i16[i] == convert(f[i], INT16_MIN, INT16_MAX));
+    assert (i16[0] == -10000 && i16[9] == 0);
+    assert (i16[17] == INT16_MAX && i16[18] == INT16_MIN);
+
+    simdI16ToF32(c, i16, N);
+    for (size_t i = 0; i < N; ++i)
+        assert (c[i] == float(i16[i]));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+Bulk kernels over raw typed array elements. These have SSE2 fast
+paths on x86-64 and NEON fast paths on AArch64, with a scalar
+fallback which also handles the elements past the last full vector.
+The destination may be one of the sources, but buffers must not
+otherwise overlap.
+
+Conversions round to nearest and saturate, and NaN converts to zero.
+*/
+
+/// Name of the instruction set used by the fast paths
+const char* simdIsa();
+
+/// dst = a + b
+void simdAdd(float* dst, const float* a, const float* b, size_t n);
+
+/// dst = a * b
+void simdMul(float* dst, const float* a, const float* b, size_t n);
+
+/// dst = dst + a * b, not fused
+void simdMulAdd(float* dst, const float* a, const float* b, size_t n);
+
+/// dst = src * k
+void simdScale(float* dst, const float* src, float k, size_t n);
+
+/// Clamp elements in place to [lo, hi], NaN elements are left as is
+void simdClamp(float* dst, float lo, float hi, size_t n);
+
+// Conversions between element types
+void simdF32ToU8(uint8_t* dst, const float* src, size_t n);
+void simdU8ToF32(float* dst, const uint8_t* src, size_t n);
+void simdF32ToI16(int16_t* dst, const float* src, size_t n);
+void simdI16ToF32(float* dst, const int16_t* src, size_t n);
+
+/// Reductions, NaN elements are ignored by min and max,
+/// which produce infinities for empty inputs
+float simdSum(const float* src, size_t n);
+float simdMin(const float* src, size_t n);
+float simdMax(const float* src, size_t n);
+
+/// Unit test for the SIMD kernels
+void testSimd();
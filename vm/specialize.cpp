@@ -0,0 +1,1515 @@
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "specialize.h"
+#include "runtime.h"
+#include "parser.h"
+#include "interp.h"
+#include "gc.h"
+
+/// Maximum nesting depth of inlined calls
+const size_t MAX_INLINE_DEPTH = 4;
+
+/// Largest function which gets inlined, in instructions
+const size_t MAX_INLINE_INSTRS = 256;
+
+/// Maximum total size of the functions inlined into one
+/// specialized function, in instructions
+const size_t MAX_INLINE_TOTAL = 4096;
+
+/**
+Abstract value of a local variable or of a temporary
+*/
+struct AbsVal
+{
+    enum Kind : uint8_t
+    {
+        /// Local of an inlined call which has returned, never read
+        DEAD,
+        KNOWN,
+        UNKNOWN
+    };
+
+    Kind kind = DEAD;
+
+    /// Value, if known
+    Value val;
+
+    /// Whether the value is stored in its slot, for locals, or pushed
+    /// on the stack, for temporaries. Unknown values always are.
+    bool real = true;
+
+    static AbsVal known(Value val, bool real)
+    {
+        AbsVal a;
+        a.kind = KNOWN;
+        a.val = val;
+        a.real = real;
+        return a;
+    }
+
+    static AbsVal unknown()
+    {
+        AbsVal a;
+        a.kind = UNKNOWN;
+        return a;
+    }
+
+    bool isKnown() const { return kind == KNOWN; }
+};
+
+/**
+Abstract state of the locals and of the temporary stack. Temporaries
+which were not pushed yet are always above those which were.
+*/
+struct AbsState
+{
+    /// Locals, indexed by slot in the specialized function
+    std::vector<AbsVal> locals;
+
+    std::vector<AbsVal> stack;
+};
+
+/**
+Call inlined into the specialized function. Site 0 is the function
+being specialized itself.
+*/
+struct InlineSite
+{
+    /// Site the call is made from
+    size_t parent;
+
+    /// Nesting depth of the call
+    size_t depth;
+
+    /// Block the call returns to, in the parent site
+    Value retTo;
+
+    /// Number of temporaries below the arguments of the call
+    size_t stackBase;
+
+    /// Slots of the callee locals in the specialized function
+    std::vector<uint32_t> slots;
+};
+
+/**
+Basic block of the original code, at a given inlining site
+*/
+struct SpecBlock
+{
+    Value block;
+
+    size_t site;
+
+    /// Meet of the states flowing into the block
+    AbsState entry;
+
+    bool reached = false;
+
+    /// Reachability and number of incoming edges with the final states
+    bool visited = false;
+    size_t numPreds = 0;
+
+    /// Whether the block starts a block of the specialized function,
+    /// other blocks are appended to their only predecessor
+    bool isHead = false;
+
+    Value newBlock;
+};
+
+/**
+Specializer for one function. Propagation visits the blocks with
+a worklist until their entry states stop changing, only following
+the branches which can be taken. A second pass finds the blocks
+reachable with the final states and counts their predecessors, and
+the last one writes the specialized blocks. The three passes share the
+code simulating the instructions on abstract states, so that they take
+the same decisions.
+*/
+class Specializer
+{
+    enum Mode
+    {
+        ANALYZE,
+        COUNT,
+        EMIT
+    };
+
+    Object fun;
+
+    Object args;
+
+    Mode mode = ANALYZE;
+
+    std::vector<InlineSite> sites;
+
+    /// Sites by parent site and call instruction
+    std::map<std::pair<size_t, refptr>, size_t> siteIdx;
+
+    std::vector<SpecBlock> blocks;
+
+    /// Blocks by original block, site and number of temporaries. As
+    /// with block versions in the interpreter, code following a call
+    /// which is not meant to return may have an inconsistent stack.
+    std::map<std::tuple<refptr, size_t, size_t>, size_t> blockIdx;
+
+    std::vector<size_t> queue;
+
+    /// Sizes of the functions which can be inlined, in instructions,
+    /// SIZE_MAX for those which can't
+    std::unordered_map<refptr, size_t> calleeSizes;
+
+    /// Total size of the functions inlined so far
+    size_t numInlined = 0;
+
+    /// Number of local slots of the specialized function
+    size_t numSlots = 0;
+
+    /// Instructions of the block being written
+    Value curInstrs;
+
+public:
+
+    Specializer(Object fun, Object args)
+    : fun(fun),
+      args(args)
+    {
+    }
+
+    Object run();
+
+private:
+
+    size_t getBlock(Value block, size_t site, size_t numTmps);
+    size_t getSite(size_t parent, Object callInstr, Object callee, Value retTo, size_t stackBase);
+
+    bool meet(size_t idx, const AbsState& state);
+    void edge(size_t idx, const AbsState& state, bool isJump);
+    size_t jumpTo(Value block, size_t site, AbsState& s);
+
+    void simulate(size_t idx, AbsState s);
+    size_t simBlock(size_t idx, AbsState& s);
+
+    bool fold(const std::string& op, Object instr, AbsState& s);
+    bool canInline(Object callInstr, const AbsState& s, size_t site, size_t numArgs);
+
+    void conform(AbsState& s, const AbsState& entry);
+    void storeLocals(AbsState& s, const AbsState& entry);
+    void flush(AbsState& s);
+    void drop(AbsState& s, size_t n);
+    void setLocal(AbsState& s, uint32_t slot);
+
+    void emit(Object instr);
+    void emitOp(const char* op);
+    void emitPush(Value val);
+    void emitIdx(const char* op, uint32_t idx);
+    void emitJump(size_t target);
+    void emitIfTrue(size_t thenIdx, size_t elseIdx);
+    void emitCall(Object callInstr, size_t retIdx, size_t excIdx);
+
+    Object copyObj(Object obj, const char* skip0, const char* skip1 = "", const char* skip2 = "");
+};
+
+/// Names of the fields of instructions holding branch targets
+static const char* targetNames[] = {
+    "to", "then", "else", "ret_to", "throw_to"
+};
+
+/// Number of values popped and pushed by instructions which
+/// have no effect on the locals or the control flow
+static std::pair<size_t, size_t> stackEffect(const std::string& op)
+{
+    static const std::unordered_map<std::string, std::pair<size_t, size_t>> effects = {
+        { "add_i32", {2, 1} }, { "sub_i32", {2, 1} }, { "mul_i32", {2, 1} },
+        { "div_i32", {2, 1} }, { "mod_i32", {2, 1} }, { "shl_i32", {2, 1} },
+        { "shr_i32", {2, 1} }, { "ushr_i32", {2, 1} }, { "and_i32", {2, 1} },
+        { "or_i32", {2, 1} }, { "xor_i32", {2, 1} }, { "not_i32", {1, 1} },
+        { "lt_i32", {2, 1} }, { "le_i32", {2, 1} }, { "gt_i32", {2, 1} },
+        { "ge_i32", {2, 1} }, { "eq_i32", {2, 1} },
+        { "add_f32", {2, 1} }, { "sub_f32", {2, 1} }, { "mul_f32", {2, 1} },
+        { "div_f32", {2, 1} }, { "lt_f32", {2, 1} }, { "le_f32", {2, 1} },
+        { "gt_f32", {2, 1} }, { "ge_f32", {2, 1} }, { "eq_f32", {2, 1} },
+        { "sin_f32", {1, 1} }, { "cos_f32", {1, 1} }, { "sqrt_f32", {1, 1} },
+        { "i32_to_f32", {1, 1} }, { "i32_to_str", {1, 1} },
+        { "f32_to_i32", {1, 1} }, { "f32_to_str", {1, 1} },
+        { "str_to_f32", {1, 1} },
+        { "eq_bool", {2, 1} }, { "has_tag", {1, 1} }, { "get_tag", {1, 1} },
+        { "str_len", {1, 1} }, { "get_char", {2, 1} },
+        { "get_char_code", {2, 1} }, { "char_to_str", {1, 1} },
+        { "str_cat", {2, 1} }, { "eq_str", {2, 1} },
+        { "new_object", {1, 1} }, { "has_field", {2, 1} },
+        { "set_field", {3, 0} }, { "get_field", {2, 1} },
+        { "get_field_list", {1, 1} }, { "eq_obj", {2, 1} },
+        { "new_array", {1, 1} }, { "array_len", {1, 1} },
+        { "array_push", {2, 0} }, { "set_elem", {3, 0} },
+        { "get_elem", {2, 1} }
+    };
+
+    auto itr = effects.find(op);
+    if (itr == effects.end())
+        throw RunError("cannot specialize opcode \"" + op + "\"");
+
+    return itr->second;
+}
+
+/// Get the ith value from the top of the abstract stack
+static const AbsVal& getTmp(const AbsState& s, size_t i)
+{
+    assert (i < s.stack.size());
+    return s.stack[s.stack.size() - 1 - i];
+}
+
+/// Check that there are enough values on the abstract stack
+static void needTmps(const AbsState& s, size_t n)
+{
+    if (s.stack.size() < n)
+        throw RunError("stack underflow in function being specialized");
+}
+
+/// Test if the n values on top of the abstract stack are known
+static bool knownTmps(const AbsState& s, size_t n)
+{
+    if (s.stack.size() < n)
+        return false;
+
+    for (size_t i = 0; i < n; ++i)
+        if (!getTmp(s, i).isKnown())
+            return false;
+
+    return true;
+}
+
+static Value boolVal(bool b)
+{
+    return b? Value::TRUE:Value::FALSE;
+}
+
+size_t Specializer::getBlock(Value block, size_t site, size_t numTmps)
+{
+    auto key = std::make_tuple((refptr)block, site, numTmps);
+    auto itr = blockIdx.find(key);
+    if (itr != blockIdx.end())
+        return itr->second;
+
+    if (!block.isObject())
+        throw RunError("branch target is not a block");
+
+    SpecBlock sb;
+    sb.block = block;
+    sb.site = site;
+    blocks.push_back(sb);
+
+    blockIdx[key] = blocks.size() - 1;
+    return blocks.size() - 1;
+}
+
+size_t Specializer::getSite(
+    size_t parent,
+    Object callInstr,
+    Object callee,
+    Value retTo,
+    size_t stackBase
+)
+{
+    auto key = std::make_pair(parent, (refptr)callInstr);
+    auto itr = siteIdx.find(key);
+    if (itr != siteIdx.end())
+    {
+        if (sites[itr->second].stackBase != stackBase)
+            throw RunError("inconsistent stack depth at call site");
+        return itr->second;
+    }
+
+    InlineSite site;
+    site.parent = parent;
+    site.depth = sites[parent].depth + 1;
+    site.retTo = retTo;
+    site.stackBase = stackBase;
+
+    auto numLocals = callee.getFieldInt32("num_locals");
+    for (int32_t i = 0; i < numLocals; ++i)
+        site.slots.push_back(uint32_t(numSlots++));
+
+    numInlined += calleeSizes[(refptr)callee];
+
+    sites.push_back(site);
+    siteIdx[key] = sites.size() - 1;
+    return sites.size() - 1;
+}
+
+/// Meet a state into the entry state of a block, returns true if it changed
+bool Specializer::meet(size_t idx, const AbsState& state)
+{
+    auto& entry = blocks[idx].entry;
+
+    if (!blocks[idx].reached)
+    {
+        blocks[idx].reached = true;
+        entry = state;
+        entry.locals.resize(numSlots);
+        return true;
+    }
+
+    if (entry.stack.size() != state.stack.size())
+        throw RunError("inconsistent stack depth at block entry");
+
+    bool changed = false;
+
+    entry.locals.resize(numSlots);
+    for (size_t i = 0; i < entry.locals.size(); ++i)
+    {
+        auto& a = entry.locals[i];
+        auto b = (i < state.locals.size())? state.locals[i]:AbsVal();
+
+        if (b.kind == AbsVal::DEAD || a.kind == AbsVal::UNKNOWN)
+            continue;
+
+        if (a.kind == AbsVal::DEAD)
+        {
+            a = b;
+            changed = true;
+        }
+        else if (b.isKnown() && a.val == b.val)
+        {
+            if (a.real && !b.real)
+            {
+                a.real = false;
+                changed = true;
+            }
+        }
+        else
+        {
+            a = AbsVal::unknown();
+            changed = true;
+        }
+    }
+
+    for (size_t i = 0; i < entry.stack.size(); ++i)
+    {
+        auto& a = entry.stack[i];
+        auto& b = state.stack[i];
+
+        if (a.isKnown() && !(b.isKnown() && a.val == b.val))
+        {
+            a = AbsVal::unknown();
+            changed = true;
+        }
+        else if (a.real && !b.real)
+        {
+            a.real = false;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/// Propagate a state along a control flow edge
+void Specializer::edge(size_t idx, const AbsState& state, bool isJump)
+{
+    if (mode == ANALYZE)
+    {
+        if (meet(idx, state))
+            queue.push_back(idx);
+        return;
+    }
+
+    assert (mode == COUNT);
+    assert (blocks[idx].reached);
+
+    blocks[idx].numPreds++;
+
+    // Blocks targeted by branches other than jumps can't be appended
+    if (!isJump)
+        blocks[idx].isHead = true;
+
+    if (!blocks[idx].visited)
+    {
+        blocks[idx].visited = true;
+        queue.push_back(idx);
+    }
+}
+
+/**
+Follow a jump. When writing code, a block with no other predecessor
+is appended to the current one, and its index is returned so that
+simulation continues in it.
+*/
+size_t Specializer::jumpTo(Value block, size_t site, AbsState& s)
+{
+    auto idx = getBlock(block, site, s.stack.size());
+
+    if (mode != EMIT)
+    {
+        edge(idx, s, true);
+        return SIZE_MAX;
+    }
+
+    if (!blocks[idx].isHead)
+    {
+        conform(s, blocks[idx].entry);
+        return idx;
+    }
+
+    flush(s);
+    storeLocals(s, blocks[idx].entry);
+    emitJump(idx);
+    return SIZE_MAX;
+}
+
+/**
+Make a state as precise as the entry state of a block, so that the
+block gets written with the decisions taken when counting edges
+*/
+void Specializer::conform(AbsState& s, const AbsState& entry)
+{
+    assert (s.stack.size() == entry.stack.size());
+
+    for (size_t i = 0; i < s.stack.size(); ++i)
+    {
+        if (s.stack[i].isKnown() && !entry.stack[i].isKnown())
+        {
+            flush(s);
+            s.stack[i] = AbsVal::unknown();
+        }
+    }
+
+    s.locals.resize(numSlots);
+    for (size_t i = 0; i < entry.locals.size(); ++i)
+    {
+        auto& a = s.locals[i];
+        auto& e = entry.locals[i];
+
+        if (e.kind == AbsVal::UNKNOWN)
+        {
+            if (a.isKnown() && !a.real)
+            {
+                emitPush(a.val);
+                emitIdx("set_local", uint32_t(i));
+            }
+
+            a = AbsVal::unknown();
+        }
+        else if (e.isKnown())
+        {
+            a = AbsVal::known(e.val, a.isKnown() && a.real);
+        }
+        else
+        {
+            a = AbsVal();
+        }
+    }
+}
+
+/// Store the known locals a block expects to find in their slots
+void Specializer::storeLocals(AbsState& s, const AbsState& entry)
+{
+    for (size_t i = 0; i < entry.locals.size() && i < s.locals.size(); ++i)
+    {
+        auto& a = s.locals[i];
+        auto& e = entry.locals[i];
+
+        bool needed = (e.kind == AbsVal::UNKNOWN) || (e.isKnown() && e.real);
+
+        if (needed && a.isKnown() && !a.real)
+        {
+            emitPush(a.val);
+            emitIdx("set_local", uint32_t(i));
+            a.real = true;
+        }
+    }
+}
+
+/// Push the known temporaries which were not pushed yet
+void Specializer::flush(AbsState& s)
+{
+    for (auto& tmp : s.stack)
+    {
+        if (!tmp.real)
+        {
+            emitPush(tmp.val);
+            tmp.real = true;
+        }
+    }
+}
+
+/// Drop temporaries, popping those which were pushed
+void Specializer::drop(AbsState& s, size_t n)
+{
+    needTmps(s, n);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (s.stack.back().real)
+            emitOp("pop");
+        s.stack.pop_back();
+    }
+}
+
+/// Store the value on top of the stack into a local slot
+void Specializer::setLocal(AbsState& s, uint32_t slot)
+{
+    needTmps(s, 1);
+    auto tmp = s.stack.back();
+    s.stack.pop_back();
+
+    if (tmp.real)
+        emitIdx("set_local", slot);
+
+    s.locals[slot] = tmp.isKnown()? AbsVal::known(tmp.val, tmp.real):AbsVal::unknown();
+}
+
+/// Fold an operation on known values, returns false if it can't be
+bool Specializer::fold(const std::string& op, Object instr, AbsState& s)
+{
+    static const std::unordered_map<std::string, uint8_t> numArgs = {
+        { "add_i32", 2 }, { "sub_i32", 2 }, { "mul_i32", 2 },
+        { "and_i32", 2 }, { "or_i32", 2 }, { "xor_i32", 2 },
+        { "not_i32", 1 }, { "lt_i32", 2 }, { "le_i32", 2 },
+        { "gt_i32", 2 }, { "ge_i32", 2 }, { "eq_i32", 2 },
+        { "add_f32", 2 }, { "sub_f32", 2 }, { "mul_f32", 2 },
+        { "div_f32", 2 }, { "lt_f32", 2 }, { "le_f32", 2 },
+        { "gt_f32", 2 }, { "ge_f32", 2 }, { "eq_f32", 2 },
+        { "i32_to_f32", 1 }, { "eq_bool", 2 }, { "has_tag", 1 },
+        { "get_tag", 1 }, { "str_len", 1 }, { "eq_str", 2 },
+        { "eq_obj", 2 }, { "has_field", 2 }, { "get_field", 2 }
+    };
+
+    auto itr = numArgs.find(op);
+    if (itr == numArgs.end() || !knownTmps(s, itr->second))
+        return false;
+
+    auto n = itr->second;
+    auto arg0 = getTmp(s, n - 1).val;
+    auto arg1 = getTmp(s, 0).val;
+    Value result;
+
+    // Operations are only folded when they can't fail, so
+    // that errors are still reported when the code runs
+    if (op == "has_tag")
+    {
+        static thread_local ICache tagIC("tag");
+        auto tag = strToTag((std::string)tagIC.getStr(instr));
+        result = boolVal(arg1.getTag() == tag);
+    }
+    else if (op == "get_tag")
+    {
+        result = String(tagToStr(arg1.getTag()));
+    }
+    else if (op == "eq_obj")
+    {
+        result = boolVal(arg0 == arg1);
+    }
+    else if (op == "not_i32" || op == "i32_to_f32")
+    {
+        if (!arg1.isInt32())
+            return false;
+
+        if (op == "not_i32")
+            result = Value::int32(~(int32_t)arg1);
+        else
+            result = Value::float32(float((int32_t)arg1));
+    }
+    else if (op == "str_len")
+    {
+        if (!arg1.isString())
+            return false;
+        result = Value::int32(String(arg1).length());
+    }
+    else if (op == "eq_str")
+    {
+        if (!arg0.isString() || !arg1.isString())
+            return false;
+        result = boolVal(String(arg0) == String(arg1));
+    }
+    else if (op == "eq_bool")
+    {
+        if (!arg0.isBool() || !arg1.isBool())
+            return false;
+        result = boolVal(arg0 == arg1);
+    }
+    else if (op == "has_field" || op == "get_field")
+    {
+        // Only the fields of frozen objects are constant
+        if (!arg0.isObject() || !arg1.isString())
+            return false;
+
+        auto obj = Object(arg0);
+        auto name = String(arg1);
+        if (!obj.isFrozen())
+            return false;
+
+        if (op == "has_field")
+            result = boolVal(obj.hasField(name));
+        else if (obj.hasField(name))
+            result = obj.getField(name);
+        else
+            return false;
+    }
+    else if (arg0.isInt32() && arg1.isInt32())
+    {
+        // Wrap around on overflow, as the interpreter does
+        auto a = (int32_t)arg0;
+        auto b = (int32_t)arg1;
+        auto ua = uint32_t(a);
+        auto ub = uint32_t(b);
+
+        if (op == "add_i32")
+            result = Value::int32(int32_t(ua + ub));
+        else if (op == "sub_i32")
+            result = Value::int32(int32_t(ua - ub));
+        else if (op == "mul_i32")
+            result = Value::int32(int32_t(ua * ub));
+        else if (op == "and_i32")
+            result = Value::int32(a & b);
+        else if (op == "or_i32")
+            result = Value::int32(a | b);
+        else if (op == "xor_i32")
+            result = Value::int32(a ^ b);
+        else if (op == "lt_i32")
+            result = boolVal(a < b);
+        else if (op == "le_i32")
+            result = boolVal(a <= b);
+        else if (op == "gt_i32")
+            result = boolVal(a > b);
+        else if (op == "ge_i32")
+            result = boolVal(a >= b);
+        else if (op == "eq_i32")
+            result = boolVal(a == b);
+        else
+            return false;
+    }
+    else if (arg0.isFloat32() && arg1.isFloat32())
+    {
+        auto a = (float)arg0;
+        auto b = (float)arg1;
+
+        if (op == "add_f32")
+            result = Value::float32(a + b);
+        else if (op == "sub_f32")
+            result = Value::float32(a - b);
+        else if (op == "mul_f32")
+            result = Value::float32(a * b);
+        else if (op == "div_f32")
+            result = Value::float32(a / b);
+        else if (op == "lt_f32")
+            result = boolVal(a < b);
+        else if (op == "le_f32")
+            result = boolVal(a <= b);
+        else if (op == "gt_f32")
+            result = boolVal(a > b);
+        else if (op == "ge_f32")
+            result = boolVal(a >= b);
+        else if (op == "eq_f32")
+            result = boolVal(a == b);
+        else
+            return false;
+    }
+    else
+    {
+        return false;
+    }
+
+    drop(s, n);
+    s.stack.push_back(AbsVal::known(result, false));
+    return true;
+}
+
+/// Count the instructions of a function which could be inlined,
+/// returns SIZE_MAX if it is too large or catches exceptions
+static size_t calleeSize(Object callee)
+{
+    std::vector<Object> calleeBlocks = { callee.getFieldObj("entry") };
+    std::unordered_map<refptr, bool> seen = { { (refptr)calleeBlocks[0], true } };
+    size_t numInstrs = 0;
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < calleeBlocks.size(); ++i)
+    {
+        auto instrs = calleeBlocks[i].getFieldArr("instrs");
+        numInstrs += instrs.length();
+
+        for (size_t j = 0; ok && j < instrs.length(); ++j)
+        {
+            auto instr = Object(instrs.getElem(j));
+            if (instr.hasField("throw_to"))
+                ok = false;
+
+            for (auto name : targetNames)
+            {
+                if (!instr.hasField(name))
+                    continue;
+
+                auto target = instr.getField(name);
+                if (target.isObject() && seen.insert({ (refptr)target, true }).second)
+                    calleeBlocks.push_back(Object(target));
+            }
+        }
+
+        if (numInstrs > MAX_INLINE_INSTRS)
+            ok = false;
+    }
+
+    return ok? numInstrs:SIZE_MAX;
+}
+
+/**
+Decide whether to inline a call. The callee must be a known function
+taking as many parameters as there are arguments, and small enough.
+The nesting depth and the total size of the inlined functions are
+bounded, which also bounds the inlining of recursive functions.
+*/
+bool Specializer::canInline(
+    Object callInstr,
+    const AbsState& s,
+    size_t site,
+    size_t numArgs
+)
+{
+    // The exception handler of the call would be skipped by
+    // exceptions thrown from the inlined code
+    if (callInstr.hasField("throw_to"))
+        return false;
+
+    if (sites[site].depth >= MAX_INLINE_DEPTH)
+        return false;
+
+    if (!knownTmps(s, 1) || !getTmp(s, 0).val.isObject())
+        return false;
+
+    auto callee = Object(getTmp(s, 0).val);
+    if (!callee.hasField("entry") || !callee.hasField("params") ||
+        !callee.hasField("num_locals"))
+        return false;
+
+    auto params = callee.getField("params");
+    auto numLocals = callee.getField("num_locals");
+    if (!params.isArray() || !numLocals.isInt32() ||
+        !callee.getField("entry").isObject())
+        return false;
+
+    if (Array(params).length() != numArgs || (int32_t)numLocals < int32_t(numArgs + 1))
+        return false;
+
+    auto itr = calleeSizes.find((refptr)callee);
+    if (itr == calleeSizes.end())
+        itr = calleeSizes.insert({ (refptr)callee, calleeSize(callee) }).first;
+
+    if (itr->second == SIZE_MAX)
+        return false;
+
+    // Calls already inlined stay so, for the passes to agree
+    auto key = std::make_pair(site, (refptr)callInstr);
+    if (siteIdx.find(key) != siteIdx.end())
+        return true;
+
+    return numInlined + itr->second <= MAX_INLINE_TOTAL;
+}
+
+/**
+Simulate the instructions of a block, returns the index of the
+block to continue with when it gets appended to this one
+*/
+size_t Specializer::simBlock(size_t idx, AbsState& s)
+{
+    auto block = Object(blocks[idx].block);
+    auto site = blocks[idx].site;
+
+    static thread_local ICache instrsIC("instrs");
+    auto instrs = instrsIC.getArr(block);
+
+    for (size_t i = 0; i < instrs.length(); ++i)
+    {
+        auto instr = Object(instrs.getElem(i));
+
+        static thread_local ICache opIC("op");
+        auto op = (std::string)opIC.getStr(instr);
+
+        if (op == "push")
+        {
+            static thread_local ICache valIC("val");
+            s.stack.push_back(AbsVal::known(valIC.getField(instr), false));
+            continue;
+        }
+
+        if (op == "pop")
+        {
+            drop(s, 1);
+            continue;
+        }
+
+        if (op == "dup")
+        {
+            static thread_local ICache idxIC("idx");
+            auto tmpIdx = size_t(idxIC.getInt32(instr));
+            needTmps(s, tmpIdx + 1);
+
+            auto tmp = getTmp(s, tmpIdx);
+            if (tmp.isKnown())
+            {
+                s.stack.push_back(AbsVal::known(tmp.val, false));
+                continue;
+            }
+
+            // With all temporaries pushed, the index is unchanged
+            flush(s);
+            emit(instr);
+            s.stack.push_back(AbsVal::unknown());
+            continue;
+        }
+
+        if (op == "swap")
+        {
+            needTmps(s, 2);
+            auto n = s.stack.size();
+
+            if (s.stack[n - 2].real)
+            {
+                flush(s);
+                emit(instr);
+            }
+
+            std::swap(s.stack[n - 1], s.stack[n - 2]);
+            continue;
+        }
+
+        if (op == "get_local" || op == "set_local")
+        {
+            static thread_local ICache idxIC("idx");
+            auto localIdx = idxIC.getInt32(instr);
+            auto& slots = sites[site].slots;
+
+            if (localIdx < 0 || size_t(localIdx) >= slots.size())
+                throw RunError("local index out of range");
+
+            auto slot = slots[localIdx];
+
+            if (op == "set_local")
+            {
+                setLocal(s, slot);
+                continue;
+            }
+
+            auto local = s.locals[slot];
+
+            if (local.isKnown())
+            {
+                s.stack.push_back(AbsVal::known(local.val, false));
+                continue;
+            }
+
+            if (local.kind == AbsVal::DEAD)
+                throw RunError("local read before being set");
+
+            flush(s);
+            emitIdx("get_local", slot);
+            s.stack.push_back(AbsVal::unknown());
+            continue;
+        }
+
+        if (op == "jump")
+        {
+            static thread_local ICache toIC("to");
+            return jumpTo(toIC.getField(instr), site, s);
+        }
+
+        if (op == "if_true")
+        {
+            static thread_local ICache thenIC("then");
+            static thread_local ICache elseIC("else");
+            needTmps(s, 1);
+
+            auto cond = getTmp(s, 0);
+            if (cond.isKnown() && cond.val.isBool())
+            {
+                drop(s, 1);
+                auto target = (cond.val == Value::TRUE)? thenIC.getField(instr):elseIC.getField(instr);
+                return jumpTo(target, site, s);
+            }
+
+            flush(s);
+            s.stack.pop_back();
+
+            auto thenIdx = getBlock(thenIC.getField(instr), site, s.stack.size());
+            auto elseIdx = getBlock(elseIC.getField(instr), site, s.stack.size());
+
+            if (mode == EMIT)
+            {
+                storeLocals(s, blocks[thenIdx].entry);
+                storeLocals(s, blocks[elseIdx].entry);
+                emitIfTrue(thenIdx, elseIdx);
+            }
+            else
+            {
+                edge(thenIdx, s, false);
+                edge(elseIdx, s, false);
+            }
+
+            return SIZE_MAX;
+        }
+
+        if (op == "call" || op == "import")
+        {
+            static thread_local ICache numArgsIC("num_args");
+            static thread_local ICache retToIC("ret_to");
+            auto numArgs = (op == "call")? size_t(numArgsIC.getInt32(instr)):0;
+            auto retTo = retToIC.getField(instr);
+            needTmps(s, (op == "call")? (numArgs + 1):1);
+
+            if (op == "call" && canInline(instr, s, site, numArgs))
+            {
+                auto callee = Object(getTmp(s, 0).val);
+                auto calleeSite = getSite(
+                    site,
+                    instr,
+                    callee,
+                    retTo,
+                    s.stack.size() - numArgs - 1
+                );
+
+                drop(s, 1);
+
+                // The callee locals start out undefined, then the
+                // arguments get moved into the parameter slots
+                auto slots = sites[calleeSite].slots;
+                s.locals.resize(numSlots);
+                for (auto slot : slots)
+                    s.locals[slot] = AbsVal::known(Value::UNDEF, false);
+
+                for (size_t j = numArgs; j > 0; --j)
+                    setLocal(s, slots[j - 1]);
+
+                // Hidden function/closure parameter
+                s.locals[slots[numArgs]] = AbsVal::known(callee, false);
+
+                return jumpTo(callee.getField("entry"), calleeSite, s);
+            }
+
+            // The import instruction takes the package name only
+            auto numPops = (op == "call")? (numArgs + 1):1;
+            flush(s);
+            s.stack.resize(s.stack.size() - numPops);
+
+            auto retIdx = getBlock(retTo, site, s.stack.size() + 1);
+            auto excIdx = SIZE_MAX;
+
+            // The exception handler gets the exception value alone
+            AbsState excState;
+            excState.locals = s.locals;
+            excState.stack.push_back(AbsVal::unknown());
+
+            if (instr.hasField("throw_to"))
+                excIdx = getBlock(instr.getField("throw_to"), site, 1);
+
+            s.stack.push_back(AbsVal::unknown());
+
+            if (mode == EMIT)
+            {
+                storeLocals(s, blocks[retIdx].entry);
+                if (excIdx != SIZE_MAX)
+                    storeLocals(s, blocks[excIdx].entry);
+                emitCall(instr, retIdx, excIdx);
+            }
+            else
+            {
+                edge(retIdx, s, false);
+                if (excIdx != SIZE_MAX)
+                    edge(excIdx, excState, false);
+            }
+
+            return SIZE_MAX;
+        }
+
+        if (op == "ret")
+        {
+            needTmps(s, 1);
+
+            if (site == 0)
+            {
+                flush(s);
+                emit(instr);
+                return SIZE_MAX;
+            }
+
+            // Returning from an inlined call jumps to its continuation.
+            // Code returning with temporaries left can only be reached
+            // if the callee's calls don't behave as expected, such as a
+            // function meant to throw returning, and it's an error which
+            // the interpreter reports when compiling the block.
+            auto& inlined = sites[site];
+            if (s.stack.size() != inlined.stackBase + 1)
+            {
+                emitPush(String(
+                    "there must be no values left on the temporary stack "
+                    "when returning from a function"
+                ));
+                emitOp("abort");
+                return SIZE_MAX;
+            }
+
+            for (auto slot : inlined.slots)
+                s.locals[slot] = AbsVal();
+
+            return jumpTo(inlined.retTo, inlined.parent, s);
+        }
+
+        // Nothing runs after these, abort exits the program
+        if (op == "throw" || op == "abort")
+        {
+            needTmps(s, 1);
+            flush(s);
+            emit(instr);
+            return SIZE_MAX;
+        }
+
+        if (fold(op, instr, s))
+            continue;
+
+        auto effect = stackEffect(op);
+        needTmps(s, effect.first);
+        flush(s);
+        emit(instr);
+        s.stack.resize(s.stack.size() - effect.first);
+        for (size_t j = 0; j < effect.second; ++j)
+            s.stack.push_back(AbsVal::unknown());
+    }
+
+    throw RunError("block does not end with a branch instruction");
+}
+
+/// Simulate a block and the blocks appended to it
+void Specializer::simulate(size_t idx, AbsState s)
+{
+    s.locals.resize(numSlots);
+
+    while (idx != SIZE_MAX)
+        idx = simBlock(idx, s);
+}
+
+void Specializer::emit(Object instr)
+{
+    if (mode != EMIT)
+        return;
+
+    GCRoot root(instr);
+    Array(curInstrs).push(instr);
+}
+
+/// Write an instruction with no other field than its opcode
+void Specializer::emitOp(const char* op)
+{
+    if (mode != EMIT)
+        return;
+
+    String opName("op");
+    String opStr(op);
+    auto instr = Object::newObject(2);
+    instr.setField(opName, opStr);
+    emit(instr);
+}
+
+void Specializer::emitPush(Value val)
+{
+    if (mode != EMIT)
+        return;
+
+    String opName("op");
+    String valName("val");
+    String opStr("push");
+    auto instr = Object::newObject(2);
+    instr.setField(opName, opStr);
+    instr.setField(valName, val);
+    emit(instr);
+}
+
+/// Write an instruction with a local slot or stack index
+void Specializer::emitIdx(const char* op, uint32_t idx)
+{
+    if (mode != EMIT)
+        return;
+
+    String opName("op");
+    String idxName("idx");
+    String opStr(op);
+    auto instr = Object::newObject(2);
+    instr.setField(opName, opStr);
+    instr.setField(idxName, Value::int32(int32_t(idx)));
+    emit(instr);
+}
+
+void Specializer::emitJump(size_t target)
+{
+    if (mode != EMIT)
+        return;
+
+    String opName("op");
+    String toName("to");
+    String opStr("jump");
+    auto instr = Object::newObject(2);
+    instr.setField(opName, opStr);
+    instr.setField(toName, blocks[target].newBlock);
+    emit(instr);
+}
+
+void Specializer::emitIfTrue(size_t thenIdx, size_t elseIdx)
+{
+    if (mode != EMIT)
+        return;
+
+    String opName("op");
+    String thenName("then");
+    String elseName("else");
+    String opStr("if_true");
+    auto instr = Object::newObject(3);
+    instr.setField(opName, opStr);
+    instr.setField(thenName, blocks[thenIdx].newBlock);
+    instr.setField(elseName, blocks[elseIdx].newBlock);
+    emit(instr);
+}
+
+/// Write a copy of a call, keeping its source position, with new targets
+void Specializer::emitCall(Object callInstr, size_t retIdx, size_t excIdx)
+{
+    if (mode != EMIT)
+        return;
+
+    String retName("ret_to");
+    String excName("throw_to");
+    auto instr = copyObj(callInstr, "ret_to", "throw_to");
+    GCRoot root(instr);
+
+    instr.setField(retName, blocks[retIdx].newBlock);
+    if (excIdx != SIZE_MAX)
+        instr.setField(excName, blocks[excIdx].newBlock);
+
+    emit(instr);
+}
+
+/// Shallow copy of an object, leaving out some of its fields
+Object Specializer::copyObj(
+    Object obj,
+    const char* skip0,
+    const char* skip1,
+    const char* skip2
+)
+{
+    std::vector<String> names;
+    for (ObjFieldItr itr(obj); itr.valid(); itr.next())
+    {
+        auto name = itr.getName();
+        if (name == skip0 || name == skip1 || name == skip2)
+            continue;
+        names.push_back(name);
+    }
+
+    // Leave room for the fields set after copying
+    auto copy = Object::newObject(names.size() + 3);
+    for (auto name : names)
+        copy.setField(name, obj.getField(name));
+
+    return copy;
+}
+
+Object Specializer::run()
+{
+    auto params = fun.getFieldArr("params");
+    auto numParams = size_t(params.length());
+    auto numLocals = fun.getFieldInt32("num_locals");
+
+    if (numLocals < int32_t(numParams + 1))
+        throw RunError("not enough locals to store function parameters");
+
+    for (ObjFieldItr itr(args); itr.valid(); itr.next())
+    {
+        bool found = false;
+        for (size_t i = 0; i < numParams; ++i)
+            found = found || (String(params.getElem(i)) == itr.getName());
+
+        if (!found)
+        {
+            throw RunError(
+                "specialize: \"" + itr.get() + "\" is not a parameter "
+                "of the function"
+            );
+        }
+    }
+
+    // The remaining parameters come first, followed by the hidden
+    // function parameter, the other locals, and then the slots of
+    // the parameters which got constant values
+    InlineSite top;
+    top.parent = SIZE_MAX;
+    top.depth = 0;
+    top.stackBase = 0;
+    top.slots.resize(numLocals);
+
+    std::vector<Value> newParams;
+    for (size_t i = 0; i < numParams; ++i)
+    {
+        auto name = String(params.getElem(i));
+        if (!args.hasField(name))
+        {
+            top.slots[i] = uint32_t(newParams.size());
+            newParams.push_back(name);
+        }
+    }
+
+    numSlots = newParams.size();
+    top.slots[numParams] = uint32_t(numSlots++);
+    for (size_t i = numParams + 1; i < size_t(numLocals); ++i)
+        top.slots[i] = uint32_t(numSlots++);
+    for (size_t i = 0; i < numParams; ++i)
+        if (args.hasField(String(params.getElem(i))))
+            top.slots[i] = uint32_t(numSlots++);
+
+    sites.push_back(top);
+
+    // The locals which are not parameters are cleared on entry
+    AbsState entryState;
+    entryState.locals.resize(numSlots, AbsVal::known(Value::UNDEF, true));
+    for (size_t i = 0; i <= numParams; ++i)
+    {
+        auto slot = top.slots[i];
+
+        if (i < numParams && args.hasField(String(params.getElem(i))))
+        {
+            auto val = args.getField(String(params.getElem(i)));
+            entryState.locals[slot] = AbsVal::known(val, false);
+        }
+        else
+        {
+            entryState.locals[slot] = AbsVal::unknown();
+        }
+    }
+
+    // Propagate the known values until the entry states are stable
+    auto entryIdx = getBlock(fun.getField("entry"), 0, 0);
+    mode = ANALYZE;
+    meet(entryIdx, entryState);
+    queue = { entryIdx };
+
+    while (!queue.empty())
+    {
+        auto idx = queue.back();
+        queue.pop_back();
+        simulate(idx, blocks[idx].entry);
+    }
+
+    // Find the reachable blocks and their predecessors
+    mode = COUNT;
+    blocks[entryIdx].visited = true;
+    blocks[entryIdx].isHead = true;
+    queue = { entryIdx };
+
+    for (size_t i = 0; i < queue.size(); ++i)
+        simulate(queue[i], blocks[queue[i]].entry);
+
+    for (auto idx : queue)
+        if (blocks[idx].numPreds != 1)
+            blocks[idx].isHead = true;
+
+    // Create the blocks of the specialized function, keeping them alive
+    // through the function object, which the caller gets in the end
+    auto newParamArr = Array(newParams.size());
+    GCRoot paramsRoot(newParamArr);
+    for (auto name : newParams)
+        newParamArr.push(name);
+
+    auto newFun = copyObj(fun, "params", "num_locals", "entry");
+    GCRoot funRoot(newFun);
+
+    auto newBlocks = Array(queue.size());
+    GCRoot blocksRoot(newBlocks);
+
+    for (auto idx : queue)
+    {
+        if (!blocks[idx].isHead)
+            continue;
+
+        auto newBlock = copyObj(Object(blocks[idx].block), "instrs");
+        newBlocks.push(newBlock);
+        newBlock.setField("instrs", Array(16));
+        blocks[idx].newBlock = newBlock;
+    }
+
+    mode = EMIT;
+    for (auto idx : queue)
+    {
+        if (!blocks[idx].isHead)
+            continue;
+
+        // Temporaries are all pushed before branching to a new block
+        auto entry = blocks[idx].entry;
+        for (auto& tmp : entry.stack)
+            tmp.real = true;
+
+        curInstrs = Object(blocks[idx].newBlock).getField("instrs");
+        simulate(idx, entry);
+    }
+
+    newFun.setField("params", newParamArr);
+    newFun.setField("num_locals", Value::int32(int32_t(numSlots)));
+    newFun.setField("entry", blocks[entryIdx].newBlock);
+
+    return newFun;
+}
+
+Object specialize(Object fun, Object args)
+{
+    Specializer spec(fun, args);
+    return spec.run();
+}
+
+/// Count the instructions in the blocks of a function, only used
+/// by the tests, whose asserts may be compiled out
+__attribute__((unused)) static size_t countInstrs(Object fun)
+{
+    std::vector<Object> queue = { fun.getFieldObj("entry") };
+    std::unordered_map<refptr, bool> seen = { { (refptr)queue[0], true } };
+    size_t numInstrs = 0;
+
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        auto instrs = queue[i].getFieldArr("instrs");
+        numInstrs += instrs.length();
+
+        for (size_t j = 0; j < instrs.length(); ++j)
+        {
+            auto instr = Object(instrs.getElem(j));
+            for (auto name : targetNames)
+            {
+                if (!instr.hasField(name))
+                    continue;
+
+                auto target = instr.getField(name);
+                if (target.isObject() && seen.insert({ (refptr)target, true }).second)
+                    queue.push_back(Object(target));
+            }
+        }
+    }
+
+    return numInstrs;
+}
+
+void testSpecialize()
+{
+    std::cout << "specialize" << std::endl;
+
+    auto pkg = Object(parseString(
+        "#zeta-image\n"
+        "scale = { entry:@b0, params:['cfg', 'x'], num_locals:4 };\n"
+        "b0 = { instrs:["
+        "  { op:'get_local', idx:0 }, { op:'push', val:'double' },"
+        "  { op:'get_field' }, { op:'if_true', then:@b1, else:@b2 } ] };\n"
+        "b1 = { instrs:["
+        "  { op:'get_local', idx:1 }, { op:'get_local', idx:0 },"
+        "  { op:'push', val:'factor' }, { op:'get_field' },"
+        "  { op:'push', val:2 }, { op:'push', val:@twice },"
+        "  { op:'call', num_args:2, ret_to:@b3 } ] };\n"
+        "b2 = { instrs:["
+        "  { op:'get_local', idx:1 }, { op:'get_local', idx:0 },"
+        "  { op:'push', val:'factor' }, { op:'get_field' },"
+        "  { op:'jump', to:@b3 } ] };\n"
+        "b3 = { instrs:[ { op:'mul_i32' }, { op:'ret' } ] };\n"
+        "twice = { entry:@t0, params:['a', 'b'], num_locals:3 };\n"
+        "t0 = { instrs:["
+        "  { op:'get_local', idx:0 }, { op:'get_local', idx:1 },"
+        "  { op:'mul_i32' }, { op:'ret' } ] };\n"
+        "sum = { entry:@s0, params:['n', 'step'], num_locals:4 };\n"
+        "s0 = { instrs:["
+        "  { op:'push', val:0 }, { op:'set_local', idx:3 },"
+        "  { op:'jump', to:@s1 } ] };\n"
+        "s1 = { instrs:["
+        "  { op:'get_local', idx:0 }, { op:'push', val:0 }, { op:'gt_i32' },"
+        "  { op:'if_true', then:@s2, else:@s3 } ] };\n"
+        "s2 = { instrs:["
+        "  { op:'get_local', idx:3 }, { op:'get_local', idx:1 },"
+        "  { op:'add_i32' }, { op:'set_local', idx:3 },"
+        "  { op:'get_local', idx:0 }, { op:'push', val:1 }, { op:'sub_i32' },"
+        "  { op:'set_local', idx:0 }, { op:'jump', to:@s1 } ] };\n"
+        "s3 = { instrs:[ { op:'get_local', idx:3 }, { op:'ret' } ] };\n"
+        "{ scale:@scale, sum:@sum, cfg:{ double:$true, factor:3 } };\n",
+        "specialize_test"
+    ));
+    GCRoot pkgRoot(pkg);
+
+    auto scale = pkg.getFieldObj("scale");
+    auto cfg = pkg.getFieldObj("cfg");
+    cfg.freeze();
+
+    // With the fields of the frozen object folded and the call
+    // inlined, what is left is x * 6
+    auto args = Object::newObject();
+    GCRoot argsRoot(args);
+    args.setField("cfg", cfg);
+    auto scaleCfg = specialize(scale, args);
+    GCRoot scaleRoot(scaleCfg);
+    assert (scaleCfg.getFieldArr("params").length() == 1);
+    assert (countInstrs(scaleCfg) == 4);
+    assert (callFun(scaleCfg, { Value::int32(5) }) == Value::int32(30));
+    assert (callFun(scale, { cfg, Value::int32(5) }) == Value::int32(30));
+
+    // Fields of objects which are not frozen are not folded
+    auto cfg2 = Object::newObject();
+    GCRoot cfg2Root(cfg2);
+    cfg2.setField("double", Value::FALSE);
+    cfg2.setField("factor", Value::int32(7));
+    args.setField("cfg", cfg2);
+    auto scaleCfg2 = specialize(scale, args);
+    GCRoot scale2Root(scaleCfg2);
+    assert (countInstrs(scaleCfg2) > 4);
+    assert (callFun(scaleCfg2, { Value::int32(5) }) == Value::int32(35));
+    cfg2.setField("factor", Value::int32(1));
+    assert (callFun(scaleCfg2, { Value::int32(5) }) == Value::int32(5));
+
+    // Frozen objects can't be changed
+    bool caught = false;
+    try
+    {
+        cfg.setField("factor", Value::int32(4));
+    }
+    catch (RunError& err)
+    {
+        caught = true;
+    }
+    assert (caught && cfg.getField("factor") == Value::int32(3));
+
+    // Locals changed in loops are not constant, but the
+    // loop still runs with the known step folded in
+    auto sum = pkg.getFieldObj("sum");
+    auto stepArgs = Object::newObject();
+    GCRoot stepRoot(stepArgs);
+    stepArgs.setField("step", Value::int32(3));
+    auto sum3 = specialize(sum, stepArgs);
+    GCRoot sumRoot(sum3);
+    assert (callFun(sum3, { Value::int32(4) }) == Value::int32(12));
+    assert (callFun(sum3, { Value::int32(0) }) == Value::int32(0));
+
+    // Locals which start out known get stored before the loop
+    stepArgs.setField("n", Value::int32(5));
+    auto sum53 = specialize(sum, stepArgs);
+    GCRoot sum53Root(sum53);
+    assert (sum53.getFieldArr("params").length() == 0);
+    assert (callFun(sum53, {}) == Value::int32(15));
+
+    // Unknown parameter names are an error
+    caught = false;
+    try
+    {
+        auto badArgs = Object::newObject();
+        badArgs.setField("y", Value::ONE);
+        specialize(scale, badArgs);
+    }
+    catch (RunError& err)
+    {
+        caught = true;
+    }
+    assert (caught);
+    (void)caught;
+}
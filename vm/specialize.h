@@ -0,0 +1,21 @@
+#pragma once
+
+#include "runtime.h"
+
+/**
+Specialize a function with respect to constant values for some of its
+parameters, given as an object mapping parameter names to values. The
+result is a new function object taking the remaining parameters.
+
+Constants are propagated through the locals and the temporary stack
+over the block graph of the function, and operations on constants are
+folded. Fields of frozen objects are constant, so reading them folds
+too. Branches on constant conditions become jumps, and blocks which
+are no longer reachable are left out. Calls to small constant functions
+are inlined, which lets the runtime functions of language
+implementations fold away. The original function is unchanged.
+*/
+Object specialize(Object fun, Object args);
+
+/// Unit test for the specializer
+void testSpecialize();
@@ -0,0 +1,308 @@
+#include <cassert>
+#include <cstring>
+#include <sys/mman.h>
+#include "x86.h"
+
+X86Asm::~X86Asm()
+{
+    if (mem)
+        munmap(mem, limit - mem);
+}
+
+bool X86Asm::init(size_t size)
+{
+    assert (mem == nullptr);
+
+    auto ptr = mmap(
+        nullptr,
+        size,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+
+    if (ptr == MAP_FAILED)
+        return false;
+
+    mem = alloc = (uint8_t*)ptr;
+    limit = windowEnd = mem + size;
+    return true;
+}
+
+void X86Asm::setWindow(uint8_t* start, uint8_t* end)
+{
+    assert (start >= mem && end <= limit && start <= end);
+    alloc = start;
+    windowEnd = end;
+}
+
+void X86Asm::discard(uint8_t* start, uint8_t* end)
+{
+    assert (start >= mem && end <= limit);
+    madvise(start, end - start, MADV_DONTNEED);
+}
+
+void X86Asm::byte(uint8_t val)
+{
+    assert (alloc < windowEnd);
+    *(alloc++) = val;
+}
+
+void X86Asm::dword(uint32_t val)
+{
+    assert (alloc + sizeof(val) <= windowEnd);
+    memcpy(alloc, &val, sizeof(val));
+    alloc += sizeof(val);
+}
+
+void X86Asm::qword(uint64_t val)
+{
+    assert (alloc + sizeof(val) <= windowEnd);
+    memcpy(alloc, &val, sizeof(val));
+    alloc += sizeof(val);
+}
+
+void X86Asm::patchRel32(uint8_t* site, uint8_t* target)
+{
+    auto offset = int64_t(target - (site + 4));
+    assert (offset == int32_t(offset));
+    auto rel = int32_t(offset);
+    memcpy(site, &rel, sizeof(rel));
+}
+
+/// Write a REX prefix, if one is needed
+void X86Asm::rex(bool w, uint8_t reg, uint8_t base)
+{
+    uint8_t prefix = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (prefix != 0x40)
+        byte(prefix);
+}
+
+void X86Asm::modRM(uint8_t reg, X86Reg base, int32_t disp)
+{
+    byte(0x80 | ((reg & 7) << 3) | (base & 7));
+
+    // RSP and R12 as base registers require a SIB byte
+    if ((base & 7) == RSP)
+        byte(0x24);
+
+    dword(disp);
+}
+
+void X86Asm::modReg(uint8_t reg, uint8_t rm)
+{
+    byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void X86Asm::opMem(bool w, uint8_t op, uint8_t reg, X86Reg base, int32_t disp)
+{
+    rex(w, reg, base);
+    byte(op);
+    modRM(reg, base, disp);
+}
+
+void X86Asm::opReg(bool w, uint8_t op, uint8_t reg, uint8_t rm)
+{
+    rex(w, reg, rm);
+    byte(op);
+    modReg(reg, rm);
+}
+
+void X86Asm::mov(X86Reg dst, uint64_t imm)
+{
+    // Writing a 32-bit register zero-extends the value
+    if (imm <= UINT32_MAX)
+    {
+        rex(false, 0, dst);
+        byte(0xB8 + (dst & 7));
+        dword(uint32_t(imm));
+        return;
+    }
+
+    mov64(dst, imm);
+}
+
+void X86Asm::mov64(X86Reg dst, uint64_t imm)
+{
+    rex(true, 0, dst);
+    byte(0xB8 + (dst & 7));
+    qword(imm);
+}
+
+void X86Asm::mov(X86Reg dst, X86Reg src)
+{
+    opReg(true, 0x89, src, dst);
+}
+
+void X86Asm::load64(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(true, 0x8B, dst, base, disp);
+}
+
+void X86Asm::load32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(false, 0x8B, dst, base, disp);
+}
+
+void X86Asm::loadU8(X86Reg dst, X86Reg base, int32_t disp)
+{
+    rex(false, dst, base);
+    byte(0x0F);
+    byte(0xB6);
+    modRM(dst, base, disp);
+}
+
+void X86Asm::store64(X86Reg base, int32_t disp, X86Reg src)
+{
+    opMem(true, 0x89, src, base, disp);
+}
+
+void X86Asm::store32(X86Reg base, int32_t disp, X86Reg src)
+{
+    opMem(false, 0x89, src, base, disp);
+}
+
+void X86Asm::store64(X86Reg base, int32_t disp, int32_t imm)
+{
+    opMem(true, 0xC7, 0, base, disp);
+    dword(imm);
+}
+
+void X86Asm::lea(X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(true, 0x8D, dst, base, disp);
+}
+
+void X86Asm::movsxd(X86Reg dst, X86Reg src)
+{
+    opReg(true, 0x63, dst, src);
+}
+
+void X86Asm::alu32(X86AluOp op, X86Reg dst, X86Reg base, int32_t disp)
+{
+    opMem(false, (op << 3) | 3, dst, base, disp);
+}
+
+void X86Asm::alu32(X86AluOp op, X86Reg dst, int32_t imm)
+{
+    opReg(false, 0x81, op, dst);
+    dword(imm);
+}
+
+void X86Asm::alu64(X86AluOp op, X86Reg dst, int32_t imm)
+{
+    opReg(true, 0x81, op, dst);
+    dword(imm);
+}
+
+void X86Asm::alu64(X86AluOp op, X86Reg dst, X86Reg src)
+{
+    opReg(true, (op << 3) | 1, src, dst);
+}
+
+void X86Asm::imul32(X86Reg dst, X86Reg base, int32_t disp)
+{
+    rex(false, dst, base);
+    byte(0x0F);
+    byte(0xAF);
+    modRM(dst, base, disp);
+}
+
+void X86Asm::shift32(X86ShiftOp op, X86Reg dst)
+{
+    opReg(false, 0xD3, op, dst);
+}
+
+void X86Asm::not32(X86Reg dst)
+{
+    opReg(false, 0xF7, 2, dst);
+}
+
+void X86Asm::test64(X86Reg a, X86Reg b)
+{
+    opReg(true, 0x85, b, a);
+}
+
+void X86Asm::cmp8(X86Reg base, int32_t disp, uint8_t imm)
+{
+    opMem(false, 0x80, ALU_CMP, base, disp);
+    byte(imm);
+}
+
+void X86Asm::cmp32(X86Reg base, int32_t disp, int32_t imm)
+{
+    opMem(false, 0x81, ALU_CMP, base, disp);
+    dword(imm);
+}
+
+void X86Asm::cmp64(X86Reg base, int32_t disp, int32_t imm)
+{
+    opMem(true, 0x81, ALU_CMP, base, disp);
+    dword(imm);
+}
+
+void X86Asm::setcc(X86Cond cond, X86Reg dst)
+{
+    // The low bytes of RSP-RDI are only addressable with a REX prefix
+    if (dst >= RSP)
+        byte(0x40 | (dst >> 3));
+    byte(0x0F);
+    byte(0x90 | cond);
+    modReg(0, dst);
+
+    // movzx dst32, dst8
+    if (dst >= RSP)
+        byte(0x40 | ((dst >> 3) << 2) | (dst >> 3));
+    byte(0x0F);
+    byte(0xB6);
+    modReg(dst, dst);
+}
+
+uint8_t* X86Asm::jmp(uint8_t* target)
+{
+    byte(0xE9);
+    auto site = alloc;
+    dword(0);
+    if (target)
+        patchRel32(site, target);
+    return site;
+}
+
+uint8_t* X86Asm::jcc(X86Cond cond, uint8_t* target)
+{
+    byte(0x0F);
+    byte(0x80 | cond);
+    auto site = alloc;
+    dword(0);
+    if (target)
+        patchRel32(site, target);
+    return site;
+}
+
+void X86Asm::jmp(X86Reg target)
+{
+    opReg(false, 0xFF, 4, target);
+}
+
+void X86Asm::call(X86Reg target)
+{
+    opReg(false, 0xFF, 2, target);
+}
+
+void X86Asm::push(X86Reg reg)
+{
+    rex(false, 0, reg);
+    byte(0x50 + (reg & 7));
+}
+
+void X86Asm::pop(X86Reg reg)
+{
+    rex(false, 0, reg);
+    byte(0x58 + (reg & 7));
+}
+
+void X86Asm::ret()
+{
+    byte(0xC3);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/// x86-64 general-purpose registers
+enum X86Reg : uint8_t
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/// Condition codes, as encoded in jcc and setcc instructions
+enum X86Cond : uint8_t
+{
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_L  = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G  = 0xF
+};
+
+/// Arithmetic instructions sharing the same encoding scheme,
+/// valued by their /digit opcode extension
+enum X86AluOp : uint8_t
+{
+    ALU_ADD = 0,
+    ALU_OR  = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7
+};
+
+/// Shift instructions, valued by their /digit opcode extension
+enum X86ShiftOp : uint8_t
+{
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7
+};
+
+/**
+Assembler writing x86-64 machine code into a region of executable
+memory. Code is appended within a window of the region, which the user
+moves to manage the memory, so that all the code stays within reach
+of 32-bit relative branches. Memory operands are always of the
+[base + disp32] form.
+*/
+class X86Asm
+{
+private:
+
+    uint8_t* mem = nullptr;
+    uint8_t* alloc = nullptr;
+    uint8_t* limit = nullptr;
+
+    /// End of the window being written to
+    uint8_t* windowEnd = nullptr;
+
+    void rex(bool w, uint8_t reg, uint8_t base);
+    void modRM(uint8_t reg, X86Reg base, int32_t disp);
+    void modReg(uint8_t reg, uint8_t rm);
+
+    /// Instruction with a [base + disp32] operand
+    void opMem(bool w, uint8_t op, uint8_t reg, X86Reg base, int32_t disp);
+
+    /// Instruction with a register operand
+    void opReg(bool w, uint8_t op, uint8_t reg, uint8_t rm);
+
+public:
+
+    ~X86Asm();
+
+    /// Map a region of executable memory, returns false on failure
+    bool init(size_t size);
+
+    bool isInit() const { return mem != nullptr; }
+
+    /// Start and size of the executable memory
+    uint8_t* base() const { return mem; }
+    size_t size() const { return limit - mem; }
+
+    /// Current write position
+    uint8_t* pos() const { return alloc; }
+
+    /// Test if a given number of bytes can still be written
+    bool hasSpace(size_t numBytes) const
+    {
+        return alloc && size_t(windowEnd - alloc) >= numBytes;
+    }
+
+    /// Continue writing code in another window of the memory
+    void setWindow(uint8_t* start, uint8_t* end);
+
+    /// Release the pages of a window no longer holding any code,
+    /// which read as zeros should they get written to again
+    void discard(uint8_t* start, uint8_t* end);
+
+    void byte(uint8_t val);
+    void dword(uint32_t val);
+    void qword(uint64_t val);
+
+    /// Patch a 32-bit relative offset written by jmp/jcc
+    static void patchRel32(uint8_t* site, uint8_t* target);
+
+    // Data movement
+    void mov(X86Reg dst, uint64_t imm);
+
+    /// Move a 64-bit immediate, always encoded in full so that
+    /// the last 8 bytes can be patched
+    void mov64(X86Reg dst, uint64_t imm);
+    void mov(X86Reg dst, X86Reg src);
+    void load64(X86Reg dst, X86Reg base, int32_t disp);
+    void load32(X86Reg dst, X86Reg base, int32_t disp);
+    void loadU8(X86Reg dst, X86Reg base, int32_t disp);
+    void store64(X86Reg base, int32_t disp, X86Reg src);
+    void store32(X86Reg base, int32_t disp, X86Reg src);
+    void store64(X86Reg base, int32_t disp, int32_t imm);
+    void lea(X86Reg dst, X86Reg base, int32_t disp);
+    void movsxd(X86Reg dst, X86Reg src);
+
+    // Arithmetic
+    void alu32(X86AluOp op, X86Reg dst, X86Reg base, int32_t disp);
+    void alu32(X86AluOp op, X86Reg dst, int32_t imm);
+    void alu64(X86AluOp op, X86Reg dst, int32_t imm);
+    void alu64(X86AluOp op, X86Reg dst, X86Reg src);
+    void imul32(X86Reg dst, X86Reg base, int32_t disp);
+    void shift32(X86ShiftOp op, X86Reg dst);
+    void not32(X86Reg dst);
+    void test64(X86Reg a, X86Reg b);
+
+    // Comparisons against memory operands
+    void cmp8(X86Reg base, int32_t disp, uint8_t imm);
+    void cmp32(X86Reg base, int32_t disp, int32_t imm);
+    void cmp64(X86Reg base, int32_t disp, int32_t imm);
+
+    /// Set the low byte of a register from a condition, zero-extended
+    void setcc(X86Cond cond, X86Reg dst);
+
+    // Control flow, jmp and jcc return the location of their offset
+    uint8_t* jmp(uint8_t* target = nullptr);
+    uint8_t* jcc(X86Cond cond, uint8_t* target = nullptr);
+    void jmp(X86Reg target);
+    void call(X86Reg target);
+    void push(X86Reg reg);
+    void pop(X86Reg reg);
+    void ret();
+};